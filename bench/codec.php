@@ -0,0 +1,64 @@
+<?php
+/*
+ * Per codec and level cost of compressing on set() and decompressing on
+ * get(). Writes go to the server, so compare them with the uncompressed
+ * row; reads are served from the local cache and only pay for decoding.
+ * The peak memory column shows what a call allocates on top of the value,
+ * the allocations and bytes columns the strings the codecs allocate for
+ * their output, one per compressed or decompressed value.
+ */
+include dirname (__FILE__) . '/bench.inc';
+
+$iterations = bench_iterations (500);
+
+$payload = '';
+for ($i = 0; $i < 1000; $i++) {
+	$payload .= json_encode (array ('id' => $i, 'name' => "item $i", 'tags' => array ('a', 'b', 'c'), 'score' => $i / 7)) . "\n";
+}
+
+$codecs = array (
+	'fastlz' => array (Memcached::COMPRESSION_FASTLZ, array (0, 1, 2)),
+	'zlib'   => array (Memcached::COMPRESSION_ZLIB,   array (0, 1, 9)),
+);
+if (Memcached::HAVE_ZSTD) {
+	$codecs['zstd'] = array (Memcached::COMPRESSION_ZSTD, array (0, 1, 19));
+}
+if (Memcached::HAVE_LZ4) {
+	$codecs['lz4'] = array (Memcached::COMPRESSION_LZ4, array (0));
+}
+
+printf ("%d iterations, payload %d bytes\n", $iterations, strlen ($payload));
+
+function codec_output (Memcached $m)
+{
+	return function () use ($m) {
+		return $m->getClientStats ()['codec_output'];
+	};
+}
+
+$m = bench_instance (array (Memcached::OPT_COMPRESSION => false));
+bench_run ('set() uncompressed', $iterations, function () use ($m, $payload) {
+	$m->set ('bench_codec', $payload);
+});
+
+foreach ($codecs as $name => list ($type, $levels)) {
+	foreach ($levels as $level) {
+		$label = $level ? "$name level $level" : "$name default";
+
+		$m = bench_instance (array (
+			Memcached::OPT_COMPRESSION_TYPE  => $type,
+			Memcached::OPT_COMPRESSION_LEVEL => $level,
+			Memcached::OPT_LOCAL_CACHE_SIZE  => 1,
+			Memcached::OPT_LOCAL_CACHE_TTL   => 3600000,
+		));
+
+		bench_run ("$label set()", $iterations, function () use ($m, $payload) {
+			$m->set ('bench_codec', $payload);
+		}, codec_output ($m));
+
+		$m->get ('bench_codec');
+		bench_run ("$label get()", $iterations, function () use ($m) {
+			$m->get ('bench_codec');
+		}, codec_output ($m));
+	}
+}
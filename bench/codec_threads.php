@@ -0,0 +1,45 @@
+<?php
+/*
+ * setMulti() and getMulti() of 2000 compressible values. The codec pool can
+ * only be sized in php.ini, so compare runs with different thread counts:
+ *
+ *   php -d memcached.codec_threads=0 bench/codec_threads.php
+ *   php -d memcached.codec_threads=8 bench/codec_threads.php
+ */
+include dirname (__FILE__) . '/bench.inc';
+
+$iterations = bench_iterations (20);
+
+$values = array ();
+for ($i = 0; $i < 2000; $i++) {
+	$payload = '';
+	for ($j = 0; $j < 100; $j++) {
+		$payload .= json_encode (array ('id' => $i * 100 + $j, 'name' => "item $j", 'score' => $j / 7)) . "\n";
+	}
+	$values["bench_codec_threads_$i"] = $payload;
+}
+
+$codecs = array (
+	'fastlz' => Memcached::COMPRESSION_FASTLZ,
+	'zlib'   => Memcached::COMPRESSION_ZLIB,
+);
+if (Memcached::HAVE_ZSTD) {
+	$codecs['zstd'] = Memcached::COMPRESSION_ZSTD;
+}
+if (Memcached::HAVE_LZ4) {
+	$codecs['lz4'] = Memcached::COMPRESSION_LZ4;
+}
+
+printf ("%d iterations, %d values, %d codec threads\n", $iterations, count ($values), ini_get ('memcached.codec_threads'));
+
+foreach ($codecs as $name => $type) {
+	$m = bench_instance (array (Memcached::OPT_COMPRESSION_TYPE => $type));
+
+	bench_run ("$name setMulti", $iterations, function () use ($m, $values) {
+		$m->setMulti ($values);
+	});
+
+	bench_run ("$name getMulti", $iterations, function () use ($m, $values) {
+		$m->getMulti (array_keys ($values));
+	});
+}
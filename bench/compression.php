@@ -0,0 +1,72 @@
+<?php
+/*
+ * Compares the available compression types on the values the tests store:
+ * the corpus of tests/types.inc and tests/testdata.res. The ratio is taken
+ * from the growth of the server's "bytes" statistic against the same values
+ * stored uncompressed, so run it against an otherwise idle server.
+ */
+include dirname (__FILE__) . '/bench.inc';
+include dirname (__FILE__) . '/../tests/types.inc';
+
+$iterations = bench_iterations (2000);
+
+$payloads = array ();
+foreach (memc_types_data () as $key => $value) {
+	$payloads["bench_compression_$key"] = $value;
+}
+$payloads['bench_compression_testdata'] = file_get_contents (dirname (__FILE__) . '/../tests/testdata.res');
+
+$types = array ('fastlz' => Memcached::COMPRESSION_FASTLZ, 'zlib' => Memcached::COMPRESSION_ZLIB);
+if (Memcached::HAVE_ZSTD) {
+	$types['zstd'] = Memcached::COMPRESSION_ZSTD;
+}
+if (Memcached::HAVE_LZ4) {
+	$types['lz4'] = Memcached::COMPRESSION_LZ4;
+}
+
+function server_bytes (Memcached $m)
+{
+	$stats = $m->getStats ();
+	return (int) current ($stats)['bytes'];
+}
+
+/* Keys of its own for every type, replacing items would take the old ones off the count */
+function stored_bytes (Memcached $m, array $payloads, $suffix)
+{
+	$keyed = array ();
+	foreach ($payloads as $key => $payload) {
+		$keyed["{$key}_{$suffix}"] = $payload;
+	}
+
+	$before = server_bytes ($m);
+	$m->setMulti ($keyed);
+	return server_bytes ($m) - $before;
+}
+
+$raw = stored_bytes (bench_instance (array (Memcached::OPT_COMPRESSION => false)), $payloads, 'none');
+printf ("%d iterations, %d payloads, %d bytes stored uncompressed\n", $iterations, count ($payloads), $raw);
+
+foreach ($types as $name => $type) {
+	$m = bench_instance (array (
+		Memcached::OPT_COMPRESSION      => true,
+		Memcached::OPT_COMPRESSION_TYPE => $type,
+	));
+
+	printf ("%-32s %10.2f%% of uncompressed\n", "$name ratio", 100 * stored_bytes ($m, $payloads, $name) / $raw);
+
+	bench_run ("$name set() testdata", $iterations, function () use ($m, $payloads) {
+		$m->set ('bench_compression_testdata', $payloads['bench_compression_testdata']);
+	});
+
+	bench_run ("$name get() testdata", $iterations, function () use ($m) {
+		$m->get ('bench_compression_testdata');
+	});
+
+	bench_run ("$name setMulti() corpus", $iterations, function () use ($m, $payloads) {
+		$m->setMulti ($payloads);
+	});
+
+	bench_run ("$name getMulti() corpus", $iterations, function () use ($m, $payloads) {
+		$m->getMulti (array_keys ($payloads));
+	});
+}
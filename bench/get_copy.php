@@ -0,0 +1,50 @@
+<?php
+/*
+ * Measures the cost of turning a fetched item into a PHP value, and the
+ * payload bytes copied per get. Before values were decoded from the result
+ * buffer, every uncompressed payload was first copied into a string of its
+ * own, so that column is the payload size for those and 0 for compressed
+ * ones, which were and are decompressed straight into their string.
+ */
+include dirname (__FILE__) . '/bench.inc';
+
+$iterations = bench_iterations (2000);
+
+$html = str_repeat ('<div class="row"><span>' . str_repeat ('lorem ipsum ', 8) . '</span></div>' . "\n", 1600);
+$html = substr ($html, 0, 200 * 1024);
+
+$array = array ();
+for ($i = 0; $i < 2000; $i++) {
+	$array["key_$i"] = array ('id' => $i, 'name' => "item $i", 'score' => $i / 3);
+}
+
+$plain = bench_instance (array (Memcached::OPT_COMPRESSION => false));
+$plain->set ('bench_html', $html);
+$plain->set ('bench_array', $array);
+$plain->set ('bench_number', 1234567);
+
+$compressed = bench_instance (array (Memcached::OPT_COMPRESSION => true));
+$compressed->set ('bench_html_compressed', $html);
+
+printf ("%d iterations, html payload %d bytes, serialized array %d bytes\n", $iterations, strlen ($html), strlen (serialize ($array)));
+
+function copied (Memcached $m)
+{
+	return function () use ($m) {
+		return $m->getClientStats ()['decode'];
+	};
+}
+
+$cases = array (
+	'get html'              => array ($plain, 'bench_html', strlen ($html)),
+	'get html (compressed)' => array ($compressed, 'bench_html_compressed', 0),
+	'get serialized array'  => array ($plain, 'bench_array', strlen (serialize ($array))),
+	'get number'            => array ($plain, 'bench_number', strlen ('1234567')),
+);
+
+foreach ($cases as $label => list ($m, $key, $copied_before)) {
+	bench_run ($label, $iterations, function () use ($m, $key) {
+		$m->get ($key);
+	}, copied ($m));
+	printf ("%-32s %12d bytes copied/op before\n", '', $copied_before);
+}
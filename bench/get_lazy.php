@@ -0,0 +1,40 @@
+<?php
+/*
+ * getMulti() of 200 serialized objects of which only a few are used,
+ * decoded up front and with GET_LAZY.
+ */
+include dirname (__FILE__) . '/bench.inc';
+
+$iterations = bench_iterations (500);
+
+$m = bench_instance ();
+
+$keys = array ();
+for ($i = 0; $i < 200; $i++) {
+	$record = new stdClass ();
+	$record->id    = $i;
+	$record->name  = "user $i";
+	$record->tags  = array_fill (0, 20, "tag $i");
+	$record->score = $i * 0.5;
+
+	$keys[] = "bench_lazy_$i";
+	$m->set ("bench_lazy_$i", $record);
+}
+
+printf ("%d iterations, %d keys\n", $iterations, count ($keys));
+
+foreach (array (1, 10, 200) as $used) {
+	bench_run ("eager, $used used", $iterations, function () use ($m, $keys, $used) {
+		$values = $m->getMulti ($keys);
+		for ($i = 0; $i < $used; $i++) {
+			$values["bench_lazy_$i"]->id;
+		}
+	});
+
+	bench_run ("lazy, $used used", $iterations, function () use ($m, $keys, $used) {
+		$values = $m->getMulti ($keys, Memcached::GET_LAZY);
+		for ($i = 0; $i < $used; $i++) {
+			$values["bench_lazy_$i"]->getValue ()->id;
+		}
+	});
+}
@@ -0,0 +1,81 @@
+<?php
+/*
+ * Compares the available serializers on the values from tests/types.inc
+ * and on the shapes SERIALIZER_NATIVE is aimed at: flat and two-level
+ * arrays of integers and strings. Reads are served from the local cache,
+ * so get() only pays for decoding. The size column is the growth of the
+ * server's "bytes" statistic, so run it against an otherwise idle server.
+ */
+include dirname (__FILE__) . '/bench.inc';
+
+$iterations = bench_iterations (2000);
+
+class testclass {
+}
+
+$flat = array ();
+for ($i = 0; $i < 100; $i++) {
+	$flat[] = $i * 7;
+	$flat[] = "value $i";
+}
+
+$records = array ();
+for ($i = 0; $i < 100; $i++) {
+	$records[] = array ('id' => $i, 'name' => "user $i", 'status' => 'active', 'score' => $i * 3);
+}
+
+/* The values memc_types_test() in tests/types.inc stores, as one array */
+$types = array (
+	'boolean_true'             => true,
+	'string'                   => "just a string",
+	'integer_negative_integer' => -10,
+	'float_positive1'          => 3.912131,
+	'null'                     => null,
+	'array'                    => array (1, 2, 3, "foo"),
+	'object_array'             => (object) array ("a" => "1", "b" => "2", "c" => "3"),
+	'object_dummy'             => new testclass (),
+);
+
+$serializers = array ('php' => Memcached::SERIALIZER_PHP, 'native' => Memcached::SERIALIZER_NATIVE);
+if (Memcached::HAVE_IGBINARY) {
+	$serializers['igbinary'] = Memcached::SERIALIZER_IGBINARY;
+}
+if (Memcached::HAVE_JSON) {
+	$serializers['json'] = Memcached::SERIALIZER_JSON_ARRAY;
+}
+if (Memcached::HAVE_MSGPACK) {
+	$serializers['msgpack'] = Memcached::SERIALIZER_MSGPACK;
+}
+
+function server_bytes (Memcached $m)
+{
+	$stats = $m->getStats ();
+	return (int) current ($stats)['bytes'];
+}
+
+printf ("%d iterations\n", $iterations);
+
+foreach (array ('flat' => $flat, 'records' => $records, 'types.inc' => $types) as $shape => $value) {
+	foreach ($serializers as $name => $serializer) {
+		$m = bench_instance (array (
+			Memcached::OPT_SERIALIZER       => $serializer,
+			Memcached::OPT_COMPRESSION      => false,
+			Memcached::OPT_LOCAL_CACHE_SIZE => 1,
+			Memcached::OPT_LOCAL_CACHE_TTL  => 3600000,
+		));
+
+		/* A key of its own, replacing an item would take the old one off the count */
+		$before = server_bytes ($m);
+		$m->set ("bench_serializers_size_{$shape}_{$name}", $value);
+		printf ("%-32s %10d bytes stored\n", "$shape $name", server_bytes ($m) - $before);
+
+		bench_run ("$shape $name set()", $iterations, function () use ($m, $value) {
+			$m->set ('bench_serializers', $value);
+		});
+
+		$m->get ('bench_serializers');
+		bench_run ("$shape $name get()", $iterations, function () use ($m) {
+			$m->get ('bench_serializers');
+		});
+	}
+}
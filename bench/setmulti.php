@@ -0,0 +1,31 @@
+<?php
+/*
+ * Compares storing a batch of items one set() at a time with a single
+ * setMulti(). The difference grows with the round trip time to the servers.
+ */
+include dirname (__FILE__) . '/bench.inc';
+
+$iterations = bench_iterations (200);
+
+$items = array ();
+for ($i = 0; $i < 500; $i++) {
+	$items["bench_setmulti_$i"] = array ('id' => $i, 'name' => "item $i");
+}
+
+$m = bench_instance ();
+
+printf ("%d iterations, %d items per batch\n", $iterations, count ($items));
+
+bench_run ('set() per item', $iterations, function () use ($m, $items) {
+	foreach ($items as $key => $value) {
+		$m->set ($key, $value);
+	}
+});
+
+bench_run ('setMulti()', $iterations, function () use ($m, $items) {
+	$m->setMulti ($items);
+});
+
+bench_run ('setMulti() with status', $iterations, function () use ($m, $items) {
+	$m->setMulti ($items, 0, Memcached::SET_RETURN_STATUS);
+});
@@ -29,6 +29,12 @@ PHP_ARG_ENABLE(memcached-protocol, whether to enable memcached protocol support,
 PHP_ARG_WITH(system-fastlz, whether to use system FastLZ bibrary,
 [  --with-system-fastlz                 Use system FastLZ bibrary], no, no)
 
+PHP_ARG_ENABLE(memcached-zstd, whether to enable memcached zstd compression support,
+[  --enable-memcached-zstd          Enable memcached zstd compression support], no, no)
+
+PHP_ARG_ENABLE(memcached-lz4, whether to enable memcached lz4 compression support,
+[  --enable-memcached-lz4          Enable memcached lz4 compression support], no, no)
+
 if test -z "$PHP_ZLIB_DIR"; then
 PHP_ARG_WITH(zlib-dir, for ZLIB,
 [  --with-zlib-dir[=DIR]   Set the path to ZLIB install prefix.], no)
@@ -318,7 +324,17 @@ if test "$PHP_MEMCACHED" != "no"; then
       AC_DEFINE(HAVE_MEMCACHED_EXIST, [1], [Whether memcached_exist is defined])
     fi
 
-    PHP_MEMCACHED_FILES="php_memcached.c php_libmemcached_compat.c  g_fmt.c"
+    PHP_MEMCACHED_FILES="php_memcached.c php_memcached_serializer.c php_memcached_pool.c php_memcached_pipeline.c php_libmemcached_compat.c  g_fmt.c"
+
+    AC_MSG_CHECKING([for memcached codec pool support])
+    AC_CHECK_HEADER([pthread.h], [ac_cv_have_memcached_pthread="yes"], [ac_cv_have_memcached_pthread="no"])
+    if test "$ac_cv_have_memcached_pthread" = "yes"; then
+      AC_MSG_RESULT([enabled])
+      PHP_ADD_LIBRARY(pthread, 1, MEMCACHED_SHARED_LIBADD)
+      AC_DEFINE(HAVE_MEMCACHED_CODEC_POOL, [1], [Whether compression can be spread over worker threads])
+    else
+      AC_MSG_RESULT([disabled])
+    fi
 
     if test "$PHP_SYSTEM_FASTLZ" != "no"; then
       AC_CHECK_HEADERS([fastlz.h], [ac_cv_have_fastlz="yes"], [ac_cv_have_fastlz="no"])
@@ -330,6 +346,30 @@ if test "$PHP_MEMCACHED" != "no"; then
       PHP_MEMCACHED_FILES="${PHP_MEMCACHED_FILES} fastlz/fastlz.c"
     fi
 
+    AC_MSG_CHECKING([for memcached zstd support])
+    if test "$PHP_MEMCACHED_ZSTD" != "no"; then
+      AC_MSG_RESULT([enabled])
+      AC_CHECK_HEADERS([zstd.h], [], [AC_MSG_ERROR(zstd.h not found)])
+      PHP_CHECK_LIBRARY(zstd, ZSTD_compress,
+          [PHP_ADD_LIBRARY(zstd, 1, MEMCACHED_SHARED_LIBADD)],
+          [AC_MSG_ERROR(zstd library not found)])
+      AC_DEFINE(HAVE_MEMCACHED_ZSTD, [1], [Whether zstd compression is enabled])
+    else
+      AC_MSG_RESULT([disabled])
+    fi
+
+    AC_MSG_CHECKING([for memcached lz4 support])
+    if test "$PHP_MEMCACHED_LZ4" != "no"; then
+      AC_MSG_RESULT([enabled])
+      AC_CHECK_HEADERS([lz4.h], [], [AC_MSG_ERROR(lz4.h not found)])
+      PHP_CHECK_LIBRARY(lz4, LZ4_compress_default,
+          [PHP_ADD_LIBRARY(lz4, 1, MEMCACHED_SHARED_LIBADD)],
+          [AC_MSG_ERROR(lz4 library not found)])
+      AC_DEFINE(HAVE_MEMCACHED_LZ4, [1], [Whether lz4 compression is enabled])
+    else
+      AC_MSG_RESULT([disabled])
+    fi
+
     if test "$PHP_MEMCACHED_SESSION" != "no"; then
       PHP_MEMCACHED_FILES="${PHP_MEMCACHED_FILES} php_memcached_session.c"
     fi
@@ -96,6 +96,13 @@ class Memcached {
 
 	const HAVE_MSGPACK;
 
+	/**
+	 * Supported compression libraries
+	 */
+	const HAVE_ZSTD;
+
+	const HAVE_LZ4;
+
 	/**
 	 * Feature support
 	 */
@@ -110,8 +117,83 @@ class Memcached {
 
 	const OPT_COMPRESSION_TYPE;
 
+	// Compression level, 0 uses the codec default. fastlz takes 1-2, zlib 1-9 and zstd 1-22,
+	// higher values use the codec's highest level. lz4 ignores it.
+	const OPT_COMPRESSION_LEVEL;
+
+	// A trained zstd dictionary file, or an array of key prefix => dictionary file. Values of
+	// matching keys are compressed with zstd and the longest matching prefix, even below
+	// memcached.compression_threshold. Requires HAVE_ZSTD.
+	const OPT_COMPRESSION_DICTIONARIES;
+
+	// Skip compressing payloads that look random, and values of a type and size that recently
+	// failed to compress. getClientStats() counts attempted, successful and skipped compressions.
+	const OPT_COMPRESSION_ADAPTIVE;
+
+	// Store integers and floats as 8 binary bytes instead of text. Both forms are always read,
+	// but increment() and decrement() only work on values stored as text.
+	const OPT_BINARY_NUMBERS;
+
 	const OPT_PREFIX_KEY;
 
+	// Number of values kept in the local read-through cache, 0 disables it.
+	const OPT_LOCAL_CACHE_SIZE;
+
+	// Milliseconds a value may be served from the local cache.
+	const OPT_LOCAL_CACHE_TTL;
+
+	// Number of keys remembered as missing by get() and getMulti(), 0 disables it. Only misses the servers
+	// answered are remembered: not those of a failed or timed out server, nor chunked values missing a chunk.
+	const OPT_NEGATIVE_CACHE_SIZE;
+
+	// Milliseconds a missing key is not requested again.
+	const OPT_NEGATIVE_CACHE_TTL;
+
+	// Queue up to this many sets, touches and deletes and send them together, 0 sends writes right away.
+	// Queued writes are sent at flushBuffers(), when the instance is freed and at the end of the request,
+	// and before any write that is not queued. getClientStats() counts the writes the servers refused,
+	// which it cannot know with OPT_NOREPLY.
+	const OPT_WRITE_BEHIND_SIZE;
+
+	// Milliseconds after which queued writes are sent with the next write, 0 means no limit.
+	const OPT_WRITE_BEHIND_AGE;
+
+	// Send the totals buffered by bufferIncrement() once this many keys are pending, 0 means no limit.
+	// Buffered totals are sent at flushBuffers(), when the instance is freed and at the end of the request.
+	const OPT_COUNTER_BUFFER_SIZE;
+
+	// Milliseconds after which buffered totals are sent with the next bufferIncrement(), 0 means no limit.
+	const OPT_COUNTER_BUFFER_AGE;
+
+	// With OPT_NUMBER_OF_REPLICAS and OPT_BINARY_PROTOCOL, milliseconds after which get() and getMulti()
+	// also ask a replica for the keys, over connections of its own, while the primary is still awaited
+	// with the normal timeout, 0 disables hedging. Without thread support the replica is only asked once
+	// the primary has failed. Keys a primary answered as missing are not asked again.
+	const OPT_HEDGE_DELAY;
+
+	// Wait for this percentile of recent primary read times instead, capped at OPT_HEDGE_DELAY, 0 disables it.
+	const OPT_HEDGE_PERCENTILE;
+
+	// Store values longer than this many bytes in chunks of that size behind a versioned manifest, 0 disables it.
+	// Keep it below the server's item size limit. Chunked values cannot be read with fetch() or an iterator,
+	// and casMulti() answers RES_E2BIG for a value this long.
+	const OPT_CHUNK_SIZE;
+
+	// Seconds a get() cache callback holds its lease on a missed key, 0 disables leases.
+	const OPT_LEASE_TIME;
+
+	// Milliseconds other clients wait for the lease holder before running the callback themselves.
+	const OPT_LEASE_WAIT;
+
+	// Seconds a stale copy of a regenerated value is kept for clients that lose the lease, 0 disables it.
+	const OPT_LEASE_STALE_TTL;
+
+	// Number of keys tracked by the hot key sketch, at most 65536, 0 disables it.
+	const OPT_HOT_KEYS_SIZE;
+
+	// Sample one in this many operations into the hot key sketch.
+	const OPT_HOT_KEYS_SAMPLE_RATE;
+
 	/**
 	 * Serializer constants
 	 */
@@ -125,6 +207,10 @@ class Memcached {
 
 	const SERIALIZER_MSGPACK;
 
+	// Compact binary format for arrays of scalars, always available. Values holding
+	// objects or shared references are stored with the php serializer instead.
+	const SERIALIZER_NATIVE;
+
 	/**
 	 * Compression types
 	 */
@@ -132,6 +218,11 @@ class Memcached {
 
 	const COMPRESSION_ZLIB;
 
+	// Only usable when HAVE_ZSTD / HAVE_LZ4 are set
+	const COMPRESSION_ZSTD;
+
+	const COMPRESSION_LZ4;
+
 	/**
 	 * Flags for get and getMulti operations.
 	 */
@@ -141,6 +232,15 @@ class Memcached {
 	// Whether to fetch CAS token as well (use "gets").
 	const GET_EXTENDED;
 
+	// getMulti only: return MemcachedLazyValue objects that decode the value on first access
+	const GET_LAZY;
+
+	/**
+	 * Flags for setMulti operations.
+	 */
+	// Return key => true|result code instead of a single bool, like deleteMulti
+	const SET_RETURN_STATUS;
+
 	/**
 	 * Return values
 	 */
@@ -263,9 +363,13 @@ class Memcached {
 
 	public function getByKey( $server_key, $key, callable $cache_cb = null, $flags = 0 ) {}
 
-	public function getMulti( array $keys, $flags = 0) {}
+	public function getMulti( array $keys, $flags = 0, $cache_cb = null ) {}
+
+	public function getMultiByKey( $server_key, array $keys, $flags = 0, $cache_cb = null ) {}
 
-	public function getMultiByKey( $server_key, array $keys, $flags = 0) {}
+	public function getAndTouch( $key, $expiration, $get_flags = 0 ) {}
+
+	public function getMultiAndTouch( array $keys, $expiration, $flags = 0 ) {}
 
 	public function getDelayed( array $keys, $with_cas = null, $value_cb = null ) {}
 
@@ -275,22 +379,28 @@ class Memcached {
 
 	public function fetchAll( ) {}
 
+	public function getIterator( array $keys, $flags = 0 ) {}
+
 	public function set( $key, $value, $expiration = 0, $udf_flags = 0 ) {}
 
 	public function touch( $key, $expiration = 0 ) {}
 
 	public function touchbyKey( $key, $expiration = 0 ) {}
 
+	public function touchMulti( array $keys, $expiration = 0 ) {}
+
 	public function setByKey( $server_key, $key, $value, $expiration = 0, $udf_flags = 0 ) {}
 
-	public function setMulti( array $items, $expiration = 0, $udf_flags = 0 ) {}
+	public function setMulti( array $items, $expiration = 0, $flags = 0 ) {}
 
-	public function setMultiByKey( $server_key, array $items, $expiration = 0, $udf_flags = 0 ) {}
+	public function setMultiByKey( $server_key, array $items, $expiration = 0, $flags = 0 ) {}
 
 	public function cas( $token, $key, $value, $expiration = 0, $udf_flags = 0 ) {}
 
 	public function casByKey( $token, $server_key, $key, $value, $expiration = 0, $udf_flags = 0 ) {}
 
+	public function casMulti( array $items ) {}
+
 	public function add( $key, $value, $expiration = 0, $udf_flags = 0 ) {}
 
 	public function addByKey( $server_key, $key, $value, $expiration = 0, $udf_flags = 0 ) {}
@@ -319,6 +429,12 @@ class Memcached {
 
 	public function decrement( $key, $offset = 1, $initial_value = 0, $expiry = 0) {}
 
+	public function incrementMulti( array $keys_to_deltas, $initial_value = 0, $expiry = 0) {}
+
+	public function decrementMulti( array $keys_to_deltas, $initial_value = 0, $expiry = 0) {}
+
+	public function bufferIncrement( $key, $delta = 1 ) {}
+
 	public function getOption( $option ) {}
 
 	public function setOption( $option, $value ) {}
@@ -349,6 +465,10 @@ class Memcached {
 
 	public function getStats( $type = null ) {}
 
+	public function getClientStats( ) {}
+
+	public function getHotKeys( $n = 10 ) {}
+
 	public function getAllKeys( ) {}
 
 	public function getVersion( ) {}
@@ -365,6 +485,30 @@ class Memcached {
 
 }
 
+final class MemcachedIterator implements Iterator {
+
+	private function __construct( ) {}
+
+	public function rewind( ) {}
+
+	public function valid( ) {}
+
+	public function current( ) {}
+
+	public function key( ) {}
+
+	public function next( ) {}
+
+}
+
+final class MemcachedLazyValue {
+
+	private function __construct( ) {}
+
+	public function getValue( ) {}
+
+}
+
 class MemcachedException extends Exception {
 
 	function __construct( $errmsg = "", $errcode  = 0 ) {}
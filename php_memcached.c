@@ -24,10 +24,22 @@
 #include "php_memcached.h"
 #include "php_memcached_private.h"
 #include "php_memcached_server.h"
+#include "php_memcached_serializer.h"
+#include "php_memcached_pool.h"
+#include "php_memcached_pipeline.h"
 #include "g_fmt.h"
 
 #include <ctype.h>
 #include <limits.h>
+#include <math.h>
+
+#include "ext/standard/php_random.h"
+
+#ifdef PHP_WIN32
+# include "win32/time.h"
+#else
+# include <sys/time.h>
+#endif
 
 #ifdef HAVE_MEMCACHED_SESSION
 # include "php_memcached_session.h"
@@ -38,6 +50,12 @@
 #include "fastlz/fastlz.h"
 #endif
 #include <zlib.h>
+#ifdef HAVE_MEMCACHED_ZSTD
+# include <zstd.h>
+#endif
+#ifdef HAVE_MEMCACHED_LZ4
+# include <lz4.h>
+#endif
 
 #ifdef HAVE_JSON_API
 # include "ext/json/php_json.h"
@@ -71,6 +89,85 @@ static int php_memc_list_entry(void) {
 #define MEMC_OPT_COMPRESSION_TYPE   -1004
 #define MEMC_OPT_STORE_RETRY_COUNT  -1005
 #define MEMC_OPT_USER_FLAGS         -1006
+#define MEMC_OPT_LOCAL_CACHE_SIZE   -1007
+#define MEMC_OPT_LOCAL_CACHE_TTL    -1008
+#define MEMC_OPT_LEASE_TIME         -1009
+#define MEMC_OPT_LEASE_WAIT         -1010
+#define MEMC_OPT_LEASE_STALE_TTL    -1011
+#define MEMC_OPT_HOT_KEYS_SIZE      -1012
+#define MEMC_OPT_HOT_KEYS_SAMPLE_RATE -1013
+#define MEMC_OPT_NEGATIVE_CACHE_SIZE  -1014
+#define MEMC_OPT_NEGATIVE_CACHE_TTL   -1015
+#define MEMC_OPT_WRITE_BEHIND_SIZE    -1016
+#define MEMC_OPT_WRITE_BEHIND_AGE     -1017
+#define MEMC_OPT_COUNTER_BUFFER_SIZE  -1018
+#define MEMC_OPT_COUNTER_BUFFER_AGE   -1019
+#define MEMC_OPT_HEDGE_DELAY          -1020
+#define MEMC_OPT_HEDGE_PERCENTILE     -1021
+#define MEMC_OPT_CHUNK_SIZE           -1022
+#define MEMC_OPT_COMPRESSION_LEVEL    -1023
+#define MEMC_OPT_COMPRESSION_DICTIONARIES -1024
+#define MEMC_OPT_COMPRESSION_ADAPTIVE -1025
+#define MEMC_OPT_BINARY_NUMBERS       -1026
+
+/****************************************
+  Local cache defaults
+****************************************/
+#define MEMC_LOCAL_CACHE_DEFAULT_TTL    1000
+#define MEMC_NEGATIVE_CACHE_DEFAULT_TTL 1000
+
+/****************************************
+  Cache callback lease defaults
+****************************************/
+#define MEMC_LEASE_DEFAULT_WAIT 100
+#define MEMC_LEASE_WAIT_MIN     5
+
+/****************************************
+  Hedged read defaults
+****************************************/
+#define MEMC_HEDGE_SAMPLES 64
+
+/****************************************
+  Compression tuning
+****************************************/
+/* The highest zstd level, the other codecs cap it at their own. 0 leaves the level to the codec */
+#define MEMC_COMPRESSION_LEVEL_MAX 22
+
+/* After this many failed attempts in a row a kind of value is only tried every MEMC_ADAPTIVE_PROBE_INTERVAL writes */
+#define MEMC_ADAPTIVE_FAILURES 4
+#define MEMC_ADAPTIVE_PROBE_INTERVAL 16
+/* Values of a type are told apart by size, in classes a factor of 4 apart, the last one open ended */
+#define MEMC_ADAPTIVE_SIZE_CLASSES 12
+#define MEMC_ADAPTIVE_SLOTS ((MEMC_MASK_TYPE + 1) * MEMC_ADAPTIVE_SIZE_CLASSES)
+/* Bytes sampled for the entropy estimate, and the bits per byte above which compression is not tried */
+#define MEMC_ADAPTIVE_SAMPLE 512
+#define MEMC_ADAPTIVE_MAX_ENTROPY 7.0
+
+/* Smaller batches are compressed and decompressed on the PHP thread, handing them to the codec pool costs more */
+#define MEMC_CODEC_POOL_MIN_VALUES 2
+#define MEMC_CODEC_POOL_MIN_BYTES  65536
+
+/****************************************
+  Chunked value limits
+****************************************/
+/* ":" + 16 hex digits of the version + ":" + chunk number */
+#define MEMC_CHUNK_KEY_SUFFIX_LENGTH 28
+#define MEMC_CHUNK_MIN_SIZE 1024
+#define MEMC_CHUNK_MAX_CHUNKS 65536
+/* Chunks sent in one pipelined batch, each batch holds a copy of its chunks */
+#define MEMC_CHUNK_BATCH 16
+
+/****************************************
+  Hot key sketch defaults
+****************************************/
+#define MEMC_HOT_KEYS_DEFAULT_SAMPLE_RATE 100
+#define MEMC_HOT_KEYS_MAX_SIZE 65536
+
+/****************************************
+  Scratch arena sizes
+****************************************/
+#define MEMC_ARENA_BLOCK_SIZE  4096
+#define MEMC_ARENA_MAX_RETAIN  (1024 * 1024)
 
 /****************************************
   Custom result codes
@@ -97,10 +194,17 @@ static int php_memc_list_entry(void) {
 #define MEMC_VAL_IS_IGBINARY   5
 #define MEMC_VAL_IS_JSON       6
 #define MEMC_VAL_IS_MSGPACK    7
+/* 8 byte little-endian two's complement and IEEE 754, written with OPT_BINARY_NUMBERS */
+#define MEMC_VAL_IS_BINARY_LONG   8
+#define MEMC_VAL_IS_BINARY_DOUBLE 9
+#define MEMC_VAL_IS_NATIVE        10
 
 #define MEMC_VAL_COMPRESSED          (1<<0)
 #define MEMC_VAL_COMPRESSION_ZLIB    (1<<1)
 #define MEMC_VAL_COMPRESSION_FASTLZ  (1<<2)
+#define MEMC_VAL_CHUNKED             (1<<3)
+#define MEMC_VAL_COMPRESSION_ZSTD    (1<<4)
+#define MEMC_VAL_COMPRESSION_LZ4     (1<<5)
 
 #define MEMC_VAL_GET_FLAGS(internal_flags)               (((internal_flags) & MEMC_MASK_INTERNAL) >> 4)
 #define MEMC_VAL_SET_FLAG(internal_flags, internal_flag) ((internal_flags) |= (((internal_flag) << 4) & MEMC_MASK_INTERNAL))
@@ -119,6 +223,12 @@ static int php_memc_list_entry(void) {
 ****************************************/
 #define MEMC_GET_PRESERVE_ORDER 1
 #define MEMC_GET_EXTENDED       2
+#define MEMC_GET_LAZY           4
+
+/****************************************
+  "set" operation flags
+****************************************/
+#define MEMC_SET_RETURN_STATUS  1
 
 /****************************************
   Helper macros
@@ -138,30 +248,257 @@ typedef enum {
 	MEMC_OP_PREPEND
 } php_memc_write_op;
 
+/* A trained zstd dictionary, used for the values of keys starting with prefix */
+typedef struct {
+	zend_string *prefix;
+	zend_string *file;
+	uint32_t     id;
+#ifdef HAVE_MEMCACHED_ZSTD
+	ZSTD_CDict  *cdict;
+	ZSTD_DDict  *ddict;
+#endif
+} php_memc_dictionary_t;
+
+/* Codec state reused from one value to the next, see s_codec_deflate() */
+typedef struct {
+	z_stream   deflate;
+	z_stream   inflate;
+	int        deflate_level;
+	zend_bool  deflate_ready;
+	zend_bool  inflate_ready;
+#ifdef HAVE_MEMCACHED_ZSTD
+	ZSTD_CCtx *zstd_cctx;
+	ZSTD_DCtx *zstd_dctx;
+#endif
+} php_memc_codec_t;
+
 typedef struct {
 
 	zend_bool is_persistent;
 	zend_bool compression_enabled;
+	zend_bool binary_numbers;
 
 	zend_long serializer;
 	zend_long compression_type;
+	zend_long compression_level;
 
 	zend_long store_retry_count;
 	zend_long set_udf_flags;
 
+	/* Values fetched by get()/getMulti(), kept across requests for persistent instances */
+	struct {
+		HashTable *entries;
+		zend_long  size;
+		zend_long  ttl;
+
+		zend_long  hits;
+		zend_long  misses;
+		zend_long  evictions;
+	} local_cache;
+
+	/* Keys recently found missing by get()/getMulti(), not requested again until they expire */
+	struct {
+		HashTable *entries;
+		zend_long  size;
+		zend_long  ttl;
+
+		zend_long  hits;
+	} negative_cache;
+
+	/* Leases taken before running a get() cache callback */
+	struct {
+		zend_long  time;
+		zend_long  wait;
+		zend_long  stale_ttl;
+
+		zend_long  granted;
+		zend_long  stale;
+		zend_long  waited;
+		zend_long  expired;
+	} lease;
+
+	/* Sets, touches and deletes queued instead of sent, see s_write_queue_push() */
+	struct {
+		zend_long  size;
+		zend_long  age;
+
+		zend_long  queued;
+		zend_long  flushed;
+		zend_long  failed;
+		zend_long  dropped;
+	} write_behind;
+
+	/* Deltas summed per key by bufferIncrement(), see s_counter_buffer_add() */
+	struct {
+		zend_long  size;
+		zend_long  age;
+
+		zend_long  buffered;
+		zend_long  flushed;
+		zend_long  failed;
+	} counter_buffer;
+
+	/* Values longer than this are stored in chunks, see s_chunked_write() */
+	zend_long chunk_size;
+
+	/* Reads sent on to a replica when the primary is slow, see s_hedge_mget_apply() */
+	struct {
+		zend_long  delay;
+		zend_long  percentile;
+		zend_long  observed;
+		uint32_t   samples[MEMC_HEDGE_SAMPLES];
+		uint32_t   sampled;
+
+		zend_long  reads;
+		zend_long  hedged;
+		zend_long  wins;
+		zend_long  keys;
+
+		/* A copy of the instance with connections of its own, the replicas are read over it */
+		memcached_st *replicas;
+		/* A group key per server of the copy, see s_hedge_pin() */
+		struct _php_memc_hedge_pin_t *pins;
+		uint32_t   pins_count;
+		/* Waits out the delay and reads the replicas while the primaries are awaited */
+		php_memc_async_t *async;
+	} hedge;
+
+	/* Compression outcomes, with the per type and size history used by s_adaptive_should_compress() */
+	struct {
+		zend_bool  adaptive;
+		uint32_t   failures[MEMC_ADAPTIVE_SLOTS];
+		uint32_t   skips[MEMC_ADAPTIVE_SLOTS];
+
+		zend_long  attempted;
+		zend_long  successful;
+		zend_long  skipped;
+	} compression;
+
+	/* Dictionaries set with OPT_COMPRESSION_DICTIONARIES, see s_dictionary_find() */
+	struct {
+		php_memc_dictionary_t *entries;
+		uint32_t   count;
+	} dictionaries;
+
+	/* Codecs of the PHP thread, workers of the codec pool have their own */
+	php_memc_codec_t codec;
+
+	/* Strings allocated for codec output, see s_compress_prepare() and s_decompress_prepare() */
+	struct {
+		zend_long  allocations;
+		zend_long  bytes;
+	} codec_output;
+
+	/* Payload bytes copied into strings of their own while decoding, see s_memcached_decoded_to_zval() */
+	struct {
+		zend_long  copied;
+	} decode;
+
+	/* Batches of values s_codec_run() handed to the codec pool */
+	struct {
+		zend_long  batches;
+		zend_long  values;
+	} codec_pool;
+
+	/* Connections for multi-key writes, see s_batch_run() */
+	php_memc_pipeline_t pipeline;
+
+	/* Space-Saving sketch of the most accessed keys, fed by sampled reads and writes. The slots
+	   are a min-heap on count, the index maps a key to its position in it */
+	struct {
+		HashTable *index;
+		struct _php_memc_hot_key_t *slots;
+		zend_long  size;
+		zend_long  sample_rate;
+		uint32_t   used;
+		uint32_t   rand_state;
+	} hot_keys;
+
 #ifdef HAVE_MEMCACHED_SASL
 	zend_bool has_sasl_data;
 #endif
 } php_memc_user_data_t;
 
+typedef struct _php_memc_arena_block_t {
+	struct _php_memc_arena_block_t *prev;
+	size_t size;
+	size_t used;
+	char data[1];
+} php_memc_arena_block_t;
+
+/* Bump allocator for scratch memory that only lives for the duration of a method call */
+typedef struct {
+	php_memc_arena_block_t *block;
+	uint32_t depth;
+
+	zend_long allocations;
+	zend_long requests;
+} php_memc_arena_t;
+
+typedef struct {
+	php_memc_arena_block_t *block;
+	size_t used;
+} php_memc_arena_mark_t;
+
+typedef enum {
+	MEMC_QUEUED_SET,
+	MEMC_QUEUED_TOUCH,
+	MEMC_QUEUED_DELETE
+} php_memc_queued_op;
+
+typedef struct {
+	php_memc_queued_op op;
+	zend_string *server_key;
+	zend_string *key;
+	zend_string *payload;
+	uint32_t flags;
+	time_t expiration;
+} php_memc_queued_write_t;
+
+typedef struct {
+	php_memc_queued_write_t *writes;
+	size_t count;
+	size_t allocated;
+	uint64_t oldest;
+} php_memc_write_queue_t;
+
+typedef struct {
+	HashTable *deltas;
+	uint64_t oldest;
+} php_memc_counter_buffer_t;
+
 typedef struct {
 	memcached_st *memc;
 	zend_bool is_pristine;
+	zend_bool local_cache_fill;
+	/* Keys of the running get() or getMulti() whose miss was not confirmed by their server */
+	HashTable *unconfirmed;
+	/* The iterator of getIterator() until it has read all results */
+	zend_object *iterator;
 	int rescode;
 	int memc_errno;
+	php_memc_arena_t arena;
+	php_memc_write_queue_t write_queue;
+	php_memc_counter_buffer_t counters;
 	zend_object zo;
 } php_memc_object_t;
 
+/* Negative cache entries use the same structure without a payload */
+typedef struct {
+	zend_string *payload;
+	uint32_t flags;
+	uint64_t cas;
+	uint64_t expires;
+	zend_bool is_persistent;
+} php_memc_local_entry_t;
+
+typedef struct _php_memc_hot_key_t {
+	zend_string *key;
+	zend_long count;
+	zend_long error;
+	zend_long bytes;
+} php_memc_hot_key_t;
+
 typedef struct {
 	size_t num_valid_keys;
 
@@ -170,6 +507,10 @@ typedef struct {
 
 	zend_string **strings;
 
+	/* The vectors above live in the arena until s_clear_keys() */
+	php_memc_arena_t *arena;
+	php_memc_arena_mark_t mark;
+
 } php_memc_keys_t;
 
 typedef struct {
@@ -178,6 +519,35 @@ typedef struct {
 	zend_fcall_info_cache fcc;
 } php_memc_result_callback_ctx_t;
 
+typedef struct {
+	zval object;
+	zval key;
+	zval value;
+	zend_long position;
+	zend_bool extended;
+	zend_bool started;
+	zend_bool finished;
+	zend_object zo;
+} php_memc_iterator_t;
+
+static inline php_memc_iterator_t *php_memc_iterator_fetch_object(zend_object *obj) {
+	return (php_memc_iterator_t *)((char *)obj - XtOffsetOf(php_memc_iterator_t, zo));
+}
+#define Z_MEMC_ITERATOR_P(zv) php_memc_iterator_fetch_object(Z_OBJ_P(zv))
+
+typedef struct {
+	zval object;
+	zend_string *payload;
+	uint32_t flags;
+	zval value;
+	zend_object zo;
+} php_memc_lazy_value_t;
+
+static inline php_memc_lazy_value_t *php_memc_lazy_value_fetch_object(zend_object *obj) {
+	return (php_memc_lazy_value_t *)((char *)obj - XtOffsetOf(php_memc_lazy_value_t, zo));
+}
+#define Z_MEMC_LAZY_VALUE_P(zv) php_memc_lazy_value_fetch_object(Z_OBJ_P(zv))
+
 static inline php_memc_object_t *php_memc_fetch_object(zend_object *obj) {
 	return (php_memc_object_t *)((char *)obj - XtOffsetOf(php_memc_object_t, zo));
 }
@@ -188,7 +558,8 @@ static inline php_memc_object_t *php_memc_fetch_object(zend_object *obj) {
 	php_memc_object_t*     intern         = NULL;      \
 	php_memc_user_data_t*  memc_user_data = NULL;
 
-#define MEMC_METHOD_FETCH_OBJECT                                                      \
+/* For methods that do not talk to the servers */
+#define MEMC_METHOD_FETCH_LOCAL_OBJECT                                                \
 	intern = Z_MEMC_OBJ_P(object);                                                    \
 	if (!intern->memc) {                                                              \
 		php_error_docref(NULL, E_WARNING, "Memcached constructor was not called");    \
@@ -197,6 +568,14 @@ static inline php_memc_object_t *php_memc_fetch_object(zend_object *obj) {
 	memc_user_data = (php_memc_user_data_t *) memcached_get_user_data(intern->memc);  \
 	(void)memc_user_data; /* avoid unused variable warning */
 
+/* The results of getIterator() are read from the connections, other requests would take them */
+#define MEMC_METHOD_FETCH_OBJECT                                                      \
+	MEMC_METHOD_FETCH_LOCAL_OBJECT                                                    \
+	if (intern->iterator) {                                                           \
+		php_error_docref(NULL, E_WARNING, "cannot send requests while an iterator is reading results"); \
+		return;                                                                       \
+	}
+
 static
 zend_bool s_memc_valid_key_binary(zend_string *key)
 {
@@ -247,6 +626,12 @@ static zend_class_entry *memcached_ce = NULL;
 static zend_class_entry *memcached_exception_ce = NULL;
 static zend_object_handlers memcached_object_handlers;
 
+static zend_class_entry *memcached_iterator_ce = NULL;
+static zend_object_handlers memcached_iterator_object_handlers;
+
+static zend_class_entry *memcached_lazy_value_ce = NULL;
+static zend_object_handlers memcached_lazy_value_object_handlers;
+
 #ifdef HAVE_SPL
 static zend_class_entry *spl_ce_RuntimeException = NULL;
 #endif
@@ -265,6 +650,14 @@ static PHP_INI_MH(OnUpdateCompressionType)
 		MEMC_G(compression_type) = COMPRESSION_TYPE_FASTLZ;
 	} else if (!strcmp(ZSTR_VAL(new_value), "zlib")) {
 		MEMC_G(compression_type) = COMPRESSION_TYPE_ZLIB;
+#ifdef HAVE_MEMCACHED_ZSTD
+	} else if (!strcmp(ZSTR_VAL(new_value), "zstd")) {
+		MEMC_G(compression_type) = COMPRESSION_TYPE_ZSTD;
+#endif
+#ifdef HAVE_MEMCACHED_LZ4
+	} else if (!strcmp(ZSTR_VAL(new_value), "lz4")) {
+		MEMC_G(compression_type) = COMPRESSION_TYPE_LZ4;
+#endif
 	} else {
 		return FAILURE;
 	}
@@ -291,6 +684,8 @@ static PHP_INI_MH(OnUpdateSerializer)
 	} else if (!strcmp(ZSTR_VAL(new_value), "msgpack")) {
 		MEMC_G(serializer_type) = SERIALIZER_MSGPACK;
 #endif // msgpack
+	} else if (!strcmp(ZSTR_VAL(new_value), "native")) {
+		MEMC_G(serializer_type) = SERIALIZER_NATIVE;
 	} else {
 		return FAILURE;
 	}
@@ -367,6 +762,9 @@ PHP_INI_BEGIN()
 	MEMC_INI_ENTRY("serializer",            SERIALIZER_DEFAULT_NAME, OnUpdateSerializer,      serializer_name)
 	MEMC_INI_ENTRY("store_retry_count",     "2",                     OnUpdateLong,            store_retry_count)
 
+	/* The worker threads are shared by the whole process */
+	STD_PHP_INI_ENTRY("memcached.codec_threads", "0", PHP_INI_SYSTEM, OnUpdateLongGEZero, memc.codec_threads, zend_php_memcached_globals, php_memcached_globals)
+
 	MEMC_INI_ENTRY("default_consistent_hash",       "0", OnUpdateBool,       default_behavior.consistent_hash_enabled)
 	MEMC_INI_ENTRY("default_binary_protocol",       "0", OnUpdateBool,       default_behavior.binary_protocol_enabled)
 	MEMC_INI_ENTRY("default_connect_timeout",       "0", OnUpdateLongGEZero, default_behavior.connect_timeout)
@@ -386,6 +784,7 @@ static void php_memc_store_impl(INTERNAL_FUNCTION_PARAMETERS, int op, zend_bool
 static void php_memc_setMulti_impl(INTERNAL_FUNCTION_PARAMETERS, zend_bool by_key);
 static void php_memc_delete_impl(INTERNAL_FUNCTION_PARAMETERS, zend_bool by_key);
 static void php_memc_deleteMulti_impl(INTERNAL_FUNCTION_PARAMETERS, zend_bool by_key);
+static void php_memc_incdecMulti_impl(INTERNAL_FUNCTION_PARAMETERS, zend_bool incr);
 static void php_memc_getDelayed_impl(INTERNAL_FUNCTION_PARAMETERS, zend_bool by_key);
 
 /* Invoke PHP functions */
@@ -394,13 +793,57 @@ static zend_bool s_invoke_cache_callback(zval *zobject, zend_fcall_info *fci, ze
 /* Iterate result sets */
 typedef zend_bool (*php_memc_result_apply_fn)(php_memc_object_t *intern, zend_string *key, zval *value, zval *cas, uint32_t flags, void *context);
 
+/* A chunked value whose manifest has been read, waiting for its chunks */
+typedef struct {
+	zend_string *key;
+	zend_string *data;
+	uint64_t version;
+	uint64_t cas;
+	uint32_t flags;
+	uint32_t chunks;
+	uint32_t received;
+	size_t chunk_size;
+} php_memc_chunked_value_t;
+
+typedef struct {
+	php_memc_chunked_value_t *values;
+	size_t count;
+	size_t allocated;
+} php_memc_chunked_list_t;
+
+static
+zend_bool s_chunked_defer(php_memc_chunked_list_t *list, memcached_result_st *result);
+
+static
+memcached_return s_chunked_fetch(php_memc_object_t *intern, php_memc_chunked_list_t *list, php_memc_result_apply_fn result_apply_fn, zend_bool lazy, void *context);
+
+static
+void s_chunked_list_free(php_memc_chunked_list_t *list);
+
+/* Compressed results kept back until the result set is read, to be decompressed together */
+typedef struct {
+	memcached_result_st **results;
+	size_t count;
+	size_t allocated;
+	size_t bytes;
+} php_memc_deferred_list_t;
+
+static
+void s_deferred_add(php_memc_deferred_list_t *list, memcached_result_st *result);
+
+static
+memcached_return s_deferred_apply(php_memc_object_t *intern, php_memc_deferred_list_t *list, php_memc_result_apply_fn result_apply_fn, void *context, zend_bool *stopped);
+
+static
+void s_deferred_list_free(php_memc_deferred_list_t *list);
+
 static
-memcached_return php_memc_result_apply(php_memc_object_t *intern, php_memc_result_apply_fn result_apply_fn, zend_bool fetch_delay, void *context);
+memcached_return php_memc_result_apply(php_memc_object_t *intern, php_memc_result_apply_fn result_apply_fn, zend_bool fetch_delay, size_t expected, zend_bool lazy, void *context);
 
 static
 zend_bool php_memc_mget_apply(php_memc_object_t *intern, zend_string *server_key,
 								php_memc_keys_t *keys, php_memc_result_apply_fn result_apply_fn,
-								zend_bool with_cas, void *context);
+								zend_bool with_cas, zend_bool lazy, void *context);
 
 
 /* Callback functions for different server list iterations */
@@ -417,17 +860,46 @@ static
 	void php_memc_destroy(memcached_st *memc, php_memc_user_data_t *memc_user_data);
 
 static
-	zend_bool s_memcached_result_to_zval(memcached_st *memc, memcached_result_st *result, zval *return_value);
+	zend_bool s_memcached_payload_to_zval(memcached_st *memc, const char *payload, size_t payload_len, uint32_t flags, zval *return_value);
+
+static
+	zend_bool s_memcached_decoded_to_zval(memcached_st *memc, zend_string *data, const char *payload, size_t payload_len, uint32_t flags, zval *return_value);
+
+static
+	zend_bool s_memcached_string_to_zval(memcached_st *memc, zend_string *payload, uint32_t flags, zval *return_value);
+
+static
+	zend_bool s_memcached_payload_to_result(php_memc_object_t *intern, zend_bool lazy, const char *payload, size_t payload_len, uint32_t flags, zval *return_value);
 
 static
-	zend_string *s_zval_to_payload(php_memc_object_t *intern, zval *value, uint32_t *flags);
+	zend_string *s_zval_to_payload(php_memc_object_t *intern, zend_string *key, zval *value, uint32_t *flags);
 
 static
-	void s_hash_to_keys(php_memc_keys_t *keys_out, HashTable *hash_in, zend_bool preserve_order, zval *return_value);
+	void s_hash_to_keys(php_memc_object_t *intern, php_memc_keys_t *keys_out, HashTable *hash_in, zend_bool preserve_order, zval *return_value);
 
 static
 	void s_clear_keys(php_memc_keys_t *keys);
 
+static
+	zend_bool s_write_behind_enabled(php_memc_object_t *intern);
+
+static
+	void s_write_queue_push(php_memc_object_t *intern, php_memc_queued_op op, zend_string *server_key, zend_string *key,
+							zend_string *payload, uint32_t flags, time_t expiration);
+
+static
+	void s_write_queue_flush(php_memc_object_t *intern);
+
+static
+	void s_batch_incdec(php_memc_object_t *intern, php_memc_batch_item_t *items, size_t count, const uint64_t *initials, time_t expiry);
+
+static
+	zend_bool s_chunked_wanted(php_memc_object_t *intern, php_memc_write_op op, zend_string *key, zend_string *payload);
+
+static
+	memcached_return s_chunked_write(php_memc_object_t *intern, php_memc_write_op op, zend_string *server_key, zend_string *key,
+									zend_string *payload, uint32_t flags, time_t expiration);
+
 
 /****************************************
   Exported helper functions
@@ -586,583 +1058,3351 @@ uint64_t s_zval_to_uint64 (zval *cas)
 	return 0;
 }
 
-
 /****************************************
-  Iterate over memcached results and mget
+  Scratch arena
 ****************************************/
 
 static
-memcached_return php_memc_result_apply(php_memc_object_t *intern, php_memc_result_apply_fn result_apply_fn, zend_bool fetch_delay, void *context)
+void *s_arena_alloc(php_memc_arena_t *arena, size_t size)
 {
-	memcached_result_st result, *result_ptr;
-	memcached_return rc, status = MEMCACHED_SUCCESS;
-
-	memcached_result_create(intern->memc, &result);
+	php_memc_arena_block_t *block = arena->block;
+	void *ptr;
 
-	do {
-		result_ptr = memcached_fetch_result(intern->memc, &result, &rc);
+	size = ZEND_MM_ALIGNED_SIZE(size);
+	arena->requests++;
 
-		if (s_memcached_return_is_error(rc, 0)) {
-			status = rc;
-		}
+	if (!block || block->used + size > block->size) {
+		size_t block_size = MAX(MEMC_ARENA_BLOCK_SIZE, size);
 
-		/* nothing returned */
-		if (!result_ptr) {
-			break;
+		if (block) {
+			block_size = MAX(block_size, block->size * 2);
 		}
-		else {
-			zend_string *key;
-			zval val, zcas;
-			zend_bool retval;
 
-			uint64_t cas;
-			uint32_t flags;
+		block = emalloc(XtOffsetOf(php_memc_arena_block_t, data) + block_size);
+		block->prev = arena->block;
+		block->size = block_size;
+		block->used = 0;
 
-			const char *res_key;
-			size_t res_key_len;
-			
-			if (!s_memcached_result_to_zval(intern->memc, &result, &val)) {
-				if (EG(exception)) {
-					status = MEMC_RES_PAYLOAD_FAILURE;
-					memcached_quit(intern->memc);
-					break;
-				}
-				status = MEMCACHED_SOME_ERRORS;
-				continue;
-			}
+		arena->block = block;
+		arena->allocations++;
+	}
 
-			res_key     = memcached_result_key_value(&result);
-			res_key_len = memcached_result_key_length(&result);
-			cas         = memcached_result_cas(&result);
-			flags       = memcached_result_flags(&result);
+	ptr = block->data + block->used;
+	block->used += size;
+	return ptr;
+}
 
-			s_uint64_to_zval(&zcas, cas);
+static
+void *s_arena_calloc(php_memc_arena_t *arena, size_t nmemb, size_t size)
+{
+	void *ptr = s_arena_alloc(arena, nmemb * size);
+	memset(ptr, 0, nmemb * size);
+	return ptr;
+}
 
-			key = zend_string_init (res_key, res_key_len, 0);
-			retval = result_apply_fn(intern, key, &val, &zcas, flags, context);
+static
+void s_arena_free(php_memc_arena_t *arena)
+{
+	while (arena->block) {
+		php_memc_arena_block_t *block = arena->block;
 
-			zend_string_release(key);
-			zval_ptr_dtor(&val);
-			zval_ptr_dtor(&zcas);
+		arena->block = block->prev;
+		efree(block);
+	}
+}
 
-			/* Stop iterating on false */
-			if (!retval) {
-				if (!fetch_delay) {
-					/* Make sure we clear our results */
-					while (memcached_fetch_result(intern->memc, &result, &rc)) {}
-				}
-				break;
-			}
-		}
-	} while (result_ptr != NULL);
+static
+size_t s_arena_size(php_memc_arena_t *arena)
+{
+	php_memc_arena_block_t *block;
+	size_t size = 0;
 
-	memcached_result_free(&result);
-	return status;
+	for (block = arena->block; block; block = block->prev) {
+		size += block->size;
+	}
+	return size;
 }
 
 static
-zend_bool php_memc_mget_apply(php_memc_object_t *intern, zend_string *server_key, php_memc_keys_t *keys,
-						php_memc_result_apply_fn result_apply_fn, zend_bool with_cas, void *context)
+php_memc_arena_mark_t s_arena_mark(php_memc_arena_t *arena)
 {
-	memcached_return status;
-	int mget_status;
-	uint64_t orig_cas_flag = 0;
+	php_memc_arena_mark_t mark;
 
-	// Reset status code
-	s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
+	mark.block = arena->block;
+	mark.used  = arena->block ? arena->block->used : 0;
 
-	if (!keys->num_valid_keys) {
-		intern->rescode = MEMCACHED_BAD_KEY_PROVIDED;
-		return 0;
-	}
+	arena->depth++;
+	return mark;
+}
 
-	if (with_cas) {
-		orig_cas_flag = memcached_behavior_get (intern->memc, MEMCACHED_BEHAVIOR_SUPPORT_CAS);
+/* Releases everything allocated since the mark. Marks must be released in reverse order. */
+static
+void s_arena_release(php_memc_arena_t *arena, php_memc_arena_mark_t mark)
+{
+	if (--arena->depth == 0) {
+		/* Nothing is in use anymore, keep one block big enough for what this call needed */
+		size_t total = s_arena_size(arena);
 
-		if (!orig_cas_flag) {
-			memcached_behavior_set (intern->memc, MEMCACHED_BEHAVIOR_SUPPORT_CAS, 1);
+		if (!arena->block) {
+			return;
 		}
-	}
-
-	if (server_key) {
-		status = memcached_mget_by_key(intern->memc, ZSTR_VAL(server_key), ZSTR_LEN(server_key), keys->mkeys, keys->mkeys_len, keys->num_valid_keys);
-	} else {
-		status = memcached_mget(intern->memc, keys->mkeys, keys->mkeys_len, keys->num_valid_keys);
-	}
 
-	/* Need to handle result code before restoring cas flags, would mess up errno */
-	mget_status = s_memc_status_handle_result_code(intern, status);
-		
-	if (with_cas && !orig_cas_flag) {
-		memcached_behavior_set (intern->memc, MEMCACHED_BEHAVIOR_SUPPORT_CAS, orig_cas_flag);
-	}
+		if (!arena->block->prev && total <= MEMC_ARENA_MAX_RETAIN) {
+			arena->block->used = 0;
+			return;
+		}
 
-	/* Return on failure codes */
-	if (mget_status == FAILURE) {
-		return 0;
-	}
+		s_arena_free(arena);
 
-	if (!result_apply_fn) {
-		/* no callback, for example getDelayed */
-		return 1;
+		if (total <= MEMC_ARENA_MAX_RETAIN) {
+			arena->block = emalloc(XtOffsetOf(php_memc_arena_block_t, data) + total);
+			arena->block->prev = NULL;
+			arena->block->size = total;
+			arena->block->used = 0;
+			arena->allocations++;
+		}
+		return;
 	}
 
-	status = php_memc_result_apply(intern, result_apply_fn, 0, context);
+	while (arena->block != mark.block) {
+		php_memc_arena_block_t *block = arena->block;
 
-	if (s_memc_status_handle_result_code(intern, status) == FAILURE) {
-		return 0;
+		arena->block = block->prev;
+		efree(block);
 	}
 
-	return 1;
+	if (arena->block) {
+		arena->block->used = mark.used;
+	}
 }
 
 /****************************************
-  Invoke callbacks
+  Local read-through cache
 ****************************************/
 
 static
-zend_bool s_invoke_new_instance_cb(zval *object, zend_fcall_info *fci, zend_fcall_info_cache *fci_cache, zend_string *persistent_id)
+uint64_t s_memc_time_ms(void)
 {
-	zend_bool ret = 1;
-	zval retval;
-	zval params[2];
+	struct timeval tv;
 
-	ZVAL_COPY(&params[0], object);
-	if (persistent_id) {
-		ZVAL_STR(&params[1], zend_string_copy(persistent_id));
-	} else {
-		ZVAL_NULL(&params[1]);
-	}
+	gettimeofday(&tv, NULL);
+	return ((uint64_t) tv.tv_sec * 1000) + ((uint64_t) tv.tv_usec / 1000);
+}
 
-	fci->retval = &retval;
-	fci->params = params;
-	fci->param_count = 2;
+static
+uint64_t s_memc_time_us(void)
+{
+	struct timeval tv;
 
-	if (zend_call_function(fci, fci_cache) == FAILURE) {
-		char *buf = php_memc_printable_func (fci, fci_cache);
-		php_error_docref(NULL, E_WARNING, "Failed to invoke 'on_new' callback %s()", buf);
-		efree (buf);
-		ret = 0;
-	}
+	gettimeofday(&tv, NULL);
+	return ((uint64_t) tv.tv_sec * 1000000) + (uint64_t) tv.tv_usec;
+}
 
-	zval_ptr_dtor(&params[0]);
-	zval_ptr_dtor(&params[1]);
-	zval_ptr_dtor(&retval);
+static
+void s_local_cache_entry_dtor(zval *zv)
+{
+	php_memc_local_entry_t *entry = Z_PTR_P(zv);
 
-	return ret;
+	if (entry->payload) {
+		zend_string_release(entry->payload);
+	}
+	pefree(entry, entry->is_persistent);
 }
 
 static
-zend_bool s_invoke_cache_callback(zval *zobject, zend_fcall_info *fci, zend_fcall_info_cache *fcc, zend_bool with_cas, zend_string *key, zval *value)
+void s_local_cache_clear(php_memc_user_data_t *memc_user_data)
 {
-	zend_bool status = 0;
-	zval params[4];
-	zval retval;
-	php_memc_object_t *intern = Z_MEMC_OBJ_P(zobject);
-
-	/* Prepare params */
-	ZVAL_COPY(&params[0], zobject);
-	ZVAL_STR_COPY(&params[1], key);    /* key */
-	ZVAL_NEW_REF(&params[2], value);   /* value */
-
-	if (with_cas) {
-		fci->param_count = 3;
-	} else {
-		ZVAL_NEW_EMPTY_REF(&params[3]);    /* expiration */
-		ZVAL_NULL(Z_REFVAL(params[3]));
-		fci->param_count = 4;
+	if (memc_user_data->local_cache.entries) {
+		zend_hash_destroy(memc_user_data->local_cache.entries);
+		pefree(memc_user_data->local_cache.entries, memc_user_data->is_persistent);
+		memc_user_data->local_cache.entries = NULL;
 	}
+}
 
-	fci->retval = &retval;
-	fci->params = params;
-
-	if (zend_call_function(fci, fcc) == SUCCESS) {
-		if (zend_is_true(&retval)) {
-			time_t expiration;
-			zval *val = Z_REFVAL(params[2]);
+static
+void s_local_cache_delete(php_memc_object_t *intern, zend_string *key)
+{
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
 
-			if (with_cas) {
-				if (Z_TYPE_P(val) == IS_ARRAY) {
-					zval *rv = zend_hash_str_find(Z_ARRVAL_P(val), "value", sizeof("value") - 1);
-					if (rv) {
-						zval *cas = zend_hash_str_find(Z_ARRVAL_P(val), "cas", sizeof("cas") -1);
-						expiration = cas? Z_LVAL_P(cas) : 0;
-						status = s_memc_write_zval (intern, MEMC_OP_SET, NULL, key, rv, expiration);
-					}
-					/* memleak?  zval_ptr_dtor(value); */
-					ZVAL_COPY(value, val);
-				}
-			} else {
-				expiration = zval_get_long(Z_REFVAL(params[3]));
-				status = s_memc_write_zval (intern, MEMC_OP_SET, NULL, key, val, expiration);
-				/* memleak?  zval_ptr_dtor(value); */
-				ZVAL_COPY(value, val);
-			}
-		}
-	}
-	else {
-		s_memc_set_status(intern, MEMCACHED_NOTFOUND, 0);
+	if (memc_user_data->local_cache.entries) {
+		zend_hash_del(memc_user_data->local_cache.entries, key);
 	}
+}
 
-	zval_ptr_dtor(&params[0]);
-	zval_ptr_dtor(&params[1]);
-	zval_ptr_dtor(&params[2]);
-	if (!with_cas) {
-		zval_ptr_dtor(&params[3]);
-	}
-	zval_ptr_dtor(&retval);
+/*
+ * The first key of a table filled in insertion order. Deleting the entry under the internal
+ * pointer moves the pointer on to the next one, so it stays on the oldest entry and the holes
+ * left by deleted entries are stepped over once rather than on every eviction.
+ */
+static
+zend_string *s_hash_oldest_key(HashTable *entries)
+{
+	zend_string *key = NULL;
+	zend_ulong index;
 
-	return status;
+	zend_hash_get_current_key(entries, &key, &index);
+	return key;
 }
 
-/****************************************
-  Wrapper for setting from zval
-****************************************/
-
 static
-zend_bool s_compress_value (php_memc_compression_type compression_type, zend_string **payload_in, uint32_t *flags)
+void s_local_cache_store(php_memc_object_t *intern, const char *key, size_t key_len, const char *payload, size_t payload_len, uint32_t flags, uint64_t cas)
 {
-	/* status */
-	zend_bool compress_status = 0;
-	zend_string *payload = *payload_in;
-	uint32_t compression_type_flag = 0;
+	php_memc_local_entry_t *entry;
+	zend_string *oldest;
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+	HashTable *entries = memc_user_data->local_cache.entries;
 
-	/* Additional 5% for the data */
-	size_t buffer_size = (size_t) (((double) ZSTR_LEN(payload) * 1.05) + 1.0);
-	char *buffer       = emalloc(buffer_size);
+	if (memc_user_data->local_cache.size <= 0) {
+		return;
+	}
 
-	/* Store compressed size here */
-	size_t compressed_size = 0;
-	uint32_t original_size = ZSTR_LEN(payload);
+	if (!entries) {
+		entries = pemalloc(sizeof(HashTable), memc_user_data->is_persistent);
+		zend_hash_init(entries, 0, NULL, s_local_cache_entry_dtor, memc_user_data->is_persistent);
+		memc_user_data->local_cache.entries = entries;
+	}
 
-	switch (compression_type) {
+	/* Entries are evicted in insertion order, a refreshed key moves to the back */
+	zend_hash_str_del(entries, key, key_len);
 
-		case COMPRESSION_TYPE_FASTLZ:
-		{
-			compressed_size = fastlz_compress(ZSTR_VAL(payload), ZSTR_LEN(payload), buffer);
+	while (zend_hash_num_elements(entries) >= (uint32_t) memc_user_data->local_cache.size && (oldest = s_hash_oldest_key(entries))) {
+		zend_hash_del(entries, oldest);
+		memc_user_data->local_cache.evictions++;
+	}
 
-			if (compressed_size > 0) {
-				compress_status = 1;
-				compression_type_flag = MEMC_VAL_COMPRESSION_FASTLZ;
-			}
-		}
-			break;
+	entry                = pemalloc(sizeof(*entry), memc_user_data->is_persistent);
+	entry->payload       = zend_string_init(payload ? payload : "", payload_len, memc_user_data->is_persistent);
+	entry->flags         = flags;
+	entry->cas           = cas;
+	entry->expires       = s_memc_time_ms() + memc_user_data->local_cache.ttl;
+	entry->is_persistent = memc_user_data->is_persistent;
 
-		case COMPRESSION_TYPE_ZLIB:
-		{
-			compressed_size = buffer_size;
-			int status = compress((Bytef *) buffer, &compressed_size, (Bytef *) ZSTR_VAL(payload), ZSTR_LEN(payload));
+	zend_hash_str_update_ptr(entries, key, key_len, entry);
+}
 
-			if (status == Z_OK) {
-				compress_status = 1;
-				compression_type_flag = MEMC_VAL_COMPRESSION_ZLIB;
-			}
-		}
-			break;
+static
+zend_bool s_local_cache_apply(php_memc_object_t *intern, zend_string *key, php_memc_result_apply_fn result_apply_fn, zend_bool with_cas, zend_bool lazy, void *context)
+{
+	zval value, zcas;
+	php_memc_local_entry_t *entry;
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
 
-		default:
-			compress_status = 0;
-			break;
+	if (memc_user_data->local_cache.size <= 0) {
+		return 0;
 	}
 
-	/* This means the value was too small to be compressed and ended up larger */
-	if (ZSTR_LEN(payload) <= (compressed_size * MEMC_G(compression_factor))) {
-		compress_status = 0;
-	}
+	if (memc_user_data->local_cache.entries &&
+		(entry = zend_hash_find_ptr(memc_user_data->local_cache.entries, key)) != NULL) {
 
-	/* Replace the payload with the compressed copy */
-	if (compress_status) {
-		MEMC_VAL_SET_FLAG(*flags, MEMC_VAL_COMPRESSED | compression_type_flag);
-		payload = zend_string_realloc(payload, compressed_size + sizeof(uint32_t), 0);
+		/* Values cached by a plain get() do not carry a cas token */
+		if (entry->expires > s_memc_time_ms() && (!with_cas || entry->cas) &&
+			/* A persistent payload cannot be shared with a value of the request */
+			((lazy || entry->is_persistent) ?
+				s_memcached_payload_to_result(intern, lazy, ZSTR_VAL(entry->payload), ZSTR_LEN(entry->payload), entry->flags, &value) :
+				s_memcached_string_to_zval(intern->memc, entry->payload, entry->flags, &value))) {
 
-		/* Copy the uin32_t at the beginning */
-		memcpy(ZSTR_VAL(payload), &original_size, sizeof(uint32_t));
-		memcpy(ZSTR_VAL(payload) + sizeof (uint32_t), buffer, compressed_size);
-		efree(buffer);
+			memc_user_data->local_cache.hits++;
 
-		zend_string_forget_hash_val(payload);
-		*payload_in = payload;
+			s_uint64_to_zval(&zcas, entry->cas);
+			result_apply_fn(intern, key, &value, &zcas, entry->flags, context);
 
-		return 1;
+			zval_ptr_dtor(&value);
+			zval_ptr_dtor(&zcas);
+			return 1;
+		}
+		zend_hash_del(memc_user_data->local_cache.entries, key);
 	}
-
-	/* Original payload was not modified */
-	efree(buffer);
+	memc_user_data->local_cache.misses++;
 	return 0;
 }
 
+/* Serves what it can from the local cache and leaves only the missing keys in keys */
 static
-zend_bool s_serialize_value (php_memc_serializer_type serializer, zval *value, smart_str *buf, uint32_t *flags)
+size_t s_local_cache_apply_keys(php_memc_object_t *intern, php_memc_keys_t *keys, php_memc_result_apply_fn result_apply_fn, zend_bool with_cas, zend_bool lazy, void *context)
 {
-	switch (serializer) {
-
-		/*
-			Igbinary serialization
-		*/
-#ifdef HAVE_MEMCACHED_IGBINARY
-		case SERIALIZER_IGBINARY:
-		{
-			uint8_t *buffer;
-			size_t buffer_len;
+	size_t i, remaining = 0, served = 0;
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
 
-			if (igbinary_serialize(&buffer, &buffer_len, value) != 0) {
-				php_error_docref(NULL, E_WARNING, "could not serialize value with igbinary");
-				return 0;
-			}
-			smart_str_appendl (buf, (char *)buffer, buffer_len);
-			efree(buffer);
-			MEMC_VAL_SET_TYPE(*flags, MEMC_VAL_IS_IGBINARY);
-		}
-			break;
-#endif
+	if (memc_user_data->local_cache.size <= 0) {
+		return 0;
+	}
 
-		/*
-			JSON serialization
-		*/
-#ifdef HAVE_JSON_API
-		case SERIALIZER_JSON:
-		case SERIALIZER_JSON_ARRAY:
-		{
-			php_json_encode(buf, value, 0);
-			MEMC_VAL_SET_TYPE(*flags, MEMC_VAL_IS_JSON);
+	for (i = 0; i < keys->num_valid_keys; i++) {
+		if (s_local_cache_apply(intern, keys->strings[i], result_apply_fn, with_cas, lazy, context)) {
+			zend_string_release(keys->strings[i]);
+			served++;
+			continue;
 		}
-			break;
-#endif
+		keys->mkeys[remaining]     = keys->mkeys[i];
+		keys->mkeys_len[remaining] = keys->mkeys_len[i];
+		keys->strings[remaining]   = keys->strings[i];
+		remaining++;
+	}
 
-		/*
-			msgpack serialization
-		*/
-#ifdef HAVE_MEMCACHED_MSGPACK
-		case SERIALIZER_MSGPACK:
-			php_msgpack_serialize(buf, value);
-			if (!buf->s) {
-				php_error_docref(NULL, E_WARNING, "could not serialize value with msgpack");
-				return 0;
-			}
-			MEMC_VAL_SET_TYPE(*flags, MEMC_VAL_IS_MSGPACK);
-			break;
-#endif
+	keys->num_valid_keys = remaining;
+	return served;
+}
 
-		/*
-			PHP serialization
-		*/
-		default:
-		{
-			php_serialize_data_t var_hash;
-			PHP_VAR_SERIALIZE_INIT(var_hash);
-			php_var_serialize(buf, value, &var_hash);
-			PHP_VAR_SERIALIZE_DESTROY(var_hash);
+/****************************************
+  Negative result cache
+****************************************/
 
-			if (!buf->s) {
-				php_error_docref(NULL, E_WARNING, "could not serialize value");
-				return 0;
-			}
-			MEMC_VAL_SET_TYPE(*flags, MEMC_VAL_IS_SERIALIZED);
-		}
-			break;
+static
+void s_negative_cache_clear(php_memc_user_data_t *memc_user_data)
+{
+	if (memc_user_data->negative_cache.entries) {
+		zend_hash_destroy(memc_user_data->negative_cache.entries);
+		pefree(memc_user_data->negative_cache.entries, memc_user_data->is_persistent);
+		memc_user_data->negative_cache.entries = NULL;
 	}
+}
 
-	/* Check for exceptions caused by serializers */
-	if (EG(exception) && buf->s->len) {
-		return 0;
+static
+void s_negative_cache_delete(php_memc_object_t *intern, zend_string *key)
+{
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+
+	if (memc_user_data->negative_cache.entries) {
+		zend_hash_del(memc_user_data->negative_cache.entries, key);
 	}
-	return 1;
 }
 
 static
-zend_string *s_zval_to_payload(php_memc_object_t *intern, zval *value, uint32_t *flags)
+void s_negative_cache_store(php_memc_object_t *intern, zend_string *key)
 {
-	zend_string *payload;
+	php_memc_local_entry_t *entry;
+	zend_string *oldest;
 	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
-	zend_bool should_compress = memc_user_data->compression_enabled;
+	HashTable *entries = memc_user_data->negative_cache.entries;
 
-	switch (Z_TYPE_P(value)) {
+	if (memc_user_data->negative_cache.size <= 0) {
+		return;
+	}
 
-		case IS_STRING:
-			payload = zval_get_string(value);
-			MEMC_VAL_SET_TYPE(*flags, MEMC_VAL_IS_STRING);
-			break;
+	if (!entries) {
+		entries = pemalloc(sizeof(HashTable), memc_user_data->is_persistent);
+		zend_hash_init(entries, 0, NULL, s_local_cache_entry_dtor, memc_user_data->is_persistent);
+		memc_user_data->negative_cache.entries = entries;
+	}
 
-		case IS_LONG:
-		{
-			smart_str buffer = {0};
-			smart_str_append_long (&buffer, Z_LVAL_P(value));
-			smart_str_0(&buffer);
-			payload = buffer.s;
+	zend_hash_del(entries, key);
 
-			MEMC_VAL_SET_TYPE(*flags, MEMC_VAL_IS_LONG);
-			should_compress = 0;
-		}
-			break;
+	while (zend_hash_num_elements(entries) >= (uint32_t) memc_user_data->negative_cache.size && (oldest = s_hash_oldest_key(entries))) {
+		zend_hash_del(entries, oldest);
+	}
 
-		case IS_DOUBLE:
-		{
-			char buffer[40];
-			php_memcached_g_fmt(buffer, Z_DVAL_P(value));
-			payload = zend_string_init (buffer, strlen (buffer), 0);
-			MEMC_VAL_SET_TYPE(*flags, MEMC_VAL_IS_DOUBLE);
-			should_compress = 0;
-		}
-			break;
+	entry                = pecalloc(1, sizeof(*entry), memc_user_data->is_persistent);
+	entry->expires       = s_memc_time_ms() + memc_user_data->negative_cache.ttl;
+	entry->is_persistent = memc_user_data->is_persistent;
 
-		case IS_TRUE:
-			payload = zend_string_init ("1", 1, 0);
-			MEMC_VAL_SET_TYPE(*flags, MEMC_VAL_IS_BOOL);
-			should_compress = 0;
-			break;
+	zend_hash_str_update_ptr(entries, ZSTR_VAL(key), ZSTR_LEN(key), entry);
+}
 
-		case IS_FALSE:
-			payload = zend_string_alloc (0, 0);
-			MEMC_VAL_SET_TYPE(*flags, MEMC_VAL_IS_BOOL);
-			should_compress = 0;
-			break;
+static
+zend_bool s_negative_cache_has(php_memc_object_t *intern, zend_string *key)
+{
+	php_memc_local_entry_t *entry;
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
 
-		default:
-		{
-			smart_str buffer = {0};
+	if (memc_user_data->negative_cache.size <= 0 || !memc_user_data->negative_cache.entries) {
+		return 0;
+	}
 
-			if (!s_serialize_value (memc_user_data->serializer, value, &buffer, flags)) {
-				smart_str_free(&buffer);
-				return NULL;
-			}
-			payload = buffer.s;
+	if ((entry = zend_hash_find_ptr(memc_user_data->negative_cache.entries, key)) != NULL) {
+		if (entry->expires > s_memc_time_ms()) {
+			memc_user_data->negative_cache.hits++;
+			return 1;
 		}
-			break;
+		zend_hash_del(memc_user_data->negative_cache.entries, key);
 	}
+	return 0;
+}
 
-	/* turn off compression for values below the threshold */
-	if (ZSTR_LEN(payload) == 0 || ZSTR_LEN(payload) < MEMC_G(compression_threshold)) {
-		should_compress = 0;
-	}
+/* Drops the keys known to be missing from keys */
+static
+size_t s_negative_cache_apply_keys(php_memc_object_t *intern, php_memc_keys_t *keys)
+{
+	size_t i, remaining = 0, skipped = 0;
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
 
-	/* If we have compression flag, compress the value */
-	if (should_compress) {
-		/* s_compress_value() will always leave a valid payload, even if that payload
-		 * did not actually get compressed. The flags will be set according to the
-		 * to the compression type or no compression.
-		 *
-		 * No need to check the return value because the payload is always valid.
-		 */
-		(void)s_compress_value (memc_user_data->compression_type, &payload, flags);
+	if (memc_user_data->negative_cache.size <= 0 || !memc_user_data->negative_cache.entries) {
+		return 0;
 	}
 
-	if (memc_user_data->set_udf_flags >= 0) {
-		MEMC_VAL_SET_USER_FLAGS(*flags, ((uint32_t) memc_user_data->set_udf_flags));
+	for (i = 0; i < keys->num_valid_keys; i++) {
+		if (s_negative_cache_has(intern, keys->strings[i])) {
+			zend_string_release(keys->strings[i]);
+			skipped++;
+			continue;
+		}
+		keys->mkeys[remaining]     = keys->mkeys[i];
+		keys->mkeys_len[remaining] = keys->mkeys_len[i];
+		keys->strings[remaining]   = keys->strings[i];
+		remaining++;
 	}
 
-	return payload;
+	keys->num_valid_keys = remaining;
+	return skipped;
 }
 
+/*
+ * Tells the running get() or getMulti() not to remember the key as missing: it may well
+ * exist, but its value could not be read, or its server never finished its reply.
+ */
 static
-zend_bool s_should_retry_write (php_memc_object_t *intern, memcached_return status)
+void s_negative_cache_unconfirm(php_memc_object_t *intern, const char *key, size_t key_len)
 {
-	if (memcached_server_count (intern->memc) == 0) {
-		return 0;
+	if (intern->unconfirmed) {
+		zend_hash_str_add_empty_element(intern->unconfirmed, key, key_len);
 	}
+}
+
+/* Servers that still owe a reply, after a poll timed out, did not confirm their keys missing */
+static
+void s_negative_cache_unconfirm_unanswered(php_memc_object_t *intern, php_memc_keys_t *keys)
+{
+	size_t i;
+
+	if (!intern->unconfirmed) {
+		return;
+	}
+
+	for (i = 0; i < keys->num_valid_keys; i++) {
+		memcached_return status;
+		php_memcached_instance_st instance = memcached_server_by_key(intern->memc, keys->mkeys[i], keys->mkeys_len[i], &status);
+
+		if (!instance || memcached_server_response_count(instance) > 0) {
+			s_negative_cache_unconfirm(intern, keys->mkeys[i], keys->mkeys_len[i]);
+		}
+	}
+}
+
+/* Remembers the requested keys that did not make it into the result, if their server said so */
+static
+void s_negative_cache_store_misses(php_memc_object_t *intern, php_memc_keys_t *keys, HashTable *unconfirmed, zval *return_value)
+{
+	size_t i;
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+
+	if (memc_user_data->negative_cache.size <= 0) {
+		return;
+	}
+
+	for (i = 0; i < keys->num_valid_keys; i++) {
+		if (!zend_symtable_exists(Z_ARRVAL_P(return_value), keys->strings[i]) &&
+			!zend_hash_exists(unconfirmed, keys->strings[i])) {
+			s_negative_cache_store(intern, keys->strings[i]);
+		}
+	}
+}
+
+/****************************************
+  Hot key sketch
+****************************************/
+
+static
+void s_hot_keys_clear(php_memc_user_data_t *memc_user_data)
+{
+	uint32_t i;
+
+	if (memc_user_data->hot_keys.index) {
+		zend_hash_destroy(memc_user_data->hot_keys.index);
+		pefree(memc_user_data->hot_keys.index, memc_user_data->is_persistent);
+		memc_user_data->hot_keys.index = NULL;
+	}
+
+	if (memc_user_data->hot_keys.slots) {
+		for (i = 0; i < memc_user_data->hot_keys.used; i++) {
+			zend_string_release(memc_user_data->hot_keys.slots[i].key);
+		}
+		pefree(memc_user_data->hot_keys.slots, memc_user_data->is_persistent);
+		memc_user_data->hot_keys.slots = NULL;
+	}
+	memc_user_data->hot_keys.used = 0;
+}
+
+static
+zend_bool s_hot_keys_sample(php_memc_user_data_t *memc_user_data)
+{
+	uint32_t x;
+
+	if (memc_user_data->hot_keys.size <= 0) {
+		return 0;
+	}
+
+	if (memc_user_data->hot_keys.sample_rate <= 1) {
+		return 1;
+	}
+
+	/* xorshift32, cheap enough to run on every operation */
+	x = memc_user_data->hot_keys.rand_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	memc_user_data->hot_keys.rand_state = x;
+
+	return (x % (uint32_t) memc_user_data->hot_keys.sample_rate) == 0;
+}
+
+/* Swaps two slots of the heap, keeping the index in step */
+static
+void s_hot_keys_swap(php_memc_user_data_t *memc_user_data, uint32_t a, uint32_t b)
+{
+	php_memc_hot_key_t *slots = memc_user_data->hot_keys.slots;
+	php_memc_hot_key_t tmp = slots[a];
+
+	slots[a] = slots[b];
+	slots[b] = tmp;
+
+	ZVAL_LONG(zend_hash_find(memc_user_data->hot_keys.index, slots[a].key), a);
+	ZVAL_LONG(zend_hash_find(memc_user_data->hot_keys.index, slots[b].key), b);
+}
+
+/* Moves a new slot up the heap, past the slots counted more often */
+static
+void s_hot_keys_sift_up(php_memc_user_data_t *memc_user_data, uint32_t i)
+{
+	php_memc_hot_key_t *slots = memc_user_data->hot_keys.slots;
+
+	while (i > 0 && slots[(i - 1) / 2].count > slots[i].count) {
+		s_hot_keys_swap(memc_user_data, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+/* Moves a slot down the heap after its count grew */
+static
+void s_hot_keys_sift_down(php_memc_user_data_t *memc_user_data, uint32_t i)
+{
+	php_memc_hot_key_t *slots = memc_user_data->hot_keys.slots;
+	uint32_t used = memc_user_data->hot_keys.used;
+
+	for (;;) {
+		uint32_t child = 2 * i + 1, min = i;
+
+		if (child < used && slots[child].count < slots[min].count) {
+			min = child;
+		}
+		if (child + 1 < used && slots[child + 1].count < slots[min].count) {
+			min = child + 1;
+		}
+		if (min == i) {
+			break;
+		}
+
+		s_hot_keys_swap(memc_user_data, i, min);
+		i = min;
+	}
+}
+
+static
+void s_hot_keys_record(php_memc_object_t *intern, const char *key, size_t key_len, size_t bytes)
+{
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+	php_memc_hot_key_t *slot;
+	zval *zslot, zindex;
+	uint32_t i;
+
+	if (!s_hot_keys_sample(memc_user_data)) {
+		return;
+	}
+
+	if (!memc_user_data->hot_keys.index) {
+		memc_user_data->hot_keys.index = pemalloc(sizeof(HashTable), memc_user_data->is_persistent);
+		zend_hash_init(memc_user_data->hot_keys.index, (uint32_t) memc_user_data->hot_keys.size, NULL, NULL, memc_user_data->is_persistent);
+
+		memc_user_data->hot_keys.slots = pecalloc((size_t) memc_user_data->hot_keys.size, sizeof(php_memc_hot_key_t), memc_user_data->is_persistent);
+		memc_user_data->hot_keys.used  = 0;
+	}
+
+	if ((zslot = zend_hash_str_find(memc_user_data->hot_keys.index, key, key_len)) != NULL) {
+		i = (uint32_t) Z_LVAL_P(zslot);
+		slot = &memc_user_data->hot_keys.slots[i];
+		slot->count++;
+		slot->bytes += bytes;
+		s_hot_keys_sift_down(memc_user_data, i);
+		return;
+	}
+
+	if (memc_user_data->hot_keys.used < (uint32_t) memc_user_data->hot_keys.size) {
+		i = memc_user_data->hot_keys.used++;
+		slot = &memc_user_data->hot_keys.slots[i];
+		slot->count = 0;
+		slot->error = 0;
+	}
+	else {
+		/* Sketch is full, the new key takes over the least counted slot at the top of the heap */
+		i = 0;
+		slot = &memc_user_data->hot_keys.slots[i];
+
+		zend_hash_del(memc_user_data->hot_keys.index, slot->key);
+		zend_string_release(slot->key);
+		slot->error = slot->count;
+	}
+
+	slot->key    = zend_string_init(key, key_len, memc_user_data->is_persistent);
+	slot->count += 1;
+	slot->bytes  = bytes;
+
+	ZVAL_LONG(&zindex, i);
+	zend_hash_add(memc_user_data->hot_keys.index, slot->key, &zindex);
+
+	if (i > 0) {
+		s_hot_keys_sift_up(memc_user_data, i);
+	} else {
+		s_hot_keys_sift_down(memc_user_data, i);
+	}
+}
+
+static
+int s_hot_keys_compare(const void *a, const void *b)
+{
+	const php_memc_hot_key_t *first = a, *second = b;
+
+	if (first->count == second->count) {
+		return 0;
+	}
+	return (first->count > second->count) ? -1 : 1;
+}
+
+/****************************************
+  Lazily decoded values
+****************************************/
+
+/*
+ * With GET_LAZY a fetched value keeps the payload as it came from the server,
+ * decompression and unserialization run on the first getValue().
+ */
+static
+void s_lazy_value_init(php_memc_object_t *intern, zend_string *payload, uint32_t flags, zval *return_value)
+{
+	php_memc_lazy_value_t *lazy;
+
+	object_init_ex(return_value, memcached_lazy_value_ce);
+	lazy = Z_MEMC_LAZY_VALUE_P(return_value);
+
+	/* Decoding needs the options and codec contexts of the instance */
+	ZVAL_OBJ(&lazy->object, &intern->zo);
+	Z_ADDREF(lazy->object);
+
+	lazy->payload = payload;
+	lazy->flags   = flags;
+}
+
+/* Values that are already decoded, such as those from a cache callback, are wrapped as they are */
+static
+void s_lazy_value_wrap(zval *value, zval *return_value)
+{
+	php_memc_lazy_value_t *lazy;
+
+	object_init_ex(return_value, memcached_lazy_value_ce);
+	lazy = Z_MEMC_LAZY_VALUE_P(return_value);
+
+	ZVAL_COPY(&lazy->value, value);
+}
+
+static
+zend_bool s_memcached_payload_to_result(php_memc_object_t *intern, zend_bool lazy, const char *payload, size_t payload_len, uint32_t flags, zval *return_value)
+{
+	if (lazy && (payload || !payload_len) && !MEMC_VAL_HAS_FLAG(flags, MEMC_VAL_CHUNKED)) {
+		php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+
+		s_lazy_value_init(intern, zend_string_init(payload ? payload : "", payload_len, 0), flags, return_value);
+		memc_user_data->decode.copied += payload_len;
+		return 1;
+	}
+	return s_memcached_payload_to_zval(intern->memc, payload, payload_len, flags, return_value);
+}
+
+/****************************************
+  Iterate over memcached results and mget
+****************************************/
+
+/*
+ * expected is the number of keys asked for, 0 when it is not known. With the codec pool and enough
+ * keys, compressed results are kept as they are and decompressed together once every result is in.
+ */
+static
+memcached_return php_memc_result_apply(php_memc_object_t *intern, php_memc_result_apply_fn result_apply_fn, zend_bool fetch_delay, size_t expected, zend_bool lazy, void *context)
+{
+	memcached_result_st result, *current = &result, *next, *result_ptr;
+	memcached_return rc, status = MEMCACHED_SUCCESS;
+	php_memc_chunked_list_t chunked = {0};
+	php_memc_deferred_list_t deferred = {0};
+	zend_bool stopped = 0;
+
+	zend_bool defer_compressed = (!fetch_delay && !lazy && expected >= MEMC_CODEC_POOL_MIN_VALUES && php_memc_pool_size() > 0);
+
+	memcached_result_create(intern->memc, &result);
+
+	do {
+		result_ptr = memcached_fetch_result(intern->memc, current, &rc);
+
+		if (s_memcached_return_is_error(rc, 0)) {
+			status = rc;
+		}
+
+		/* nothing returned */
+		if (!result_ptr) {
+			break;
+		}
+		else {
+			zend_string *key;
+			zval val, zcas;
+			zend_bool retval;
+
+			uint64_t cas;
+			uint32_t flags;
+
+			const char *res_key;
+			size_t res_key_len;
+
+			/* Chunks can only be requested once this result set has been read, fetch() cannot wait for that */
+			if (!fetch_delay && MEMC_VAL_HAS_FLAG(memcached_result_flags(result_ptr), MEMC_VAL_CHUNKED)) {
+				if (!s_chunked_defer(&chunked, result_ptr)) {
+					status = MEMCACHED_SOME_ERRORS;
+				}
+				continue;
+			}
+
+			res_key     = memcached_result_key_value(result_ptr);
+			res_key_len = memcached_result_key_length(result_ptr);
+			cas         = memcached_result_cas(result_ptr);
+			flags       = memcached_result_flags(result_ptr);
+
+			if (defer_compressed && MEMC_VAL_HAS_FLAG(flags, MEMC_VAL_COMPRESSED) &&
+				(next = memcached_result_create(intern->memc, NULL)) != NULL) {
+				/* The list takes the result with its buffer, the next one is fetched into a new result */
+				s_deferred_add(&deferred, result_ptr);
+				current = next;
+
+				if (intern->local_cache_fill) {
+					s_local_cache_store(intern, res_key, res_key_len, memcached_result_value(result_ptr), memcached_result_length(result_ptr), flags, cas);
+				}
+				s_hot_keys_record(intern, res_key, res_key_len, memcached_result_length(result_ptr));
+				continue;
+			}
+
+			if (!s_memcached_payload_to_result(intern, lazy, memcached_result_value(result_ptr), memcached_result_length(result_ptr), flags, &val)) {
+				if (EG(exception)) {
+					status = MEMC_RES_PAYLOAD_FAILURE;
+					memcached_quit(intern->memc);
+					stopped = 1;
+					break;
+				}
+				status = MEMCACHED_SOME_ERRORS;
+				continue;
+			}
+
+			s_uint64_to_zval(&zcas, cas);
+
+			if (intern->local_cache_fill) {
+				s_local_cache_store(intern, res_key, res_key_len, memcached_result_value(result_ptr), memcached_result_length(result_ptr), flags, cas);
+			}
+
+			s_hot_keys_record(intern, res_key, res_key_len, memcached_result_length(result_ptr));
+
+			key = zend_string_init (res_key, res_key_len, 0);
+			retval = result_apply_fn(intern, key, &val, &zcas, flags, context);
+
+			zend_string_release(key);
+			zval_ptr_dtor(&val);
+			zval_ptr_dtor(&zcas);
+
+			/* Stop iterating on false */
+			if (!retval) {
+				if (!fetch_delay) {
+					/* Make sure we clear our results */
+					while (memcached_fetch_result(intern->memc, current, &rc)) {}
+				}
+				stopped = 1;
+				break;
+			}
+		}
+	} while (result_ptr != NULL);
+
+	memcached_result_free(current);
+
+	if (deferred.count) {
+		if (!stopped) {
+			rc = s_deferred_apply(intern, &deferred, result_apply_fn, context, &stopped);
+			if (s_memcached_return_is_error(rc, 0)) {
+				status = rc;
+			}
+		}
+		s_deferred_list_free(&deferred);
+	}
+
+	if (chunked.count) {
+		if (!stopped) {
+			rc = s_chunked_fetch(intern, &chunked, result_apply_fn, lazy, context);
+			if (s_memcached_return_is_error(rc, 0)) {
+				status = rc;
+			}
+		}
+		s_chunked_list_free(&chunked);
+	}
+	return status;
+}
+
+/****************************************
+  Hedged reads
+****************************************/
+
+typedef struct {
+	php_memc_result_apply_fn result_apply_fn;
+	void *context;
+	HashTable returned;
+	zend_bool lazy;
+	zend_bool stopped;
+} php_memc_hedge_context_t;
+
+typedef struct _php_memc_hedge_pin_t {
+	char key[16];
+	int  len;
+} php_memc_hedge_pin_t;
+
+/* The keys asked from one replica server, with a group key that maps to it */
+typedef struct {
+	php_memc_hedge_pin_t pin;
+	const char **mkeys;
+	size_t *mkeys_len;
+	size_t count;
+} php_memc_hedge_group_t;
+
+/* A replica read, run by s_hedge_task_run() on another thread while the primaries are awaited */
+typedef struct {
+	memcached_st *memc;
+	uint64_t delay;
+
+	php_memc_hedge_group_t *groups;
+	uint32_t groups_count;
+	const char **mkeys;
+	size_t *mkeys_len;
+	size_t keys_count;
+
+	memcached_result_st **results;
+	size_t count;
+	memcached_return status;
+	zend_bool sent;
+} php_memc_hedge_task_t;
+
+static
+zend_bool s_hedge_apply_fn(php_memc_object_t *intern, zend_string *key, zval *value, zval *cas, uint32_t flags, void *in_context)
+{
+	php_memc_hedge_context_t *context = (php_memc_hedge_context_t *) in_context;
+
+	zend_hash_add_empty_element(&context->returned, key);
+
+	if (!context->result_apply_fn(intern, key, value, cas, flags, context->context)) {
+		context->stopped = 1;
+		return 0;
+	}
+	return 1;
+}
+
+static
+zend_bool s_hedge_enabled(php_memc_object_t *intern)
+{
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+
+	/* libmemcached only writes the replicas over the binary protocol */
+	return memc_user_data->hedge.delay > 0 &&
+		memcached_behavior_get(intern->memc, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL) &&
+		memcached_behavior_get(intern->memc, MEMCACHED_BEHAVIOR_NUMBER_OF_REPLICAS) > 0 &&
+		memcached_server_count(intern->memc) > 1;
+}
+
+/* Milliseconds the primary gets before the keys are asked from a replica */
+static
+zend_long s_hedge_delay(php_memc_user_data_t *memc_user_data)
+{
+	if (memc_user_data->hedge.percentile > 0 && memc_user_data->hedge.observed > 0) {
+		return MIN(memc_user_data->hedge.observed, memc_user_data->hedge.delay);
+	}
+	return memc_user_data->hedge.delay;
+}
+
+static
+int s_hedge_compare_samples(const void *a, const void *b)
+{
+	uint32_t first = *(const uint32_t *) a, second = *(const uint32_t *) b;
+
+	if (first == second) {
+		return 0;
+	}
+	return (first < second) ? -1 : 1;
+}
+
+/* Keeps the latest primary read times, the percentile is recomputed every 16 reads */
+static
+void s_hedge_record(php_memc_user_data_t *memc_user_data, uint64_t elapsed_us)
+{
+	uint32_t sorted[MEMC_HEDGE_SAMPLES];
+	uint32_t count;
+
+	memc_user_data->hedge.samples[memc_user_data->hedge.sampled++ % MEMC_HEDGE_SAMPLES] = (uint32_t) MIN(elapsed_us, UINT32_MAX);
+
+	if (!memc_user_data->hedge.percentile || memc_user_data->hedge.sampled < 16 || memc_user_data->hedge.sampled % 16) {
+		return;
+	}
+
+	count = MIN(memc_user_data->hedge.sampled, MEMC_HEDGE_SAMPLES);
+	memcpy(sorted, memc_user_data->hedge.samples, count * sizeof(uint32_t));
+	qsort(sorted, count, sizeof(uint32_t), s_hedge_compare_samples);
+
+	/* The delay is in milliseconds, round up */
+	memc_user_data->hedge.observed = MAX(1, (sorted[(count - 1) * memc_user_data->hedge.percentile / 100] + 999) / 1000);
+}
+
+/* Failures where the keys may still be found on a replica */
+static
+zend_bool s_hedge_should_retry(memcached_return status)
+{
+	switch (status) {
+		case MEMCACHED_TIMEOUT:
+		case MEMCACHED_ERRNO:
+		case MEMCACHED_CONNECTION_FAILURE:
+		case MEMCACHED_READ_FAILURE:
+		case MEMCACHED_UNKNOWN_READ_FAILURE:
+		case MEMCACHED_WRITE_FAILURE:
+		case MEMCACHED_SERVER_MARKED_DEAD:
+		case MEMCACHED_SERVER_TEMPORARILY_DISABLED:
+		case MEMCACHED_SOME_ERRORS:
+			return 1;
+
+		default:
+			return 0;
+	}
+}
+
+/* Drops the copy of the instance and the group keys, after the servers or the options changed */
+static
+void s_hedge_reset(php_memc_user_data_t *memc_user_data)
+{
+	if (memc_user_data->hedge.replicas) {
+		memcached_free(memc_user_data->hedge.replicas);
+		memc_user_data->hedge.replicas = NULL;
+	}
+	if (memc_user_data->hedge.pins) {
+		pefree(memc_user_data->hedge.pins, memc_user_data->is_persistent);
+		memc_user_data->hedge.pins = NULL;
+	}
+	memc_user_data->hedge.pins_count = 0;
+}
+
+/*
+ * The replicas are read over a copy of the instance, so the primaries keep their connections
+ * and their normal timeout: a slow primary is never given up on or counted as failed.
+ */
+static
+memcached_st *s_hedge_replicas(php_memc_object_t *intern)
+{
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+
+	if (!memc_user_data->hedge.replicas) {
+		memc_user_data->hedge.replicas = memcached_clone(NULL, intern->memc);
+	}
+	return memc_user_data->hedge.replicas;
+}
+
+/*
+ * Returns a group key that maps to the server at the given position, so that it can be addressed
+ * with the _by_key API. The keys of all servers are searched for at once and kept until the
+ * servers or the options change, or until the copy ejects a server and they move.
+ */
+static
+php_memc_hedge_pin_t *s_hedge_pin(php_memc_user_data_t *memc_user_data, memcached_st *replicas, uint32_t server)
+{
+	uint32_t servers = memcached_server_count(replicas);
+	php_memc_hedge_pin_t *pins = memc_user_data->hedge.pins;
+	uint32_t i, found = 0;
+
+	if (server >= servers) {
+		return NULL;
+	}
+
+	if (pins && memc_user_data->hedge.pins_count == servers) {
+		if (!pins[server].len) {
+			return NULL;
+		}
+		if (memcached_generate_hash(replicas, pins[server].key, pins[server].len) == server) {
+			return &pins[server];
+		}
+	} else {
+		if (pins) {
+			pefree(pins, memc_user_data->is_persistent);
+		}
+		pins = safe_pemalloc(servers, sizeof(php_memc_hedge_pin_t), 0, memc_user_data->is_persistent);
+
+		memc_user_data->hedge.pins       = pins;
+		memc_user_data->hedge.pins_count = servers;
+	}
+	memset(pins, 0, servers * sizeof(php_memc_hedge_pin_t));
+
+	for (i = 0; i < 64 * servers && found < servers; i++) {
+		char key[sizeof(pins->key)];
+		int key_len = snprintf(key, sizeof(key), "hedge%u", i);
+		uint32_t hash = memcached_generate_hash(replicas, key, key_len);
+
+		if (hash < servers && !pins[hash].len) {
+			memcpy(pins[hash].key, key, key_len + 1);
+			pins[hash].len = key_len;
+			found++;
+		}
+	}
+	return pins[server].len ? &pins[server] : NULL;
+}
+
+/*
+ * Prepares the read of one replica level: libmemcached keeps the n-th replica of a key on the
+ * n-th server after its primary, so the keys are grouped by that server. Keys already returned
+ * are left out, and so are the keys of primaries that finished their reply when unanswered is
+ * given. Returns 0 if there is nothing to read.
+ */
+static
+zend_bool s_hedge_task_init(php_memc_object_t *intern, php_memc_keys_t *keys, php_memc_hedge_context_t *context,
+							uint32_t replica, const zend_bool *unanswered, uint64_t delay, php_memc_hedge_task_t *task)
+{
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+	uint32_t server, servers = memcached_server_count(intern->memc);
+	memcached_st *replicas;
+	uint32_t *targets;
+	size_t i, offset = 0;
+
+	memset(task, 0, sizeof(*task));
+
+	if (!(replicas = s_hedge_replicas(intern))) {
+		return 0;
+	}
+
+	task->memc         = replicas;
+	task->delay        = delay;
+	task->groups_count = servers;
+	task->groups       = safe_emalloc(servers, sizeof(php_memc_hedge_group_t), 0);
+	task->mkeys        = safe_emalloc(keys->num_valid_keys, sizeof(char *), 0);
+	task->mkeys_len    = safe_emalloc(keys->num_valid_keys, sizeof(size_t), 0);
+	memset(task->groups, 0, servers * sizeof(php_memc_hedge_group_t));
+
+	targets = safe_emalloc(keys->num_valid_keys, sizeof(uint32_t), 0);
+
+	for (i = 0; i < keys->num_valid_keys; i++) {
+		uint32_t primary = memcached_generate_hash(intern->memc, keys->mkeys[i], keys->mkeys_len[i]);
+
+		targets[i] = servers;
+
+		if ((unanswered && !unanswered[primary]) || zend_hash_str_exists(&context->returned, keys->mkeys[i], keys->mkeys_len[i])) {
+			continue;
+		}
+		targets[i] = (primary + replica) % servers;
+		task->groups[targets[i]].count++;
+	}
+
+	for (server = 0; server < servers; server++) {
+		php_memc_hedge_group_t *group = &task->groups[server];
+		php_memc_hedge_pin_t *pin;
+
+		if (!group->count) {
+			continue;
+		}
+		if (!(pin = s_hedge_pin(memc_user_data, replicas, server))) {
+			/* Nothing reaches the server, its keys stay missing */
+			task->status = MEMCACHED_SOME_ERRORS;
+			group->count = 0;
+			continue;
+		}
+		group->pin       = *pin;
+		group->mkeys     = task->mkeys + offset;
+		group->mkeys_len = task->mkeys_len + offset;
+		offset += group->count;
+		group->count = 0;
+	}
+
+	for (i = 0; i < keys->num_valid_keys; i++) {
+		php_memc_hedge_group_t *group;
+
+		if (targets[i] == servers || !task->groups[targets[i]].mkeys) {
+			continue;
+		}
+		group = &task->groups[targets[i]];
+		group->mkeys[group->count]     = keys->mkeys[i];
+		group->mkeys_len[group->count] = keys->mkeys_len[i];
+		group->count++;
+	}
+	efree(targets);
+
+	task->keys_count = offset;
+	task->results    = safe_emalloc(MAX(offset, 1), sizeof(memcached_result_st *), 0);
+
+	return offset > 0;
+}
+
+/*
+ * Reads the replicas, once the delay has passed when it runs alongside the primaries. This runs
+ * outside of PHP: it only touches the copy of the instance and the task, and the results are
+ * decoded by s_hedge_task_apply() afterwards.
+ */
+static
+void s_hedge_task_run(void *arg, php_memc_async_t *async)
+{
+	php_memc_hedge_task_t *task = (php_memc_hedge_task_t *) arg;
+	uint32_t server;
+
+	if (async && !php_memc_async_sleep(async, task->delay)) {
+		return;
+	}
+	task->sent = 1;
+
+	for (server = 0; server < task->groups_count; server++) {
+		php_memc_hedge_group_t *group = &task->groups[server];
+		memcached_result_st *result;
+		memcached_return rc;
+
+		if (!group->count) {
+			continue;
+		}
+
+		rc = memcached_mget_by_key(task->memc, group->pin.key, group->pin.len, group->mkeys, group->mkeys_len, group->count);
+
+		while (rc == MEMCACHED_SUCCESS && (result = memcached_fetch_result(task->memc, NULL, &rc)) != NULL) {
+			if (task->count < task->keys_count) {
+				task->results[task->count++] = result;
+			} else {
+				memcached_result_free(result);
+			}
+		}
+		if (s_memcached_return_is_error(rc, 0)) {
+			task->status = rc;
+		}
+	}
+}
+
+/* Hands what the replicas returned to the callback, for the keys the primaries did not return */
+static
+memcached_return s_hedge_task_apply(php_memc_object_t *intern, php_memc_hedge_task_t *task, php_memc_hedge_context_t *context)
+{
+	memcached_return status = task->status;
+	uint32_t server;
+	size_t i;
+
+	/* A replica that has no copy does not make the key missing */
+	for (server = 0; server < task->groups_count; server++) {
+		for (i = 0; i < task->groups[server].count; i++) {
+			s_negative_cache_unconfirm(intern, task->groups[server].mkeys[i], task->groups[server].mkeys_len[i]);
+		}
+	}
+
+	for (i = 0; i < task->count && !context->stopped; i++) {
+		memcached_result_st *result = task->results[i];
+		const char *res_key = memcached_result_key_value(result);
+		size_t res_key_len  = memcached_result_key_length(result);
+		uint32_t flags      = memcached_result_flags(result);
+		zend_string *key;
+		zval val, zcas;
+
+		/* Chunks are only read through the primaries */
+		if (MEMC_VAL_HAS_FLAG(flags, MEMC_VAL_CHUNKED) || zend_hash_str_exists(&context->returned, res_key, res_key_len)) {
+			continue;
+		}
+
+		if (!s_memcached_payload_to_result(intern, context->lazy, memcached_result_value(result), memcached_result_length(result), flags, &val)) {
+			if (EG(exception)) {
+				status = MEMC_RES_PAYLOAD_FAILURE;
+				context->stopped = 1;
+			} else {
+				status = MEMCACHED_SOME_ERRORS;
+			}
+			continue;
+		}
+
+		if (intern->local_cache_fill) {
+			s_local_cache_store(intern, res_key, res_key_len, memcached_result_value(result), memcached_result_length(result), flags, memcached_result_cas(result));
+		}
+		s_hot_keys_record(intern, res_key, res_key_len, memcached_result_length(result));
+
+		s_uint64_to_zval(&zcas, memcached_result_cas(result));
+		key = zend_string_init(res_key, res_key_len, 0);
+
+		s_hedge_apply_fn(intern, key, &val, &zcas, flags, context);
+
+		zend_string_release(key);
+		zval_ptr_dtor(&val);
+		zval_ptr_dtor(&zcas);
+	}
+	return status;
+}
+
+static
+void s_hedge_task_free(php_memc_hedge_task_t *task)
+{
+	size_t i;
+
+	if (!task->groups) {
+		return;
+	}
+	for (i = 0; i < task->count; i++) {
+		memcached_result_free(task->results[i]);
+	}
+	efree(task->groups);
+	efree(task->mkeys);
+	efree(task->mkeys_len);
+	efree(task->results);
+}
+
+/*
+ * Asks the replicas, one level after the other, for the keys of the primaries that failed.
+ * A primary that finished its reply has confirmed its keys missing, those are not asked again.
+ */
+static
+memcached_return s_hedge_fetch_replicas(php_memc_object_t *intern, php_memc_keys_t *keys, php_memc_hedge_context_t *context, zend_bool *sent)
+{
+	uint32_t servers = memcached_server_count(intern->memc);
+	uint32_t replicas = MIN((uint32_t) memcached_behavior_get(intern->memc, MEMCACHED_BEHAVIOR_NUMBER_OF_REPLICAS), servers - 1);
+	uint32_t replica, server;
+	memcached_return status = MEMCACHED_SUCCESS;
+	php_memc_hedge_task_t task;
+	zend_bool *unanswered;
+
+	unanswered = safe_emalloc(servers, sizeof(zend_bool), 0);
+	for (server = 0; server < servers; server++) {
+		php_memcached_instance_st instance = memcached_server_instance_by_position(intern->memc, server);
+
+		unanswered[server] = !instance || memcached_server_response_count(instance) > 0 ||
+							 s_memcached_return_is_error(memcached_server_error_return(instance), 0);
+	}
+
+	for (replica = 1; replica <= replicas; replica++) {
+		if (s_hedge_task_init(intern, keys, context, replica, unanswered, 0, &task)) {
+			s_hedge_task_run(&task, NULL);
+			*sent = 1;
+		}
+		status = s_hedge_task_apply(intern, &task, context);
+		s_hedge_task_free(&task);
+
+		if (context->stopped || !s_hedge_should_retry(status)) {
+			break;
+		}
+	}
+	efree(unanswered);
+	return status;
+}
+
+/*
+ * Reads the keys from their primaries with the normal timeout. If they have not all answered
+ * after OPT_HEDGE_DELAY milliseconds (or the observed OPT_HEDGE_PERCENTILE of recent reads), the
+ * first replicas are asked for the same keys from another thread, over a copy of the instance,
+ * and stand in for the keys the primaries do not return. Without threads, or when the primaries
+ * fail before the delay, the replicas are asked once the primaries have failed.
+ */
+static
+memcached_return s_hedge_mget_apply(php_memc_object_t *intern, php_memc_keys_t *keys, php_memc_result_apply_fn result_apply_fn, zend_bool lazy, void *context)
+{
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+	php_memc_hedge_context_t hedge_context;
+	php_memc_hedge_task_t task;
+	memcached_return status;
+	uint64_t started, elapsed;
+	uint32_t returned;
+	zend_bool running = 0, sent = 0;
+
+	hedge_context.result_apply_fn = result_apply_fn;
+	hedge_context.context         = context;
+	hedge_context.lazy            = lazy;
+	hedge_context.stopped         = 0;
+	zend_hash_init(&hedge_context.returned, keys->num_valid_keys, NULL, NULL, 0);
+	memset(&task, 0, sizeof(task));
+
+	started = s_memc_time_us();
+	status = memcached_mget(intern->memc, keys->mkeys, keys->mkeys_len, keys->num_valid_keys);
+	if (status == MEMCACHED_SUCCESS) {
+		if (!memc_user_data->hedge.async) {
+			memc_user_data->hedge.async = php_memc_async_new();
+		}
+		if (memc_user_data->hedge.async &&
+			s_hedge_task_init(intern, keys, &hedge_context, 1, NULL, (uint64_t) s_hedge_delay(memc_user_data), &task)) {
+			running = php_memc_async_start(memc_user_data->hedge.async, s_hedge_task_run, &task);
+		}
+		/* The task lives on this stack, a fatal error must not leave the thread behind writing to it */
+		zend_try {
+			status = php_memc_result_apply(intern, s_hedge_apply_fn, 0, keys->num_valid_keys, lazy, &hedge_context);
+		} zend_catch {
+			if (running) {
+				php_memc_async_finish(memc_user_data->hedge.async);
+			}
+			zend_bailout();
+		} zend_end_try();
+	}
+	elapsed = s_memc_time_us() - started;
+
+	if (running) {
+		php_memc_async_finish(memc_user_data->hedge.async);
+	}
+	s_negative_cache_unconfirm_unanswered(intern, keys);
+	s_hedge_record(memc_user_data, elapsed);
+	memc_user_data->hedge.reads++;
+
+	returned = zend_hash_num_elements(&hedge_context.returned);
+
+	if (task.sent) {
+		memcached_return replica_status = s_hedge_task_apply(intern, &task, &hedge_context);
+
+		sent = 1;
+
+		/* The replicas answered for the failed primaries */
+		if (s_hedge_should_retry(status) && !s_hedge_should_retry(replica_status)) {
+			status = replica_status;
+		}
+	}
+	s_hedge_task_free(&task);
+
+	if (!sent && !hedge_context.stopped && s_hedge_should_retry(status) &&
+		zend_hash_num_elements(&hedge_context.returned) < keys->num_valid_keys) {
+		memcached_return replica_status = s_hedge_fetch_replicas(intern, keys, &hedge_context, &sent);
+
+		if (!s_hedge_should_retry(replica_status)) {
+			status = replica_status;
+		}
+	}
+
+	if (sent) {
+		memc_user_data->hedge.hedged++;
+	}
+	if (zend_hash_num_elements(&hedge_context.returned) > returned) {
+		memc_user_data->hedge.wins++;
+		memc_user_data->hedge.keys += zend_hash_num_elements(&hedge_context.returned) - returned;
+	}
+
+	zend_hash_destroy(&hedge_context.returned);
+	return status;
+}
+
+static
+zend_bool php_memc_mget_apply(php_memc_object_t *intern, zend_string *server_key, php_memc_keys_t *keys,
+						php_memc_result_apply_fn result_apply_fn, zend_bool with_cas, zend_bool lazy, void *context)
+{
+	memcached_return status;
+	int mget_status;
+	uint64_t orig_cas_flag = 0;
+
+	// Reset status code
+	s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
+
+	if (!keys->num_valid_keys) {
+		intern->rescode = MEMCACHED_BAD_KEY_PROVIDED;
+		return 0;
+	}
+
+	if (with_cas) {
+		orig_cas_flag = memcached_behavior_get (intern->memc, MEMCACHED_BEHAVIOR_SUPPORT_CAS);
+
+		if (!orig_cas_flag) {
+			memcached_behavior_set (intern->memc, MEMCACHED_BEHAVIOR_SUPPORT_CAS, 1);
+		}
+	}
+
+	if (!server_key && result_apply_fn && s_hedge_enabled(intern)) {
+		status = s_hedge_mget_apply(intern, keys, result_apply_fn, lazy, context);
+
+		if (with_cas && !orig_cas_flag) {
+			memcached_behavior_set (intern->memc, MEMCACHED_BEHAVIOR_SUPPORT_CAS, orig_cas_flag);
+		}
+		return s_memc_status_handle_result_code(intern, status) == SUCCESS;
+	}
+
+	if (server_key) {
+		status = memcached_mget_by_key(intern->memc, ZSTR_VAL(server_key), ZSTR_LEN(server_key), keys->mkeys, keys->mkeys_len, keys->num_valid_keys);
+	} else {
+		status = memcached_mget(intern->memc, keys->mkeys, keys->mkeys_len, keys->num_valid_keys);
+	}
+
+	/* Need to handle result code before restoring cas flags, would mess up errno */
+	mget_status = s_memc_status_handle_result_code(intern, status);
+		
+	if (with_cas && !orig_cas_flag) {
+		memcached_behavior_set (intern->memc, MEMCACHED_BEHAVIOR_SUPPORT_CAS, orig_cas_flag);
+	}
+
+	/* Return on failure codes */
+	if (mget_status == FAILURE) {
+		return 0;
+	}
+
+	if (!result_apply_fn) {
+		/* no callback, for example getDelayed */
+		return 1;
+	}
+
+	status = php_memc_result_apply(intern, result_apply_fn, 0, keys->num_valid_keys, lazy, context);
+	s_negative_cache_unconfirm_unanswered(intern, keys);
+
+	if (s_memc_status_handle_result_code(intern, status) == FAILURE) {
+		return 0;
+	}
+
+	return 1;
+}
+
+/****************************************
+  Invoke callbacks
+****************************************/
+
+static
+zend_bool s_invoke_new_instance_cb(zval *object, zend_fcall_info *fci, zend_fcall_info_cache *fci_cache, zend_string *persistent_id)
+{
+	zend_bool ret = 1;
+	zval retval;
+	zval params[2];
+
+	ZVAL_COPY(&params[0], object);
+	if (persistent_id) {
+		ZVAL_STR(&params[1], zend_string_copy(persistent_id));
+	} else {
+		ZVAL_NULL(&params[1]);
+	}
+
+	fci->retval = &retval;
+	fci->params = params;
+	fci->param_count = 2;
+
+	if (zend_call_function(fci, fci_cache) == FAILURE) {
+		char *buf = php_memc_printable_func (fci, fci_cache);
+		php_error_docref(NULL, E_WARNING, "Failed to invoke 'on_new' callback %s()", buf);
+		efree (buf);
+		ret = 0;
+	}
+
+	zval_ptr_dtor(&params[0]);
+	zval_ptr_dtor(&params[1]);
+	zval_ptr_dtor(&retval);
+
+	return ret;
+}
+
+static
+zend_bool s_invoke_cache_callback(zval *zobject, zend_fcall_info *fci, zend_fcall_info_cache *fcc, zend_bool with_cas, zend_string *key, zval *value)
+{
+	zend_bool status = 0;
+	zval params[4];
+	zval retval;
+	php_memc_object_t *intern = Z_MEMC_OBJ_P(zobject);
+
+	/* Prepare params */
+	ZVAL_COPY(&params[0], zobject);
+	ZVAL_STR_COPY(&params[1], key);    /* key */
+	ZVAL_NEW_REF(&params[2], value);   /* value */
+
+	if (with_cas) {
+		fci->param_count = 3;
+	} else {
+		ZVAL_NEW_EMPTY_REF(&params[3]);    /* expiration */
+		ZVAL_NULL(Z_REFVAL(params[3]));
+		fci->param_count = 4;
+	}
+
+	fci->retval = &retval;
+	fci->params = params;
+
+	if (zend_call_function(fci, fcc) == SUCCESS) {
+		if (zend_is_true(&retval)) {
+			time_t expiration;
+			zval *val = Z_REFVAL(params[2]);
+
+			if (with_cas) {
+				if (Z_TYPE_P(val) == IS_ARRAY) {
+					zval *rv = zend_hash_str_find(Z_ARRVAL_P(val), "value", sizeof("value") - 1);
+					if (rv) {
+						zval *cas = zend_hash_str_find(Z_ARRVAL_P(val), "cas", sizeof("cas") -1);
+						expiration = cas? Z_LVAL_P(cas) : 0;
+						status = s_memc_write_zval (intern, MEMC_OP_SET, NULL, key, rv, expiration);
+					}
+					/* memleak?  zval_ptr_dtor(value); */
+					ZVAL_COPY(value, val);
+				}
+			} else {
+				expiration = zval_get_long(Z_REFVAL(params[3]));
+				status = s_memc_write_zval (intern, MEMC_OP_SET, NULL, key, val, expiration);
+				/* memleak?  zval_ptr_dtor(value); */
+				ZVAL_COPY(value, val);
+			}
+		}
+	}
+	else {
+		s_memc_set_status(intern, MEMCACHED_NOTFOUND, 0);
+	}
+
+	zval_ptr_dtor(&params[0]);
+	zval_ptr_dtor(&params[1]);
+	zval_ptr_dtor(&params[2]);
+	if (!with_cas) {
+		zval_ptr_dtor(&params[3]);
+	}
+	zval_ptr_dtor(&retval);
+
+	return status;
+}
+
+/****************************************
+  Codec contexts
+****************************************/
+
+/*
+ * One value for the codecs. The output string is allocated on the PHP thread
+ * and the codec only writes into it, which lets jobs run on the codec pool.
+ */
+typedef struct {
+	const char  *input;
+	size_t       input_len;
+	zend_string *output;
+	size_t       output_len;
+	uint32_t     codec;      /* MEMC_VAL_COMPRESSION_* */
+	zend_long    level;
+	php_memc_dictionary_t *dictionary;
+	zend_bool    status;
+} php_memc_codec_job_t;
+
+static
+void s_codec_free(php_memc_codec_t *codec)
+{
+	if (codec->deflate_ready) {
+		deflateEnd(&codec->deflate);
+		codec->deflate_ready = 0;
+	}
+
+	if (codec->inflate_ready) {
+		inflateEnd(&codec->inflate);
+		codec->inflate_ready = 0;
+	}
+
+#ifdef HAVE_MEMCACHED_ZSTD
+	ZSTD_freeCCtx(codec->zstd_cctx);
+	ZSTD_freeDCtx(codec->zstd_dctx);
+
+	codec->zstd_cctx = NULL;
+	codec->zstd_dctx = NULL;
+#endif
+}
+
+/* A deflate stream at the given level, reset instead of set up again for every value */
+static
+z_stream *s_codec_deflate(php_memc_codec_t *codec, int level)
+{
+	z_stream *stream = &codec->deflate;
+
+	if (codec->deflate_ready && codec->deflate_level != level) {
+		deflateEnd(stream);
+		codec->deflate_ready = 0;
+	}
+
+	if (codec->deflate_ready) {
+		return deflateReset(stream) == Z_OK ? stream : NULL;
+	}
+
+	memset(stream, 0, sizeof(*stream));
+	if (deflateInit(stream, level) != Z_OK) {
+		return NULL;
+	}
+
+	codec->deflate_ready = 1;
+	codec->deflate_level = level;
+	return stream;
+}
+
+static
+z_stream *s_codec_inflate(php_memc_codec_t *codec)
+{
+	z_stream *stream = &codec->inflate;
+
+	if (codec->inflate_ready) {
+		return inflateReset(stream) == Z_OK ? stream : NULL;
+	}
+
+	memset(stream, 0, sizeof(*stream));
+	if (inflateInit(stream) != Z_OK) {
+		return NULL;
+	}
+
+	codec->inflate_ready = 1;
+	return stream;
+}
+
+#ifdef HAVE_MEMCACHED_ZSTD
+static
+ZSTD_CCtx *s_codec_zstd_cctx(php_memc_codec_t *codec)
+{
+	if (!codec->zstd_cctx) {
+		codec->zstd_cctx = ZSTD_createCCtx();
+	}
+	return codec->zstd_cctx;
+}
+
+static
+ZSTD_DCtx *s_codec_zstd_dctx(php_memc_codec_t *codec)
+{
+	if (!codec->zstd_dctx) {
+		codec->zstd_dctx = ZSTD_createDCtx();
+	}
+	return codec->zstd_dctx;
+}
+#endif
+
+/* Compresses the input into the output string, after the four bytes that hold the original size */
+static
+void s_compress_run(php_memc_codec_t *codec, php_memc_codec_job_t *job)
+{
+	char *buffer;
+	size_t capacity, compressed_size = 0;
+
+	if (!job->output) {
+		return;
+	}
+
+	buffer   = ZSTR_VAL(job->output) + sizeof(uint32_t);
+	capacity = ZSTR_LEN(job->output) - sizeof(uint32_t);
+
+	switch (job->codec) {
+
+		case MEMC_VAL_COMPRESSION_FASTLZ:
+			/* Level 0 lets fastlz pick by size, above 2 is the same as 2 */
+			if (job->level) {
+				compressed_size = fastlz_compress_level(MIN(job->level, 2), job->input, job->input_len, buffer);
+			} else {
+				compressed_size = fastlz_compress(job->input, job->input_len, buffer);
+			}
+			break;
+
+		case MEMC_VAL_COMPRESSION_ZLIB:
+		{
+			/* Same zlib format as compress(), so values stay readable by older versions */
+			z_stream *stream = s_codec_deflate(codec, job->level ? (int) MIN(job->level, Z_BEST_COMPRESSION) : Z_DEFAULT_COMPRESSION);
+
+			if (stream) {
+				stream->next_in   = (Bytef *) job->input;
+				stream->avail_in  = job->input_len;
+				stream->next_out  = (Bytef *) buffer;
+				stream->avail_out = capacity;
+
+				/* Running out of room means the value was not worth compressing */
+				if (deflate(stream, Z_FINISH) == Z_STREAM_END) {
+					compressed_size = stream->total_out;
+				}
+			}
+		}
+			break;
+
+#ifdef HAVE_MEMCACHED_ZSTD
+		case MEMC_VAL_COMPRESSION_ZSTD:
+		{
+			ZSTD_CCtx *cctx = s_codec_zstd_cctx(codec);
+
+			/* Level 0 is the library default, dictionaries keep the level they were loaded with */
+			if (!cctx) {
+				break;
+			} else if (job->dictionary) {
+				compressed_size = ZSTD_compress_usingCDict(cctx, buffer, capacity, job->input, job->input_len, job->dictionary->cdict);
+			} else {
+				compressed_size = ZSTD_compressCCtx(cctx, buffer, capacity, job->input, job->input_len, (int) job->level);
+			}
+
+			if (ZSTD_isError(compressed_size)) {
+				compressed_size = 0;
+			}
+		}
+			break;
+#endif
+
+#ifdef HAVE_MEMCACHED_LZ4
+		case MEMC_VAL_COMPRESSION_LZ4:
+		{
+			int status = LZ4_compress_default(job->input, buffer, job->input_len, capacity);
+
+			if (status > 0) {
+				compressed_size = status;
+			}
+		}
+			break;
+#endif
+	}
+
+	job->output_len = compressed_size;
+	job->status     = (compressed_size > 0);
+}
+
+/* Decompresses the input, the payload past its original size, into the output string */
+static
+void s_decompress_run(php_memc_codec_t *codec, php_memc_codec_job_t *job)
+{
+	char *buffer;
+	size_t length;
+
+	if (!job->output) {
+		return;
+	}
+
+	buffer = ZSTR_VAL(job->output);
+	length = ZSTR_LEN(job->output);
+
+	switch (job->codec) {
+
+		case MEMC_VAL_COMPRESSION_FASTLZ:
+			job->status = ((size_t) fastlz_decompress(job->input, job->input_len, buffer, length) == length);
+			break;
+
+		case MEMC_VAL_COMPRESSION_ZLIB:
+		{
+			z_stream *stream = s_codec_inflate(codec);
+
+			if (stream) {
+				stream->next_in   = (Bytef *) job->input;
+				stream->avail_in  = job->input_len;
+				stream->next_out  = (Bytef *) buffer;
+				stream->avail_out = length;
+
+				job->status = (inflate(stream, Z_FINISH) == Z_STREAM_END && stream->total_out == length);
+			}
+		}
+			break;
+
+#ifdef HAVE_MEMCACHED_ZSTD
+		case MEMC_VAL_COMPRESSION_ZSTD:
+		{
+			ZSTD_DCtx *dctx = s_codec_zstd_dctx(codec);
+			size_t zstd_length;
+
+			if (!dctx) {
+				break;
+			} else if (job->dictionary) {
+				zstd_length = ZSTD_decompress_usingDDict(dctx, buffer, length, job->input, job->input_len, job->dictionary->ddict);
+			} else {
+				zstd_length = ZSTD_decompressDCtx(dctx, buffer, length, job->input, job->input_len);
+			}
+			job->status = (!ZSTD_isError(zstd_length) && zstd_length == length);
+		}
+			break;
+#endif
+
+#ifdef HAVE_MEMCACHED_LZ4
+		case MEMC_VAL_COMPRESSION_LZ4:
+			job->status = (LZ4_decompress_safe(job->input, buffer, job->input_len, length) == (int) length);
+			break;
+#endif
+	}
+
+	job->output_len = job->status ? length : 0;
+}
+
+/****************************************
+  Codec pool
+****************************************/
+
+/* Workers keep their codec state in their scratch slot, for as long as the pool lives */
+static
+php_memc_codec_t *s_codec_scratch(void **scratch)
+{
+	if (!*scratch) {
+		/* Not emalloc(), it is used off the PHP thread and outlives the request */
+		*scratch = calloc(1, sizeof(php_memc_codec_t));
+	}
+	return *scratch;
+}
+
+static
+void s_codec_scratch_free(void *scratch)
+{
+	s_codec_free(scratch);
+	free(scratch);
+}
+
+static
+void s_compress_task(void *task, void **scratch)
+{
+	php_memc_codec_t *codec = s_codec_scratch(scratch);
+
+	if (codec) {
+		s_compress_run(codec, task);
+	}
+}
+
+static
+void s_decompress_task(void *task, void **scratch)
+{
+	php_memc_codec_t *codec = s_codec_scratch(scratch);
+
+	if (codec) {
+		s_decompress_run(codec, task);
+	}
+}
+
+/*
+ * Runs a batch of jobs, spread over the codec pool when the batch is large
+ * enough and the pool is not busy, one after another on the PHP thread otherwise.
+ */
+static
+void s_codec_run(php_memc_user_data_t *memc_user_data, php_memc_codec_job_t *jobs, size_t count, size_t bytes, zend_bool compress)
+{
+	size_t i;
+
+	if (count >= MEMC_CODEC_POOL_MIN_VALUES && bytes >= MEMC_CODEC_POOL_MIN_BYTES &&
+		php_memc_pool_run(compress ? s_compress_task : s_decompress_task, jobs, sizeof(php_memc_codec_job_t), count)) {
+		memc_user_data->codec_pool.batches++;
+		memc_user_data->codec_pool.values += count;
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (compress) {
+			s_compress_run(&memc_user_data->codec, &jobs[i]);
+		} else {
+			s_decompress_run(&memc_user_data->codec, &jobs[i]);
+		}
+	}
+}
+
+/****************************************
+  Compression dictionaries
+****************************************/
+
+static
+void s_dictionaries_free(zend_bool is_persistent, php_memc_dictionary_t *entries, uint32_t count)
+{
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		zend_string_release(entries[i].prefix);
+		zend_string_release(entries[i].file);
+#ifdef HAVE_MEMCACHED_ZSTD
+		ZSTD_freeCDict(entries[i].cdict);
+		ZSTD_freeDDict(entries[i].ddict);
+#endif
+	}
+
+	if (entries) {
+		pefree(entries, is_persistent);
+	}
+}
+
+static
+void s_dictionaries_clear(php_memc_user_data_t *memc_user_data)
+{
+	s_dictionaries_free(memc_user_data->is_persistent, memc_user_data->dictionaries.entries, memc_user_data->dictionaries.count);
+
+	memc_user_data->dictionaries.entries = NULL;
+	memc_user_data->dictionaries.count   = 0;
+}
+
+/* The dictionary with the longest prefix matching the key, NULL if there is none */
+static
+php_memc_dictionary_t *s_dictionary_find(php_memc_user_data_t *memc_user_data, zend_string *key)
+{
+	php_memc_dictionary_t *found = NULL;
+	uint32_t i;
+
+	for (i = 0; i < memc_user_data->dictionaries.count; i++) {
+		php_memc_dictionary_t *dictionary = &memc_user_data->dictionaries.entries[i];
+
+		if (ZSTR_LEN(dictionary->prefix) > ZSTR_LEN(key) ||
+			memcmp(ZSTR_VAL(dictionary->prefix), ZSTR_VAL(key), ZSTR_LEN(dictionary->prefix))) {
+			continue;
+		}
+
+		if (!found || ZSTR_LEN(dictionary->prefix) > ZSTR_LEN(found->prefix)) {
+			found = dictionary;
+		}
+	}
+	return found;
+}
+
+#ifdef HAVE_MEMCACHED_ZSTD
+static
+php_memc_dictionary_t *s_dictionary_by_id(php_memc_user_data_t *memc_user_data, uint32_t id)
+{
+	uint32_t i;
+
+	for (i = 0; i < memc_user_data->dictionaries.count; i++) {
+		if (memc_user_data->dictionaries.entries[i].id == id) {
+			return &memc_user_data->dictionaries.entries[i];
+		}
+	}
+	return NULL;
+}
+
+static
+zend_bool s_dictionary_load(php_memc_user_data_t *memc_user_data, php_memc_dictionary_t *dictionary, zend_string *prefix, zend_string *file)
+{
+	php_stream *stream;
+	zend_string *contents;
+	int level = memc_user_data->compression_level ? (int) memc_user_data->compression_level : ZSTD_CLEVEL_DEFAULT;
+
+	stream = php_stream_open_wrapper(ZSTR_VAL(file), "rb", REPORT_ERRORS, NULL);
+	if (!stream) {
+		return 0;
+	}
+
+	contents = php_stream_copy_to_mem(stream, PHP_STREAM_COPY_ALL, 0);
+	php_stream_close(stream);
+
+	/* Raw content dictionaries carry no ID, so values using them could not be told apart on read */
+	if (!contents || !ZSTD_getDictID_fromDict(ZSTR_VAL(contents), ZSTR_LEN(contents))) {
+		php_error_docref(NULL, E_WARNING, "%s is not a trained zstd dictionary", ZSTR_VAL(file));
+		if (contents) {
+			zend_string_release(contents);
+		}
+		return 0;
+	}
+
+	dictionary->id    = ZSTD_getDictID_fromDict(ZSTR_VAL(contents), ZSTR_LEN(contents));
+	dictionary->cdict = ZSTD_createCDict(ZSTR_VAL(contents), ZSTR_LEN(contents), level);
+	dictionary->ddict = ZSTD_createDDict(ZSTR_VAL(contents), ZSTR_LEN(contents));
+	zend_string_release(contents);
+
+	if (!dictionary->cdict || !dictionary->ddict) {
+		php_error_docref(NULL, E_WARNING, "could not load zstd dictionary %s", ZSTR_VAL(file));
+		ZSTD_freeCDict(dictionary->cdict);
+		ZSTD_freeDDict(dictionary->ddict);
+		return 0;
+	}
+
+	dictionary->prefix = zend_string_init(ZSTR_VAL(prefix), ZSTR_LEN(prefix), memc_user_data->is_persistent);
+	dictionary->file   = zend_string_init(ZSTR_VAL(file), ZSTR_LEN(file), memc_user_data->is_persistent);
+	return 1;
+}
+#endif
+
+/*
+ * Takes either a single file, used for every key, or an array of key prefix => file.
+ * The current dictionaries are only replaced once all of the new ones have loaded.
+ */
+static
+zend_bool s_dictionaries_set(php_memc_object_t *intern, zval *value)
+{
+#ifdef HAVE_MEMCACHED_ZSTD
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+	php_memc_dictionary_t *entries;
+	uint32_t count = 0;
+	zend_string *skey, *prefix, *file;
+	zend_ulong num_key;
+	zval files, *entry;
+	zend_bool loaded = 1;
+
+	if (Z_TYPE_P(value) == IS_NULL || (Z_TYPE_P(value) == IS_ARRAY && !zend_hash_num_elements(Z_ARRVAL_P(value)))) {
+		s_dictionaries_clear(memc_user_data);
+		return 1;
+	}
+
+	if (Z_TYPE_P(value) == IS_ARRAY) {
+		ZVAL_COPY(&files, value);
+	} else {
+		array_init(&files);
+		add_assoc_str_ex(&files, "", 0, zval_get_string(value));
+	}
+
+	entries = pecalloc(zend_hash_num_elements(Z_ARRVAL(files)), sizeof(*entries), memc_user_data->is_persistent);
+
+	ZEND_HASH_FOREACH_KEY_VAL(Z_ARRVAL(files), num_key, skey, entry) {
+		/* Numeric looking prefixes end up as integer keys */
+		prefix = skey ? zend_string_copy(skey) : zend_long_to_str((zend_long) num_key);
+		file   = zval_get_string(entry);
+
+		loaded = s_dictionary_load(memc_user_data, &entries[count], prefix, file);
+
+		zend_string_release(prefix);
+		zend_string_release(file);
+
+		if (!loaded) {
+			break;
+		}
+		count++;
+	} ZEND_HASH_FOREACH_END();
+
+	zval_ptr_dtor(&files);
+
+	if (!loaded) {
+		s_dictionaries_free(memc_user_data->is_persistent, entries, count);
+		return 0;
+	}
+
+	s_dictionaries_free(memc_user_data->is_persistent, memc_user_data->dictionaries.entries, memc_user_data->dictionaries.count);
+	memc_user_data->dictionaries.entries = entries;
+	memc_user_data->dictionaries.count   = count;
+	return 1;
+#else
+	if (Z_TYPE_P(value) == IS_NULL) {
+		return 1;
+	}
+	php_error_docref(NULL, E_WARNING, "MEMC_OPT_COMPRESSION_DICTIONARIES requires zstd support");
+	return 0;
+#endif
+}
+
+/****************************************
+  Adaptive compression
+****************************************/
+
+/* Order-0 entropy in bits per byte, estimated from bytes spread evenly over the payload */
+static
+double s_entropy_estimate(zend_string *payload)
+{
+	uint32_t counts[256] = {0};
+	const unsigned char *data = (const unsigned char *) ZSTR_VAL(payload);
+	size_t samples = MIN(ZSTR_LEN(payload), MEMC_ADAPTIVE_SAMPLE);
+	size_t stride  = ZSTR_LEN(payload) / samples;
+	double entropy = 0.0;
+	size_t i;
+
+	for (i = 0; i < samples; i++) {
+		counts[data[i * stride]]++;
+	}
+
+	for (i = 0; i < 256; i++) {
+		if (counts[i]) {
+			double p = (double) counts[i] / samples;
+			entropy -= p * log2(p);
+		}
+	}
+	return entropy;
+}
+
+/* Slot of the compression history for a payload of this type and length */
+static
+uint32_t s_adaptive_slot(uint32_t type, size_t length)
+{
+	uint32_t size_class = 0;
+
+	while (length >= 4 && size_class < MEMC_ADAPTIVE_SIZE_CLASSES - 1) {
+		length >>= 2;
+		size_class++;
+	}
+	return type * MEMC_ADAPTIVE_SIZE_CLASSES + size_class;
+}
+
+/*
+ * Payloads that look random, like images or already compressed data, are not
+ * tried. Otherwise values of a type and size whose last attempts all failed to
+ * compress are skipped, save for an occasional probe to notice when that changes.
+ */
+static
+zend_bool s_adaptive_should_compress(php_memc_user_data_t *memc_user_data, uint32_t slot, zend_string *payload)
+{
+	if (s_entropy_estimate(payload) > MEMC_ADAPTIVE_MAX_ENTROPY) {
+		memc_user_data->compression.skipped++;
+		return 0;
+	}
+
+	if (memc_user_data->compression.failures[slot] >= MEMC_ADAPTIVE_FAILURES) {
+		if (++memc_user_data->compression.skips[slot] < MEMC_ADAPTIVE_PROBE_INTERVAL) {
+			memc_user_data->compression.skipped++;
+			return 0;
+		}
+		memc_user_data->compression.skips[slot] = 0;
+	}
+	return 1;
+}
+
+static
+void s_adaptive_record(php_memc_user_data_t *memc_user_data, uint32_t slot, zend_bool compressed)
+{
+	memc_user_data->compression.attempted++;
+
+	if (compressed) {
+		memc_user_data->compression.successful++;
+		memc_user_data->compression.failures[slot] = 0;
+	} else {
+		memc_user_data->compression.failures[slot]++;
+	}
+}
+
+/****************************************
+  Wrapper for setting from zval
+****************************************/
+
+/*
+ * Room the codecs get for their output. Anything longer would fail the
+ * compression_factor check, so there is no point in producing it.
+ */
+static
+size_t s_compress_capacity(size_t length, size_t bound)
+{
+	double factor = MEMC_G(compression_factor);
+
+	if (factor > 1.0) {
+		return MIN(bound, (size_t) (length / factor));
+	}
+	return bound;
+}
+
+/* Picks the codec for the value and allocates the string it compresses into */
+static
+zend_bool s_compress_prepare(php_memc_object_t *intern, zend_string *key, zend_string *payload, php_memc_codec_job_t *job)
+{
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+	php_memc_compression_type compression_type = memc_user_data->compression_type;
+	size_t capacity;
+
+	memset(job, 0, sizeof(*job));
+	job->input      = ZSTR_VAL(payload);
+	job->input_len  = ZSTR_LEN(payload);
+	job->level      = memc_user_data->compression_level;
+	job->dictionary = s_dictionary_find(memc_user_data, key);
+
+	/* Keys with a dictionary always use zstd, whatever the compression type */
+	if (job->dictionary) {
+		compression_type = COMPRESSION_TYPE_ZSTD;
+	}
+
+	switch (compression_type) {
+		case COMPRESSION_TYPE_FASTLZ:
+			/* fastlz cannot be told the size of its output, so it gets the worst case */
+			capacity   = MAX(66, (size_t) (((double) ZSTR_LEN(payload) * 1.05) + 1.0));
+			job->codec = MEMC_VAL_COMPRESSION_FASTLZ;
+			break;
+
+		case COMPRESSION_TYPE_ZLIB:
+			capacity   = s_compress_capacity(ZSTR_LEN(payload), compressBound(ZSTR_LEN(payload)));
+			job->codec = MEMC_VAL_COMPRESSION_ZLIB;
+			break;
+
+#ifdef HAVE_MEMCACHED_ZSTD
+		case COMPRESSION_TYPE_ZSTD:
+			capacity   = s_compress_capacity(ZSTR_LEN(payload), ZSTD_compressBound(ZSTR_LEN(payload)));
+			job->codec = MEMC_VAL_COMPRESSION_ZSTD;
+			break;
+#endif
+
+#ifdef HAVE_MEMCACHED_LZ4
+		case COMPRESSION_TYPE_LZ4:
+			capacity   = s_compress_capacity(ZSTR_LEN(payload), LZ4_compressBound(ZSTR_LEN(payload)));
+			job->codec = MEMC_VAL_COMPRESSION_LZ4;
+			break;
+#endif
+
+		default:
+			return 0;
+	}
+
+	/* The codecs write straight into the string that replaces the payload, after the original size */
+	job->output = zend_string_alloc(sizeof(uint32_t) + capacity, 0);
+	memc_user_data->codec_output.allocations++;
+	memc_user_data->codec_output.bytes += sizeof(uint32_t) + capacity;
+	return 1;
+}
+
+/* Replaces the payload with the compressed one, if compression paid off */
+static
+zend_bool s_compress_finish(php_memc_codec_job_t *job, zend_string **payload_in, uint32_t *flags)
+{
+	zend_string *compressed = job->output;
+	uint32_t original_size = job->input_len;
+
+	if (!compressed) {
+		return 0;
+	}
+	job->output = NULL;
+
+	/* This means the value was too small to be compressed and ended up larger */
+	if (!job->status || job->input_len <= (job->output_len * MEMC_G(compression_factor))) {
+		/* Original payload was not modified */
+		zend_string_free(compressed);
+		return 0;
+	}
+
+	/*
+	 * Copy the uin32_t at the beginning. The string keeps the room the codec did not use,
+	 * at most the compression_factor share of the value, rather than being reallocated.
+	 */
+	memcpy(ZSTR_VAL(compressed), &original_size, sizeof(uint32_t));
+	ZSTR_LEN(compressed) = sizeof(uint32_t) + job->output_len;
+	ZSTR_VAL(compressed)[ZSTR_LEN(compressed)] = '\0';
+
+	MEMC_VAL_SET_FLAG(*flags, MEMC_VAL_COMPRESSED | job->codec);
+	zend_string_release(*payload_in);
+	*payload_in = compressed;
+
+	return 1;
+}
+
+static
+zend_bool s_compress_value (php_memc_object_t *intern, zend_string *key, zend_string **payload_in, uint32_t *flags)
+{
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+	php_memc_codec_job_t job;
+
+	if (!s_compress_prepare(intern, key, *payload_in, &job)) {
+		return 0;
+	}
+
+	s_compress_run(&memc_user_data->codec, &job);
+	return s_compress_finish(&job, payload_in, flags);
+}
+
+/*
+ * Compresses the payloads of a multi-key write that s_zval_to_payload_ex() left
+ * for later, all at once so that a large batch can use the codec pool.
+ */
+static
+void s_compress_batch(php_memc_object_t *intern, php_memc_batch_item_t *items, size_t count)
+{
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+	php_memc_arena_mark_t mark;
+	php_memc_codec_job_t *jobs;
+	uint32_t *slots;
+	size_t i, bytes = 0;
+
+	for (i = 0; i < count && !items[i].compress; i++) {}
+	if (i == count) {
+		return;
+	}
+
+	mark  = s_arena_mark(&intern->arena);
+	jobs  = s_arena_calloc(&intern->arena, count, sizeof(php_memc_codec_job_t));
+	slots = s_arena_alloc(&intern->arena, count * sizeof(uint32_t));
+
+	for (i = 0; i < count; i++) {
+		if (!items[i].compress) {
+			continue;
+		}
+		/* The history goes by the size before compression */
+		slots[i] = s_adaptive_slot(MEMC_VAL_GET_TYPE(items[i].flags), ZSTR_LEN(items[i].payload));
+
+		if (s_compress_prepare(intern, items[i].key, items[i].payload, &jobs[i])) {
+			bytes += ZSTR_LEN(items[i].payload);
+		}
+	}
+
+	s_codec_run(memc_user_data, jobs, count, bytes, 1);
+
+	for (i = 0; i < count; i++) {
+		if (items[i].compress) {
+			s_adaptive_record(memc_user_data, slots[i], s_compress_finish(&jobs[i], &items[i].payload, &items[i].flags));
+			items[i].compress = 0;
+		}
+	}
+	s_arena_release(&intern->arena, mark);
+}
+
+static
+zend_bool s_serialize_value (php_memc_serializer_type serializer, zval *value, smart_str *buf, uint32_t *flags)
+{
+	switch (serializer) {
+
+		/*
+			Igbinary serialization
+		*/
+#ifdef HAVE_MEMCACHED_IGBINARY
+		case SERIALIZER_IGBINARY:
+		{
+			uint8_t *buffer;
+			size_t buffer_len;
+
+			if (igbinary_serialize(&buffer, &buffer_len, value) != 0) {
+				php_error_docref(NULL, E_WARNING, "could not serialize value with igbinary");
+				return 0;
+			}
+			smart_str_appendl (buf, (char *)buffer, buffer_len);
+			efree(buffer);
+			MEMC_VAL_SET_TYPE(*flags, MEMC_VAL_IS_IGBINARY);
+		}
+			break;
+#endif
+
+		/*
+			JSON serialization
+		*/
+#ifdef HAVE_JSON_API
+		case SERIALIZER_JSON:
+		case SERIALIZER_JSON_ARRAY:
+		{
+			php_json_encode(buf, value, 0);
+			MEMC_VAL_SET_TYPE(*flags, MEMC_VAL_IS_JSON);
+		}
+			break;
+#endif
+
+		/*
+			msgpack serialization
+		*/
+#ifdef HAVE_MEMCACHED_MSGPACK
+		case SERIALIZER_MSGPACK:
+			php_msgpack_serialize(buf, value);
+			if (!buf->s) {
+				php_error_docref(NULL, E_WARNING, "could not serialize value with msgpack");
+				return 0;
+			}
+			MEMC_VAL_SET_TYPE(*flags, MEMC_VAL_IS_MSGPACK);
+			break;
+#endif
+
+		/*
+			Native serialization, values it has no room for fall through to php serialize
+		*/
+		case SERIALIZER_NATIVE:
+			if (php_memc_native_serialize(buf, value)) {
+				MEMC_VAL_SET_TYPE(*flags, MEMC_VAL_IS_NATIVE);
+				break;
+			}
+			smart_str_free(buf);
+			/* break intentionally missing */
+
+		/*
+			PHP serialization
+		*/
+		default:
+		{
+			php_serialize_data_t var_hash;
+			PHP_VAR_SERIALIZE_INIT(var_hash);
+			php_var_serialize(buf, value, &var_hash);
+			PHP_VAR_SERIALIZE_DESTROY(var_hash);
+
+			if (!buf->s) {
+				php_error_docref(NULL, E_WARNING, "could not serialize value");
+				return 0;
+			}
+			MEMC_VAL_SET_TYPE(*flags, MEMC_VAL_IS_SERIALIZED);
+		}
+			break;
+	}
+
+	/* Check for exceptions caused by serializers */
+	if (EG(exception) && buf->s->len) {
+		return 0;
+	}
+	return 1;
+}
+
+static
+zend_string *s_binary_number_encode(uint64_t bits)
+{
+	zend_string *payload = zend_string_alloc(sizeof(uint64_t), 0);
+	unsigned char *out = (unsigned char *) ZSTR_VAL(payload);
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		out[i] = (unsigned char) (bits >> (i * 8));
+	}
+	out[8] = '\0';
+
+	return payload;
+}
+
+static
+uint64_t s_binary_number_decode(const char *payload)
+{
+	const unsigned char *in = (const unsigned char *) payload;
+	uint64_t bits = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		bits |= ((uint64_t) in[i]) << (i * 8);
+	}
+	return bits;
+}
+
+/*
+ * With compress_later the payload is left uncompressed and *compress_later
+ * tells whether it should be, for the caller to compress a batch at once.
+ */
+static
+zend_string *s_zval_to_payload_ex(php_memc_object_t *intern, zend_string *key, zval *value, uint32_t *flags, zend_bool *compress_later)
+{
+	zend_string *payload;
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+	zend_bool should_compress = memc_user_data->compression_enabled;
+	uint32_t slot = 0;
+
+	switch (Z_TYPE_P(value)) {
+
+		case IS_STRING:
+			payload = zval_get_string(value);
+			MEMC_VAL_SET_TYPE(*flags, MEMC_VAL_IS_STRING);
+			break;
+
+		case IS_LONG:
+			if (memc_user_data->binary_numbers) {
+				payload = s_binary_number_encode((uint64_t) (int64_t) Z_LVAL_P(value));
+				MEMC_VAL_SET_TYPE(*flags, MEMC_VAL_IS_BINARY_LONG);
+			}
+			else {
+				smart_str buffer = {0};
+				smart_str_append_long (&buffer, Z_LVAL_P(value));
+				smart_str_0(&buffer);
+				payload = buffer.s;
+
+				MEMC_VAL_SET_TYPE(*flags, MEMC_VAL_IS_LONG);
+			}
+			should_compress = 0;
+			break;
+
+		case IS_DOUBLE:
+			if (memc_user_data->binary_numbers) {
+				uint64_t bits;
+				double dval = Z_DVAL_P(value);
+
+				memcpy(&bits, &dval, sizeof(bits));
+				payload = s_binary_number_encode(bits);
+				MEMC_VAL_SET_TYPE(*flags, MEMC_VAL_IS_BINARY_DOUBLE);
+			}
+			else {
+				char buffer[40];
+				php_memcached_g_fmt(buffer, Z_DVAL_P(value));
+				payload = zend_string_init (buffer, strlen (buffer), 0);
+				MEMC_VAL_SET_TYPE(*flags, MEMC_VAL_IS_DOUBLE);
+			}
+			should_compress = 0;
+			break;
+
+		case IS_TRUE:
+			payload = zend_string_init ("1", 1, 0);
+			MEMC_VAL_SET_TYPE(*flags, MEMC_VAL_IS_BOOL);
+			should_compress = 0;
+			break;
+
+		case IS_FALSE:
+			payload = zend_string_alloc (0, 0);
+			MEMC_VAL_SET_TYPE(*flags, MEMC_VAL_IS_BOOL);
+			should_compress = 0;
+			break;
+
+		default:
+		{
+			smart_str buffer = {0};
+
+			if (!s_serialize_value (memc_user_data->serializer, value, &buffer, flags)) {
+				smart_str_free(&buffer);
+				return NULL;
+			}
+			payload = buffer.s;
+		}
+			break;
+	}
+
+	/* turn off compression for values below the threshold, unless a dictionary covers the key */
+	if (ZSTR_LEN(payload) == 0 ||
+		(ZSTR_LEN(payload) < MEMC_G(compression_threshold) && !s_dictionary_find(memc_user_data, key))) {
+		should_compress = 0;
+	}
+
+	if (should_compress) {
+		/* The history goes by the size before compression */
+		slot = s_adaptive_slot(MEMC_VAL_GET_TYPE(*flags), ZSTR_LEN(payload));
+
+		if (memc_user_data->compression.adaptive && !s_adaptive_should_compress(memc_user_data, slot, payload)) {
+			should_compress = 0;
+		}
+	}
+
+	if (compress_later) {
+		*compress_later = should_compress;
+	}
+	/* If we have compression flag, compress the value */
+	else if (should_compress) {
+		/* s_compress_value() will always leave a valid payload, even if that payload
+		 * did not actually get compressed. The flags will be set according to the
+		 * to the compression type or no compression.
+		 *
+		 * The return value only tells whether compression paid off.
+		 */
+		s_adaptive_record(memc_user_data, slot, s_compress_value (intern, key, &payload, flags));
+	}
+
+	if (memc_user_data->set_udf_flags >= 0) {
+		MEMC_VAL_SET_USER_FLAGS(*flags, ((uint32_t) memc_user_data->set_udf_flags));
+	}
+
+	return payload;
+}
+
+static
+zend_string *s_zval_to_payload(php_memc_object_t *intern, zend_string *key, zval *value, uint32_t *flags)
+{
+	return s_zval_to_payload_ex(intern, key, value, flags, NULL);
+}
+
+static
+zend_bool s_should_retry_write (php_memc_object_t *intern, memcached_return status)
+{
+	if (memcached_server_count (intern->memc) == 0) {
+		return 0;
+	}
+
+	return s_memcached_return_is_error (status, 1);
+}
+
+static
+zend_bool s_memc_write_zval (php_memc_object_t *intern, php_memc_write_op op, zend_string *server_key, zend_string *key, zval *value, time_t expiration)
+{
+	uint32_t flags = 0;
+	zend_string *payload = NULL;
+	memcached_return status = 0;
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+	zend_long retries = memc_user_data->store_retry_count;
+
+	s_local_cache_delete(intern, key);
+	s_negative_cache_delete(intern, key);
+
+	if (value) {
+		payload = s_zval_to_payload(intern, key, value, &flags);
+
+		if (!payload) {
+			s_memc_set_status(intern, MEMC_RES_PAYLOAD_FAILURE, 0);
+			return 0;
+		}
+	}
+
+	s_hot_keys_record(intern, ZSTR_VAL(key), ZSTR_LEN(key), payload ? ZSTR_LEN(payload) : 0);
+
+	if (payload && s_chunked_wanted(intern, op, key, payload)) {
+		status = s_chunked_write(intern, op, server_key, key, payload, flags, expiration);
+		zend_string_release(payload);
+
+		return s_memc_status_handle_result_code(intern, status) == SUCCESS;
+	}
+
+	if ((op == MEMC_OP_SET || op == MEMC_OP_TOUCH) && s_write_behind_enabled(intern)) {
+		s_write_queue_push(intern, op == MEMC_OP_SET ? MEMC_QUEUED_SET : MEMC_QUEUED_TOUCH, server_key, key, payload, flags, expiration);
+		s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
+		return 1;
+	}
+
+	/* A write that is not queued must not overtake the queued ones */
+	s_write_queue_flush(intern);
+
+#define memc_write_using_fn(fn_name) payload ? fn_name(intern->memc, ZSTR_VAL(key), ZSTR_LEN(key), ZSTR_VAL(payload), ZSTR_LEN(payload), expiration, flags) : MEMC_RES_PAYLOAD_FAILURE;
+#define memc_write_using_fn_by_key(fn_name) payload ? fn_name(intern->memc, ZSTR_VAL(server_key), ZSTR_LEN(server_key), ZSTR_VAL(key), ZSTR_LEN(key), ZSTR_VAL(payload), ZSTR_LEN(payload), expiration, flags) : MEMC_RES_PAYLOAD_FAILURE;
+
+	if (server_key) {
+		switch (op) {
+			case MEMC_OP_SET:
+				status = memc_write_using_fn_by_key(memcached_set_by_key);
+			break;
+
+			case MEMC_OP_TOUCH:
+				status = php_memcached_touch_by_key(intern->memc, ZSTR_VAL(server_key), ZSTR_LEN(server_key), ZSTR_VAL(key), ZSTR_LEN(key), expiration);
+			break;
+			
+			case MEMC_OP_ADD:
+				status = memc_write_using_fn_by_key(memcached_add_by_key);
+			break;
+			
+			case MEMC_OP_REPLACE:
+				status = memc_write_using_fn_by_key(memcached_replace_by_key);
+			break;
+			
+			case MEMC_OP_APPEND:
+				status = memc_write_using_fn_by_key(memcached_append_by_key);
+			break;
+
+			case MEMC_OP_PREPEND:
+				status = memc_write_using_fn_by_key(memcached_prepend_by_key);
+			break;
+		}
+
+		if (status == MEMCACHED_END) {
+			status = MEMCACHED_SUCCESS;
+		}
+	}
+	else {
+retry:
+		switch (op) {
+			case MEMC_OP_SET:
+				status = memc_write_using_fn(memcached_set);
+			break;
+
+			case MEMC_OP_TOUCH:
+				status = php_memcached_touch(intern->memc, ZSTR_VAL(key), ZSTR_LEN(key), expiration);
+			break;
+			
+			case MEMC_OP_ADD:
+				status = memc_write_using_fn(memcached_add);
+			break;
+			
+			case MEMC_OP_REPLACE:
+				status = memc_write_using_fn(memcached_replace);
+			break;
+			
+			case MEMC_OP_APPEND:
+				status = memc_write_using_fn(memcached_append);
+			break;
+
+			case MEMC_OP_PREPEND:
+				status = memc_write_using_fn(memcached_prepend);
+			break;
+		}
+		if (status == MEMCACHED_END) {
+			status = MEMCACHED_SUCCESS;
+		}
+	}
+
+	if (s_should_retry_write (intern, status) && retries-- > 0) {
+		goto retry;
+	}
+
+#undef memc_write_using_fn
+#undef memc_write_using_fn_by_key
+
+	if (payload) {
+		zend_string_release(payload);
+	}
+	if (s_memc_status_handle_result_code(intern, status) == FAILURE) {
+		return 0;
+	}
+	return 1;
+}
+
+/****************************************
+  Pipelined multi-key writes
+****************************************/
+
+/* Sends the command of one item and waits for its reply */
+static
+memcached_return s_batch_run_item(php_memc_object_t *intern, zend_string *server_key, php_memc_batch_item_t *item)
+{
+	zend_string *hash_key = server_key ? server_key : item->key;
+	memcached_return status;
+
+	switch (item->cmd) {
+		case MEMC_BATCH_ADD:
+			status = memcached_add_by_key(intern->memc, ZSTR_VAL(hash_key), ZSTR_LEN(hash_key), ZSTR_VAL(item->key), ZSTR_LEN(item->key),
+										  ZSTR_VAL(item->payload), ZSTR_LEN(item->payload), item->expiration, item->flags);
+		break;
+
+		case MEMC_BATCH_REPLACE:
+			status = memcached_replace_by_key(intern->memc, ZSTR_VAL(hash_key), ZSTR_LEN(hash_key), ZSTR_VAL(item->key), ZSTR_LEN(item->key),
+											  ZSTR_VAL(item->payload), ZSTR_LEN(item->payload), item->expiration, item->flags);
+		break;
+
+		case MEMC_BATCH_CAS:
+			status = memcached_cas_by_key(intern->memc, ZSTR_VAL(hash_key), ZSTR_LEN(hash_key), ZSTR_VAL(item->key), ZSTR_LEN(item->key),
+										  ZSTR_VAL(item->payload), ZSTR_LEN(item->payload), item->expiration, item->flags, item->cas);
+		break;
+
+		case MEMC_BATCH_DELETE:
+			status = memcached_delete_by_key(intern->memc, ZSTR_VAL(hash_key), ZSTR_LEN(hash_key), ZSTR_VAL(item->key), ZSTR_LEN(item->key), item->expiration);
+		break;
+
+		case MEMC_BATCH_TOUCH:
+			status = php_memcached_touch_by_key(intern->memc, ZSTR_VAL(hash_key), ZSTR_LEN(hash_key), ZSTR_VAL(item->key), ZSTR_LEN(item->key), item->expiration);
+		break;
+
+		case MEMC_BATCH_INCR:
+			status = memcached_increment_by_key(intern->memc, ZSTR_VAL(hash_key), ZSTR_LEN(hash_key), ZSTR_VAL(item->key), ZSTR_LEN(item->key), item->delta, &item->value);
+		break;
+
+		case MEMC_BATCH_DECR:
+			status = memcached_decrement_by_key(intern->memc, ZSTR_VAL(hash_key), ZSTR_LEN(hash_key), ZSTR_VAL(item->key), ZSTR_LEN(item->key), item->delta, &item->value);
+		break;
+
+		case MEMC_BATCH_SET:
+		default:
+			status = memcached_set_by_key(intern->memc, ZSTR_VAL(hash_key), ZSTR_LEN(hash_key), ZSTR_VAL(item->key), ZSTR_LEN(item->key),
+										  ZSTR_VAL(item->payload), ZSTR_LEN(item->payload), item->expiration, item->flags);
+		break;
+	}
+
+	if (status == MEMCACHED_END) {
+		status = MEMCACHED_SUCCESS;
+	}
+	return status;
+}
+
+/*
+ * Sends the command of every pending item and fills in the status from its reply.
+ * Over the ASCII protocol the commands are pipelined and every reply is read, see
+ * php_memc_pipeline_run(). Otherwise, or when the user buffers writes or ignores
+ * replies, each item is a blocking command of its own. So are the items the pipeline
+ * did not send because their server could not be reached: libmemcached then learns
+ * of the failure and applies its failure limit, retry timeout and ejection.
+ */
+static
+void s_batch_run(php_memc_object_t *intern, zend_string *server_key, php_memc_batch_item_t *items, size_t count)
+{
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+	zend_bool pipelined = php_memc_pipeline_supported(intern->memc);
+	size_t i;
+
+	s_write_queue_flush(intern);
+
+	/* Servers only take a delete time over the old protocol, which the pipeline does not speak */
+	for (i = 0; pipelined && i < count; i++) {
+		if (items[i].cmd == MEMC_BATCH_DELETE && items[i].expiration) {
+			pipelined = 0;
+		}
+	}
+
+	if (pipelined) {
+		php_memc_pipeline_run(&memc_user_data->pipeline, intern->memc, server_key, items, count);
+	}
+
+	for (i = 0; i < count; i++) {
+		if ((!pipelined || items[i].unsent) && php_memc_batch_item_pending(&items[i])) {
+			items[i].unsent = 0;
+			items[i].status = s_batch_run_item(intern, server_key, &items[i]);
+		}
+	}
+}
+
+/* Array keys of a batch, integer keys become their decimal string */
+static
+zend_string *s_batch_item_key(zend_string *skey, zend_ulong num_key)
+{
+	char tmp_key[64];
+	int tmp_len;
+
+	if (skey) {
+		return zend_string_copy(skey);
+	}
+
+	tmp_len = snprintf(tmp_key, sizeof(tmp_key) - 1, "%ld", (long)num_key);
+	return zend_string_init(tmp_key, tmp_len, 0);
+}
+
+/*
+ * Stores the items of a set batch that come with a payload, or with the status of the
+ * serialization that failed. The payloads are compressed together, values over
+ * OPT_CHUNK_SIZE are written on their own and the rest is queued with write-behind
+ * or sent through s_batch_run(). Failed keys are sent again one by one, a key the
+ * pipeline refused would only fail again.
+ */
+static
+void s_batch_set(php_memc_object_t *intern, zend_string *server_key, php_memc_batch_item_t *items, size_t count)
+{
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+	size_t i;
+
+	s_compress_batch(intern, items, count);
+
+	for (i = 0; i < count; i++) {
+		s_hot_keys_record(intern, ZSTR_VAL(items[i].key), ZSTR_LEN(items[i].key), items[i].payload ? ZSTR_LEN(items[i].payload) : 0);
+
+		if (items[i].payload && s_chunked_wanted(intern, MEMC_OP_SET, items[i].key, items[i].payload)) {
+			items[i].status = s_chunked_write(intern, MEMC_OP_SET, server_key, items[i].key, items[i].payload, items[i].flags, items[i].expiration);
+			zend_string_release(items[i].payload);
+			items[i].payload = NULL;
+		}
+	}
+
+	if (s_write_behind_enabled(intern)) {
+		for (i = 0; i < count; i++) {
+			if (items[i].payload) {
+				s_write_queue_push(intern, MEMC_QUEUED_SET, server_key, items[i].key, items[i].payload, items[i].flags, items[i].expiration);
+				items[i].payload = NULL;
+			}
+		}
+		return;
+	}
+
+	s_batch_run(intern, server_key, items, count);
+
+	for (i = 0; i < count; i++) {
+		php_memc_batch_item_t *item = &items[i];
+		zend_long retries = memc_user_data->store_retry_count;
+
+		while (item->payload && item->status != MEMCACHED_BAD_KEY_PROVIDED && s_should_retry_write(intern, item->status) && retries-- > 0) {
+			item->status = s_batch_run_item(intern, server_key, item);
+		}
+	}
+}
+
+/****************************************
+  Chunked values
+****************************************/
+
+/*
+ * A value longer than OPT_CHUNK_SIZE is split into chunk keys named after the key and a
+ * random version, followed by a manifest under the key itself. The manifest carries the
+ * version, the chunk count, the length and the chunk size, and has the value flags plus
+ * MEMC_VAL_CHUNKED. Every chunk has the low 32 bits of the version as its flags.
+ *
+ * A new write never touches the chunks of an older version, so a reader only combines
+ * chunks of the version its manifest names. A missing or mismatched chunk makes the
+ * whole value a miss. Chunks of overwritten or deleted values are left to expire.
+ */
+
+static
+int s_chunk_key(char *buffer, size_t buffer_size, zend_string *key, uint64_t version, uint32_t chunk)
+{
+	return snprintf(buffer, buffer_size, "%.*s:%016llx:%u", (int) ZSTR_LEN(key), ZSTR_VAL(key), (unsigned long long) version, chunk);
+}
+
+static
+zend_bool s_chunked_wanted(php_memc_object_t *intern, php_memc_write_op op, zend_string *key, zend_string *payload)
+{
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+
+	return memc_user_data->chunk_size > 0 &&
+		ZSTR_LEN(payload) > (size_t) memc_user_data->chunk_size &&
+		(op == MEMC_OP_SET || op == MEMC_OP_ADD || op == MEMC_OP_REPLACE) &&
+		ZSTR_LEN(key) + MEMC_CHUNK_KEY_SUFFIX_LENGTH <= MEMC_OBJECT_KEY_MAX_LENGTH &&
+		(ZSTR_LEN(payload) - 1) / memc_user_data->chunk_size < MEMC_CHUNK_MAX_CHUNKS;
+}
+
+static
+uint64_t s_chunked_version(void)
+{
+	uint64_t version;
+
+	if (php_random_bytes_silent(&version, sizeof(version)) == FAILURE) {
+		version = s_memc_time_us() ^ (uint64_t) (uintptr_t) &version;
+	}
+	return version;
+}
+
+static
+memcached_return s_chunked_write(php_memc_object_t *intern, php_memc_write_op op, zend_string *server_key, zend_string *key,
+								zend_string *payload, uint32_t flags, time_t expiration)
+{
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+	size_t chunk_size = (size_t) memc_user_data->chunk_size;
+	uint32_t chunks = (uint32_t) ((ZSTR_LEN(payload) + chunk_size - 1) / chunk_size);
+	uint64_t version = s_chunked_version();
+	zend_long retries = memc_user_data->store_retry_count;
+	memcached_return status = MEMCACHED_SUCCESS;
+	char chunk_key[MEMCACHED_MAX_KEY], manifest[96];
+	int manifest_len;
+	uint32_t first, count, i;
+
+	/* Chunked values are never queued, whatever is queued goes first */
+	s_write_queue_flush(intern);
+
+	/* The chunks go first and must all be stored, readers only find them through the manifest */
+	for (first = 0; first < chunks && !s_memcached_return_is_error(status, 1); first += count) {
+		php_memc_batch_item_t items[MEMC_CHUNK_BATCH];
+
+		count = MIN(chunks - first, MEMC_CHUNK_BATCH);
+		memset(items, 0, sizeof(items));
+
+		for (i = 0; i < count; i++) {
+			size_t offset = (size_t) (first + i) * chunk_size;
+			int chunk_key_len = s_chunk_key(chunk_key, sizeof(chunk_key), key, version, first + i);
+
+			items[i].cmd        = MEMC_BATCH_SET;
+			items[i].key        = zend_string_init(chunk_key, chunk_key_len, 0);
+			items[i].payload    = zend_string_init(ZSTR_VAL(payload) + offset, MIN(chunk_size, ZSTR_LEN(payload) - offset), 0);
+			items[i].flags      = (uint32_t) version;
+			items[i].expiration = expiration;
+			items[i].status     = MEMCACHED_SUCCESS;
+		}
+
+		s_batch_run(intern, NULL, items, count);
+
+		for (i = 0; i < count; i++) {
+			zend_long chunk_retries = retries;
+
+			while (s_should_retry_write(intern, items[i].status) && chunk_retries-- > 0) {
+				items[i].status = s_batch_run_item(intern, NULL, &items[i]);
+			}
+			if (s_memcached_return_is_error(items[i].status, 1)) {
+				status = items[i].status;
+			}
+			zend_string_release(items[i].key);
+			zend_string_release(items[i].payload);
+		}
+	}
+
+	if (s_memcached_return_is_error(status, 1)) {
+		return status;
+	}
+
+	manifest_len = snprintf(manifest, sizeof(manifest), "%016llx %u %zu %zu", (unsigned long long) version, chunks, ZSTR_LEN(payload), chunk_size);
+	MEMC_VAL_SET_FLAG(flags, MEMC_VAL_CHUNKED);
+
+	if (!server_key) {
+		server_key = key;
+	}
+
+	do {
+		switch (op) {
+			case MEMC_OP_ADD:
+				status = memcached_add_by_key(intern->memc, ZSTR_VAL(server_key), ZSTR_LEN(server_key), ZSTR_VAL(key), ZSTR_LEN(key), manifest, manifest_len, expiration, flags);
+			break;
+
+			case MEMC_OP_REPLACE:
+				status = memcached_replace_by_key(intern->memc, ZSTR_VAL(server_key), ZSTR_LEN(server_key), ZSTR_VAL(key), ZSTR_LEN(key), manifest, manifest_len, expiration, flags);
+			break;
 
-	return s_memcached_return_is_error (status, 1);
+			case MEMC_OP_SET:
+			default:
+				status = memcached_set_by_key(intern->memc, ZSTR_VAL(server_key), ZSTR_LEN(server_key), ZSTR_VAL(key), ZSTR_LEN(key), manifest, manifest_len, expiration, flags);
+			break;
+		}
+		if (status == MEMCACHED_END) {
+			status = MEMCACHED_SUCCESS;
+		}
+	} while (s_should_retry_write(intern, status) && retries-- > 0);
+
+	return status;
 }
 
+/* Reads a manifest into the list, the value itself is filled in by s_chunked_fetch() */
 static
-zend_bool s_memc_write_zval (php_memc_object_t *intern, php_memc_write_op op, zend_string *server_key, zend_string *key, zval *value, time_t expiration)
+zend_bool s_chunked_defer(php_memc_chunked_list_t *list, memcached_result_st *result)
 {
-	uint32_t flags = 0;
-	zend_string *payload = NULL;
-	memcached_return status = 0;
-	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
-	zend_long retries = memc_user_data->store_retry_count;
+	php_memc_chunked_value_t *value;
+	unsigned long long version;
+	unsigned int chunks;
+	size_t length, chunk_size;
+	char manifest[96];
+	size_t manifest_len = memcached_result_length(result);
+
+	if (manifest_len >= sizeof(manifest)) {
+		return 0;
+	}
+	memcpy(manifest, memcached_result_value(result), manifest_len);
+	manifest[manifest_len] = '\0';
 
-	if (value) {
-		payload = s_zval_to_payload(intern, value, &flags);
+	if (sscanf(manifest, "%llx %u %zu %zu", &version, &chunks, &length, &chunk_size) != 4 ||
+		chunk_size == 0 || chunks == 0 || chunks > MEMC_CHUNK_MAX_CHUNKS || (length + chunk_size - 1) / chunk_size != chunks) {
+		return 0;
+	}
 
-		if (!payload) {
-			s_memc_set_status(intern, MEMC_RES_PAYLOAD_FAILURE, 0);
-			return 0;
+	if (list->count == list->allocated) {
+		list->allocated = list->allocated ? list->allocated * 2 : 8;
+		list->values    = erealloc(list->values, list->allocated * sizeof(php_memc_chunked_value_t));
+	}
+
+	value = &list->values[list->count++];
+	value->key        = zend_string_init(memcached_result_key_value(result), memcached_result_key_length(result), 0);
+	value->data       = zend_string_alloc(length, 0);
+	value->version    = (uint64_t) version;
+	value->cas        = memcached_result_cas(result);
+	value->flags      = memcached_result_flags(result);
+	value->chunks     = chunks;
+	value->received   = 0;
+	value->chunk_size = chunk_size;
+
+	ZSTR_VAL(value->data)[length] = '\0';
+	MEMC_VAL_DEL_FLAG(value->flags, MEMC_VAL_CHUNKED);
+	return 1;
+}
+
+/* Requests the chunks of every deferred value with one mget and applies the complete ones */
+static
+memcached_return s_chunked_fetch(php_memc_object_t *intern, php_memc_chunked_list_t *list, php_memc_result_apply_fn result_apply_fn, zend_bool lazy, void *context)
+{
+	memcached_result_st result;
+	memcached_return rc, status = MEMCACHED_SUCCESS;
+	php_memc_arena_mark_t mark = s_arena_mark(&intern->arena);
+	HashTable lookup;
+	const char **mkeys;
+	size_t *mkeys_len, *owners;
+	uint32_t *positions;
+	size_t i, n = 0, total = 0;
+
+	for (i = 0; i < list->count; i++) {
+		total += list->values[i].chunks;
+	}
+
+	mkeys     = s_arena_alloc(&intern->arena, total * sizeof(char *));
+	mkeys_len = s_arena_alloc(&intern->arena, total * sizeof(size_t));
+	owners    = s_arena_alloc(&intern->arena, total * sizeof(size_t));
+	positions = s_arena_alloc(&intern->arena, total * sizeof(uint32_t));
+	zend_hash_init(&lookup, total, NULL, NULL, 0);
+
+	for (i = 0; i < list->count; i++) {
+		uint32_t chunk;
+
+		for (chunk = 0; chunk < list->values[i].chunks; chunk++) {
+			char *chunk_key = s_arena_alloc(&intern->arena, MEMCACHED_MAX_KEY);
+			zval zn;
+
+			mkeys_len[n] = s_chunk_key(chunk_key, MEMCACHED_MAX_KEY, list->values[i].key, list->values[i].version, chunk);
+			mkeys[n]     = chunk_key;
+			owners[n]    = i;
+			positions[n] = chunk;
+
+			ZVAL_LONG(&zn, (zend_long) n);
+			zend_hash_str_update(&lookup, chunk_key, mkeys_len[n], &zn);
+			n++;
 		}
 	}
 
-#define memc_write_using_fn(fn_name) payload ? fn_name(intern->memc, ZSTR_VAL(key), ZSTR_LEN(key), ZSTR_VAL(payload), ZSTR_LEN(payload), expiration, flags) : MEMC_RES_PAYLOAD_FAILURE;
-#define memc_write_using_fn_by_key(fn_name) payload ? fn_name(intern->memc, ZSTR_VAL(server_key), ZSTR_LEN(server_key), ZSTR_VAL(key), ZSTR_LEN(key), ZSTR_VAL(payload), ZSTR_LEN(payload), expiration, flags) : MEMC_RES_PAYLOAD_FAILURE;
+	status = memcached_mget(intern->memc, mkeys, mkeys_len, n);
 
-	if (server_key) {
-		switch (op) {
-			case MEMC_OP_SET:
-				status = memc_write_using_fn_by_key(memcached_set_by_key);
-			break;
+	if (status == MEMCACHED_SUCCESS) {
+		memcached_result_create(intern->memc, &result);
 
-			case MEMC_OP_TOUCH:
-				status = php_memcached_touch_by_key(intern->memc, ZSTR_VAL(server_key), ZSTR_LEN(server_key), ZSTR_VAL(key), ZSTR_LEN(key), expiration);
-			break;
-			
-			case MEMC_OP_ADD:
-				status = memc_write_using_fn_by_key(memcached_add_by_key);
-			break;
-			
-			case MEMC_OP_REPLACE:
-				status = memc_write_using_fn_by_key(memcached_replace_by_key);
-			break;
-			
-			case MEMC_OP_APPEND:
-				status = memc_write_using_fn_by_key(memcached_append_by_key);
-			break;
+		while (memcached_fetch_result(intern->memc, &result, &rc)) {
+			php_memc_chunked_value_t *value;
+			size_t offset, expected;
+			zval *zn = zend_hash_str_find(&lookup, memcached_result_key_value(&result), memcached_result_key_length(&result));
 
-			case MEMC_OP_PREPEND:
-				status = memc_write_using_fn_by_key(memcached_prepend_by_key);
+			if (!zn) {
+				continue;
+			}
+
+			value    = &list->values[owners[Z_LVAL_P(zn)]];
+			offset   = (size_t) positions[Z_LVAL_P(zn)] * value->chunk_size;
+			expected = MIN(value->chunk_size, ZSTR_LEN(value->data) - offset);
+
+			/* A chunk of another version is never part of the value */
+			if (memcached_result_flags(&result) != (uint32_t) value->version || memcached_result_length(&result) != expected) {
+				continue;
+			}
+
+			memcpy(ZSTR_VAL(value->data) + offset, memcached_result_value(&result), expected);
+			value->received++;
+		}
+
+		if (s_memcached_return_is_error(rc, 0)) {
+			status = rc;
+		}
+		memcached_result_free(&result);
+	}
+
+	zend_hash_destroy(&lookup);
+	s_arena_release(&intern->arena, mark);
+
+	for (i = 0; i < list->count; i++) {
+		php_memc_chunked_value_t *value = &list->values[i];
+		zval val, zcas;
+		zend_bool retval;
+
+		/* Incomplete values read as misses, but are not known to be missing */
+		if (value->received != value->chunks) {
+			s_negative_cache_unconfirm(intern, ZSTR_VAL(value->key), ZSTR_LEN(value->key));
+			continue;
+		}
+
+		if (lazy) {
+			/* The reassembled payload is handed over instead of being copied */
+			s_lazy_value_init(intern, zend_string_copy(value->data), value->flags, &val);
+		}
+		else if (!s_memcached_string_to_zval(intern->memc, value->data, value->flags, &val)) {
+			if (EG(exception)) {
+				return MEMC_RES_PAYLOAD_FAILURE;
+			}
+			status = MEMCACHED_SOME_ERRORS;
+			continue;
+		}
+
+		if (intern->local_cache_fill) {
+			s_local_cache_store(intern, ZSTR_VAL(value->key), ZSTR_LEN(value->key), ZSTR_VAL(value->data), ZSTR_LEN(value->data), value->flags, value->cas);
+		}
+
+		s_uint64_to_zval(&zcas, value->cas);
+		retval = result_apply_fn(intern, value->key, &val, &zcas, value->flags, context);
+
+		zval_ptr_dtor(&val);
+		zval_ptr_dtor(&zcas);
+
+		if (!retval) {
 			break;
 		}
+	}
+	return status;
+}
 
-		if (status == MEMCACHED_END) {
-			status = MEMCACHED_SUCCESS;
+static
+void s_chunked_list_free(php_memc_chunked_list_t *list)
+{
+	size_t i;
+
+	for (i = 0; i < list->count; i++) {
+		zend_string_release(list->values[i].key);
+		zend_string_release(list->values[i].data);
+	}
+	efree(list->values);
+}
+
+/****************************************
+  Write-behind queue
+****************************************/
+
+/* Remembers an instance with queued writes or buffered counters so that the request shutdown can drain it */
+static
+void s_pending_register(php_memc_object_t *intern)
+{
+	if (!MEMC_G(pending)) {
+		ALLOC_HASHTABLE(MEMC_G(pending));
+		zend_hash_init(MEMC_G(pending), 8, NULL, NULL, 0);
+	}
+	zend_hash_index_update_ptr(MEMC_G(pending), intern->zo.handle, intern);
+}
+
+static
+void s_pending_unregister(php_memc_object_t *intern)
+{
+	if (MEMC_G(pending) && !intern->write_queue.count &&
+		(!intern->counters.deltas || !zend_hash_num_elements(intern->counters.deltas))) {
+		zend_hash_index_del(MEMC_G(pending), intern->zo.handle);
+	}
+}
+
+static
+zend_bool s_write_behind_enabled(php_memc_object_t *intern)
+{
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+	return memc_user_data->write_behind.size > 0;
+}
+
+static
+void s_write_queue_clear(php_memc_write_queue_t *queue)
+{
+	size_t i;
+
+	for (i = 0; i < queue->count; i++) {
+		php_memc_queued_write_t *write = &queue->writes[i];
+
+		if (write->server_key) {
+			zend_string_release(write->server_key);
+		}
+		zend_string_release(write->key);
+		if (write->payload) {
+			zend_string_release(write->payload);
 		}
 	}
+	queue->count = 0;
+}
+
+/*
+ * Sends everything queued and counts the replies, see s_batch_run(). Consecutive writes
+ * with the same server key go out as one batch, so the writes to a key keep their order.
+ */
+static
+void s_write_queue_flush(php_memc_object_t *intern)
+{
+	php_memc_write_queue_t *queue = &intern->write_queue;
+	php_memc_user_data_t *memc_user_data;
+	php_memc_batch_item_t *items;
+	php_memc_arena_mark_t mark;
+	size_t i, start, end, count = queue->count;
+
+	if (!count) {
+		return;
+	}
+
+	memc_user_data = memcached_get_user_data(intern->memc);
+
+	if (memcached_server_count(intern->memc) == 0) {
+		memc_user_data->write_behind.dropped += count;
+	}
 	else {
-retry:
-		switch (op) {
-			case MEMC_OP_SET:
-				status = memc_write_using_fn(memcached_set);
-			break;
+		/* The batches below flush the queue themselves, there must be nothing left to send */
+		queue->count = 0;
 
-			case MEMC_OP_TOUCH:
-				status = php_memcached_touch(intern->memc, ZSTR_VAL(key), ZSTR_LEN(key), expiration);
-			break;
-			
-			case MEMC_OP_ADD:
-				status = memc_write_using_fn(memcached_add);
-			break;
-			
-			case MEMC_OP_REPLACE:
-				status = memc_write_using_fn(memcached_replace);
-			break;
-			
-			case MEMC_OP_APPEND:
-				status = memc_write_using_fn(memcached_append);
-			break;
+		mark  = s_arena_mark(&intern->arena);
+		items = s_arena_calloc(&intern->arena, count, sizeof(php_memc_batch_item_t));
 
-			case MEMC_OP_PREPEND:
-				status = memc_write_using_fn(memcached_prepend);
-			break;
+		for (i = 0; i < count; i++) {
+			php_memc_queued_write_t *write = &queue->writes[i];
+
+			switch (write->op) {
+				case MEMC_QUEUED_SET:
+					items[i].cmd = MEMC_BATCH_SET;
+				break;
+
+				case MEMC_QUEUED_TOUCH:
+					items[i].cmd = MEMC_BATCH_TOUCH;
+				break;
+
+				case MEMC_QUEUED_DELETE:
+				default:
+					items[i].cmd = MEMC_BATCH_DELETE;
+				break;
+			}
+			items[i].key        = write->key;
+			items[i].payload    = write->payload;
+			items[i].flags      = write->flags;
+			items[i].expiration = write->expiration;
+			items[i].status     = MEMCACHED_SUCCESS;
 		}
-		if (status == MEMCACHED_END) {
-			status = MEMCACHED_SUCCESS;
+
+		for (start = 0; start < count; start = end) {
+			zend_string *server_key = queue->writes[start].server_key;
+
+			for (end = start + 1; end < count; end++) {
+				zend_string *next = queue->writes[end].server_key;
+
+				if (next != server_key && (!next || !server_key || !zend_string_equals(next, server_key))) {
+					break;
+				}
+			}
+			s_batch_run(intern, server_key, &items[start], end - start);
+		}
+
+		for (i = 0; i < count; i++) {
+			/* A get() while the write was queued may have cached the value it replaces */
+			if (items[i].cmd != MEMC_BATCH_TOUCH) {
+				s_local_cache_delete(intern, items[i].key);
+				s_negative_cache_delete(intern, items[i].key);
+			}
+
+			/* Touching or deleting a key that is already gone is not a failure */
+			if (items[i].status != MEMCACHED_NOTFOUND && s_memcached_return_is_error(items[i].status, 1)) {
+				memc_user_data->write_behind.failed++;
+			} else {
+				memc_user_data->write_behind.flushed++;
+			}
 		}
+		s_arena_release(&intern->arena, mark);
+
+		queue->count = count;
 	}
 
-	if (s_should_retry_write (intern, status) && retries-- > 0) {
-		goto retry;
+	s_write_queue_clear(queue);
+	s_pending_unregister(intern);
+}
+
+/*
+ * Queues a write instead of sending it, taking over the payload. Nothing is sent until
+ * flushBuffers(), until OPT_WRITE_BEHIND_SIZE writes or OPT_WRITE_BEHIND_AGE milliseconds
+ * have piled up, or until the instance is freed or the request ends. Reads in between
+ * do not see the queued writes.
+ */
+static
+void s_write_queue_push(php_memc_object_t *intern, php_memc_queued_op op, zend_string *server_key, zend_string *key,
+						zend_string *payload, uint32_t flags, time_t expiration)
+{
+	php_memc_write_queue_t *queue = &intern->write_queue;
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+	php_memc_queued_write_t *write;
+	uint64_t now = s_memc_time_ms();
+
+	if (queue->count == queue->allocated) {
+		queue->allocated = queue->allocated ? queue->allocated * 2 : 16;
+		queue->writes    = erealloc(queue->writes, queue->allocated * sizeof(php_memc_queued_write_t));
 	}
 
-#undef memc_write_using_fn
-#undef memc_write_using_fn_by_key
+	if (!queue->count) {
+		queue->oldest = now;
+		s_pending_register(intern);
+	}
 
-	if (payload) {
-		zend_string_release(payload);
+	write = &queue->writes[queue->count++];
+	write->op         = op;
+	write->server_key = server_key ? zend_string_copy(server_key) : NULL;
+	write->key        = zend_string_copy(key);
+	write->payload    = payload;
+	write->flags      = flags;
+	write->expiration = expiration;
+
+	memc_user_data->write_behind.queued++;
+
+	if (queue->count >= (size_t) memc_user_data->write_behind.size ||
+		(memc_user_data->write_behind.age > 0 && now - queue->oldest >= (uint64_t) memc_user_data->write_behind.age)) {
+		s_write_queue_flush(intern);
 	}
-	if (s_memc_status_handle_result_code(intern, status) == FAILURE) {
-		return 0;
+}
+
+
+/****************************************
+  Buffered counters
+****************************************/
+
+/*
+ * Sends one increment per buffered key. Counters that do not exist yet are created
+ * with the summed delta, and keys whose deltas cancel out are not sent at all.
+ */
+static
+void s_counter_buffer_flush(php_memc_object_t *intern)
+{
+	HashTable *deltas = intern->counters.deltas;
+	php_memc_user_data_t *memc_user_data;
+	php_memc_batch_item_t *items;
+	uint64_t *initials;
+	php_memc_arena_mark_t mark;
+	zend_string *key;
+	zval *delta;
+	size_t i, count = 0;
+
+	if (!deltas || !zend_hash_num_elements(deltas)) {
+		return;
 	}
-	return 1;
+
+	memc_user_data = memcached_get_user_data(intern->memc);
+
+	if (memcached_server_count(intern->memc) == 0) {
+		memc_user_data->counter_buffer.failed += zend_hash_num_elements(deltas);
+		zend_hash_clean(deltas);
+		s_pending_unregister(intern);
+		return;
+	}
+
+	mark     = s_arena_mark(&intern->arena);
+	items    = s_arena_alloc(&intern->arena, zend_hash_num_elements(deltas) * sizeof(php_memc_batch_item_t));
+	initials = s_arena_alloc(&intern->arena, zend_hash_num_elements(deltas) * sizeof(uint64_t));
+
+	/*
+	 * One batch for all keys: net increments and net decrements, which cannot take a
+	 * counter below zero. Counters answered NOT_FOUND are then created with their total.
+	 */
+	ZEND_HASH_FOREACH_STR_KEY_VAL (deltas, key, delta) {
+		zend_long sum = Z_LVAL_P(delta);
+
+		if (sum == 0) {
+			continue;
+		}
+		memset(&items[count], 0, sizeof(php_memc_batch_item_t));
+		items[count].cmd    = sum > 0 ? MEMC_BATCH_INCR : MEMC_BATCH_DECR;
+		items[count].key    = key;
+		items[count].delta  = sum > 0 ? (uint64_t) sum : (uint64_t) -(sum + 1) + 1;
+		items[count].value  = UINT64_MAX;
+		items[count].status = MEMCACHED_SUCCESS;
+		initials[count]     = sum > 0 ? (uint64_t) sum : 0;
+
+		s_local_cache_delete(intern, key);
+		s_negative_cache_delete(intern, key);
+		count++;
+	} ZEND_HASH_FOREACH_END();
+
+	s_batch_incdec(intern, items, count, initials, 0);
+
+	for (i = 0; i < count; i++) {
+		if (s_memcached_return_is_error(items[i].status, 1)) {
+			memc_user_data->counter_buffer.failed++;
+		} else {
+			memc_user_data->counter_buffer.flushed++;
+		}
+	}
+	s_arena_release(&intern->arena, mark);
+
+	zend_hash_clean(deltas);
+	s_pending_unregister(intern);
 }
 
+/*
+ * Adds a delta to the buffered total of the key. Totals are sent as one increment
+ * per key on flushBuffers(), once OPT_COUNTER_BUFFER_SIZE keys or OPT_COUNTER_BUFFER_AGE
+ * milliseconds have piled up, or when the instance is freed or the request ends.
+ */
+static
+void s_counter_buffer_add(php_memc_object_t *intern, zend_string *key, zend_long delta)
+{
+	php_memc_counter_buffer_t *counters = &intern->counters;
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+	uint64_t now = s_memc_time_ms();
+	zval *sum;
+
+	if (!counters->deltas) {
+		ALLOC_HASHTABLE(counters->deltas);
+		zend_hash_init(counters->deltas, 16, NULL, NULL, 0);
+	}
+
+	/* A sum that would overflow is sent first, the delta then starts a new one */
+	sum = zend_hash_find(counters->deltas, key);
+	if (sum && ((delta > 0 && Z_LVAL_P(sum) > ZEND_LONG_MAX - delta) ||
+				(delta < 0 && Z_LVAL_P(sum) < ZEND_LONG_MIN - delta))) {
+		s_counter_buffer_flush(intern);
+	}
+
+	if (!zend_hash_num_elements(counters->deltas)) {
+		counters->oldest = now;
+		s_pending_register(intern);
+	}
+
+	sum = zend_hash_find(counters->deltas, key);
+	if (sum) {
+		Z_LVAL_P(sum) += delta;
+	} else {
+		zval zdelta;
+		ZVAL_LONG(&zdelta, delta);
+		zend_hash_add_new(counters->deltas, key, &zdelta);
+	}
+
+	memc_user_data->counter_buffer.buffered++;
+
+	if ((memc_user_data->counter_buffer.size > 0 && zend_hash_num_elements(counters->deltas) >= (uint32_t) memc_user_data->counter_buffer.size) ||
+		(memc_user_data->counter_buffer.age > 0 && now - counters->oldest >= (uint64_t) memc_user_data->counter_buffer.age)) {
+		s_counter_buffer_flush(intern);
+	}
+}
 
 /****************************************
   Methods
@@ -1227,6 +4467,12 @@ static PHP_METHOD(Memcached, __construct)
 	memc_user_data->store_retry_count = MEMC_G(store_retry_count);
 	memc_user_data->set_udf_flags     = -1;
 	memc_user_data->is_persistent     = is_persistent;
+	memc_user_data->pipeline.is_persistent = is_persistent;
+	memc_user_data->local_cache.ttl   = MEMC_LOCAL_CACHE_DEFAULT_TTL;
+	memc_user_data->negative_cache.ttl = MEMC_NEGATIVE_CACHE_DEFAULT_TTL;
+	memc_user_data->lease.wait        = MEMC_LEASE_DEFAULT_WAIT;
+	memc_user_data->hot_keys.sample_rate = MEMC_HOT_KEYS_DEFAULT_SAMPLE_RATE;
+	memc_user_data->hot_keys.rand_state  = ((uint32_t) time(NULL) ^ (uint32_t) (uintptr_t) memc_user_data) | 1;
 
 	memcached_set_user_data(intern->memc, memc_user_data);
 
@@ -1237,329 +4483,835 @@ static PHP_METHOD(Memcached, __construct)
 			MEMC_G(default_behavior.consistent_hash_enabled), MEMC_G(default_behavior.binary_protocol_enabled), MEMC_G(default_behavior.connect_timeout));
 #endif
 
-		memcached_return rc;
+		memcached_return rc;
+
+		if (MEMC_G(default_behavior.consistent_hash_enabled)) {
+
+			rc = memcached_behavior_set(intern->memc, MEMCACHED_BEHAVIOR_DISTRIBUTION, MEMCACHED_DISTRIBUTION_CONSISTENT);
+			if (rc != MEMCACHED_SUCCESS) {
+				php_error_docref(NULL, E_WARNING, "Failed to turn on consistent hash: %s", memcached_strerror(intern->memc, rc));
+			}
+		}
+
+		if (MEMC_G(default_behavior.binary_protocol_enabled)) {
+			rc = memcached_behavior_set(intern->memc, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, 1);
+			if (rc != MEMCACHED_SUCCESS) {
+				php_error_docref(NULL, E_WARNING, "Failed to turn on binary protocol: %s", memcached_strerror(intern->memc, rc));
+			}
+		}
+
+		if (MEMC_G(default_behavior.connect_timeout)) {
+			rc = memcached_behavior_set(intern->memc, MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT, MEMC_G(default_behavior.connect_timeout));
+			if (rc != MEMCACHED_SUCCESS) {
+				php_error_docref(NULL, E_WARNING, "Failed to set connect timeout: %s", memcached_strerror(intern->memc, rc));
+			}
+		}
+	}
+
+	if (fci.size) {
+		if (!s_invoke_new_instance_cb(getThis(), &fci, &fci_cache, persistent_id) || EG(exception)) {
+			/* error calling or exception thrown from callback */
+			if (plist_key) {
+				zend_string_release(plist_key);
+			}
+			/*
+				Setting intern->memc null prevents object destruction from freeing the memcached_st
+				We free it manually here because it might be persistent and has not been
+				registered to persistent_list yet
+			*/
+			php_memc_destroy(intern->memc, memc_user_data);
+			intern->memc = NULL;
+			return;
+		}
+	}
+
+	if (plist_key) {
+		zend_resource le;
+
+		le.type = php_memc_list_entry();
+		le.ptr  = intern->memc;
+
+		GC_REFCOUNT(&le) = 1;
+
+		/* plist_key is not a persistent allocated key, thus we use str_update here */
+		if (zend_hash_str_update_mem(&EG(persistent_list), ZSTR_VAL(plist_key), ZSTR_LEN(plist_key), &le, sizeof(le)) == NULL) {
+			zend_string_release(plist_key);
+			php_error_docref(NULL, E_ERROR, "could not register persistent entry");
+			/* not reached */
+		}
+		zend_string_release(plist_key);
+	}
+}
+/* }}} */
+
+
+
+static
+void s_hash_to_keys(php_memc_object_t *intern, php_memc_keys_t *keys_out, HashTable *hash_in, zend_bool preserve_order, zval *return_value)
+{
+	size_t idx = 0, alloc_count;
+	zval *zv;
+
+	keys_out->num_valid_keys = 0;
+	keys_out->arena = &intern->arena;
+	keys_out->mark  = s_arena_mark(&intern->arena);
+
+	alloc_count = zend_hash_num_elements(hash_in);
+	if (!alloc_count) {
+		return;
+	}
+	keys_out->mkeys     = s_arena_calloc (&intern->arena, alloc_count, sizeof (char *));
+	keys_out->mkeys_len = s_arena_calloc (&intern->arena, alloc_count, sizeof (size_t));
+	keys_out->strings   = s_arena_calloc (&intern->arena, alloc_count, sizeof (zend_string *));
+
+	ZEND_HASH_FOREACH_VAL(hash_in, zv) {
+		zend_string *key = zval_get_string(zv);
+
+		if (preserve_order && return_value) {
+			add_assoc_null_ex(return_value, ZSTR_VAL(key), ZSTR_LEN(key));
+		}
+
+		if (ZSTR_LEN(key) > 0 && ZSTR_LEN(key) < MEMCACHED_MAX_KEY) {
+			keys_out->mkeys[idx]     = ZSTR_VAL(key);
+			keys_out->mkeys_len[idx] = ZSTR_LEN(key);
+
+			keys_out->strings[idx] = key;
+			idx++;
+		}
+		else {
+			zend_string_release (key);
+		}
+
+	} ZEND_HASH_FOREACH_END();
+
+	keys_out->num_valid_keys = idx;
+}
+
+static
+void s_key_to_keys(php_memc_object_t *intern, php_memc_keys_t *keys_out, zend_string *key)
+{
+	keys_out->num_valid_keys = 0;
+	keys_out->arena = &intern->arena;
+	keys_out->mark  = s_arena_mark(&intern->arena);
+
+	if (ZSTR_LEN(key) == 0 || ZSTR_LEN(key) >= MEMCACHED_MAX_KEY) {
+		return;
+	}
+
+	keys_out->mkeys     = s_arena_alloc (&intern->arena, sizeof (char *));
+	keys_out->mkeys_len = s_arena_alloc (&intern->arena, sizeof (size_t));
+	keys_out->strings   = s_arena_alloc (&intern->arena, sizeof (zend_string *));
+
+	keys_out->mkeys[0]     = ZSTR_VAL(key);
+	keys_out->mkeys_len[0] = ZSTR_LEN(key);
+	keys_out->strings[0]   = zend_string_copy(key);
+
+	keys_out->num_valid_keys = 1;
+}
+
+static
+void s_clear_keys(php_memc_keys_t *keys)
+{
+	size_t i;
+
+	for (i = 0; i < keys->num_valid_keys; i++) {
+		zend_string_release (keys->strings[i]);
+	}
+	keys->num_valid_keys = 0;
+
+	if (keys->arena) {
+		s_arena_release(keys->arena, keys->mark);
+		keys->arena = NULL;
+	}
+}
+
+typedef struct {
+	zend_bool extended;
+	/* Hand out MemcachedLazyValue objects, see GET_LAZY */
+	zend_bool lazy;
+	/* Keys a value was returned for, when the caller needs to know, see getMultiAndTouch() */
+	HashTable *fetched;
+	zval *return_value;
+} php_memc_get_ctx_t;
+
+static
+zend_bool s_get_apply_fn(php_memc_object_t *intern, zend_string *key, zval *value, zval *cas, uint32_t flags, void *in_context)
+{
+	php_memc_get_ctx_t *context = (php_memc_get_ctx_t *) in_context;
+
+	if (context->extended) {
+		Z_TRY_ADDREF_P(value);
+		Z_TRY_ADDREF_P(cas);
+
+		array_init (context->return_value);
+		add_assoc_zval (context->return_value, "value", value);
+		add_assoc_zval (context->return_value, "cas",   cas);
+		add_assoc_long (context->return_value, "flags", (zend_long) MEMC_VAL_GET_USER_FLAGS(flags));
+	}
+	else {
+		ZVAL_COPY(context->return_value, value);
+	}
+	return 0; /* Stop after one */
+}
+
+static
+zend_string *s_lease_key(const char *prefix, size_t prefix_len, zend_string *key)
+{
+	zend_string *lease_key;
+
+	if (prefix_len + ZSTR_LEN(key) > MEMC_OBJECT_KEY_MAX_LENGTH) {
+		return NULL;
+	}
+
+	lease_key = zend_string_alloc(prefix_len + ZSTR_LEN(key), 0);
+	memcpy(ZSTR_VAL(lease_key), prefix, prefix_len);
+	memcpy(ZSTR_VAL(lease_key) + prefix_len, ZSTR_VAL(key), ZSTR_LEN(key));
+	ZSTR_VAL(lease_key)[ZSTR_LEN(lease_key)] = '\0';
+
+	return lease_key;
+}
+
+static
+zend_bool s_lease_read(php_memc_object_t *intern, zend_string *server_key, zend_string *key, php_memc_get_ctx_t *context)
+{
+	php_memc_keys_t keys = {0};
+	zend_bool status;
+
+	s_key_to_keys(intern, &keys, key);
+	status = php_memc_mget_apply(intern, server_key, &keys, s_get_apply_fn, context->extended, 0, context);
+	s_clear_keys(&keys);
+
+	return status;
+}
+
+/*
+ * Runs the cache callback for a missed key while holding a lease on it, so
+ * that only one client regenerates a popular key when it expires. Clients
+ * that lose the race are served the stale copy if one is kept, or poll for
+ * the value the lease holder writes back. If the holder does not deliver
+ * within OPT_LEASE_WAIT they run the callback themselves.
+ */
+static
+zend_bool s_invoke_leased_cache_callback(zval *object, zend_string *server_key, zend_string *key, zend_fcall_info *fci, zend_fcall_info_cache *fcc, php_memc_get_ctx_t *context)
+{
+	php_memc_object_t *intern = Z_MEMC_OBJ_P(object);
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+	zend_string *lease_key, *stale_key = NULL;
+	zend_long waited = 0, wait_time = MEMC_LEASE_WAIT_MIN;
+	memcached_return rc;
+	zend_bool status = 0;
+
+	lease_key = s_lease_key(ZEND_STRL("lease."), key);
+
+	if (!lease_key) {
+		return s_invoke_cache_callback(object, fci, fcc, context->extended, key, context->return_value);
+	}
+
+	/* A stale copy has no meaningful cas, so it is not used for extended gets */
+	if (memc_user_data->lease.stale_ttl > 0 && !context->extended) {
+		stale_key = s_lease_key(ZEND_STRL("stale."), key);
+	}
+
+	if (server_key) {
+		rc = memcached_add_by_key(intern->memc, ZSTR_VAL(server_key), ZSTR_LEN(server_key), ZSTR_VAL(lease_key), ZSTR_LEN(lease_key), "1", sizeof ("1") - 1, memc_user_data->lease.time, 0);
+	} else {
+		rc = memcached_add(intern->memc, ZSTR_VAL(lease_key), ZSTR_LEN(lease_key), "1", sizeof ("1") - 1, memc_user_data->lease.time, 0);
+	}
+
+	switch (rc) {
+
+		case MEMCACHED_SUCCESS:
+			memc_user_data->lease.granted++;
+			status = s_invoke_cache_callback(object, fci, fcc, context->extended, key, context->return_value);
+
+			if (status && stale_key) {
+				int rescode = intern->rescode, memc_errno = intern->memc_errno;
+
+				/* Failing to keep a stale copy does not fail the get */
+				s_memc_write_zval(intern, MEMC_OP_SET, server_key, stale_key, context->return_value, memc_user_data->lease.stale_ttl);
+				s_memc_set_status(intern, (memcached_return) rescode, memc_errno);
+			}
+
+			/* The value written back may still be queued, waiters must find it once the lease is gone */
+			s_write_queue_flush(intern);
+
+			if (server_key) {
+				memcached_delete_by_key(intern->memc, ZSTR_VAL(server_key), ZSTR_LEN(server_key), ZSTR_VAL(lease_key), ZSTR_LEN(lease_key), 0);
+			} else {
+				memcached_delete(intern->memc, ZSTR_VAL(lease_key), ZSTR_LEN(lease_key), 0);
+			}
+		break;
+
+		case MEMCACHED_NOTSTORED:
+		case MEMCACHED_DATA_EXISTS:
+			if (stale_key && s_lease_read(intern, server_key, stale_key, context)) {
+				memc_user_data->lease.stale++;
+				status = 1;
+				break;
+			}
+
+			memc_user_data->lease.waited++;
+
+			while (waited < memc_user_data->lease.wait) {
+				wait_time = MIN(wait_time, memc_user_data->lease.wait - waited);
+				usleep(wait_time * 1000);
+				waited += wait_time;
+				wait_time *= 2;
+
+				if (s_lease_read(intern, server_key, key, context)) {
+					status = 1;
+					break;
+				}
+
+				if (!s_memc_status_has_result_code(intern, MEMCACHED_NOTFOUND)) {
+					break;
+				}
+			}
+
+			if (!status) {
+				memc_user_data->lease.expired++;
+				s_memc_set_status(intern, MEMCACHED_NOTFOUND, 0);
+				status = s_invoke_cache_callback(object, fci, fcc, context->extended, key, context->return_value);
+			}
+		break;
+
+		default:
+			/* Leases are best effort, behave as if they were disabled */
+			status = s_invoke_cache_callback(object, fci, fcc, context->extended, key, context->return_value);
+		break;
+	}
+
+	zend_string_release(lease_key);
+	if (stale_key) {
+		zend_string_release(stale_key);
+	}
+	return status;
+}
+
+static
+void php_memc_get_impl(INTERNAL_FUNCTION_PARAMETERS, zend_bool by_key)
+{
+	php_memc_get_ctx_t context = {};
+	php_memc_keys_t keys = {0};
+	zend_long get_flags = 0;
+	zend_string *key;
+	zend_string *server_key = NULL;
+	zend_bool mget_status;
+	memcached_return status = MEMCACHED_SUCCESS;
+	zend_fcall_info fci = empty_fcall_info;
+	zend_fcall_info_cache fcc = empty_fcall_info_cache;
+	MEMC_METHOD_INIT_VARS;
+
+	if (by_key) {
+		if (zend_parse_parameters(ZEND_NUM_ARGS(), "SS|f!l", &server_key, &key, &fci, &fcc, &get_flags) == FAILURE) {
+			return;
+		}
+	} else {
+		if (zend_parse_parameters(ZEND_NUM_ARGS(), "S|f!l", &key, &fci, &fcc, &get_flags) == FAILURE) {
+			return;
+		}
+	}
+
+	MEMC_METHOD_FETCH_OBJECT;
+	s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
+	MEMC_CHECK_KEY(intern, key);
+
+	context.extended = (get_flags & MEMC_GET_EXTENDED);
+
+	context.return_value = return_value;
+
+	if (!server_key && s_local_cache_apply(intern, key, s_get_apply_fn, context.extended, 0, &context)) {
+		return;
+	}
+
+	if (!server_key && s_negative_cache_has(intern, key)) {
+		s_memc_set_status(intern, MEMCACHED_NOTFOUND, 0);
+		mget_status = 0;
+	}
+	else {
+		HashTable unconfirmed;
+
+		s_key_to_keys(intern, &keys, key);
+
+		zend_hash_init(&unconfirmed, 0, NULL, NULL, 0);
+		intern->unconfirmed = (!server_key && memcached_get_user_data(intern->memc)->negative_cache.size > 0) ? &unconfirmed : NULL;
+		intern->local_cache_fill = !server_key;
+		mget_status = php_memc_mget_apply(intern, server_key, &keys, s_get_apply_fn, context.extended, 0, &context);
+		intern->local_cache_fill = 0;
+		intern->unconfirmed = NULL;
 
-		if (MEMC_G(default_behavior.consistent_hash_enabled)) {
+		s_clear_keys(&keys);
 
-			rc = memcached_behavior_set(intern->memc, MEMCACHED_BEHAVIOR_DISTRIBUTION, MEMCACHED_DISTRIBUTION_CONSISTENT);
-			if (rc != MEMCACHED_SUCCESS) {
-				php_error_docref(NULL, E_WARNING, "Failed to turn on consistent hash: %s", memcached_strerror(intern->memc, rc));
-			}
+		if (!mget_status && !server_key && s_memc_status_has_result_code(intern, MEMCACHED_NOTFOUND) &&
+			!zend_hash_exists(&unconfirmed, key)) {
+			s_negative_cache_store(intern, key);
 		}
+		zend_hash_destroy(&unconfirmed);
+	}
 
-		if (MEMC_G(default_behavior.binary_protocol_enabled)) {
-			rc = memcached_behavior_set(intern->memc, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, 1);
-			if (rc != MEMCACHED_SUCCESS) {
-				php_error_docref(NULL, E_WARNING, "Failed to turn on binary protocol: %s", memcached_strerror(intern->memc, rc));
+	if (!mget_status) {
+		if (s_memc_status_has_result_code(intern, MEMCACHED_NOTFOUND) && fci.size > 0) {
+			if (memc_user_data->lease.time > 0) {
+				status = s_invoke_leased_cache_callback(object, server_key, key, &fci, &fcc, &context);
+			} else {
+				status = s_invoke_cache_callback(object, &fci, &fcc, context.extended, key, return_value);
 			}
-		}
 
-		if (MEMC_G(default_behavior.connect_timeout)) {
-			rc = memcached_behavior_set(intern->memc, MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT, MEMC_G(default_behavior.connect_timeout));
-			if (rc != MEMCACHED_SUCCESS) {
-				php_error_docref(NULL, E_WARNING, "Failed to set connect timeout: %s", memcached_strerror(intern->memc, rc));
+			if (!status) {
+				zval_ptr_dtor(return_value);
+				RETURN_FROM_GET;
 			}
 		}
 	}
 
-	if (fci.size) {
-		if (!s_invoke_new_instance_cb(getThis(), &fci, &fci_cache, persistent_id) || EG(exception)) {
-			/* error calling or exception thrown from callback */
-			if (plist_key) {
-				zend_string_release(plist_key);
-			}
-			/*
-				Setting intern->memc null prevents object destruction from freeing the memcached_st
-				We free it manually here because it might be persistent and has not been
-				registered to persistent_list yet
-			*/
-			php_memc_destroy(intern->memc, memc_user_data);
-			intern->memc = NULL;
-			return;
-		}
+	if (s_memc_status_has_error(intern)) {
+		zval_ptr_dtor(return_value);
+		RETURN_FROM_GET;
 	}
+}
 
-	if (plist_key) {
-		zend_resource le;
+/* {{{ Memcached::get(string key [, mixed callback [, int get_flags = 0])
+   Returns a value for the given key or false */
+PHP_METHOD(Memcached, get)
+{
+	php_memc_get_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 0);
+}
+/* }}} */
 
-		le.type = php_memc_list_entry();
-		le.ptr  = intern->memc;
+/* {{{ Memcached::getByKey(string server_key, string key [, mixed callback [, int get_flags = 0])
+   Returns a value for key from the server identified by the server key or false */
+PHP_METHOD(Memcached, getByKey)
+{
+	php_memc_get_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1);
+}
+/* }}} */
 
-		GC_REFCOUNT(&le) = 1;
+static
+zend_bool s_get_multi_apply_fn(php_memc_object_t *intern, zend_string *key, zval *value, zval *cas, uint32_t flags, void *in_context)
+{
+	php_memc_get_ctx_t *context = (php_memc_get_ctx_t *) in_context;
 
-		/* plist_key is not a persistent allocated key, thus we use str_update here */
-		if (zend_hash_str_update_mem(&EG(persistent_list), ZSTR_VAL(plist_key), ZSTR_LEN(plist_key), &le, sizeof(le)) == NULL) {
-			zend_string_release(plist_key);
-			php_error_docref(NULL, E_ERROR, "could not register persistent entry");
-			/* not reached */
-		}
-		zend_string_release(plist_key);
+	if (context->fetched) {
+		zend_hash_add_empty_element(context->fetched, key);
 	}
-}
-/* }}} */
 
+	Z_TRY_ADDREF_P(value);
+
+	if (context->extended) {
+		zval node;
+
+		Z_TRY_ADDREF_P(cas);
+
+		array_init(&node);
+		add_assoc_zval(&node, "value", value);
+		add_assoc_zval(&node, "cas",   cas);
+		add_assoc_long(&node, "flags", (zend_long) MEMC_VAL_GET_USER_FLAGS(flags));
 
+		zend_symtable_update(Z_ARRVAL_P(context->return_value), key, &node); 
+	}
+	else {
+		zend_symtable_update(Z_ARRVAL_P(context->return_value), key, value);
+	}
+	return 1;
+}
 
+/*
+ * Passes the keys getMulti() did not find to the cache callback in one call.
+ * Values it returns for those keys are written back and merged into the
+ * result, using the per-key expirations the callback sets.
+ */
 static
-void s_hash_to_keys(php_memc_keys_t *keys_out, HashTable *hash_in, zend_bool preserve_order, zval *return_value)
+zend_bool s_invoke_multi_cache_callback(zval *zobject, zend_fcall_info *fci, zend_fcall_info_cache *fcc, zend_string *server_key, zval *missing, php_memc_get_ctx_t *context)
 {
-	size_t idx = 0, alloc_count;
+	zend_bool status = 1;
+	zval params[3];
+	zval retval, zcas;
+	HashTable requested;
 	zval *zv;
+	php_memc_object_t *intern = Z_MEMC_OBJ_P(zobject);
+	php_memc_batch_item_t *items;
+	php_memc_arena_mark_t mark;
+	size_t i, count = 0;
 
-	keys_out->num_valid_keys = 0;
+	/* Prepare params */
+	ZVAL_COPY(&params[0], zobject);
+	ZVAL_COPY(&params[1], missing);   /* keys */
+	ZVAL_NEW_EMPTY_REF(&params[2]);   /* expirations */
+	array_init(Z_REFVAL(params[2]));
 
-	alloc_count = zend_hash_num_elements(hash_in);
-	if (!alloc_count) {
-		return;
+	fci->retval = &retval;
+	fci->params = params;
+	fci->param_count = 3;
+
+	if (zend_call_function(fci, fcc) == FAILURE) {
+		php_error_docref(NULL, E_WARNING, "could not invoke cache callback");
+		status = 0;
 	}
-	keys_out->mkeys     = ecalloc (alloc_count, sizeof (char *));
-	keys_out->mkeys_len = ecalloc (alloc_count, sizeof (size_t));
-	keys_out->strings   = ecalloc (alloc_count, sizeof (zend_string *));
+	else if (Z_TYPE(retval) == IS_ARRAY) {
+		zend_string *key;
+		zend_ulong num_key;
 
-	ZEND_HASH_FOREACH_VAL(hash_in, zv) {
-		zend_string *key = zval_get_string(zv);
+		zend_hash_init(&requested, zend_hash_num_elements(Z_ARRVAL_P(missing)), NULL, NULL, 0);
+		ZEND_HASH_FOREACH_VAL(Z_ARRVAL_P(missing), zv) {
+			zend_symtable_update(&requested, Z_STR_P(zv), &EG(uninitialized_zval));
+		} ZEND_HASH_FOREACH_END();
 
-		if (preserve_order && return_value) {
-			add_assoc_null_ex(return_value, ZSTR_VAL(key), ZSTR_LEN(key));
-		}
+		ZVAL_LONG(&zcas, 0);
+		s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
 
-		if (ZSTR_LEN(key) > 0 && ZSTR_LEN(key) < MEMCACHED_MAX_KEY) {
-			keys_out->mkeys[idx]     = ZSTR_VAL(key);
-			keys_out->mkeys_len[idx] = ZSTR_LEN(key);
+		/* The values are written back as one batch, like setMulti() */
+		mark  = s_arena_mark(&intern->arena);
+		items = s_arena_calloc(&intern->arena, zend_hash_num_elements(Z_ARRVAL(retval)), sizeof(php_memc_batch_item_t));
 
-			keys_out->strings[idx] = key;
-			idx++;
-		}
-		else {
-			zend_string_release (key);
-		}
+		ZEND_HASH_FOREACH_KEY_VAL(Z_ARRVAL(retval), num_key, key, zv) {
+			php_memc_batch_item_t *item;
+			zval *zexpiration;
+			time_t expiration = 0;
 
-	} ZEND_HASH_FOREACH_END();
+			if (key) {
+				zend_string_addref(key);
+			} else {
+				key = zend_long_to_str((zend_long) num_key);
+			}
 
-	if (!idx) {
-		efree (keys_out->mkeys);
-		efree (keys_out->mkeys_len);
-		efree (keys_out->strings);
-	}
-	keys_out->num_valid_keys = idx;
-}
+			/* Only fill in what was actually missed */
+			if (zend_symtable_exists(&requested, key)) {
+				zexpiration = zend_symtable_find(Z_ARRVAL_P(Z_REFVAL(params[2])), key);
+				if (zexpiration) {
+					expiration = zval_get_long(zexpiration);
+				}
 
-static
-void s_key_to_keys(php_memc_keys_t *keys_out, zend_string *key)
-{
-	zval zv_keys;
+				ZVAL_DEREF(zv);
+				item = &items[count++];
+				item->cmd        = MEMC_BATCH_SET;
+				item->key        = zend_string_copy(key);
+				item->expiration = expiration;
 
-	array_init(&zv_keys);
-	add_next_index_str(&zv_keys, zend_string_copy(key));
+				s_local_cache_delete(intern, key);
+				s_negative_cache_delete(intern, key);
 
-	s_hash_to_keys(keys_out, Z_ARRVAL(zv_keys), 0, NULL);
-	zval_ptr_dtor(&zv_keys);
-}
+				item->payload = s_zval_to_payload_ex(intern, key, zv, &item->flags, &item->compress);
+				item->status  = item->payload ? MEMCACHED_SUCCESS : MEMC_RES_PAYLOAD_FAILURE;
 
-static
-void s_clear_keys(php_memc_keys_t *keys)
-{
-	size_t i;
+				if (context->lazy) {
+					zval lazy;
 
-	if (!keys->num_valid_keys) {
-		return;
-	}
+					s_lazy_value_wrap(zv, &lazy);
+					s_get_multi_apply_fn(intern, key, &lazy, &zcas, 0, context);
+					zval_ptr_dtor(&lazy);
+				} else {
+					s_get_multi_apply_fn(intern, key, zv, &zcas, 0, context);
+				}
+			}
+			zend_string_release(key);
+		} ZEND_HASH_FOREACH_END();
 
-	for (i = 0; i < keys->num_valid_keys; i++) {
-		zend_string_release (keys->strings[i]);
+		zend_hash_destroy(&requested);
+
+		s_batch_set(intern, server_key, items, count);
+
+		for (i = 0; i < count; i++) {
+			if (s_memcached_return_is_error(items[i].status, 1)) {
+				status = 0;
+			}
+			zend_string_release(items[i].key);
+			if (items[i].payload) {
+				zend_string_release(items[i].payload);
+			}
+		}
+		s_arena_release(&intern->arena, mark);
+
+		if (!status) {
+			/* The values are still returned, report the failed write backs */
+			s_memc_set_status(intern, MEMCACHED_SOME_ERRORS, 0);
+			status = 1;
+		}
 	}
-	efree(keys->strings);
-	efree(keys->mkeys);
-	efree(keys->mkeys_len);
-}
 
-typedef struct {
-	zend_bool extended;
-	zval *return_value;
-} php_memc_get_ctx_t;
+	zval_ptr_dtor(&params[0]);
+	zval_ptr_dtor(&params[1]);
+	zval_ptr_dtor(&params[2]);
+	zval_ptr_dtor(&retval);
+
+	return status;
+}
 
 static
-zend_bool s_get_apply_fn(php_memc_object_t *intern, zend_string *key, zval *value, zval *cas, uint32_t flags, void *in_context)
+void s_restore_key_order(HashTable *keys, zval *return_value)
 {
-	php_memc_get_ctx_t *context = (php_memc_get_ctx_t *) in_context;
+	zval ordered, *zv, *value;
 
-	if (context->extended) {
-		Z_TRY_ADDREF_P(value);
-		Z_TRY_ADDREF_P(cas);
+	array_init_size(&ordered, zend_hash_num_elements(keys));
 
-		array_init (context->return_value);
-		add_assoc_zval (context->return_value, "value", value);
-		add_assoc_zval (context->return_value, "cas",   cas);
-		add_assoc_long (context->return_value, "flags", (zend_long) MEMC_VAL_GET_USER_FLAGS(flags));
-	}
-	else {
-		ZVAL_COPY(context->return_value, value);
-	}
-	return 0; /* Stop after one */
+	ZEND_HASH_FOREACH_VAL(keys, zv) {
+		zend_string *key = zval_get_string(zv);
+
+		if ((value = zend_symtable_find(Z_ARRVAL_P(return_value), key)) != NULL) {
+			Z_TRY_ADDREF_P(value);
+			zend_symtable_update(Z_ARRVAL(ordered), key, value);
+		} else {
+			add_assoc_null_ex(&ordered, ZSTR_VAL(key), ZSTR_LEN(key));
+		}
+		zend_string_release(key);
+	} ZEND_HASH_FOREACH_END();
+
+	zval_ptr_dtor(return_value);
+	ZVAL_COPY_VALUE(return_value, &ordered);
 }
 
-static
-void php_memc_get_impl(INTERNAL_FUNCTION_PARAMETERS, zend_bool by_key)
+/* {{{ -- php_memc_getMulti_impl */
+static void php_memc_getMulti_impl(INTERNAL_FUNCTION_PARAMETERS, zend_bool by_key)
 {
 	php_memc_get_ctx_t context = {};
-	php_memc_keys_t keys = {0};
-	zend_long get_flags = 0;
-	zend_string *key;
+	php_memc_keys_t keys_out;
+
+	zval *keys = NULL;
+	zval missing;
 	zend_string *server_key = NULL;
-	zend_bool mget_status;
-	memcached_return status = MEMCACHED_SUCCESS;
+	zend_long flags = 0;
+	size_t local_hits = 0, negative_hits = 0;
 	zend_fcall_info fci = empty_fcall_info;
 	zend_fcall_info_cache fcc = empty_fcall_info_cache;
 	MEMC_METHOD_INIT_VARS;
+	zend_bool retval, preserve_order, track_misses;
 
 	if (by_key) {
-		if (zend_parse_parameters(ZEND_NUM_ARGS(), "SS|f!l", &server_key, &key, &fci, &fcc, &get_flags) == FAILURE) {
+		if (zend_parse_parameters(ZEND_NUM_ARGS(), "Sa|lf!", &server_key,
+								  &keys, &flags, &fci, &fcc) == FAILURE) {
 			return;
 		}
 	} else {
-		if (zend_parse_parameters(ZEND_NUM_ARGS(), "S|f!l", &key, &fci, &fcc, &get_flags) == FAILURE) {
+		if (zend_parse_parameters(ZEND_NUM_ARGS(), "a|lf!", &keys, &flags, &fci, &fcc) == FAILURE) {
 			return;
 		}
 	}
 
 	MEMC_METHOD_FETCH_OBJECT;
+
+	array_init(return_value);
+	if (zend_hash_num_elements(Z_ARRVAL_P(keys)) == 0) {
+		/* BC compatible */
+		s_memc_set_status(intern, MEMCACHED_NOTFOUND, 0);
+		return;
+	}
+
 	s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
-	MEMC_CHECK_KEY(intern, key);
 
-	context.extended = (get_flags & MEMC_GET_EXTENDED);
+	preserve_order = (flags & MEMC_GET_PRESERVE_ORDER);
+	track_misses   = (fci.size > 0 || (!server_key && memc_user_data->negative_cache.size > 0));
+
+	/* When misses are tracked the order is restored at the end, so that misses can be told apart from stored nulls */
+	s_hash_to_keys(intern, &keys_out, Z_ARRVAL_P(keys), preserve_order, track_misses ? NULL : return_value);
 
+	context.extended = (flags & MEMC_GET_EXTENDED);
+	context.lazy = (flags & MEMC_GET_LAZY) != 0;
 	context.return_value = return_value;
 
-	s_key_to_keys(&keys, key);
-	mget_status = php_memc_mget_apply(intern, server_key, &keys, s_get_apply_fn, context.extended, &context);
-	s_clear_keys(&keys);
+	if (!server_key) {
+		local_hits    = s_local_cache_apply_keys(intern, &keys_out, s_get_multi_apply_fn, context.extended, context.lazy, &context);
+		negative_hits = s_negative_cache_apply_keys(intern, &keys_out);
+	}
 
-	if (!mget_status) {
-		if (s_memc_status_has_result_code(intern, MEMCACHED_NOTFOUND) && fci.size > 0) {
-			status = s_invoke_cache_callback(object, &fci, &fcc, context.extended, key, return_value);
+	if (keys_out.num_valid_keys || (!local_hits && !negative_hits)) {
+		HashTable unconfirmed;
 
-			if (!status) {
-				zval_ptr_dtor(return_value);
-				RETURN_FROM_GET;
+		zend_hash_init(&unconfirmed, 0, NULL, NULL, 0);
+		intern->unconfirmed = (!server_key && memc_user_data->negative_cache.size > 0) ? &unconfirmed : NULL;
+		intern->local_cache_fill = !server_key;
+		retval = php_memc_mget_apply(intern, server_key, &keys_out, s_get_multi_apply_fn, context.extended, context.lazy, &context);
+		intern->local_cache_fill = 0;
+		intern->unconfirmed = NULL;
+
+		/* A partial failure leaves the keys of the failed servers unanswered */
+		if (!server_key && (s_memc_status_has_result_code(intern, MEMCACHED_SUCCESS) || s_memc_status_has_result_code(intern, MEMCACHED_NOTFOUND))) {
+			s_negative_cache_store_misses(intern, &keys_out, &unconfirmed, return_value);
+		}
+		zend_hash_destroy(&unconfirmed);
+	}
+	else {
+		/* Everything was answered locally */
+		retval = (local_hits > 0);
+		s_memc_set_status(intern, retval ? MEMCACHED_SUCCESS : MEMCACHED_NOTFOUND, 0);
+	}
+
+	if (fci.size > 0 && !EG(exception) &&
+		(retval || s_memc_status_has_result_code(intern, MEMCACHED_NOTFOUND) || s_memc_status_has_result_code(intern, MEMCACHED_SOME_ERRORS))) {
+		zval *zv;
+
+		array_init(&missing);
+		ZEND_HASH_FOREACH_VAL(Z_ARRVAL_P(keys), zv) {
+			zend_string *key = zval_get_string(zv);
+
+			if (ZSTR_LEN(key) > 0 && ZSTR_LEN(key) < MEMCACHED_MAX_KEY && !zend_symtable_exists(Z_ARRVAL_P(return_value), key)) {
+				add_next_index_str(&missing, key);
+			} else {
+				zend_string_release(key);
 			}
+		} ZEND_HASH_FOREACH_END();
+
+		if (zend_hash_num_elements(Z_ARRVAL(missing)) > 0 &&
+			s_invoke_multi_cache_callback(object, &fci, &fcc, server_key, &missing, &context)) {
+			retval = !s_memc_status_has_error(intern);
 		}
+		zval_ptr_dtor(&missing);
 	}
 
-	if (s_memc_status_has_error(intern)) {
-		zval_ptr_dtor(return_value);
+	if (track_misses && preserve_order) {
+		s_restore_key_order(Z_ARRVAL_P(keys), return_value);
+	}
+
+	s_clear_keys(&keys_out);
+
+	if (!retval && (s_memc_status_has_result_code(intern, MEMCACHED_NOTFOUND) || s_memc_status_has_result_code(intern, MEMCACHED_SOME_ERRORS))) {
+		if (local_hits && s_memc_status_has_result_code(intern, MEMCACHED_NOTFOUND)) {
+			s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
+		}
+		return;
+	}
+
+	if (!retval || EG(exception)) {
+		zval_dtor(return_value);
 		RETURN_FROM_GET;
 	}
 }
+/* }}} */
 
-/* {{{ Memcached::get(string key [, mixed callback [, int get_flags = 0])
-   Returns a value for the given key or false */
-PHP_METHOD(Memcached, get)
+/* {{{ Memcached::getMulti(array keys[, long flags = 0 [, mixed callback ] ])
+   Returns values for the given keys or false */
+PHP_METHOD(Memcached, getMulti)
 {
-	php_memc_get_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 0);
+	php_memc_getMulti_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 0);
 }
 /* }}} */
 
-/* {{{ Memcached::getByKey(string server_key, string key [, mixed callback [, int get_flags = 0])
-   Returns a value for key from the server identified by the server key or false */
-PHP_METHOD(Memcached, getByKey)
+/* {{{ Memcached::getMultiByKey(string server_key, array keys[, long flags = 0 [, mixed callback ] ])
+   Returns values for the given keys from the server identified by the server key or false */
+PHP_METHOD(Memcached, getMultiByKey)
 {
-	php_memc_get_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1);
+	php_memc_getMulti_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1);
 }
 /* }}} */
 
+/*
+ * libmemcached has no get-and-touch command, so the values are fetched with one
+ * mget and the keys that were found are then touched in one pipelined batch.
+ */
 static
-zend_bool s_get_multi_apply_fn(php_memc_object_t *intern, zend_string *key, zval *value, zval *cas, uint32_t flags, void *in_context)
+void s_touch_fetched(php_memc_object_t *intern, HashTable *fetched, time_t expiration)
 {
-	php_memc_get_ctx_t *context = (php_memc_get_ctx_t *) in_context;
+	int rescode = intern->rescode, memc_errno = intern->memc_errno;
+	php_memc_batch_item_t *items;
+	php_memc_arena_mark_t mark;
+	zend_string *key;
+	size_t i, count = 0;
 
-	Z_TRY_ADDREF_P(value);
+	if (!zend_hash_num_elements(fetched)) {
+		return;
+	}
 
-	if (context->extended) {
-		zval node;
+	mark  = s_arena_mark(&intern->arena);
+	items = s_arena_calloc(&intern->arena, zend_hash_num_elements(fetched), sizeof(php_memc_batch_item_t));
 
-		Z_TRY_ADDREF_P(cas);
+	ZEND_HASH_FOREACH_STR_KEY(fetched, key) {
+		items[count].cmd        = MEMC_BATCH_TOUCH;
+		items[count].key        = key;
+		items[count].expiration = expiration;
+		items[count].status     = MEMCACHED_SUCCESS;
+		count++;
+	} ZEND_HASH_FOREACH_END();
 
-		array_init(&node);
-		add_assoc_zval(&node, "value", value);
-		add_assoc_zval(&node, "cas",   cas);
-		add_assoc_long(&node, "flags", (zend_long) MEMC_VAL_GET_USER_FLAGS(flags));
+	/* A key that expires in between is simply not extended */
+	s_batch_run(intern, NULL, items, count);
+	s_arena_release(&intern->arena, mark);
 
-		zend_symtable_update(Z_ARRVAL_P(context->return_value), key, &node); 
+	s_memc_set_status(intern, (memcached_return) rescode, memc_errno);
+}
+
+/* {{{ Memcached::getAndTouch(string key, int expiration [, int get_flags = 0 ])
+   Returns a value for the given key or false and sets a new expiration for it */
+PHP_METHOD(Memcached, getAndTouch)
+{
+	php_memc_get_ctx_t context = {};
+	php_memc_keys_t keys = {0};
+	zend_string *key;
+	zend_long expiration, get_flags = 0;
+	HashTable fetched;
+	MEMC_METHOD_INIT_VARS;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "Sl|l", &key, &expiration, &get_flags) == FAILURE) {
+		return;
 	}
-	else {
-		zend_symtable_update(Z_ARRVAL_P(context->return_value), key, value);
+
+	MEMC_METHOD_FETCH_OBJECT;
+	s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
+	MEMC_CHECK_KEY(intern, key);
+
+	context.extended = (get_flags & MEMC_GET_EXTENDED);
+	context.return_value = return_value;
+
+	s_key_to_keys(intern, &keys, key);
+	if (!php_memc_mget_apply(intern, NULL, &keys, s_get_apply_fn, context.extended, 0, &context)) {
+		s_clear_keys(&keys);
+		zval_ptr_dtor(return_value);
+		RETURN_FROM_GET;
 	}
-	return 1;
+	s_clear_keys(&keys);
+
+	/* Expired in between, the value that was read is still returned */
+	zend_hash_init(&fetched, 1, NULL, NULL, 0);
+	zend_hash_add_empty_element(&fetched, key);
+	s_touch_fetched(intern, &fetched, (time_t) expiration);
+	zend_hash_destroy(&fetched);
 }
+/* }}} */
 
-/* {{{ -- php_memc_getMulti_impl */
-static void php_memc_getMulti_impl(INTERNAL_FUNCTION_PARAMETERS, zend_bool by_key)
+/* {{{ Memcached::getMultiAndTouch(array keys, int expiration [, int flags = 0 ])
+   Returns values for the given keys or false and sets a new expiration for the keys that were found */
+PHP_METHOD(Memcached, getMultiAndTouch)
 {
-	php_memc_get_ctx_t context;
+	php_memc_get_ctx_t context = {};
 	php_memc_keys_t keys_out;
-
-	zval *keys = NULL;
-	zend_string *server_key = NULL;
-	zend_long flags = 0;
+	zval *keys;
+	zend_long expiration, flags = 0;
+	zend_bool retval;
+	HashTable fetched;
 	MEMC_METHOD_INIT_VARS;
-	zend_bool retval, preserve_order;
 
-	if (by_key) {
-		if (zend_parse_parameters(ZEND_NUM_ARGS(), "Sa|l", &server_key,
-								  &keys, &flags) == FAILURE) {
-			return;
-		}
-	} else {
-		if (zend_parse_parameters(ZEND_NUM_ARGS(), "a|l", &keys, &flags) == FAILURE) {
-			return;
-		}
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "al|l", &keys, &expiration, &flags) == FAILURE) {
+		return;
 	}
 
 	MEMC_METHOD_FETCH_OBJECT;
 
 	array_init(return_value);
 	if (zend_hash_num_elements(Z_ARRVAL_P(keys)) == 0) {
-		/* BC compatible */
 		s_memc_set_status(intern, MEMCACHED_NOTFOUND, 0);
 		return;
 	}
 
 	s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
 
-	preserve_order = (flags & MEMC_GET_PRESERVE_ORDER);
-	s_hash_to_keys(&keys_out, Z_ARRVAL_P(keys), preserve_order, return_value);
+	s_hash_to_keys(intern, &keys_out, Z_ARRVAL_P(keys), (flags & MEMC_GET_PRESERVE_ORDER), return_value);
+
+	/* A null in the result is either a stored null or a miss kept in place by GET_PRESERVE_ORDER, so the keys found are kept apart */
+	zend_hash_init(&fetched, keys_out.num_valid_keys, NULL, NULL, 0);
 
 	context.extended = (flags & MEMC_GET_EXTENDED);
+	context.lazy = (flags & MEMC_GET_LAZY) != 0;
+	context.fetched = &fetched;
 	context.return_value = return_value;
 
-	retval = php_memc_mget_apply(intern, server_key, &keys_out, s_get_multi_apply_fn, context.extended, &context);
-
+	retval = php_memc_mget_apply(intern, NULL, &keys_out, s_get_multi_apply_fn, context.extended, context.lazy, &context);
 	s_clear_keys(&keys_out);
 
-	if (!retval && (s_memc_status_has_result_code(intern, MEMCACHED_NOTFOUND) || s_memc_status_has_result_code(intern, MEMCACHED_SOME_ERRORS))) {
-		return;
-	}
-
-	if (!retval || EG(exception)) {
+	if (!retval && !s_memc_status_has_result_code(intern, MEMCACHED_NOTFOUND) && !s_memc_status_has_result_code(intern, MEMCACHED_SOME_ERRORS)) {
+		zend_hash_destroy(&fetched);
 		zval_dtor(return_value);
 		RETURN_FROM_GET;
 	}
-}
-/* }}} */
-
-/* {{{ Memcached::getMulti(array keys[, long flags = 0 ])
-   Returns values for the given keys or false */
-PHP_METHOD(Memcached, getMulti)
-{
-	php_memc_getMulti_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 0);
-}
-/* }}} */
 
-/* {{{ Memcached::getMultiByKey(string server_key, array keys[, long flags = 0 ])
-   Returns values for the given keys from the server identified by the server key or false */
-PHP_METHOD(Memcached, getMultiByKey)
-{
-	php_memc_getMulti_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1);
+	s_touch_fetched(intern, &fetched, (time_t) expiration);
+	zend_hash_destroy(&fetched);
 }
 /* }}} */
 
@@ -1656,16 +5408,16 @@ static void php_memc_getDelayed_impl(INTERNAL_FUNCTION_PARAMETERS, zend_bool by_
 	MEMC_METHOD_FETCH_OBJECT;
 	s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
 
-	s_hash_to_keys(&keys_out, Z_ARRVAL_P(keys), 0, NULL);
+	s_hash_to_keys(intern, &keys_out, Z_ARRVAL_P(keys), 0, NULL);
 
 	if (fci.size > 0) {
 		php_memc_result_callback_ctx_t context = {
 			getThis(), fci, fcc
 		};
-		status = php_memc_mget_apply(intern, server_key, &keys_out, &s_result_callback_apply, with_cas, (void *) &context);
+		status = php_memc_mget_apply(intern, server_key, &keys_out, &s_result_callback_apply, with_cas, 0, (void *) &context);
 	}
 	else {
-		status = php_memc_mget_apply(intern, server_key, &keys_out, NULL, with_cas, NULL);
+		status = php_memc_mget_apply(intern, server_key, &keys_out, NULL, with_cas, 0, NULL);
 	}
 
 	s_clear_keys(&keys_out);
@@ -1693,53 +5445,318 @@ PHP_METHOD(Memcached, fetch)
 		return;
 	}
 
-	MEMC_METHOD_FETCH_OBJECT;
-	s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
-
-	array_init(return_value);
-	status = php_memc_result_apply(intern, s_fetch_apply, 1, return_value);
-
-	if (s_memc_status_handle_result_code(intern, status) == FAILURE) {
-		zval_ptr_dtor(return_value);
-		RETURN_FROM_GET;
+	MEMC_METHOD_FETCH_OBJECT;
+	s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
+
+	array_init(return_value);
+	status = php_memc_result_apply(intern, s_fetch_apply, 1, 0, 0, return_value);
+
+	if (s_memc_status_handle_result_code(intern, status) == FAILURE) {
+		zval_ptr_dtor(return_value);
+		RETURN_FROM_GET;
+	}
+}
+/* }}} */
+
+static
+zend_bool s_fetch_all_apply(php_memc_object_t *intern, zend_string *key, zval *value, zval *cas, uint32_t flags, void *in_context)
+{
+	zval zv;
+	zval *return_value = (zval *) in_context;
+
+	array_init (&zv);
+	s_create_result_array(key, value, cas, flags, &zv);
+
+	add_next_index_zval(return_value, &zv);
+	return 1;
+}
+
+/* {{{ Memcached::fetchAll()
+   Returns all the results from a previous delayed request */
+PHP_METHOD(Memcached, fetchAll)
+{
+	memcached_return status = MEMCACHED_SUCCESS;
+	MEMC_METHOD_INIT_VARS;
+
+	if (zend_parse_parameters_none() == FAILURE) {
+		return;
+	}
+
+	MEMC_METHOD_FETCH_OBJECT;
+	s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
+
+	array_init(return_value);
+	status = php_memc_result_apply(intern, s_fetch_all_apply, 0, 0, 0, return_value);
+
+	if (s_memc_status_handle_result_code(intern, status) == FAILURE) {
+		zval_dtor(return_value);
+		RETURN_FALSE;
+	}
+}
+/* }}} */
+
+/****************************************
+  Streaming iterator over mget results
+****************************************/
+
+static
+zend_bool s_iterator_apply(php_memc_object_t *intern, zend_string *key, zval *value, zval *cas, uint32_t flags, void *in_context)
+{
+	php_memc_iterator_t *it = (php_memc_iterator_t *) in_context;
+
+	ZVAL_STR_COPY(&it->key, key);
+
+	if (it->extended) {
+		Z_TRY_ADDREF_P(value);
+		Z_TRY_ADDREF_P(cas);
+
+		array_init(&it->value);
+		add_assoc_zval(&it->value, "value", value);
+		add_assoc_zval(&it->value, "cas",   cas);
+		add_assoc_long(&it->value, "flags", (zend_long) MEMC_VAL_GET_USER_FLAGS(flags));
+	}
+	else {
+		ZVAL_COPY(&it->value, value);
+	}
+	return 0; // stop iterating after one
+}
+
+/* Frees the instance for other requests, the results an iterator left behind are read and dropped */
+static
+void s_iterator_end(php_memc_object_t *intern, zend_bool drain)
+{
+	memcached_result_st result;
+	memcached_return status;
+
+	intern->iterator = NULL;
+
+	if (!drain || !intern->memc) {
+		return;
+	}
+
+	memcached_result_create(intern->memc, &result);
+	while (memcached_fetch_result(intern->memc, &result, &status) != NULL) {
+	}
+	memcached_result_free(&result);
+}
+
+static
+void s_iterator_fetch(php_memc_iterator_t *it)
+{
+	php_memc_object_t *intern;
+	memcached_return status;
+
+	zval_ptr_dtor(&it->key);
+	zval_ptr_dtor(&it->value);
+	ZVAL_UNDEF(&it->key);
+	ZVAL_UNDEF(&it->value);
+
+	/* Not created by getIterator() */
+	if (Z_ISUNDEF(it->object)) {
+		it->finished = 1;
+		return;
+	}
+
+	intern = Z_MEMC_OBJ_P(&it->object);
+
+	if (it->finished || !intern->memc || intern->iterator != &it->zo) {
+		it->finished = 1;
+		return;
+	}
+
+	status = php_memc_result_apply(intern, s_iterator_apply, 1, 0, 0, it);
+	s_memc_status_handle_result_code(intern, status);
+
+	if (Z_ISUNDEF(it->value)) {
+		it->finished = 1;
+		s_iterator_end(intern, 0);
+	}
+}
+
+static
+void s_iterator_start(php_memc_iterator_t *it)
+{
+	if (!it->started) {
+		it->started = 1;
+		s_iterator_fetch(it);
+	}
+}
+
+/* {{{ Memcached::getIterator(array keys[, long flags = 0 ])
+   Sends a request for the given keys and returns an iterator that fetches one result at a time */
+PHP_METHOD(Memcached, getIterator)
+{
+	php_memc_keys_t keys_out = {0};
+	php_memc_iterator_t *it;
+
+	zval *keys = NULL;
+	zend_long flags = 0;
+	zend_bool extended;
+	MEMC_METHOD_INIT_VARS;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "a|l", &keys, &flags) == FAILURE) {
+		return;
+	}
+
+	MEMC_METHOD_FETCH_OBJECT;
+	s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
+
+	extended = (flags & MEMC_GET_EXTENDED);
+
+	object_init_ex(return_value, memcached_iterator_ce);
+	it = Z_MEMC_ITERATOR_P(return_value);
+
+	ZVAL_COPY(&it->object, object);
+	it->extended = extended;
+
+	if (zend_hash_num_elements(Z_ARRVAL_P(keys)) == 0) {
+		/* BC compatible with getMulti */
+		s_memc_set_status(intern, MEMCACHED_NOTFOUND, 0);
+		it->finished = 1;
+		return;
+	}
+
+	s_hash_to_keys(intern, &keys_out, Z_ARRVAL_P(keys), 0, NULL);
+
+	if (!php_memc_mget_apply(intern, NULL, &keys_out, NULL, extended, 0, NULL)) {
+		s_clear_keys(&keys_out);
+		zval_ptr_dtor(return_value);
+		RETURN_FALSE;
+	}
+	s_clear_keys(&keys_out);
+
+	intern->iterator = &it->zo;
+}
+/* }}} */
+
+/* {{{ MemcachedIterator::__construct()
+   Iterators are only created by Memcached::getIterator() */
+PHP_METHOD(MemcachedIterator, __construct)
+{
+}
+/* }}} */
+
+/* {{{ MemcachedIterator::rewind()
+   Fetches the first result. Results are consumed as they are read, so the iterator can not be rewound */
+PHP_METHOD(MemcachedIterator, rewind)
+{
+	php_memc_iterator_t *it = Z_MEMC_ITERATOR_P(getThis());
+
+	if (zend_parse_parameters_none() == FAILURE) {
+		return;
+	}
+
+	if (it->started && it->position > 0) {
+		php_error_docref(NULL, E_WARNING, "cannot rewind an iterator that has already advanced");
+		return;
+	}
+	s_iterator_start(it);
+}
+/* }}} */
+
+/* {{{ MemcachedIterator::valid()
+   Returns whether a result is available */
+PHP_METHOD(MemcachedIterator, valid)
+{
+	php_memc_iterator_t *it = Z_MEMC_ITERATOR_P(getThis());
+
+	if (zend_parse_parameters_none() == FAILURE) {
+		return;
+	}
+
+	s_iterator_start(it);
+	RETURN_BOOL(!it->finished);
+}
+/* }}} */
+
+/* {{{ MemcachedIterator::current()
+   Returns the value of the current result */
+PHP_METHOD(MemcachedIterator, current)
+{
+	php_memc_iterator_t *it = Z_MEMC_ITERATOR_P(getThis());
+
+	if (zend_parse_parameters_none() == FAILURE) {
+		return;
+	}
+
+	s_iterator_start(it);
+	if (Z_ISUNDEF(it->value)) {
+		RETURN_NULL();
+	}
+	RETURN_ZVAL(&it->value, 1, 0);
+}
+/* }}} */
+
+/* {{{ MemcachedIterator::key()
+   Returns the key of the current result */
+PHP_METHOD(MemcachedIterator, key)
+{
+	php_memc_iterator_t *it = Z_MEMC_ITERATOR_P(getThis());
+
+	if (zend_parse_parameters_none() == FAILURE) {
+		return;
+	}
+
+	s_iterator_start(it);
+	if (Z_ISUNDEF(it->key)) {
+		RETURN_NULL();
+	}
+	RETURN_ZVAL(&it->key, 1, 0);
+}
+/* }}} */
+
+/* {{{ MemcachedIterator::next()
+   Releases the current result and fetches the next one */
+PHP_METHOD(MemcachedIterator, next)
+{
+	php_memc_iterator_t *it = Z_MEMC_ITERATOR_P(getThis());
+
+	if (zend_parse_parameters_none() == FAILURE) {
+		return;
+	}
+
+	if (!it->started) {
+		s_iterator_start(it);
 	}
+	s_iterator_fetch(it);
+	it->position++;
 }
 /* }}} */
 
-static
-zend_bool s_fetch_all_apply(php_memc_object_t *intern, zend_string *key, zval *value, zval *cas, uint32_t flags, void *in_context)
+/* {{{ MemcachedLazyValue::__construct()
+   Lazy values are only created by getMulti() with Memcached::GET_LAZY */
+PHP_METHOD(MemcachedLazyValue, __construct)
 {
-	zval zv;
-	zval *return_value = (zval *) in_context;
-
-	array_init (&zv);
-	s_create_result_array(key, value, cas, flags, &zv);
-
-	add_next_index_zval(return_value, &zv);
-	return 1;
 }
+/* }}} */
 
-/* {{{ Memcached::fetchAll()
-   Returns all the results from a previous delayed request */
-PHP_METHOD(Memcached, fetchAll)
+/* {{{ MemcachedLazyValue::getValue()
+   Decodes the value on the first call and returns it, false if it can not be decoded */
+PHP_METHOD(MemcachedLazyValue, getValue)
 {
-	memcached_return status = MEMCACHED_SUCCESS;
-	MEMC_METHOD_INIT_VARS;
+	php_memc_lazy_value_t *lazy = Z_MEMC_LAZY_VALUE_P(getThis());
+	php_memc_object_t *intern;
 
 	if (zend_parse_parameters_none() == FAILURE) {
 		return;
 	}
 
-	MEMC_METHOD_FETCH_OBJECT;
-	s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
+	if (Z_ISUNDEF(lazy->value)) {
+		intern = Z_MEMC_OBJ_P(&lazy->object);
 
-	array_init(return_value);
-	status = php_memc_result_apply(intern, s_fetch_all_apply, 0, return_value);
+		if (!s_memcached_string_to_zval(intern->memc, lazy->payload, lazy->flags, &lazy->value)) {
+			ZVAL_UNDEF(&lazy->value);
+			s_memc_set_status(intern, MEMC_RES_PAYLOAD_FAILURE, 0);
+			RETURN_FALSE;
+		}
 
-	if (s_memc_status_handle_result_code(intern, status) == FAILURE) {
-		zval_dtor(return_value);
-		RETURN_FALSE;
+		/* Only the decoded value is kept from here on */
+		zend_string_release(lazy->payload);
+		lazy->payload = NULL;
+		zval_ptr_dtor(&lazy->object);
+		ZVAL_UNDEF(&lazy->object);
 	}
+	RETURN_ZVAL(&lazy->value, 1, 0);
 }
 /* }}} */
 
@@ -1775,7 +5792,61 @@ PHP_METHOD(Memcached, touchByKey)
 }
 /* }}} */
 
-/* {{{ Memcached::setMulti(array items [, int expiration  ])
+/* {{{ Memcached::touchMulti(array keys [, int expiration ])
+   Sets a new expiration for the given keys */
+PHP_METHOD(Memcached, touchMulti)
+{
+	zval *keys, *zv, ret;
+	time_t expiration = 0;
+	php_memc_batch_item_t *items = NULL;
+	php_memc_arena_mark_t mark;
+	size_t i, count = 0;
+	MEMC_METHOD_INIT_VARS;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "a|l", &keys, &expiration) == FAILURE) {
+		return;
+	}
+
+	MEMC_METHOD_FETCH_OBJECT;
+	s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
+
+	mark = s_arena_mark(&intern->arena);
+	if (zend_hash_num_elements(Z_ARRVAL_P(keys))) {
+		items = s_arena_calloc(&intern->arena, zend_hash_num_elements(Z_ARRVAL_P(keys)), sizeof(php_memc_batch_item_t));
+	}
+
+	ZEND_HASH_FOREACH_VAL (Z_ARRVAL_P(keys), zv) {
+		zend_string *key = zval_get_string(zv);
+
+		if (ZSTR_LEN(key) == 0) {
+			zend_string_release(key);
+			continue;
+		}
+
+		items[count].cmd        = MEMC_BATCH_TOUCH;
+		items[count].key        = key;
+		items[count].expiration = expiration;
+		items[count].status     = MEMCACHED_SUCCESS;
+		count++;
+	} ZEND_HASH_FOREACH_END();
+
+	s_batch_run(intern, NULL, items, count);
+
+	array_init(return_value);
+	for (i = 0; i < count; i++) {
+		if (s_memc_status_handle_result_code(intern, items[i].status) == FAILURE) {
+			ZVAL_LONG(&ret, items[i].status);
+		} else {
+			ZVAL_TRUE(&ret);
+		}
+		zend_symtable_update(Z_ARRVAL_P(return_value), items[i].key, &ret);
+		zend_string_release(items[i].key);
+	}
+	s_arena_release(&intern->arena, mark);
+}
+/* }}} */
+
+/* {{{ Memcached::setMulti(array items [, int expiration [, int flags ] ])
    Sets the keys/values specified in the items array */
 PHP_METHOD(Memcached, setMulti)
 {
@@ -1783,7 +5854,7 @@ PHP_METHOD(Memcached, setMulti)
 }
 /* }}} */
 
-/* {{{ Memcached::setMultiByKey(string server_key, array items [, int expiration ])
+/* {{{ Memcached::setMultiByKey(string server_key, array items [, int expiration [, int flags ] ])
    Sets the keys/values specified in the items array on the server identified by the given server key */
 PHP_METHOD(Memcached, setMultiByKey)
 {
@@ -1797,19 +5868,23 @@ static void php_memc_setMulti_impl(INTERNAL_FUNCTION_PARAMETERS, zend_bool by_ke
 	zval *entries;
 	zend_string *server_key = NULL;
 	time_t expiration = 0;
+	zend_long set_flags = 0;
 	zval *value;
 	zend_string *skey;
 	zend_ulong num_key;
-	int tmp_len = 0;
+	php_memc_batch_item_t *items = NULL;
+	php_memc_arena_mark_t mark;
+	memcached_return failed = MEMCACHED_SUCCESS;
+	size_t i, count = 0;
 	MEMC_METHOD_INIT_VARS;
 
 	if (by_key) {
 		if (zend_parse_parameters(ZEND_NUM_ARGS(), "Sa|ll", &server_key,
-								  &entries, &expiration) == FAILURE) {
+								  &entries, &expiration, &set_flags) == FAILURE) {
 			return;
 		}
 	} else {
-		if (zend_parse_parameters(ZEND_NUM_ARGS(), "a|ll", &entries, &expiration) == FAILURE) {
+		if (zend_parse_parameters(ZEND_NUM_ARGS(), "a|ll", &entries, &expiration, &set_flags) == FAILURE) {
 			return;
 		}
 	}
@@ -1817,30 +5892,65 @@ static void php_memc_setMulti_impl(INTERNAL_FUNCTION_PARAMETERS, zend_bool by_ke
 	MEMC_METHOD_FETCH_OBJECT;
 	s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
 
+	mark = s_arena_mark(&intern->arena);
+	if (zend_hash_num_elements(Z_ARRVAL_P(entries))) {
+		items = s_arena_calloc(&intern->arena, zend_hash_num_elements(Z_ARRVAL_P(entries)), sizeof(php_memc_batch_item_t));
+	}
+
+	/* Serialize and compress everything before the first command goes out */
 	ZEND_HASH_FOREACH_KEY_VAL (Z_ARRVAL_P(entries), num_key, skey, value) {
-		zend_string *str_key = NULL;
+		php_memc_batch_item_t *item = &items[count++];
 
-		if (skey) {
-			str_key = skey;
-		}
-		else {
-			char tmp_key[64];
+		item->cmd        = MEMC_BATCH_SET;
+		item->key        = s_batch_item_key(skey, num_key);
+		item->expiration = expiration;
 
-			tmp_len = snprintf(tmp_key, sizeof(tmp_key) - 1, "%ld", (long)num_key);
-			str_key = zend_string_init(tmp_key, tmp_len, 0);
-		}
+		s_local_cache_delete(intern, item->key);
+		s_negative_cache_delete(intern, item->key);
+
+		item->payload = s_zval_to_payload_ex(intern, item->key, value, &item->flags, &item->compress);
+		item->status  = item->payload ? MEMCACHED_SUCCESS : MEMC_RES_PAYLOAD_FAILURE;
+	} ZEND_HASH_FOREACH_END();
+
+	s_batch_set(intern, server_key, items, count);
+
+	for (i = 0; i < count; i++) {
+		php_memc_batch_item_t *item = &items[i];
 
-		if (!s_memc_write_zval (intern, MEMC_OP_SET, server_key, str_key, value, expiration)) {
-			php_error_docref(NULL, E_WARNING, "failed to set key %s", ZSTR_VAL(str_key));
+		if (s_memcached_return_is_error(item->status, 1)) {
+			php_error_docref(NULL, E_WARNING, "failed to set key %s", ZSTR_VAL(item->key));
+			failed = item->status;
 		}
+	}
+
+	s_memc_status_handle_result_code(intern, failed);
+
+	if (set_flags & MEMC_SET_RETURN_STATUS) {
+		array_init(return_value);
+	}
 
-		if (!skey) {
-			zend_string_release (str_key);
+	for (i = 0; i < count; i++) {
+		if (set_flags & MEMC_SET_RETURN_STATUS) {
+			zval ret;
+
+			if (s_memcached_return_is_error(items[i].status, 1)) {
+				ZVAL_LONG(&ret, items[i].status);
+			} else {
+				ZVAL_TRUE(&ret);
+			}
+			zend_symtable_update(Z_ARRVAL_P(return_value), items[i].key, &ret);
 		}
 
-	} ZEND_HASH_FOREACH_END();
+		zend_string_release(items[i].key);
+		if (items[i].payload) {
+			zend_string_release(items[i].payload);
+		}
+	}
+	s_arena_release(&intern->arena, mark);
 
-	RETURN_BOOL(!s_memc_status_has_error(intern));
+	if (!(set_flags & MEMC_SET_RETURN_STATUS)) {
+		RETURN_BOOL(!s_memc_status_has_error(intern));
+	}
 }
 /* }}} */
 
@@ -2008,12 +6118,16 @@ static void php_memc_cas_impl(INTERNAL_FUNCTION_PARAMETERS, zend_bool by_key)
 
 	cas = s_zval_to_uint64(zv_cas);
 
-	payload = s_zval_to_payload(intern, value, &flags);
+	s_local_cache_delete(intern, key);
+
+	payload = s_zval_to_payload(intern, key, value, &flags);
 	if (payload == NULL) {
 		intern->rescode = MEMC_RES_PAYLOAD_FAILURE;
 		RETURN_FALSE;
 	}
 
+	s_write_queue_flush(intern);
+
 	if (by_key) {
 		status = memcached_cas_by_key(intern->memc, ZSTR_VAL(server_key), ZSTR_LEN(server_key), ZSTR_VAL(key), ZSTR_LEN(key), ZSTR_VAL(payload), ZSTR_LEN(payload), expiration, flags, cas);
 	} else {
@@ -2045,6 +6159,99 @@ PHP_METHOD(Memcached, casByKey)
 }
 /* }}} */
 
+/* {{{ Memcached::casMulti(array items)
+   Sets the values for the given keys, each failing if its cas token doesn't match the one in memcache.
+   Items are key => array('value' => mixed, 'cas' => token [, 'expiration' => int ]) */
+PHP_METHOD(Memcached, casMulti)
+{
+	zval *entries, *entry, *zv, ret;
+	zend_string *skey;
+	zend_ulong num_key;
+	php_memc_batch_item_t *items = NULL;
+	php_memc_arena_mark_t mark;
+	memcached_return status = MEMCACHED_SUCCESS;
+	size_t i, count = 0;
+	MEMC_METHOD_INIT_VARS;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "a", &entries) == FAILURE) {
+		return;
+	}
+
+	MEMC_METHOD_FETCH_OBJECT;
+	s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
+
+	ZEND_HASH_FOREACH_VAL (Z_ARRVAL_P(entries), entry) {
+		ZVAL_DEREF(entry);
+		if (Z_TYPE_P(entry) != IS_ARRAY ||
+			!zend_hash_str_exists(Z_ARRVAL_P(entry), ZEND_STRL("value")) ||
+			!zend_hash_str_exists(Z_ARRVAL_P(entry), ZEND_STRL("cas"))) {
+			php_error_docref(NULL, E_WARNING, "items must be arrays with 'value' and 'cas' elements");
+			RETURN_FALSE;
+		}
+	} ZEND_HASH_FOREACH_END();
+
+	mark = s_arena_mark(&intern->arena);
+	if (zend_hash_num_elements(Z_ARRVAL_P(entries))) {
+		items = s_arena_calloc(&intern->arena, zend_hash_num_elements(Z_ARRVAL_P(entries)), sizeof(php_memc_batch_item_t));
+	}
+
+	/* Serialize and compress everything before the first command goes out */
+	ZEND_HASH_FOREACH_KEY_VAL (Z_ARRVAL_P(entries), num_key, skey, entry) {
+		php_memc_batch_item_t *item = &items[count++];
+
+		ZVAL_DEREF(entry);
+		item->cmd = MEMC_BATCH_CAS;
+		item->key = s_batch_item_key(skey, num_key);
+
+		zv = zend_hash_str_find(Z_ARRVAL_P(entry), ZEND_STRL("cas"));
+		ZVAL_DEREF(zv);
+		item->cas = s_zval_to_uint64(zv);
+
+		if ((zv = zend_hash_str_find(Z_ARRVAL_P(entry), ZEND_STRL("expiration"))) != NULL) {
+			item->expiration = (time_t) zval_get_long(zv);
+		}
+
+		s_local_cache_delete(intern, item->key);
+		s_negative_cache_delete(intern, item->key);
+
+		zv = zend_hash_str_find(Z_ARRVAL_P(entry), ZEND_STRL("value"));
+		ZVAL_DEREF(zv);
+		item->payload = s_zval_to_payload(intern, item->key, zv, &item->flags);
+		item->status  = item->payload ? MEMCACHED_SUCCESS : MEMC_RES_PAYLOAD_FAILURE;
+
+		/* A token names one item, it cannot stand for the manifest and the chunks set() would write */
+		if (item->payload && s_chunked_wanted(intern, MEMC_OP_SET, item->key, item->payload)) {
+			php_error_docref(NULL, E_WARNING, "value of key '%s' is longer than OPT_CHUNK_SIZE and cannot be written with a cas token", ZSTR_VAL(item->key));
+			zend_string_release(item->payload);
+			item->payload = NULL;
+			item->status  = MEMCACHED_E2BIG;
+		}
+	} ZEND_HASH_FOREACH_END();
+
+	/* Each reply tells stored, changed by someone else and missing apart */
+	s_batch_run(intern, NULL, items, count);
+
+	array_init(return_value);
+	for (i = 0; i < count; i++) {
+		if (s_memcached_return_is_error(items[i].status, 1)) {
+			ZVAL_LONG(&ret, items[i].status);
+			status = items[i].status;
+		} else {
+			ZVAL_TRUE(&ret);
+		}
+		zend_symtable_update(Z_ARRVAL_P(return_value), items[i].key, &ret);
+
+		zend_string_release(items[i].key);
+		if (items[i].payload) {
+			zend_string_release(items[i].payload);
+		}
+	}
+	s_arena_release(&intern->arena, mark);
+
+	s_memc_status_handle_result_code(intern, status);
+}
+/* }}} */
+
 /* {{{ Memcached::delete(string key [, int time ])
    Deletes the given key */
 PHP_METHOD(Memcached, delete)
@@ -2100,6 +6307,13 @@ static void php_memc_delete_impl(INTERNAL_FUNCTION_PARAMETERS, zend_bool by_key)
 	s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
 	MEMC_CHECK_KEY(intern, key);
 
+	s_local_cache_delete(intern, key);
+
+	if (s_write_behind_enabled(intern)) {
+		s_write_queue_push(intern, MEMC_QUEUED_DELETE, by_key ? server_key : NULL, key, NULL, 0, expiration);
+		RETURN_TRUE;
+	}
+
 	if (by_key) {
 		status = memcached_delete_by_key(intern->memc, ZSTR_VAL(server_key), ZSTR_LEN(server_key), ZSTR_VAL(key),
 									 ZSTR_LEN(key), expiration);
@@ -2122,8 +6336,9 @@ static void php_memc_deleteMulti_impl(INTERNAL_FUNCTION_PARAMETERS, zend_bool by
 	zend_string *server_key = NULL;
 	time_t expiration = 0;
 	zend_string *entry;
-
-	memcached_return status;
+	php_memc_batch_item_t *items = NULL;
+	php_memc_arena_mark_t mark;
+	size_t i, count = 0;
 	MEMC_METHOD_INIT_VARS;
 
 	if (by_key) {
@@ -2139,7 +6354,11 @@ static void php_memc_deleteMulti_impl(INTERNAL_FUNCTION_PARAMETERS, zend_bool by
 	MEMC_METHOD_FETCH_OBJECT;
 	s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
 
-	array_init(return_value);
+	mark = s_arena_mark(&intern->arena);
+	if (zend_hash_num_elements(Z_ARRVAL_P(entries))) {
+		items = s_arena_calloc(&intern->arena, zend_hash_num_elements(Z_ARRVAL_P(entries)), sizeof(php_memc_batch_item_t));
+	}
+
 	ZEND_HASH_FOREACH_VAL (Z_ARRVAL_P(entries), zv) {
 		entry = zval_get_string(zv);
 
@@ -2148,20 +6367,36 @@ static void php_memc_deleteMulti_impl(INTERNAL_FUNCTION_PARAMETERS, zend_bool by
 			continue;
 		}
 
-		if (by_key) {
-			status = memcached_delete_by_key(intern->memc, ZSTR_VAL(server_key), ZSTR_LEN(server_key), ZSTR_VAL(entry), ZSTR_LEN(entry), expiration);
-		} else {
-			status = memcached_delete_by_key(intern->memc, ZSTR_VAL(entry), ZSTR_LEN(entry), ZSTR_VAL(entry), ZSTR_LEN(entry), expiration);
+		s_local_cache_delete(intern, entry);
+
+		items[count].cmd        = MEMC_BATCH_DELETE;
+		items[count].key        = entry;
+		items[count].expiration = expiration;
+		items[count].status     = MEMCACHED_SUCCESS;
+		count++;
+	} ZEND_HASH_FOREACH_END();
+
+	if (s_write_behind_enabled(intern)) {
+		for (i = 0; i < count; i++) {
+			s_write_queue_push(intern, MEMC_QUEUED_DELETE, server_key, items[i].key, NULL, 0, expiration);
 		}
+		goto done;
+	}
+
+	s_batch_run(intern, server_key, items, count);
 
-		if (s_memc_status_handle_result_code(intern, status) == FAILURE) {
-			ZVAL_LONG(&ret, status);
+done:
+	array_init(return_value);
+	for (i = 0; i < count; i++) {
+		if (s_memc_status_handle_result_code(intern, items[i].status) == FAILURE) {
+			ZVAL_LONG(&ret, items[i].status);
 		} else {
 			ZVAL_TRUE(&ret);
 		}
-		zend_symtable_update(Z_ARRVAL_P(return_value), entry, &ret);
-		zend_string_release(entry);
-	} ZEND_HASH_FOREACH_END();
+		zend_symtable_update(Z_ARRVAL_P(return_value), items[i].key, &ret);
+		zend_string_release(items[i].key);
+	}
+	s_arena_release(&intern->arena, mark);
 
 	return;
 }
@@ -2198,6 +6433,10 @@ static void php_memc_incdec_impl(INTERNAL_FUNCTION_PARAMETERS, zend_bool by_key,
 		RETURN_FALSE;
 	}
 
+	s_local_cache_delete(intern, key);
+	s_negative_cache_delete(intern, key);
+	s_write_queue_flush(intern);
+
 	if ((!by_key && n_args < 3) || (by_key && n_args < 4)) {
 		if (by_key) {
 			if (incr) {
@@ -2239,52 +6478,269 @@ retry_inc_dec:
 				status = memcached_decrement_with_initial(intern->memc, ZSTR_VAL(key), ZSTR_LEN(key), offset, initial, expiry, &value);
 			}
 		}
-		if (s_should_retry_write(intern, status) && retries-- > 0) {
-			goto retry_inc_dec;
+		if (s_should_retry_write(intern, status) && retries-- > 0) {
+			goto retry_inc_dec;
+		}
+	}
+
+	if (s_memc_status_handle_result_code(intern, status) == FAILURE) {
+		RETURN_FALSE;
+	}
+
+	if (value == UINT64_MAX) {
+		RETURN_FALSE;
+	}
+
+	RETURN_LONG((long)value);
+}
+/* }}} */
+
+/* {{{ Memcached::increment(string key [, int delta [, initial_value [, expiry time ] ] ])
+   Increments the value for the given key by delta, defaulting to 1 */
+PHP_METHOD(Memcached, increment)
+{
+	php_memc_incdec_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 0, 1);
+}
+/* }}} */
+
+/* {{{ Memcached::decrement(string key [, int delta [, initial_value [, expiry time ] ] ])
+   Decrements the value for the given key by delta, defaulting to 1 */
+PHP_METHOD(Memcached, decrement)
+{
+	php_memc_incdec_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 0, 0);
+}
+/* }}} */
+
+/* {{{ Memcached::decrementByKey(string server_key, string key [, int delta [, initial_value [, expiry time ] ] ])
+   Decrements by server the value for the given key by delta, defaulting to 1 */
+PHP_METHOD(Memcached, decrementByKey)
+{
+	php_memc_incdec_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1, 0);
+}
+/* }}} */
+
+/* {{{ Memcached::incrementByKey(string server_key, string key [, int delta [, initial_value [, expiry time ] ] ])
+   Increments by server the value for the given key by delta, defaulting to 1 */
+PHP_METHOD(Memcached, incrementByKey)
+{
+	php_memc_incdec_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1, 1);
+}
+/* }}} */
+
+/* Blocking increment/decrement of one key, creating it with the initial value if it is missing */
+static
+memcached_return s_batch_incdec_item_with_initial(php_memc_object_t *intern, php_memc_batch_item_t *item, uint64_t initial, time_t expiry)
+{
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+	zend_long retries = memc_user_data->store_retry_count;
+	memcached_return status;
+
+	do {
+		if (item->cmd == MEMC_BATCH_INCR) {
+			status = memcached_increment_with_initial(intern->memc, ZSTR_VAL(item->key), ZSTR_LEN(item->key), item->delta, initial, expiry, &item->value);
+		} else {
+			status = memcached_decrement_with_initial(intern->memc, ZSTR_VAL(item->key), ZSTR_LEN(item->key), item->delta, initial, expiry, &item->value);
+		}
+	} while (s_should_retry_write(intern, status) && retries-- > 0);
+
+	return status;
+}
+
+/*
+ * Increments or decrements every item by its delta, filling in the item status from
+ * the reply and the new value. With initials, missing counters are created with those
+ * values: by the server over the binary protocol, with add over the ASCII protocol.
+ */
+static
+void s_batch_incdec(php_memc_object_t *intern, php_memc_batch_item_t *items, size_t count, const uint64_t *initials, time_t expiry)
+{
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+	zend_long retries = memc_user_data->store_retry_count;
+	php_memc_batch_item_t *missing;
+	php_memc_arena_mark_t mark;
+	size_t i, j, n, *positions;
+
+	if (initials && memcached_behavior_get(intern->memc, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL)) {
+		for (i = 0; i < count; i++) {
+			items[i].status = s_batch_incdec_item_with_initial(intern, &items[i], initials[i], expiry);
+		}
+		return;
+	}
+
+	s_batch_run(intern, NULL, items, count);
+	if (!initials) {
+		return;
+	}
+
+	mark      = s_arena_mark(&intern->arena);
+	missing   = s_arena_alloc(&intern->arena, count * sizeof(php_memc_batch_item_t));
+	positions = s_arena_alloc(&intern->arena, count * sizeof(size_t));
+
+	do {
+		for (i = 0, n = 0; i < count; i++) {
+			char number[32];
+			int number_len;
+
+			if (items[i].status != MEMCACHED_NOTFOUND) {
+				continue;
+			}
+			number_len = snprintf(number, sizeof(number), "%llu", (unsigned long long) initials[i]);
+
+			missing[n]            = items[i];
+			missing[n].cmd        = MEMC_BATCH_ADD;
+			missing[n].payload    = zend_string_init(number, number_len, 0);
+			missing[n].flags      = 0;
+			missing[n].expiration = expiry;
+			missing[n].status     = MEMCACHED_SUCCESS;
+			positions[n++]        = i;
+		}
+		if (!n) {
+			break;
+		}
+		s_batch_run(intern, NULL, missing, n);
+
+		/* Someone else created the counter in between, increment that one */
+		for (i = 0, j = 0; i < n; i++) {
+			php_memc_batch_item_t *item = &items[positions[i]];
+
+			zend_string_release(missing[i].payload);
+			if (missing[i].status == MEMCACHED_SUCCESS) {
+				item->status = MEMCACHED_SUCCESS;
+				item->value  = initials[positions[i]];
+			}
+			else if (missing[i].status == MEMCACHED_NOTSTORED) {
+				missing[j]        = *item;
+				missing[j].status = MEMCACHED_SUCCESS;
+				positions[j]      = positions[i];
+				j++;
+			}
+			else {
+				item->status = missing[i].status;
+			}
+		}
+		if (!j) {
+			break;
+		}
+		s_batch_run(intern, NULL, missing, j);
+
+		for (i = 0; i < j; i++) {
+			items[positions[i]].status = missing[i].status;
+			items[positions[i]].value  = missing[i].value;
+		}
+	} while (retries-- > 0);
+
+	s_arena_release(&intern->arena, mark);
+}
+
+/* {{{ -- php_memc_incdecMulti_impl */
+static void php_memc_incdecMulti_impl(INTERNAL_FUNCTION_PARAMETERS, zend_bool incr)
+{
+	zval *entries, *delta;
+	zend_string *skey;
+	zend_ulong num_key;
+	zend_long initial = 0;
+	time_t expiry = 0;
+	php_memc_batch_item_t *items = NULL;
+	uint64_t *initials = NULL;
+	php_memc_arena_mark_t mark;
+	memcached_return status = MEMCACHED_SUCCESS;
+	size_t i, count = 0;
+	zend_bool with_initial;
+	MEMC_METHOD_INIT_VARS;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "a|ll", &entries, &initial, &expiry) == FAILURE) {
+		return;
+	}
+	with_initial = (ZEND_NUM_ARGS() >= 2);
+
+	MEMC_METHOD_FETCH_OBJECT;
+	s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
+
+	ZEND_HASH_FOREACH_VAL (Z_ARRVAL_P(entries), delta) {
+		if (zval_get_long(delta) < 0) {
+			php_error_docref(NULL, E_WARNING, "offset cannot be a negative value");
+			RETURN_FALSE;
+		}
+	} ZEND_HASH_FOREACH_END();
+
+	mark = s_arena_mark(&intern->arena);
+	if (zend_hash_num_elements(Z_ARRVAL_P(entries))) {
+		items = s_arena_calloc(&intern->arena, zend_hash_num_elements(Z_ARRVAL_P(entries)), sizeof(php_memc_batch_item_t));
+		if (with_initial) {
+			initials = s_arena_alloc(&intern->arena, zend_hash_num_elements(Z_ARRVAL_P(entries)) * sizeof(uint64_t));
 		}
 	}
 
-	if (s_memc_status_handle_result_code(intern, status) == FAILURE) {
-		RETURN_FALSE;
-	}
+	ZEND_HASH_FOREACH_KEY_VAL (Z_ARRVAL_P(entries), num_key, skey, delta) {
+		items[count].cmd    = incr ? MEMC_BATCH_INCR : MEMC_BATCH_DECR;
+		items[count].key    = s_batch_item_key(skey, num_key);
+		items[count].delta  = (uint64_t) zval_get_long(delta);
+		items[count].value  = UINT64_MAX;
+		items[count].status = MEMCACHED_SUCCESS;
+		if (initials) {
+			initials[count] = (uint64_t) initial;
+		}
 
-	if (value == UINT64_MAX) {
-		RETURN_FALSE;
+		s_local_cache_delete(intern, items[count].key);
+		s_negative_cache_delete(intern, items[count].key);
+		count++;
+	} ZEND_HASH_FOREACH_END();
+
+	s_batch_incdec(intern, items, count, initials, expiry);
+
+	array_init(return_value);
+	for (i = 0; i < count; i++) {
+		zval ret;
+
+		if (s_memcached_return_is_error(items[i].status, 1) || items[i].value == UINT64_MAX) {
+			ZVAL_FALSE(&ret);
+			status = items[i].status;
+		} else {
+			ZVAL_LONG(&ret, (zend_long) items[i].value);
+		}
+		zend_symtable_update(Z_ARRVAL_P(return_value), items[i].key, &ret);
+		zend_string_release(items[i].key);
 	}
+	s_arena_release(&intern->arena, mark);
 
-	RETURN_LONG((long)value);
+	s_memc_status_handle_result_code(intern, status);
 }
 /* }}} */
 
-/* {{{ Memcached::increment(string key [, int delta [, initial_value [, expiry time ] ] ])
-   Increments the value for the given key by delta, defaulting to 1 */
-PHP_METHOD(Memcached, increment)
+/* {{{ Memcached::incrementMulti(array keys_to_deltas [, initial_value [, expiry time ] ])
+   Increments the values for the given keys by their deltas and returns the new values */
+PHP_METHOD(Memcached, incrementMulti)
 {
-	php_memc_incdec_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 0, 1);
+	php_memc_incdecMulti_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1);
 }
 /* }}} */
 
-/* {{{ Memcached::decrement(string key [, int delta [, initial_value [, expiry time ] ] ])
-   Decrements the value for the given key by delta, defaulting to 1 */
-PHP_METHOD(Memcached, decrement)
+/* {{{ Memcached::decrementMulti(array keys_to_deltas [, initial_value [, expiry time ] ])
+   Decrements the values for the given keys by their deltas and returns the new values */
+PHP_METHOD(Memcached, decrementMulti)
 {
-	php_memc_incdec_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 0, 0);
+	php_memc_incdecMulti_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 0);
 }
 /* }}} */
 
-/* {{{ Memcached::decrementByKey(string server_key, string key [, int delta [, initial_value [, expiry time ] ] ])
-   Decrements by server the value for the given key by delta, defaulting to 1 */
-PHP_METHOD(Memcached, decrementByKey)
+/* {{{ Memcached::bufferIncrement(string key [, int delta ])
+   Adds delta to the total buffered for the key, sent later as a single increment */
+PHP_METHOD(Memcached, bufferIncrement)
 {
-	php_memc_incdec_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1, 0);
-}
-/* }}} */
+	zend_string *key;
+	zend_long delta = 1;
+	MEMC_METHOD_INIT_VARS;
 
-/* {{{ Memcached::increment(string server_key, string key [, int delta [, initial_value [, expiry time ] ] ])
-   Increments by server the value for the given key by delta, defaulting to 1 */
-PHP_METHOD(Memcached, incrementByKey)
-{
-	php_memc_incdec_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1, 1);
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "S|l", &key, &delta) == FAILURE) {
+		return;
+	}
+
+	MEMC_METHOD_FETCH_OBJECT;
+	s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
+	MEMC_CHECK_KEY(intern, key);
+
+	s_counter_buffer_add(intern, key, delta);
+	RETURN_TRUE;
 }
 /* }}} */
 
@@ -2305,6 +6761,7 @@ PHP_METHOD(Memcached, addServer)
 	s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
 
 	status = memcached_server_add_with_weight(intern->memc, ZSTR_VAL(host), port, weight);
+	s_hedge_reset(memcached_get_user_data(intern->memc));
 
 	if (s_memc_status_handle_result_code(intern, status) == FAILURE) {
 		RETURN_FALSE;
@@ -2395,6 +6852,7 @@ PHP_METHOD(Memcached, addServers)
 
 	status = memcached_server_push(intern->memc, list);
 	memcached_server_list_free(list);
+	s_hedge_reset(memcached_get_user_data(intern->memc));
 	if (s_memc_status_handle_result_code(intern, status) == FAILURE) {
 		RETURN_FALSE;
 	}
@@ -2414,7 +6872,7 @@ PHP_METHOD(Memcached, getServerList)
 		return;
 	}
 
-	MEMC_METHOD_FETCH_OBJECT;
+	MEMC_METHOD_FETCH_LOCAL_OBJECT;
 
 	callbacks[0] = s_server_cursor_list_servers_cb;
 	array_init(return_value);
@@ -2435,7 +6893,7 @@ PHP_METHOD(Memcached, getServerByKey)
 		return;
 	}
 
-	MEMC_METHOD_FETCH_OBJECT;
+	MEMC_METHOD_FETCH_LOCAL_OBJECT;
 	s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
 
 	server_instance = memcached_server_by_key(intern->memc, ZSTR_VAL(server_key), ZSTR_LEN(server_key), &error);
@@ -2464,6 +6922,9 @@ PHP_METHOD(Memcached, resetServerList)
 	MEMC_METHOD_FETCH_OBJECT;
 
 	memcached_servers_reset(intern->memc);
+	s_local_cache_clear(memc_user_data);
+	s_negative_cache_clear(memc_user_data);
+	s_hedge_reset(memc_user_data);
 	RETURN_TRUE;
 }
 /* }}} */
@@ -2481,6 +6942,7 @@ PHP_METHOD(Memcached, quit)
 	MEMC_METHOD_FETCH_OBJECT;
 
 	memcached_quit(intern->memc);
+	s_hedge_reset(memcached_get_user_data(intern->memc));
 	RETURN_TRUE;
 }
 /* }}} */
@@ -2496,6 +6958,8 @@ PHP_METHOD(Memcached, flushBuffers)
 	}
 
 	MEMC_METHOD_FETCH_OBJECT;
+	s_write_queue_flush(intern);
+	s_counter_buffer_flush(intern);
 	RETURN_BOOL(memcached_flush_buffers(intern->memc) == MEMCACHED_SUCCESS);
 }
 /* }}} */
@@ -2510,7 +6974,7 @@ PHP_METHOD(Memcached, getLastErrorMessage)
 		return;
 	}
 
-	MEMC_METHOD_FETCH_OBJECT;
+	MEMC_METHOD_FETCH_LOCAL_OBJECT;
 
 	RETURN_STRING(memcached_last_error_message(intern->memc));
 }
@@ -2526,7 +6990,7 @@ PHP_METHOD(Memcached, getLastErrorCode)
 		return;
 	}
 
-	MEMC_METHOD_FETCH_OBJECT;
+	MEMC_METHOD_FETCH_LOCAL_OBJECT;
 
 	RETURN_LONG(memcached_last_error(intern->memc));
 }
@@ -2542,7 +7006,7 @@ PHP_METHOD(Memcached, getLastErrorErrno)
 		return;
 	}
 
-	MEMC_METHOD_FETCH_OBJECT;
+	MEMC_METHOD_FETCH_LOCAL_OBJECT;
 
 	RETURN_LONG(memcached_last_error_errno(intern->memc));
 }
@@ -2560,7 +7024,7 @@ PHP_METHOD(Memcached, getLastDisconnectedServer)
 		return;
 	}
 
-	MEMC_METHOD_FETCH_OBJECT;
+	MEMC_METHOD_FETCH_LOCAL_OBJECT;
 
 	server_instance = memcached_server_get_last_disconnect(intern->memc);
 	if (server_instance == NULL) {
@@ -2669,6 +7133,134 @@ PHP_METHOD(Memcached, getStats)
 }
 /* }}} */
 
+/* {{{ Memcached::getHotKeys([int n = 10])
+   Returns the most accessed keys seen by this client with estimated access counts and bytes */
+PHP_METHOD(Memcached, getHotKeys)
+{
+	zend_long n = 10;
+	php_memc_hot_key_t *sorted;
+	uint32_t i;
+	zend_long rate;
+	MEMC_METHOD_INIT_VARS;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "|l", &n) == FAILURE) {
+		return;
+	}
+
+	MEMC_METHOD_FETCH_LOCAL_OBJECT;
+
+	array_init(return_value);
+
+	if (n <= 0 || !memc_user_data->hot_keys.used) {
+		return;
+	}
+
+	/* Counts are sampled, scale them back up */
+	rate = MAX(memc_user_data->hot_keys.sample_rate, 1);
+
+	sorted = safe_emalloc(memc_user_data->hot_keys.used, sizeof(php_memc_hot_key_t), 0);
+	memcpy(sorted, memc_user_data->hot_keys.slots, memc_user_data->hot_keys.used * sizeof(php_memc_hot_key_t));
+	qsort(sorted, memc_user_data->hot_keys.used, sizeof(php_memc_hot_key_t), s_hot_keys_compare);
+
+	for (i = 0; i < memc_user_data->hot_keys.used && i < (zend_ulong) n; i++) {
+		zval entry;
+
+		array_init(&entry);
+		add_assoc_long(&entry, "count", sorted[i].count * rate);
+		add_assoc_long(&entry, "bytes", sorted[i].bytes * rate);
+		add_assoc_long(&entry, "error", sorted[i].error * rate);
+
+		add_assoc_zval_ex(return_value, ZSTR_VAL(sorted[i].key), ZSTR_LEN(sorted[i].key), &entry);
+	}
+	efree(sorted);
+}
+/* }}} */
+
+/* {{{ Memcached::getClientStats()
+   Returns statistics collected by this client instance */
+PHP_METHOD(Memcached, getClientStats)
+{
+	zval local_cache, negative_cache, lease, write_behind, counter_buffer, hedge, compression, codec_output, decode, codec_pool, arena;
+	MEMC_METHOD_INIT_VARS;
+
+	if (zend_parse_parameters_none() == FAILURE) {
+		return;
+	}
+
+	MEMC_METHOD_FETCH_LOCAL_OBJECT;
+
+	array_init(return_value);
+
+	array_init(&local_cache);
+	add_assoc_long(&local_cache, "hits",      memc_user_data->local_cache.hits);
+	add_assoc_long(&local_cache, "misses",    memc_user_data->local_cache.misses);
+	add_assoc_long(&local_cache, "evictions", memc_user_data->local_cache.evictions);
+	add_assoc_long(&local_cache, "entries",   memc_user_data->local_cache.entries ? zend_hash_num_elements(memc_user_data->local_cache.entries) : 0);
+	add_assoc_zval(return_value, "local_cache", &local_cache);
+
+	array_init(&negative_cache);
+	add_assoc_long(&negative_cache, "hits",    memc_user_data->negative_cache.hits);
+	add_assoc_long(&negative_cache, "entries", memc_user_data->negative_cache.entries ? zend_hash_num_elements(memc_user_data->negative_cache.entries) : 0);
+	add_assoc_zval(return_value, "negative_cache", &negative_cache);
+
+	array_init(&lease);
+	add_assoc_long(&lease, "granted", memc_user_data->lease.granted);
+	add_assoc_long(&lease, "stale",   memc_user_data->lease.stale);
+	add_assoc_long(&lease, "waited",  memc_user_data->lease.waited);
+	add_assoc_long(&lease, "expired", memc_user_data->lease.expired);
+	add_assoc_zval(return_value, "lease", &lease);
+
+	array_init(&write_behind);
+	add_assoc_long(&write_behind, "queued",  memc_user_data->write_behind.queued);
+	add_assoc_long(&write_behind, "flushed", memc_user_data->write_behind.flushed);
+	add_assoc_long(&write_behind, "failed",  memc_user_data->write_behind.failed);
+	add_assoc_long(&write_behind, "dropped", memc_user_data->write_behind.dropped);
+	add_assoc_long(&write_behind, "pending", (zend_long) intern->write_queue.count);
+	add_assoc_zval(return_value, "write_behind", &write_behind);
+
+	array_init(&counter_buffer);
+	add_assoc_long(&counter_buffer, "buffered", memc_user_data->counter_buffer.buffered);
+	add_assoc_long(&counter_buffer, "flushed",  memc_user_data->counter_buffer.flushed);
+	add_assoc_long(&counter_buffer, "failed",   memc_user_data->counter_buffer.failed);
+	add_assoc_long(&counter_buffer, "pending",  intern->counters.deltas ? zend_hash_num_elements(intern->counters.deltas) : 0);
+	add_assoc_zval(return_value, "counter_buffer", &counter_buffer);
+
+	array_init(&hedge);
+	add_assoc_long(&hedge, "reads",  memc_user_data->hedge.reads);
+	add_assoc_long(&hedge, "hedged", memc_user_data->hedge.hedged);
+	add_assoc_long(&hedge, "wins",   memc_user_data->hedge.wins);
+	add_assoc_long(&hedge, "keys",   memc_user_data->hedge.keys);
+	add_assoc_long(&hedge, "delay",  memc_user_data->hedge.delay > 0 ? s_hedge_delay(memc_user_data) : 0);
+	add_assoc_zval(return_value, "hedge", &hedge);
+
+	array_init(&compression);
+	add_assoc_long(&compression, "attempted",  memc_user_data->compression.attempted);
+	add_assoc_long(&compression, "successful", memc_user_data->compression.successful);
+	add_assoc_long(&compression, "skipped",    memc_user_data->compression.skipped);
+	add_assoc_zval(return_value, "compression", &compression);
+
+	array_init(&codec_output);
+	add_assoc_long(&codec_output, "allocations", memc_user_data->codec_output.allocations);
+	add_assoc_long(&codec_output, "bytes",       memc_user_data->codec_output.bytes);
+	add_assoc_zval(return_value, "codec_output", &codec_output);
+
+	array_init(&decode);
+	add_assoc_long(&decode, "copied", memc_user_data->decode.copied);
+	add_assoc_zval(return_value, "decode", &decode);
+
+	array_init(&codec_pool);
+	add_assoc_long(&codec_pool, "batches", memc_user_data->codec_pool.batches);
+	add_assoc_long(&codec_pool, "values",  memc_user_data->codec_pool.values);
+	add_assoc_zval(return_value, "codec_pool", &codec_pool);
+
+	array_init(&arena);
+	add_assoc_long(&arena, "allocations", intern->arena.allocations);
+	add_assoc_long(&arena, "requests",    intern->arena.requests);
+	add_assoc_long(&arena, "size",        (zend_long) s_arena_size(&intern->arena));
+	add_assoc_zval(return_value, "arena", &arena);
+}
+/* }}} */
+
 /* {{{ Memcached::getVersion()
    Returns the version of each memcached server in the pool */
 PHP_METHOD(Memcached, getVersion)
@@ -2756,6 +7348,10 @@ static PHP_METHOD(Memcached, flush)
 	MEMC_METHOD_FETCH_OBJECT;
 	s_memc_set_status(intern, MEMCACHED_SUCCESS, 0);
 
+	s_local_cache_clear(memc_user_data);
+	s_negative_cache_clear(memc_user_data);
+	s_write_queue_flush(intern);
+
 	status = memcached_flush(intern->memc, delay);
 	if (s_memc_status_handle_result_code(intern, status) == FAILURE) {
 		RETURN_FALSE;
@@ -2778,15 +7374,37 @@ static PHP_METHOD(Memcached, getOption)
 		return;
 	}
 
-	MEMC_METHOD_FETCH_OBJECT;
+	MEMC_METHOD_FETCH_LOCAL_OBJECT;
 
 	switch (option) {
 		case MEMC_OPT_COMPRESSION_TYPE:
 			RETURN_LONG(memc_user_data->compression_type);
 
+		case MEMC_OPT_COMPRESSION_LEVEL:
+			RETURN_LONG(memc_user_data->compression_level);
+
+		case MEMC_OPT_COMPRESSION_DICTIONARIES:
+		{
+			uint32_t i;
+
+			array_init(return_value);
+			for (i = 0; i < memc_user_data->dictionaries.count; i++) {
+				php_memc_dictionary_t *dictionary = &memc_user_data->dictionaries.entries[i];
+				add_assoc_stringl_ex(return_value, ZSTR_VAL(dictionary->prefix), ZSTR_LEN(dictionary->prefix),
+				                     ZSTR_VAL(dictionary->file), ZSTR_LEN(dictionary->file));
+			}
+			return;
+		}
+
 		case MEMC_OPT_COMPRESSION:
 			RETURN_BOOL(memc_user_data->compression_enabled);
 
+		case MEMC_OPT_COMPRESSION_ADAPTIVE:
+			RETURN_BOOL(memc_user_data->compression.adaptive);
+
+		case MEMC_OPT_BINARY_NUMBERS:
+			RETURN_BOOL(memc_user_data->binary_numbers);
+
 		case MEMC_OPT_PREFIX_KEY:
 		{
 			memcached_return retval;
@@ -2812,6 +7430,70 @@ static PHP_METHOD(Memcached, getOption)
 			RETURN_LONG((long)memc_user_data->store_retry_count);
 			break;
 
+		case MEMC_OPT_LOCAL_CACHE_SIZE:
+			RETURN_LONG(memc_user_data->local_cache.size);
+			break;
+
+		case MEMC_OPT_LOCAL_CACHE_TTL:
+			RETURN_LONG(memc_user_data->local_cache.ttl);
+			break;
+
+		case MEMC_OPT_LEASE_TIME:
+			RETURN_LONG(memc_user_data->lease.time);
+			break;
+
+		case MEMC_OPT_LEASE_WAIT:
+			RETURN_LONG(memc_user_data->lease.wait);
+			break;
+
+		case MEMC_OPT_LEASE_STALE_TTL:
+			RETURN_LONG(memc_user_data->lease.stale_ttl);
+			break;
+
+		case MEMC_OPT_HOT_KEYS_SIZE:
+			RETURN_LONG(memc_user_data->hot_keys.size);
+			break;
+
+		case MEMC_OPT_NEGATIVE_CACHE_SIZE:
+			RETURN_LONG(memc_user_data->negative_cache.size);
+			break;
+
+		case MEMC_OPT_NEGATIVE_CACHE_TTL:
+			RETURN_LONG(memc_user_data->negative_cache.ttl);
+			break;
+
+		case MEMC_OPT_WRITE_BEHIND_SIZE:
+			RETURN_LONG(memc_user_data->write_behind.size);
+			break;
+
+		case MEMC_OPT_WRITE_BEHIND_AGE:
+			RETURN_LONG(memc_user_data->write_behind.age);
+			break;
+
+		case MEMC_OPT_COUNTER_BUFFER_SIZE:
+			RETURN_LONG(memc_user_data->counter_buffer.size);
+			break;
+
+		case MEMC_OPT_COUNTER_BUFFER_AGE:
+			RETURN_LONG(memc_user_data->counter_buffer.age);
+			break;
+
+		case MEMC_OPT_HEDGE_DELAY:
+			RETURN_LONG(memc_user_data->hedge.delay);
+			break;
+
+		case MEMC_OPT_HEDGE_PERCENTILE:
+			RETURN_LONG(memc_user_data->hedge.percentile);
+			break;
+
+		case MEMC_OPT_CHUNK_SIZE:
+			RETURN_LONG(memc_user_data->chunk_size);
+			break;
+
+		case MEMC_OPT_HOT_KEYS_SAMPLE_RATE:
+			RETURN_LONG(memc_user_data->hot_keys.sample_rate);
+			break;
+
 		case MEMCACHED_BEHAVIOR_SOCKET_SEND_SIZE:
 		case MEMCACHED_BEHAVIOR_SOCKET_RECV_SIZE:
 			if (memcached_server_count(intern->memc) == 0) {
@@ -2838,6 +7520,9 @@ int php_memc_set_option(php_memc_object_t *intern, long option, zval *value)
 	memcached_behavior flag;
 	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
 
+	/* The copy the replicas are read over takes the options when it is made again */
+	s_hedge_reset(memc_user_data);
+
 	switch (option) {
 		case MEMC_OPT_COMPRESSION:
 			memc_user_data->compression_enabled = zval_get_long(value) ? 1 : 0;
@@ -2846,6 +7531,12 @@ int php_memc_set_option(php_memc_object_t *intern, long option, zval *value)
 		case MEMC_OPT_COMPRESSION_TYPE:
 			lval = zval_get_long(value);
 			if (lval == COMPRESSION_TYPE_FASTLZ ||
+#ifdef HAVE_MEMCACHED_ZSTD
+				lval == COMPRESSION_TYPE_ZSTD ||
+#endif
+#ifdef HAVE_MEMCACHED_LZ4
+				lval == COMPRESSION_TYPE_LZ4 ||
+#endif
 				lval == COMPRESSION_TYPE_ZLIB) {
 				memc_user_data->compression_type = lval;
 			} else {
@@ -2855,6 +7546,34 @@ int php_memc_set_option(php_memc_object_t *intern, long option, zval *value)
 			}
 			break;
 
+		case MEMC_OPT_COMPRESSION_LEVEL:
+			lval = zval_get_long(value);
+
+			if (lval < 0 || lval > MEMC_COMPRESSION_LEVEL_MAX) {
+				intern->rescode = MEMCACHED_INVALID_ARGUMENTS;
+				php_error_docref(NULL, E_WARNING, "MEMC_OPT_COMPRESSION_LEVEL must be between 0 and %d", MEMC_COMPRESSION_LEVEL_MAX);
+				return 0;
+			}
+			memc_user_data->compression_level = lval;
+			break;
+
+		case MEMC_OPT_COMPRESSION_DICTIONARIES:
+			if (!s_dictionaries_set(intern, value)) {
+				intern->rescode = MEMCACHED_INVALID_ARGUMENTS;
+				return 0;
+			}
+			break;
+
+		case MEMC_OPT_COMPRESSION_ADAPTIVE:
+			memc_user_data->compression.adaptive = zval_get_long(value) ? 1 : 0;
+			memset(memc_user_data->compression.failures, 0, sizeof(memc_user_data->compression.failures));
+			memset(memc_user_data->compression.skips, 0, sizeof(memc_user_data->compression.skips));
+			break;
+
+		case MEMC_OPT_BINARY_NUMBERS:
+			memc_user_data->binary_numbers = zval_get_long(value) ? 1 : 0;
+			break;
+
 		case MEMC_OPT_PREFIX_KEY:
 		{
 			zend_string *str;
@@ -2872,6 +7591,10 @@ int php_memc_set_option(php_memc_object_t *intern, long option, zval *value)
 				return 0;
 			}
 			zend_string_release(str);
+
+			/* Cached values were stored under the old prefix */
+			s_local_cache_clear(memc_user_data);
+			s_negative_cache_clear(memc_user_data);
 		}
 			break;
 
@@ -2923,6 +7646,8 @@ int php_memc_set_option(php_memc_object_t *intern, long option, zval *value)
 			/* php serializer */
 			if (lval == SERIALIZER_PHP) {
 				memc_user_data->serializer = SERIALIZER_PHP;
+			} else if (lval == SERIALIZER_NATIVE) {
+				memc_user_data->serializer = SERIALIZER_NATIVE;
 			} else {
 				memc_user_data->serializer = SERIALIZER_PHP;
 				intern->rescode = MEMCACHED_INVALID_ARGUMENTS;
@@ -2949,7 +7674,178 @@ int php_memc_set_option(php_memc_object_t *intern, long option, zval *value)
 
 		case MEMC_OPT_STORE_RETRY_COUNT:
 			lval = zval_get_long(value);
-			memc_user_data->store_retry_count = lval;
+			memc_user_data->store_retry_count = lval;
+			break;
+
+		case MEMC_OPT_LOCAL_CACHE_SIZE:
+			lval = zval_get_long(value);
+
+			if (lval < 0) {
+				intern->rescode = MEMCACHED_INVALID_ARGUMENTS;
+				php_error_docref(NULL, E_WARNING, "MEMC_OPT_LOCAL_CACHE_SIZE must be >= 0");
+				return 0;
+			}
+			memc_user_data->local_cache.size = lval;
+			s_local_cache_clear(memc_user_data);
+			break;
+
+		case MEMC_OPT_LOCAL_CACHE_TTL:
+			lval = zval_get_long(value);
+
+			if (lval <= 0) {
+				intern->rescode = MEMCACHED_INVALID_ARGUMENTS;
+				php_error_docref(NULL, E_WARNING, "MEMC_OPT_LOCAL_CACHE_TTL must be > 0");
+				return 0;
+			}
+			memc_user_data->local_cache.ttl = lval;
+			break;
+
+		case MEMC_OPT_LEASE_TIME:
+		case MEMC_OPT_LEASE_WAIT:
+		case MEMC_OPT_LEASE_STALE_TTL:
+			lval = zval_get_long(value);
+
+			if (lval < 0) {
+				intern->rescode = MEMCACHED_INVALID_ARGUMENTS;
+				php_error_docref(NULL, E_WARNING, "lease options must be >= 0");
+				return 0;
+			}
+
+			if (option == MEMC_OPT_LEASE_TIME) {
+				memc_user_data->lease.time = lval;
+			} else if (option == MEMC_OPT_LEASE_WAIT) {
+				memc_user_data->lease.wait = lval;
+			} else {
+				memc_user_data->lease.stale_ttl = lval;
+			}
+			break;
+
+		case MEMC_OPT_HOT_KEYS_SIZE:
+			lval = zval_get_long(value);
+
+			if (lval < 0 || lval > MEMC_HOT_KEYS_MAX_SIZE) {
+				intern->rescode = MEMCACHED_INVALID_ARGUMENTS;
+				php_error_docref(NULL, E_WARNING, "MEMC_OPT_HOT_KEYS_SIZE must be between 0 and %d", MEMC_HOT_KEYS_MAX_SIZE);
+				return 0;
+			}
+			s_hot_keys_clear(memc_user_data);
+			memc_user_data->hot_keys.size = lval;
+			break;
+
+		case MEMC_OPT_HOT_KEYS_SAMPLE_RATE:
+			lval = zval_get_long(value);
+
+			if (lval < 1 || lval > UINT32_MAX) {
+				intern->rescode = MEMCACHED_INVALID_ARGUMENTS;
+				php_error_docref(NULL, E_WARNING, "MEMC_OPT_HOT_KEYS_SAMPLE_RATE must be > 0");
+				return 0;
+			}
+			memc_user_data->hot_keys.sample_rate = lval;
+			break;
+
+		case MEMC_OPT_NEGATIVE_CACHE_SIZE:
+			lval = zval_get_long(value);
+
+			if (lval < 0) {
+				intern->rescode = MEMCACHED_INVALID_ARGUMENTS;
+				php_error_docref(NULL, E_WARNING, "MEMC_OPT_NEGATIVE_CACHE_SIZE must be >= 0");
+				return 0;
+			}
+			memc_user_data->negative_cache.size = lval;
+			s_negative_cache_clear(memc_user_data);
+			break;
+
+		case MEMC_OPT_NEGATIVE_CACHE_TTL:
+			lval = zval_get_long(value);
+
+			if (lval <= 0) {
+				intern->rescode = MEMCACHED_INVALID_ARGUMENTS;
+				php_error_docref(NULL, E_WARNING, "MEMC_OPT_NEGATIVE_CACHE_TTL must be > 0");
+				return 0;
+			}
+			memc_user_data->negative_cache.ttl = lval;
+			break;
+
+		case MEMC_OPT_WRITE_BEHIND_SIZE:
+			lval = zval_get_long(value);
+
+			if (lval < 0) {
+				intern->rescode = MEMCACHED_INVALID_ARGUMENTS;
+				php_error_docref(NULL, E_WARNING, "MEMC_OPT_WRITE_BEHIND_SIZE must be >= 0");
+				return 0;
+			}
+			memc_user_data->write_behind.size = lval;
+			if (!lval) {
+				s_write_queue_flush(intern);
+			}
+			break;
+
+		case MEMC_OPT_WRITE_BEHIND_AGE:
+			lval = zval_get_long(value);
+
+			if (lval < 0) {
+				intern->rescode = MEMCACHED_INVALID_ARGUMENTS;
+				php_error_docref(NULL, E_WARNING, "MEMC_OPT_WRITE_BEHIND_AGE must be >= 0");
+				return 0;
+			}
+			memc_user_data->write_behind.age = lval;
+			break;
+
+		case MEMC_OPT_COUNTER_BUFFER_SIZE:
+			lval = zval_get_long(value);
+
+			if (lval < 0) {
+				intern->rescode = MEMCACHED_INVALID_ARGUMENTS;
+				php_error_docref(NULL, E_WARNING, "MEMC_OPT_COUNTER_BUFFER_SIZE must be >= 0");
+				return 0;
+			}
+			memc_user_data->counter_buffer.size = lval;
+			break;
+
+		case MEMC_OPT_COUNTER_BUFFER_AGE:
+			lval = zval_get_long(value);
+
+			if (lval < 0) {
+				intern->rescode = MEMCACHED_INVALID_ARGUMENTS;
+				php_error_docref(NULL, E_WARNING, "MEMC_OPT_COUNTER_BUFFER_AGE must be >= 0");
+				return 0;
+			}
+			memc_user_data->counter_buffer.age = lval;
+			break;
+
+		case MEMC_OPT_HEDGE_DELAY:
+			lval = zval_get_long(value);
+
+			if (lval < 0) {
+				intern->rescode = MEMCACHED_INVALID_ARGUMENTS;
+				php_error_docref(NULL, E_WARNING, "MEMC_OPT_HEDGE_DELAY must be >= 0");
+				return 0;
+			}
+			memc_user_data->hedge.delay = lval;
+			break;
+
+		case MEMC_OPT_HEDGE_PERCENTILE:
+			lval = zval_get_long(value);
+
+			if (lval < 0 || lval > 100) {
+				intern->rescode = MEMCACHED_INVALID_ARGUMENTS;
+				php_error_docref(NULL, E_WARNING, "MEMC_OPT_HEDGE_PERCENTILE must be between 0 and 100");
+				return 0;
+			}
+			memc_user_data->hedge.percentile = lval;
+			memc_user_data->hedge.observed   = 0;
+			memc_user_data->hedge.sampled    = 0;
+			break;
+
+		case MEMC_OPT_CHUNK_SIZE:
+			lval = zval_get_long(value);
+
+			if (lval != 0 && lval < MEMC_CHUNK_MIN_SIZE) {
+				intern->rescode = MEMCACHED_INVALID_ARGUMENTS;
+				php_error_docref(NULL, E_WARNING, "MEMC_OPT_CHUNK_SIZE must be 0 or at least %d", MEMC_CHUNK_MIN_SIZE);
+				return 0;
+			}
+			memc_user_data->chunk_size = lval;
 			break;
 
 		default:
@@ -3063,6 +7959,7 @@ PHP_METHOD(Memcached, setBucket)
 	}
 
 	rc = memcached_bucket_set (intern->memc, server_map, forward_map, (uint32_t) server_map_len, replicas);
+	s_hedge_reset(memcached_get_user_data(intern->memc));
 
 	if (s_memc_status_handle_result_code(intern, rc) == FAILURE) {
 		retval = 0;;
@@ -3153,6 +8050,7 @@ static PHP_METHOD(Memcached, setSaslAuthData)
 	}
 	memc_user_data->has_sasl_data = 1;
 	status = memcached_set_sasl_auth_data(intern->memc, ZSTR_VAL(user), ZSTR_VAL(pass));
+	s_hedge_reset(memc_user_data);
 
 	if (s_memc_status_handle_result_code(intern, status) == FAILURE) {
 		RETURN_FALSE;
@@ -3172,7 +8070,7 @@ static PHP_METHOD(Memcached, getResultCode)
 		return;
 	}
 
-	MEMC_METHOD_FETCH_OBJECT;
+	MEMC_METHOD_FETCH_LOCAL_OBJECT;
 
 	RETURN_LONG(intern->rescode);
 }
@@ -3188,7 +8086,7 @@ static PHP_METHOD(Memcached, getResultMessage)
 		return;
 	}
 
-	MEMC_METHOD_FETCH_OBJECT;
+	MEMC_METHOD_FETCH_LOCAL_OBJECT;
 
 	switch (intern->rescode) {
 		case MEMC_RES_PAYLOAD_FAILURE:
@@ -3222,7 +8120,7 @@ static PHP_METHOD(Memcached, isPersistent)
 		return;
 	}
 
-	MEMC_METHOD_FETCH_OBJECT;
+	MEMC_METHOD_FETCH_LOCAL_OBJECT;
 
 	RETURN_BOOL(memc_user_data->is_persistent);
 }
@@ -3238,7 +8136,7 @@ static PHP_METHOD(Memcached, isPristine)
 		return;
 	}
 
-	MEMC_METHOD_FETCH_OBJECT;
+	MEMC_METHOD_FETCH_LOCAL_OBJECT;
 
 	RETURN_BOOL(intern->is_pristine);
 }
@@ -3258,6 +8156,15 @@ void php_memc_destroy(memcached_st *memc, php_memc_user_data_t *memc_user_data)
 	}
 #endif
 
+	s_local_cache_clear(memc_user_data);
+	s_negative_cache_clear(memc_user_data);
+	s_hot_keys_clear(memc_user_data);
+	s_dictionaries_clear(memc_user_data);
+	s_codec_free(&memc_user_data->codec);
+	php_memc_pipeline_close(&memc_user_data->pipeline);
+	s_hedge_reset(memc_user_data);
+	php_memc_async_free(memc_user_data->hedge.async);
+
 	memcached_free(memc);
 	pefree(memc_user_data, memc_user_data->is_persistent);
 }
@@ -3270,12 +8177,26 @@ void php_memc_object_free_storage(zend_object *object)
 	if (intern->memc) {
 		php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
 
+		if (intern->iterator) {
+			s_iterator_end(intern, 1);
+		}
+		s_write_queue_flush(intern);
+		s_counter_buffer_flush(intern);
+
 		if (!memc_user_data->is_persistent) {
 			php_memc_destroy(intern->memc, memc_user_data);
 		}
 	}
 
 	intern->memc = NULL;
+	if (intern->write_queue.writes) {
+		efree(intern->write_queue.writes);
+	}
+	if (intern->counters.deltas) {
+		zend_hash_destroy(intern->counters.deltas);
+		FREE_HASHTABLE(intern->counters.deltas);
+	}
+	s_arena_free(&intern->arena);
 	zend_object_std_dtor(&intern->zo);
 }
 
@@ -3291,6 +8212,66 @@ zend_object *php_memc_object_new(zend_class_entry *ce)
 	return &intern->zo;
 }
 
+static
+void php_memc_iterator_free_storage(zend_object *object)
+{
+	php_memc_iterator_t *it = php_memc_iterator_fetch_object(object);
+
+	if (!Z_ISUNDEF(it->object) && Z_MEMC_OBJ_P(&it->object)->iterator == &it->zo) {
+		s_iterator_end(Z_MEMC_OBJ_P(&it->object), 1);
+	}
+	zval_ptr_dtor(&it->object);
+	zval_ptr_dtor(&it->key);
+	zval_ptr_dtor(&it->value);
+
+	zend_object_std_dtor(&it->zo);
+}
+
+static
+zend_object *php_memc_iterator_new(zend_class_entry *ce)
+{
+	php_memc_iterator_t *it = ecalloc(1, sizeof(php_memc_iterator_t) + zend_object_properties_size(ce));
+
+	zend_object_std_init(&it->zo, ce);
+	object_properties_init(&it->zo, ce);
+
+	ZVAL_UNDEF(&it->object);
+	ZVAL_UNDEF(&it->key);
+	ZVAL_UNDEF(&it->value);
+
+	it->zo.handlers = &memcached_iterator_object_handlers;
+	return &it->zo;
+}
+
+static
+void php_memc_lazy_value_free_storage(zend_object *object)
+{
+	php_memc_lazy_value_t *lazy = php_memc_lazy_value_fetch_object(object);
+
+	if (lazy->payload) {
+		zend_string_release(lazy->payload);
+	}
+	zval_ptr_dtor(&lazy->object);
+	zval_ptr_dtor(&lazy->value);
+
+	zend_object_std_dtor(&lazy->zo);
+}
+
+static
+zend_object *php_memc_lazy_value_new(zend_class_entry *ce)
+{
+	php_memc_lazy_value_t *lazy = ecalloc(1, sizeof(php_memc_lazy_value_t) + zend_object_properties_size(ce));
+
+	zend_object_std_init(&lazy->zo, ce);
+	object_properties_init(&lazy->zo, ce);
+
+	ZVAL_UNDEF(&lazy->object);
+	ZVAL_UNDEF(&lazy->value);
+
+	lazy->zo.handlers = &memcached_lazy_value_object_handlers;
+	return &lazy->zo;
+}
+
 #ifdef HAVE_MEMCACHED_PROTOCOL
 static
 void php_memc_server_free_storage(zend_object *object)
@@ -3374,45 +8355,77 @@ memcached_return s_server_cursor_version_cb(const memcached_st *ptr, php_memcach
 }
 
 
+/* Reads the original size and the codec off the payload and allocates the string it decompresses into */
 static
-zend_string *s_decompress_value (const char *payload, size_t payload_len, uint32_t flags)
+zend_bool s_decompress_prepare(php_memc_user_data_t *memc_user_data, const char *payload, size_t payload_len, uint32_t flags, php_memc_codec_job_t *job)
 {
-	zend_string *buffer;
-
 	uint32_t stored_length;
-	unsigned long length;
-	zend_bool decompress_status = 0;
-	zend_bool is_fastlz = 0, is_zlib = 0;
+
+	memset(job, 0, sizeof(*job));
 
 	if (payload_len < sizeof (uint32_t)) {
-		return NULL;
+		return 0;
 	}
 
-	is_fastlz = MEMC_VAL_HAS_FLAG(flags, MEMC_VAL_COMPRESSION_FASTLZ);
-	is_zlib   = MEMC_VAL_HAS_FLAG(flags, MEMC_VAL_COMPRESSION_ZLIB);
-
-	if (!is_fastlz && !is_zlib) {
+	if (MEMC_VAL_HAS_FLAG(flags, MEMC_VAL_COMPRESSION_FASTLZ)) {
+		job->codec = MEMC_VAL_COMPRESSION_FASTLZ;
+	}
+	else if (MEMC_VAL_HAS_FLAG(flags, MEMC_VAL_COMPRESSION_ZLIB)) {
+		job->codec = MEMC_VAL_COMPRESSION_ZLIB;
+	}
+#ifdef HAVE_MEMCACHED_ZSTD
+	else if (MEMC_VAL_HAS_FLAG(flags, MEMC_VAL_COMPRESSION_ZSTD)) {
+		job->codec = MEMC_VAL_COMPRESSION_ZSTD;
+	}
+#endif
+#ifdef HAVE_MEMCACHED_LZ4
+	else if (MEMC_VAL_HAS_FLAG(flags, MEMC_VAL_COMPRESSION_LZ4)) {
+		job->codec = MEMC_VAL_COMPRESSION_LZ4;
+	}
+#endif
+	else {
+		/* Values from a build with zstd or lz4 stay unreadable here */
 		php_error_docref(NULL, E_WARNING, "could not decompress value: unrecognised compression type");
-		return NULL;
+		return 0;
 	}
 
 	memcpy(&stored_length, payload, sizeof (uint32_t));
 
-	payload     += sizeof (uint32_t);
-	payload_len -= sizeof (uint32_t);
+	job->input     = payload + sizeof (uint32_t);
+	job->input_len = payload_len - sizeof (uint32_t);
 
-	buffer = zend_string_alloc (stored_length, 0);
+#ifdef HAVE_MEMCACHED_ZSTD
+	if (job->codec == MEMC_VAL_COMPRESSION_ZSTD) {
+		/* The frame header names the dictionary the value was compressed with, if any */
+		uint32_t dictionary_id = ZSTD_getDictID_fromFrame(job->input, job->input_len);
 
-	if (is_fastlz) {
-		decompress_status = ((length = fastlz_decompress(payload, payload_len, &buffer->val, buffer->len)) > 0);
+		if (dictionary_id && !(job->dictionary = s_dictionary_by_id(memc_user_data, dictionary_id))) {
+			php_error_docref(NULL, E_WARNING, "could not decompress value: zstd dictionary %u is not loaded", dictionary_id);
+			return 0;
+		}
 	}
-	else if (is_zlib) {
-		decompress_status = (uncompress((Bytef *) buffer->val, &buffer->len, (Bytef *)payload, payload_len) == Z_OK);
+#endif
+
+	/* The value is decompressed straight into the string handed back to the caller */
+	job->output = zend_string_alloc (stored_length, 0);
+	memc_user_data->codec_output.allocations++;
+	memc_user_data->codec_output.bytes += stored_length;
+	return 1;
+}
+
+static
+zend_string *s_decompress_finish(php_memc_codec_job_t *job)
+{
+	zend_string *buffer = job->output;
+
+	if (!buffer) {
+		return NULL;
 	}
+	job->output = NULL;
 
-	ZSTR_VAL(buffer)[stored_length] = '\0';
+	ZSTR_VAL(buffer)[ZSTR_LEN(buffer)] = '\0';
 
-	if (!decompress_status) {
+	if (!job->status) {
 		php_error_docref(NULL, E_WARNING, "could not decompress value");
 		zend_string_release (buffer);
 		return NULL;
@@ -3423,7 +8436,100 @@ zend_string *s_decompress_value (const char *payload, size_t payload_len, uint32
 }
 
 static
-zend_bool s_unserialize_value (memcached_st *memc, int val_type, zend_string *payload, zval *return_value)
+zend_string *s_decompress_value (php_memc_user_data_t *memc_user_data, const char *payload, size_t payload_len, uint32_t flags)
+{
+	php_memc_codec_job_t job;
+
+	if (!s_decompress_prepare(memc_user_data, payload, payload_len, flags, &job)) {
+		return NULL;
+	}
+
+	s_decompress_run(&memc_user_data->codec, &job);
+	return s_decompress_finish(&job);
+}
+
+static
+void s_deferred_add(php_memc_deferred_list_t *list, memcached_result_st *result)
+{
+	if (list->count == list->allocated) {
+		list->allocated = list->allocated ? list->allocated * 2 : 8;
+		list->results   = erealloc(list->results, list->allocated * sizeof(memcached_result_st *));
+	}
+
+	list->results[list->count++] = result;
+	list->bytes += memcached_result_length(result);
+}
+
+/* Decompresses the deferred values as one batch, then decodes and applies them in order */
+static
+memcached_return s_deferred_apply(php_memc_object_t *intern, php_memc_deferred_list_t *list, php_memc_result_apply_fn result_apply_fn, void *context, zend_bool *stopped)
+{
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(intern->memc);
+	php_memc_arena_mark_t mark = s_arena_mark(&intern->arena);
+	php_memc_codec_job_t *jobs = s_arena_calloc(&intern->arena, list->count, sizeof(php_memc_codec_job_t));
+	memcached_return status = MEMCACHED_SUCCESS;
+	size_t i;
+
+	for (i = 0; i < list->count; i++) {
+		s_decompress_prepare(memc_user_data, memcached_result_value(list->results[i]), memcached_result_length(list->results[i]), memcached_result_flags(list->results[i]), &jobs[i]);
+	}
+
+	s_codec_run(memc_user_data, jobs, list->count, list->bytes, 0);
+
+	for (i = 0; i < list->count; i++) {
+		memcached_result_st *result = list->results[i];
+		zend_string *key, *data;
+		zval val, zcas;
+
+		if (*stopped) {
+			/* Only the buffers are left to release */
+			if (jobs[i].output) {
+				zend_string_release(jobs[i].output);
+			}
+			continue;
+		}
+
+		data = s_decompress_finish(&jobs[i]);
+
+		if (!data || !s_memcached_decoded_to_zval(intern->memc, data, ZSTR_VAL(data), ZSTR_LEN(data), memcached_result_flags(result), &val)) {
+			if (EG(exception)) {
+				status = MEMC_RES_PAYLOAD_FAILURE;
+				*stopped = 1;
+			} else {
+				status = MEMCACHED_SOME_ERRORS;
+			}
+			continue;
+		}
+
+		s_uint64_to_zval(&zcas, memcached_result_cas(result));
+		key = zend_string_init(memcached_result_key_value(result), memcached_result_key_length(result), 0);
+
+		if (!result_apply_fn(intern, key, &val, &zcas, memcached_result_flags(result), context)) {
+			*stopped = 1;
+		}
+
+		zend_string_release(key);
+		zval_ptr_dtor(&val);
+		zval_ptr_dtor(&zcas);
+	}
+
+	s_arena_release(&intern->arena, mark);
+	return status;
+}
+
+static
+void s_deferred_list_free(php_memc_deferred_list_t *list)
+{
+	size_t i;
+
+	for (i = 0; i < list->count; i++) {
+		memcached_result_free(list->results[i]);
+	}
+	efree(list->results);
+}
+
+static
+zend_bool s_unserialize_value (memcached_st *memc, int val_type, const char *payload, size_t payload_len, zval *return_value)
 {
 	switch (val_type) {
 		case MEMC_VAL_IS_SERIALIZED:
@@ -3431,8 +8537,8 @@ zend_bool s_unserialize_value (memcached_st *memc, int val_type, zend_string *pa
 			php_unserialize_data_t var_hash;
 			const unsigned char *p, *max;
 
-			p   = (const unsigned char *) ZSTR_VAL(payload);
-			max = p + ZSTR_LEN(payload);
+			p   = (const unsigned char *) payload;
+			max = p + payload_len;
 
 			PHP_VAR_UNSERIALIZE_INIT(var_hash);
 			if (!php_var_unserialize(return_value, &p, max, &var_hash)) {
@@ -3448,7 +8554,7 @@ zend_bool s_unserialize_value (memcached_st *memc, int val_type, zend_string *pa
 
 		case MEMC_VAL_IS_IGBINARY:
 #ifdef HAVE_MEMCACHED_IGBINARY
-			if (igbinary_unserialize((uint8_t *) ZSTR_VAL(payload), ZSTR_LEN(payload), return_value)) {
+			if (igbinary_unserialize((uint8_t *) payload, payload_len, return_value)) {
 				ZVAL_FALSE(return_value);
 				php_error_docref(NULL, E_WARNING, "could not unserialize value with igbinary");
 				return 0;
@@ -3464,7 +8570,7 @@ zend_bool s_unserialize_value (memcached_st *memc, int val_type, zend_string *pa
 #ifdef HAVE_JSON_API
 		{
 			php_memc_user_data_t *memc_user_data = memcached_get_user_data(memc);
-			php_json_decode(return_value, ZSTR_VAL(payload), ZSTR_LEN(payload), (memc_user_data->serializer == SERIALIZER_JSON_ARRAY), PHP_JSON_PARSER_DEFAULT_DEPTH);
+			php_json_decode(return_value, (char *) payload, payload_len, (memc_user_data->serializer == SERIALIZER_JSON_ARRAY), PHP_JSON_PARSER_DEFAULT_DEPTH);
 		}
 #else
 			ZVAL_FALSE(return_value);
@@ -3475,88 +8581,181 @@ zend_bool s_unserialize_value (memcached_st *memc, int val_type, zend_string *pa
 
 		case MEMC_VAL_IS_MSGPACK:
 #ifdef HAVE_MEMCACHED_MSGPACK
-			php_msgpack_unserialize(return_value, ZSTR_VAL(payload), ZSTR_LEN(payload));
+			php_msgpack_unserialize(return_value, (char *) payload, payload_len);
 #else
 			ZVAL_FALSE(return_value);
 			php_error_docref(NULL, E_WARNING, "could not unserialize value, no msgpack support");
 			return 0;
 #endif
  			break;
+
+		case MEMC_VAL_IS_NATIVE:
+			if (!php_memc_native_unserialize(return_value, payload, payload_len)) {
+				php_error_docref(NULL, E_WARNING, "could not unserialize value with native serializer");
+				return 0;
+			}
+			break;
 	}
 	return 1;
 }
 
 static
-zend_bool s_memcached_result_to_zval(memcached_st *memc, memcached_result_st *result, zval *return_value)
+zend_bool s_memcached_payload_to_zval(memcached_st *memc, const char *payload, size_t payload_len, uint32_t flags, zval *return_value)
 {
-	zend_string *data;
-	const char *payload;
-	size_t payload_len;
-	uint32_t flags;
-	zend_bool retval = 1;
-
-	payload     = memcached_result_value(result);
-	payload_len = memcached_result_length(result);
-	flags       = memcached_result_flags(result);
+	zend_string *data = NULL;
 
 	if (!payload && payload_len > 0) {
 		php_error_docref(NULL, E_WARNING, "Could not handle non-existing value of length %zu", payload_len);
 		return 0;
 	}
 
+	/* Only a complete result set can be followed by the request for the chunks */
+	if (MEMC_VAL_HAS_FLAG(flags, MEMC_VAL_CHUNKED)) {
+		php_error_docref(NULL, E_WARNING, "chunked values cannot be read with fetch() or an iterator");
+		return 0;
+	}
+
+	/*
+	 * Values are decoded directly from the result buffer. Only compressed values
+	 * need a buffer of their own, which becomes the returned string.
+	 */
 	if (MEMC_VAL_HAS_FLAG(flags, MEMC_VAL_COMPRESSED)) {
-		data = s_decompress_value (payload, payload_len, flags);
+		data = s_decompress_value (memcached_get_user_data(memc), payload, payload_len, flags);
 		if (!data) {
 			return 0;
 		}
-	} else {
-		data = zend_string_init(payload, payload_len, 0);
+		payload     = ZSTR_VAL(data);
+		payload_len = ZSTR_LEN(data);
+	}
+
+	return s_memcached_decoded_to_zval(memc, data, payload, payload_len, flags, return_value);
+}
+
+/* Decodes a payload held in a string, which is shared with the value instead of being copied */
+static
+zend_bool s_memcached_string_to_zval(memcached_st *memc, zend_string *payload, uint32_t flags, zval *return_value)
+{
+	if (MEMC_VAL_HAS_FLAG(flags, MEMC_VAL_COMPRESSED) || MEMC_VAL_HAS_FLAG(flags, MEMC_VAL_CHUNKED)) {
+		return s_memcached_payload_to_zval(memc, ZSTR_VAL(payload), ZSTR_LEN(payload), flags, return_value);
 	}
+	return s_memcached_decoded_to_zval(memc, zend_string_copy(payload), ZSTR_VAL(payload), ZSTR_LEN(payload), flags, return_value);
+}
+
+/*
+ * Decodes a payload that is not, or no longer, compressed. data is the string the payload
+ * is in, if any, and is taken over: the decompressed payload or one shared with the caller.
+ */
+static
+zend_bool s_memcached_decoded_to_zval(memcached_st *memc, zend_string *data, const char *payload, size_t payload_len, uint32_t flags, zval *return_value)
+{
+	php_memc_user_data_t *memc_user_data = memcached_get_user_data(memc);
+	char number[64];
+	zend_bool retval = 1;
 
 	switch (MEMC_VAL_GET_TYPE(flags)) {
 
 		case MEMC_VAL_IS_STRING:
-			ZVAL_STR_COPY(return_value, data);
+			if (data) {
+				ZVAL_STR(return_value, data);
+				data = NULL;
+			} else {
+				ZVAL_STRINGL(return_value, payload ? payload : "", payload_len);
+				memc_user_data->decode.copied += payload_len;
+			}
 			break;
 
 		case MEMC_VAL_IS_LONG:
-			ZVAL_LONG(return_value, strtol(ZSTR_VAL(data), NULL, 10));
-			break;
-
 		case MEMC_VAL_IS_DOUBLE:
 		{
-			if (zend_string_equals_literal(data, "Infinity")) {
+			/* Numbers are short, terminate them on the stack instead of copying the payload */
+			size_t number_len = MIN(payload_len, sizeof(number) - 1);
+
+			memcpy(number, payload ? payload : "", number_len);
+			number[number_len] = '\0';
+
+			if (MEMC_VAL_GET_TYPE(flags) == MEMC_VAL_IS_LONG) {
+				ZVAL_LONG(return_value, strtol(number, NULL, 10));
+			}
+			else if (!strcmp(number, "Infinity")) {
 				ZVAL_DOUBLE(return_value, php_get_inf());
 			}
-			else if (zend_string_equals_literal(data, "-Infinity")) {
+			else if (!strcmp(number, "-Infinity")) {
 				ZVAL_DOUBLE(return_value, -php_get_inf());
 			}
-			else if (zend_string_equals_literal(data, "NaN")) {
+			else if (!strcmp(number, "NaN")) {
 				ZVAL_DOUBLE(return_value, php_get_nan());
 			}
 			else {
-				ZVAL_DOUBLE(return_value, zend_strtod(ZSTR_VAL(data), NULL));
+				ZVAL_DOUBLE(return_value, zend_strtod(number, NULL));
+			}
+		}
+			break;
+
+		case MEMC_VAL_IS_BINARY_LONG:
+		case MEMC_VAL_IS_BINARY_DOUBLE:
+		{
+			uint64_t bits;
+
+			if (payload_len != sizeof(uint64_t)) {
+				php_error_docref(NULL, E_WARNING, "invalid binary number of length %zu", payload_len);
+				retval = 0;
+				break;
+			}
+
+			bits = s_binary_number_decode(payload);
+
+			if (MEMC_VAL_GET_TYPE(flags) == MEMC_VAL_IS_BINARY_LONG) {
+				int64_t lval = (int64_t) bits;
+
+				/* Only possible when a 64-bit build wrote the value */
+				if (lval > ZEND_LONG_MAX || lval < ZEND_LONG_MIN) {
+					ZVAL_DOUBLE(return_value, (double) lval);
+				} else {
+					ZVAL_LONG(return_value, (zend_long) lval);
+				}
+			}
+			else {
+				double dval;
+
+				memcpy(&dval, &bits, sizeof(dval));
+				ZVAL_DOUBLE(return_value, dval);
 			}
 		}
 			break;
 
 		case MEMC_VAL_IS_BOOL:
-			ZVAL_BOOL(return_value, payload_len > 0 && ZSTR_VAL(data)[0] == '1');
+			ZVAL_BOOL(return_value, payload_len > 0 && payload[0] == '1');
 			break;
 
 		case MEMC_VAL_IS_SERIALIZED:
-		case MEMC_VAL_IS_IGBINARY:
 		case MEMC_VAL_IS_JSON:
+			/*
+			 * Both parsers read up to a terminating NUL, which the result buffers of libmemcached
+			 * are not guaranteed to have. Payloads that are not in a string of our own are copied.
+			 */
+			if (!data) {
+				data    = zend_string_init(payload ? payload : "", payload_len, 0);
+				payload = ZSTR_VAL(data);
+				memc_user_data->decode.copied += payload_len;
+			}
+			retval = s_unserialize_value (memc, MEMC_VAL_GET_TYPE(flags), payload, payload_len, return_value);
+			break;
+
+		case MEMC_VAL_IS_IGBINARY:
 		case MEMC_VAL_IS_MSGPACK:
-			retval = s_unserialize_value (memc, MEMC_VAL_GET_TYPE(flags), data, return_value);
+		case MEMC_VAL_IS_NATIVE:
+			/* These take the length and need no terminating NUL */
+			retval = s_unserialize_value (memc, MEMC_VAL_GET_TYPE(flags), payload, payload_len, return_value);
 			break;
 
 		default:
 			php_error_docref(NULL, E_WARNING, "unknown payload type");
 			break;
 	}
-	zend_string_release(data);
 
+	if (data) {
+		zend_string_release(data);
+	}
 	return retval;
 }
 
@@ -3694,12 +8893,14 @@ ZEND_END_ARG_INFO()
 ZEND_BEGIN_ARG_INFO_EX(arginfo_getMulti, 0, 0, 1)
 	ZEND_ARG_ARRAY_INFO(0, keys, 0)
 	ZEND_ARG_INFO(0, get_flags)
+	ZEND_ARG_INFO(0, cache_cb)
 ZEND_END_ARG_INFO()
 
 ZEND_BEGIN_ARG_INFO_EX(arginfo_getMultiByKey, 0, 0, 2)
 	ZEND_ARG_INFO(0, server_key)
 	ZEND_ARG_ARRAY_INFO(0, keys, 0)
 	ZEND_ARG_INFO(0, get_flags)
+	ZEND_ARG_INFO(0, cache_cb)
 ZEND_END_ARG_INFO()
 
 ZEND_BEGIN_ARG_INFO_EX(arginfo_getDelayed, 0, 0, 1)
@@ -3715,6 +8916,11 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_getDelayedByKey, 0, 0, 2)
 	ZEND_ARG_INFO(0, value_cb)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_getIterator, 0, 0, 1)
+	ZEND_ARG_ARRAY_INFO(0, keys, 0)
+	ZEND_ARG_INFO(0, get_flags)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO(arginfo_fetch, 0)
 ZEND_END_ARG_INFO()
 
@@ -3745,15 +8951,34 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_touchByKey, 0, 0, 3)
 	ZEND_ARG_INFO(0, expiration)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_touchMulti, 0, 0, 1)
+	ZEND_ARG_ARRAY_INFO(0, keys, 0)
+	ZEND_ARG_INFO(0, expiration)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_getAndTouch, 0, 0, 2)
+	ZEND_ARG_INFO(0, key)
+	ZEND_ARG_INFO(0, expiration)
+	ZEND_ARG_INFO(0, get_flags)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_getMultiAndTouch, 0, 0, 2)
+	ZEND_ARG_ARRAY_INFO(0, keys, 0)
+	ZEND_ARG_INFO(0, expiration)
+	ZEND_ARG_INFO(0, flags)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO_EX(arginfo_setMulti, 0, 0, 1)
 	ZEND_ARG_ARRAY_INFO(0, items, 0)
 	ZEND_ARG_INFO(0, expiration)
+	ZEND_ARG_INFO(0, flags)
 ZEND_END_ARG_INFO()
 
 ZEND_BEGIN_ARG_INFO_EX(arginfo_setMultiByKey, 0, 0, 2)
 	ZEND_ARG_INFO(0, server_key)
 	ZEND_ARG_ARRAY_INFO(0, items, 0)
 	ZEND_ARG_INFO(0, expiration)
+	ZEND_ARG_INFO(0, flags)
 ZEND_END_ARG_INFO()
 
 ZEND_BEGIN_ARG_INFO_EX(arginfo_add, 0, 0, 2)
@@ -3819,6 +9044,10 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_casByKey, 0, 0, 4)
 	ZEND_ARG_INFO(0, expiration)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_casMulti, 0, 0, 1)
+	ZEND_ARG_ARRAY_INFO(0, items, 0)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO_EX(arginfo_delete, 0, 0, 1)
 	ZEND_ARG_INFO(0, key)
 	ZEND_ARG_INFO(0, time)
@@ -3871,6 +9100,23 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_decrementByKey, 0, 0, 2)
 	ZEND_ARG_INFO(0, expiry)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_incrementMulti, 0, 0, 1)
+	ZEND_ARG_ARRAY_INFO(0, keys_to_deltas, 0)
+	ZEND_ARG_INFO(0, initial_value)
+	ZEND_ARG_INFO(0, expiry)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_decrementMulti, 0, 0, 1)
+	ZEND_ARG_ARRAY_INFO(0, keys_to_deltas, 0)
+	ZEND_ARG_INFO(0, initial_value)
+	ZEND_ARG_INFO(0, expiry)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_bufferIncrement, 0, 0, 1)
+	ZEND_ARG_INFO(0, key)
+	ZEND_ARG_INFO(0, delta)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO_EX(arginfo_flush, 0, 0, 0)
 	ZEND_ARG_INFO(0, delay)
 ZEND_END_ARG_INFO()
@@ -3885,6 +9131,13 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_getStats, 0, 0, 0)
 	ZEND_ARG_INFO(0, type)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO(arginfo_getClientStats, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_getHotKeys, 0, 0, 0)
+	ZEND_ARG_INFO(0, n)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO(arginfo_addServers, 0)
 	ZEND_ARG_ARRAY_INFO(0, servers, 0)
 ZEND_END_ARG_INFO()
@@ -3954,6 +9207,9 @@ ZEND_END_ARG_INFO()
 
 ZEND_BEGIN_ARG_INFO(arginfo_getAllKeys, 0)
 ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_iterator_none, 0)
+ZEND_END_ARG_INFO()
 /* }}} */
 
 /* {{{ memcached_class_methods */
@@ -3968,22 +9224,27 @@ static zend_function_entry memcached_class_methods[] = {
 	MEMC_ME(getByKey,           arginfo_getByKey)
 	MEMC_ME(getMulti,           arginfo_getMulti)
 	MEMC_ME(getMultiByKey,      arginfo_getMultiByKey)
+	MEMC_ME(getAndTouch,        arginfo_getAndTouch)
+	MEMC_ME(getMultiAndTouch,   arginfo_getMultiAndTouch)
 	MEMC_ME(getDelayed,         arginfo_getDelayed)
 	MEMC_ME(getDelayedByKey,    arginfo_getDelayedByKey)
 	MEMC_ME(fetch,              arginfo_fetch)
 	MEMC_ME(fetchAll,           arginfo_fetchAll)
+	MEMC_ME(getIterator,        arginfo_getIterator)
 
 	MEMC_ME(set,                arginfo_set)
 	MEMC_ME(setByKey,           arginfo_setByKey)
 
 	MEMC_ME(touch,              arginfo_touch)
 	MEMC_ME(touchByKey,         arginfo_touchByKey)
+	MEMC_ME(touchMulti,         arginfo_touchMulti)
 
 	MEMC_ME(setMulti,           arginfo_setMulti)
 	MEMC_ME(setMultiByKey,      arginfo_setMultiByKey)
 
 	MEMC_ME(cas,                arginfo_cas)
 	MEMC_ME(casByKey,           arginfo_casByKey)
+	MEMC_ME(casMulti,           arginfo_casMulti)
 	MEMC_ME(add,                arginfo_add)
 	MEMC_ME(addByKey,           arginfo_addByKey)
 	MEMC_ME(append,             arginfo_append)
@@ -4001,6 +9262,9 @@ static zend_function_entry memcached_class_methods[] = {
 	MEMC_ME(decrement,          arginfo_decrement)
 	MEMC_ME(incrementByKey,     arginfo_incrementByKey)
 	MEMC_ME(decrementByKey,     arginfo_decrementByKey)
+	MEMC_ME(incrementMulti,     arginfo_incrementMulti)
+	MEMC_ME(decrementMulti,     arginfo_decrementMulti)
+	MEMC_ME(bufferIncrement,    arginfo_bufferIncrement)
 
 	MEMC_ME(addServer,          arginfo_addServer)
 	MEMC_ME(addServers,         arginfo_addServers)
@@ -4016,6 +9280,8 @@ static zend_function_entry memcached_class_methods[] = {
 	MEMC_ME(getLastDisconnectedServer,	arginfo_getLastDisconnectedServer)
 
 	MEMC_ME(getStats,           arginfo_getStats)
+	MEMC_ME(getClientStats,     arginfo_getClientStats)
+	MEMC_ME(getHotKeys,         arginfo_getHotKeys)
 	MEMC_ME(getVersion,         arginfo_getVersion)
 	MEMC_ME(getAllKeys,         arginfo_getAllKeys)
 
@@ -4035,6 +9301,30 @@ static zend_function_entry memcached_class_methods[] = {
 #undef MEMC_ME
 /* }}} */
 
+/* {{{ memcached_iterator_class_methods */
+#define MEMC_IT_ME(name, args) PHP_ME(MemcachedIterator, name, args, ZEND_ACC_PUBLIC)
+static
+zend_function_entry memcached_iterator_class_methods[] = {
+	PHP_ME(MemcachedIterator, __construct, arginfo_iterator_none, ZEND_ACC_PRIVATE | ZEND_ACC_CTOR)
+	MEMC_IT_ME(rewind,  arginfo_iterator_none)
+	MEMC_IT_ME(valid,   arginfo_iterator_none)
+	MEMC_IT_ME(current, arginfo_iterator_none)
+	MEMC_IT_ME(key,     arginfo_iterator_none)
+	MEMC_IT_ME(next,    arginfo_iterator_none)
+	{ NULL, NULL, NULL }
+};
+#undef MEMC_IT_ME
+/* }}} */
+
+/* {{{ memcached_lazy_value_class_methods */
+static
+zend_function_entry memcached_lazy_value_class_methods[] = {
+	PHP_ME(MemcachedLazyValue, __construct, arginfo_iterator_none, ZEND_ACC_PRIVATE | ZEND_ACC_CTOR)
+	PHP_ME(MemcachedLazyValue, getValue,    arginfo_iterator_none, ZEND_ACC_PUBLIC)
+	{ NULL, NULL, NULL }
+};
+/* }}} */
+
 #ifdef HAVE_MEMCACHED_PROTOCOL
 /* {{{ */
 #define MEMC_SE_ME(name, args) PHP_ME(MemcachedServer, name, args, ZEND_ACC_PUBLIC)
@@ -4099,8 +9389,10 @@ PHP_GINIT_FUNCTION(php_memcached)
 	php_memcached_globals->memc.compression_type = COMPRESSION_TYPE_FASTLZ;
 	php_memcached_globals->memc.compression_factor = 1.30;
 	php_memcached_globals->memc.store_retry_count = 2;
+	php_memcached_globals->memc.codec_threads = 0;
 
 	php_memcached_globals->memc.sasl_initialised = 0;
+	php_memcached_globals->memc.pending = NULL;
 	php_memcached_globals->no_effect = 0;
 
 	/* Defaults for certain options */
@@ -4117,7 +9409,7 @@ zend_module_entry memcached_module_entry = {
 	PHP_MINIT(memcached),
 	PHP_MSHUTDOWN(memcached),
 	NULL,
-	NULL,
+	PHP_RSHUTDOWN(memcached),
 	PHP_MINFO(memcached),
 	PHP_MEMCACHED_VERSION,
 	PHP_MODULE_GLOBALS(php_memcached),
@@ -4143,12 +9435,36 @@ static void php_memc_register_constants(INIT_FUNC_ARGS)
 
 	REGISTER_MEMC_CLASS_CONST_LONG(OPT_COMPRESSION, MEMC_OPT_COMPRESSION);
 	REGISTER_MEMC_CLASS_CONST_LONG(OPT_COMPRESSION_TYPE, MEMC_OPT_COMPRESSION_TYPE);
+	REGISTER_MEMC_CLASS_CONST_LONG(OPT_COMPRESSION_LEVEL, MEMC_OPT_COMPRESSION_LEVEL);
+	REGISTER_MEMC_CLASS_CONST_LONG(OPT_COMPRESSION_DICTIONARIES, MEMC_OPT_COMPRESSION_DICTIONARIES);
+	REGISTER_MEMC_CLASS_CONST_LONG(OPT_COMPRESSION_ADAPTIVE, MEMC_OPT_COMPRESSION_ADAPTIVE);
 	REGISTER_MEMC_CLASS_CONST_LONG(OPT_PREFIX_KEY,  MEMC_OPT_PREFIX_KEY);
 	REGISTER_MEMC_CLASS_CONST_LONG(OPT_SERIALIZER,  MEMC_OPT_SERIALIZER);
+	REGISTER_MEMC_CLASS_CONST_LONG(OPT_BINARY_NUMBERS, MEMC_OPT_BINARY_NUMBERS);
 
 	REGISTER_MEMC_CLASS_CONST_LONG(OPT_USER_FLAGS,  MEMC_OPT_USER_FLAGS);
 	REGISTER_MEMC_CLASS_CONST_LONG(OPT_STORE_RETRY_COUNT,  MEMC_OPT_STORE_RETRY_COUNT);
 
+	REGISTER_MEMC_CLASS_CONST_LONG(OPT_LOCAL_CACHE_SIZE, MEMC_OPT_LOCAL_CACHE_SIZE);
+	REGISTER_MEMC_CLASS_CONST_LONG(OPT_LOCAL_CACHE_TTL,  MEMC_OPT_LOCAL_CACHE_TTL);
+
+	REGISTER_MEMC_CLASS_CONST_LONG(OPT_NEGATIVE_CACHE_SIZE, MEMC_OPT_NEGATIVE_CACHE_SIZE);
+	REGISTER_MEMC_CLASS_CONST_LONG(OPT_NEGATIVE_CACHE_TTL,  MEMC_OPT_NEGATIVE_CACHE_TTL);
+	REGISTER_MEMC_CLASS_CONST_LONG(OPT_WRITE_BEHIND_SIZE,   MEMC_OPT_WRITE_BEHIND_SIZE);
+	REGISTER_MEMC_CLASS_CONST_LONG(OPT_WRITE_BEHIND_AGE,    MEMC_OPT_WRITE_BEHIND_AGE);
+	REGISTER_MEMC_CLASS_CONST_LONG(OPT_COUNTER_BUFFER_SIZE, MEMC_OPT_COUNTER_BUFFER_SIZE);
+	REGISTER_MEMC_CLASS_CONST_LONG(OPT_COUNTER_BUFFER_AGE,  MEMC_OPT_COUNTER_BUFFER_AGE);
+	REGISTER_MEMC_CLASS_CONST_LONG(OPT_HEDGE_DELAY,         MEMC_OPT_HEDGE_DELAY);
+	REGISTER_MEMC_CLASS_CONST_LONG(OPT_HEDGE_PERCENTILE,    MEMC_OPT_HEDGE_PERCENTILE);
+	REGISTER_MEMC_CLASS_CONST_LONG(OPT_CHUNK_SIZE,          MEMC_OPT_CHUNK_SIZE);
+
+	REGISTER_MEMC_CLASS_CONST_LONG(OPT_LEASE_TIME,      MEMC_OPT_LEASE_TIME);
+	REGISTER_MEMC_CLASS_CONST_LONG(OPT_LEASE_WAIT,      MEMC_OPT_LEASE_WAIT);
+	REGISTER_MEMC_CLASS_CONST_LONG(OPT_LEASE_STALE_TTL, MEMC_OPT_LEASE_STALE_TTL);
+
+	REGISTER_MEMC_CLASS_CONST_LONG(OPT_HOT_KEYS_SIZE,        MEMC_OPT_HOT_KEYS_SIZE);
+	REGISTER_MEMC_CLASS_CONST_LONG(OPT_HOT_KEYS_SAMPLE_RATE, MEMC_OPT_HOT_KEYS_SAMPLE_RATE);
+
 	/*
 	 * Indicate whether igbinary serializer is available
 	 */
@@ -4176,6 +9492,21 @@ static void php_memc_register_constants(INIT_FUNC_ARGS)
 	REGISTER_MEMC_CLASS_CONST_BOOL(HAVE_MSGPACK, 0);
 #endif
 
+	/*
+	 * Indicate whether zstd and lz4 compression are available
+	 */
+#ifdef HAVE_MEMCACHED_ZSTD
+	REGISTER_MEMC_CLASS_CONST_BOOL(HAVE_ZSTD, 1);
+#else
+	REGISTER_MEMC_CLASS_CONST_BOOL(HAVE_ZSTD, 0);
+#endif
+
+#ifdef HAVE_MEMCACHED_LZ4
+	REGISTER_MEMC_CLASS_CONST_BOOL(HAVE_LZ4, 1);
+#else
+	REGISTER_MEMC_CLASS_CONST_BOOL(HAVE_LZ4, 0);
+#endif
+
 #ifdef HAVE_MEMCACHED_SESSION
 	REGISTER_MEMC_CLASS_CONST_BOOL(HAVE_SESSION, 1);
 #else
@@ -4301,18 +9632,23 @@ static void php_memc_register_constants(INIT_FUNC_ARGS)
 	REGISTER_MEMC_CLASS_CONST_LONG(SERIALIZER_JSON,       SERIALIZER_JSON);
 	REGISTER_MEMC_CLASS_CONST_LONG(SERIALIZER_JSON_ARRAY, SERIALIZER_JSON_ARRAY);
 	REGISTER_MEMC_CLASS_CONST_LONG(SERIALIZER_MSGPACK,    SERIALIZER_MSGPACK);
+	REGISTER_MEMC_CLASS_CONST_LONG(SERIALIZER_NATIVE,     SERIALIZER_NATIVE);
 
 	/*
 	 * Compression types
 	 */
 	REGISTER_MEMC_CLASS_CONST_LONG(COMPRESSION_FASTLZ, COMPRESSION_TYPE_FASTLZ);
 	REGISTER_MEMC_CLASS_CONST_LONG(COMPRESSION_ZLIB,   COMPRESSION_TYPE_ZLIB);
+	REGISTER_MEMC_CLASS_CONST_LONG(COMPRESSION_ZSTD,   COMPRESSION_TYPE_ZSTD);
+	REGISTER_MEMC_CLASS_CONST_LONG(COMPRESSION_LZ4,    COMPRESSION_TYPE_LZ4);
 
 	/*
 	 * Flags.
 	 */
 	REGISTER_MEMC_CLASS_CONST_LONG(GET_PRESERVE_ORDER, MEMC_GET_PRESERVE_ORDER);
 	REGISTER_MEMC_CLASS_CONST_LONG(GET_EXTENDED,       MEMC_GET_EXTENDED);
+	REGISTER_MEMC_CLASS_CONST_LONG(GET_LAZY,           MEMC_GET_LAZY);
+	REGISTER_MEMC_CLASS_CONST_LONG(SET_RETURN_STATUS,  MEMC_SET_RETURN_STATUS);
 
 #ifdef HAVE_MEMCACHED_PROTOCOL
 	/*
@@ -4377,6 +9713,33 @@ PHP_MINIT_FUNCTION(memcached)
 	memcached_ce = zend_register_internal_class(&ce);
 	memcached_ce->create_object = php_memc_object_new;
 
+	memcpy(&memcached_iterator_object_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+	memcached_iterator_object_handlers.offset    = XtOffsetOf(php_memc_iterator_t, zo);
+	memcached_iterator_object_handlers.clone_obj = NULL;
+	memcached_iterator_object_handlers.free_obj  = php_memc_iterator_free_storage;
+
+	INIT_CLASS_ENTRY(ce, "MemcachedIterator", memcached_iterator_class_methods);
+	memcached_iterator_ce = zend_register_internal_class(&ce);
+	memcached_iterator_ce->create_object = php_memc_iterator_new;
+	memcached_iterator_ce->ce_flags |= ZEND_ACC_FINAL;
+	/* The iterator reads the results of the instance that created it */
+	memcached_iterator_ce->serialize   = zend_class_serialize_deny;
+	memcached_iterator_ce->unserialize = zend_class_unserialize_deny;
+	zend_class_implements(memcached_iterator_ce, 1, zend_ce_iterator);
+
+	memcpy(&memcached_lazy_value_object_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+	memcached_lazy_value_object_handlers.offset    = XtOffsetOf(php_memc_lazy_value_t, zo);
+	memcached_lazy_value_object_handlers.clone_obj = NULL;
+	memcached_lazy_value_object_handlers.free_obj  = php_memc_lazy_value_free_storage;
+
+	INIT_CLASS_ENTRY(ce, "MemcachedLazyValue", memcached_lazy_value_class_methods);
+	memcached_lazy_value_ce = zend_register_internal_class(&ce);
+	memcached_lazy_value_ce->create_object = php_memc_lazy_value_new;
+	memcached_lazy_value_ce->ce_flags |= ZEND_ACC_FINAL;
+	/* The payload is tied to the instance that fetched it */
+	memcached_lazy_value_ce->serialize   = zend_class_serialize_deny;
+	memcached_lazy_value_ce->unserialize = zend_class_unserialize_deny;
+
 #ifdef HAVE_MEMCACHED_PROTOCOL
 	memcpy(&memcached_server_object_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
 	memcached_server_object_handlers.offset = XtOffsetOf(php_memc_server_t, zo);
@@ -4397,6 +9760,8 @@ PHP_MINIT_FUNCTION(memcached)
 	php_memc_register_constants(INIT_FUNC_ARGS_PASSTHRU);
 	REGISTER_INI_ENTRIES();
 
+	php_memc_pool_init(MEMC_G(codec_threads), s_codec_scratch_free);
+
 #ifdef HAVE_MEMCACHED_SESSION
 	php_memc_session_minit(module_number);
 #endif
@@ -4404,6 +9769,31 @@ PHP_MINIT_FUNCTION(memcached)
 }
 /* }}} */
 
+/* {{{ PHP_RSHUTDOWN_FUNCTION */
+PHP_RSHUTDOWN_FUNCTION(memcached)
+{
+	HashTable *pending = MEMC_G(pending);
+
+	if (pending) {
+		/* Flushing takes the instance out of the table */
+		while (zend_hash_num_elements(pending) > 0) {
+			php_memc_object_t *intern;
+
+			zend_hash_internal_pointer_reset(pending);
+			intern = zend_hash_get_current_data_ptr(pending);
+			s_write_queue_flush(intern);
+			s_counter_buffer_flush(intern);
+			zend_hash_index_del(pending, intern->zo.handle);
+		}
+
+		zend_hash_destroy(pending);
+		FREE_HASHTABLE(pending);
+		MEMC_G(pending) = NULL;
+	}
+	return SUCCESS;
+}
+/* }}} */
+
 /* {{{ PHP_MSHUTDOWN_FUNCTION */
 PHP_MSHUTDOWN_FUNCTION(memcached)
 {
@@ -4413,6 +9803,8 @@ PHP_MSHUTDOWN_FUNCTION(memcached)
 	}
 #endif
 
+	php_memc_pool_shutdown();
+
 	UNREGISTER_INI_ENTRIES();
 	return SUCCESS;
 }
@@ -4456,6 +9848,24 @@ PHP_MINFO_FUNCTION(memcached)
 	php_info_print_table_row(2, "msgpack support", "no");
 #endif
 
+#ifdef HAVE_MEMCACHED_ZSTD
+	php_info_print_table_row(2, "zstd support", "yes");
+#else
+	php_info_print_table_row(2, "zstd support", "no");
+#endif
+
+#ifdef HAVE_MEMCACHED_LZ4
+	php_info_print_table_row(2, "lz4 support", "yes");
+#else
+	php_info_print_table_row(2, "lz4 support", "no");
+#endif
+
+#ifdef HAVE_MEMCACHED_CODEC_POOL
+	php_info_print_table_row(2, "codec pool support", "yes");
+#else
+	php_info_print_table_row(2, "codec pool support", "no");
+#endif
+
 	php_info_print_table_end();
 
 	DISPLAY_INI_ENTRIES();
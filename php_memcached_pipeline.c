@@ -0,0 +1,695 @@
+/*
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2009-2017 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt.                                 |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+*/
+
+#include "php_memcached.h"
+#include "php_memcached_private.h"
+#include "php_memcached_pipeline.h"
+
+#include "php_network.h"
+
+#include <ctype.h>
+
+#ifndef PHP_WIN32
+# include <netinet/tcp.h>
+# include <unistd.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+
+/* The longest command line: "cas", a 250 byte key and four numbers */
+#define MEMC_PIPELINE_LINE_SIZE 384
+#define MEMC_PIPELINE_OUT_SIZE  16384
+#define MEMC_PIPELINE_IN_SIZE   4096
+
+#define MEMC_PIPELINE_KEY_MAX_LENGTH 250
+
+struct _php_memc_pipeline_conn_t {
+	char         *host;
+	in_port_t     port;
+	php_socket_t  fd;
+	/* A forked child reconnects instead of sharing the parent's socket */
+	int           pid;
+	/* Set while the connect is under way */
+	zend_bool     connecting;
+	/* Until then the server is left to libmemcached, after it could not be reached */
+	time_t        retry_at;
+};
+
+/* The commands of one batch for one connection, the buffers come last and are not cleared */
+typedef struct {
+	php_memc_pipeline_conn_t *conn;
+
+	size_t *order;
+	size_t  count;
+	size_t  queued;
+	size_t  replied;
+
+	size_t  out_len;
+	size_t  out_sent;
+
+	/* A payload too long for the output buffer is sent from where it is */
+	zend_string *payload;
+	size_t  payload_sent;
+
+	size_t  in_len;
+
+	/* Milliseconds since the epoch after which a connect under way has failed */
+	uint64_t connect_deadline;
+
+	char    out[MEMC_PIPELINE_OUT_SIZE];
+	char    in[MEMC_PIPELINE_IN_SIZE];
+} php_memc_pipeline_run_t;
+
+static
+memcached_return s_server_is_tcp_cb(const memcached_st *ptr, php_memcached_instance_st instance, void *in_context)
+{
+	zend_bool *is_tcp = (zend_bool *) in_context;
+
+	if (strcmp(memcached_server_type(instance), "TCP") != 0) {
+		*is_tcp = 0;
+	}
+	return MEMCACHED_SUCCESS;
+}
+
+zend_bool php_memc_pipeline_supported(memcached_st *memc)
+{
+	memcached_server_function callbacks[1];
+	zend_bool is_tcp = 1;
+
+	if (memcached_server_count(memc) == 0 ||
+		memcached_behavior_get(memc, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL) ||
+		memcached_behavior_get(memc, MEMCACHED_BEHAVIOR_USE_UDP) ||
+		memcached_behavior_get(memc, MEMCACHED_BEHAVIOR_NOREPLY) ||
+		memcached_behavior_get(memc, MEMCACHED_BEHAVIOR_BUFFER_REQUESTS)) {
+		return 0;
+	}
+
+	callbacks[0] = s_server_is_tcp_cb;
+	memcached_server_cursor(memc, callbacks, &is_tcp, 1);
+
+	return is_tcp;
+}
+
+static
+uint64_t s_time_ms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((uint64_t) tv.tv_sec * 1000) + (uint64_t) (tv.tv_usec / 1000);
+}
+
+static
+void s_conn_close(php_memc_pipeline_conn_t *conn)
+{
+	if (conn->fd != SOCK_ERR) {
+		closesocket(conn->fd);
+		conn->fd = SOCK_ERR;
+	}
+	conn->connecting = 0;
+}
+
+/* The server is not tried again before MEMCACHED_BEHAVIOR_RETRY_TIMEOUT, as libmemcached would */
+static
+void s_conn_failed(php_memc_pipeline_conn_t *conn, memcached_st *memc)
+{
+	s_conn_close(conn);
+	conn->retry_at = time(NULL) + (time_t) memcached_behavior_get(memc, MEMCACHED_BEHAVIOR_RETRY_TIMEOUT);
+}
+
+static
+zend_bool s_conn_disabled(php_memc_pipeline_conn_t *conn)
+{
+	return conn->retry_at && time(NULL) < conn->retry_at;
+}
+
+static
+uint32_t s_conn_find(php_memc_pipeline_t *pipeline, const char *host, in_port_t port)
+{
+	php_memc_pipeline_conn_t *conn;
+	uint32_t i;
+
+	for (i = 0; i < pipeline->count; i++) {
+		if (pipeline->conns[i].port == port && !strcmp(pipeline->conns[i].host, host)) {
+			return i;
+		}
+	}
+
+	pipeline->conns = perealloc(pipeline->conns, (pipeline->count + 1) * sizeof(php_memc_pipeline_conn_t), pipeline->is_persistent);
+
+	conn = &pipeline->conns[pipeline->count];
+	conn->host = pestrdup(host, pipeline->is_persistent);
+	conn->port = port;
+	conn->fd   = SOCK_ERR;
+	conn->pid  = 0;
+	conn->connecting = 0;
+	conn->retry_at   = 0;
+
+	return pipeline->count++;
+}
+
+/* Starts connecting without waiting, the connects to all servers of a batch run at once */
+static
+zend_bool s_conn_open(php_memc_pipeline_conn_t *conn, memcached_st *memc)
+{
+	uint64_t timeout = memcached_behavior_get(memc, MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT);
+	zend_string *error = NULL;
+	struct timeval tv;
+
+	if (conn->fd != SOCK_ERR && conn->pid == getpid()) {
+		return 1;
+	}
+	s_conn_close(conn);
+
+	tv.tv_sec  = (long) (timeout / 1000);
+	tv.tv_usec = (long) ((timeout % 1000) * 1000);
+
+	conn->fd = php_network_connect_socket_to_host(conn->host, conn->port, SOCK_STREAM, 1, &tv, &error, NULL, NULL, 0, 0);
+	if (error) {
+		zend_string_release(error);
+	}
+	if (conn->fd == SOCK_ERR) {
+		return 0;
+	}
+	conn->connecting = 1;
+
+#ifdef TCP_NODELAY
+	{
+		int nodelay = 1;
+		setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, (char *) &nodelay, sizeof(nodelay));
+	}
+#endif
+	php_set_sock_blocking(conn->fd, 0);
+	conn->pid = getpid();
+
+	return 1;
+}
+
+/* Called once the socket of a connect under way is writable */
+static
+zend_bool s_conn_connected(php_memc_pipeline_conn_t *conn)
+{
+	int error = 0;
+	socklen_t error_len = sizeof(error);
+
+	if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, (char *) &error, &error_len) != 0 || error != 0) {
+		return 0;
+	}
+	conn->connecting = 0;
+	return 1;
+}
+
+static
+zend_bool s_key_valid(const char *prefix, size_t prefix_len, zend_string *key)
+{
+	size_t i;
+
+	if (ZSTR_LEN(key) == 0 || prefix_len + ZSTR_LEN(key) > MEMC_PIPELINE_KEY_MAX_LENGTH) {
+		return 0;
+	}
+	/* The key is part of the command line */
+	for (i = 0; i < ZSTR_LEN(key); i++) {
+		if (iscntrl((unsigned char) ZSTR_VAL(key)[i]) || isspace((unsigned char) ZSTR_VAL(key)[i])) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static
+zend_bool s_cmd_has_payload(php_memc_batch_cmd cmd)
+{
+	return cmd == MEMC_BATCH_SET || cmd == MEMC_BATCH_ADD || cmd == MEMC_BATCH_REPLACE || cmd == MEMC_BATCH_CAS;
+}
+
+/* Formats the command line of the item, without the payload */
+static
+int s_command(php_memc_batch_item_t *item, const char *prefix, size_t prefix_len, char *line, size_t line_size)
+{
+	static const char *names[] = { "set", "add", "replace", "cas", "delete", "touch", "incr", "decr" };
+	int key_len = (int) ZSTR_LEN(item->key);
+
+	switch (item->cmd) {
+		case MEMC_BATCH_CAS:
+			return snprintf(line, line_size, "cas %.*s%.*s %u %ld %zu %llu\r\n", (int) prefix_len, prefix, key_len, ZSTR_VAL(item->key),
+							item->flags, (long) item->expiration, ZSTR_LEN(item->payload), (unsigned long long) item->cas);
+
+		case MEMC_BATCH_DELETE:
+			return snprintf(line, line_size, "delete %.*s%.*s\r\n", (int) prefix_len, prefix, key_len, ZSTR_VAL(item->key));
+
+		case MEMC_BATCH_TOUCH:
+			return snprintf(line, line_size, "touch %.*s%.*s %ld\r\n", (int) prefix_len, prefix, key_len, ZSTR_VAL(item->key),
+							(long) item->expiration);
+
+		case MEMC_BATCH_INCR:
+		case MEMC_BATCH_DECR:
+			return snprintf(line, line_size, "%s %.*s%.*s %llu\r\n", names[item->cmd], (int) prefix_len, prefix, key_len, ZSTR_VAL(item->key),
+							(unsigned long long) item->delta);
+
+		default:
+			return snprintf(line, line_size, "%s %.*s%.*s %u %ld %zu\r\n", names[item->cmd], (int) prefix_len, prefix, key_len, ZSTR_VAL(item->key),
+							item->flags, (long) item->expiration, ZSTR_LEN(item->payload));
+	}
+}
+
+/* Moves as many commands as fit into the output buffer, returns 0 if there were none left */
+static
+zend_bool s_run_fill(php_memc_pipeline_run_t *run, php_memc_batch_item_t *items, const char *prefix, size_t prefix_len)
+{
+	zend_bool filled = 0;
+
+	while (run->queued < run->count) {
+		php_memc_batch_item_t *item = &items[run->order[run->queued]];
+		char line[MEMC_PIPELINE_LINE_SIZE];
+		int line_len = s_command(item, prefix, prefix_len, line, sizeof(line));
+
+		if (run->out_len + line_len > sizeof(run->out)) {
+			break;
+		}
+		memcpy(run->out + run->out_len, line, line_len);
+		run->out_len += line_len;
+		run->queued++;
+		filled = 1;
+
+		if (s_cmd_has_payload(item->cmd)) {
+			if (run->out_len + ZSTR_LEN(item->payload) + 2 <= sizeof(run->out)) {
+				memcpy(run->out + run->out_len, ZSTR_VAL(item->payload), ZSTR_LEN(item->payload));
+				run->out_len += ZSTR_LEN(item->payload);
+				memcpy(run->out + run->out_len, "\r\n", 2);
+				run->out_len += 2;
+			} else {
+				run->payload      = item->payload;
+				run->payload_sent = 0;
+				break;
+			}
+		}
+	}
+	return filled;
+}
+
+static
+zend_bool s_run_writing(php_memc_pipeline_run_t *run)
+{
+	return run->out_sent < run->out_len || run->payload || run->queued < run->count;
+}
+
+static
+zend_bool s_would_block(int error)
+{
+	return error == EWOULDBLOCK || error == EAGAIN;
+}
+
+/* Writes until the socket would block or everything is sent */
+static
+memcached_return s_run_send(php_memc_pipeline_run_t *run, php_memc_batch_item_t *items, const char *prefix, size_t prefix_len)
+{
+	for (;;) {
+		const char *buffer;
+		size_t length;
+		ssize_t sent;
+
+		if (run->out_sent < run->out_len) {
+			buffer = run->out + run->out_sent;
+			length = run->out_len - run->out_sent;
+		}
+		else if (run->payload) {
+			buffer = ZSTR_VAL(run->payload) + run->payload_sent;
+			length = ZSTR_LEN(run->payload) - run->payload_sent;
+		}
+		else {
+			run->out_len = run->out_sent = 0;
+			if (!s_run_fill(run, items, prefix, prefix_len)) {
+				return MEMCACHED_SUCCESS;
+			}
+			continue;
+		}
+
+		sent = send(run->conn->fd, buffer, length, MSG_NOSIGNAL);
+		if (sent < 0) {
+			int error = php_socket_errno();
+
+			if (error == EINTR) {
+				continue;
+			}
+			return s_would_block(error) ? MEMCACHED_SUCCESS : MEMCACHED_WRITE_FAILURE;
+		}
+
+		if (run->out_sent < run->out_len) {
+			run->out_sent += sent;
+		}
+		else {
+			run->payload_sent += sent;
+
+			if (run->payload_sent == ZSTR_LEN(run->payload)) {
+				run->payload = NULL;
+				memcpy(run->out, "\r\n", 2);
+				run->out_len  = 2;
+				run->out_sent = 0;
+			}
+		}
+	}
+}
+
+#define MEMC_REPLY_IS(line, len, reply) \
+	((len) == sizeof(reply) - 1 && !memcmp((line), (reply), sizeof(reply) - 1))
+
+#define MEMC_REPLY_STARTS(line, len, reply) \
+	((len) >= sizeof(reply) - 1 && !memcmp((line), (reply), sizeof(reply) - 1))
+
+/* Returns 0 for a reply that does not belong to the command, the connection is out of step then */
+static
+zend_bool s_reply(php_memc_batch_item_t *item, const char *line, size_t len)
+{
+	if (MEMC_REPLY_IS(line, len, "STORED") || MEMC_REPLY_IS(line, len, "DELETED") || MEMC_REPLY_IS(line, len, "TOUCHED")) {
+		item->status = MEMCACHED_SUCCESS;
+	}
+	else if (MEMC_REPLY_IS(line, len, "NOT_STORED")) {
+		item->status = MEMCACHED_NOTSTORED;
+	}
+	else if (MEMC_REPLY_IS(line, len, "EXISTS")) {
+		item->status = MEMCACHED_DATA_EXISTS;
+	}
+	else if (MEMC_REPLY_IS(line, len, "NOT_FOUND")) {
+		item->status = MEMCACHED_NOTFOUND;
+	}
+	else if (MEMC_REPLY_STARTS(line, len, "SERVER_ERROR")) {
+		/* "SERVER_ERROR object too large for cache" */
+		item->status = zend_memnstr(line, "too large", sizeof("too large") - 1, line + len) ? MEMCACHED_E2BIG : MEMCACHED_SERVER_ERROR;
+	}
+	else if (MEMC_REPLY_STARTS(line, len, "CLIENT_ERROR")) {
+		/* Such as incrementing a value that is not a number */
+		item->status = MEMCACHED_CLIENT_ERROR;
+	}
+	else if (MEMC_REPLY_IS(line, len, "ERROR")) {
+		/* A command the server does not know, touch before memcached 1.4.8 */
+		item->status = MEMCACHED_PROTOCOL_ERROR;
+	}
+	else if ((item->cmd == MEMC_BATCH_INCR || item->cmd == MEMC_BATCH_DECR) && len > 0 && len <= 20) {
+		uint64_t value = 0;
+		size_t i;
+
+		for (i = 0; i < len; i++) {
+			if (line[i] < '0' || line[i] > '9') {
+				return 0;
+			}
+			value = value * 10 + (line[i] - '0');
+		}
+		item->status = MEMCACHED_SUCCESS;
+		item->value  = value;
+	}
+	else {
+		return 0;
+	}
+	return 1;
+}
+
+/* Reads the replies that have arrived */
+static
+memcached_return s_run_receive(php_memc_pipeline_run_t *run, php_memc_batch_item_t *items)
+{
+	while (run->replied < run->count) {
+		ssize_t received;
+		size_t start = 0;
+		char *eol;
+
+		received = recv(run->conn->fd, run->in + run->in_len, sizeof(run->in) - run->in_len, 0);
+		if (received == 0) {
+			return MEMCACHED_CONNECTION_FAILURE;
+		}
+		if (received < 0) {
+			int error = php_socket_errno();
+
+			if (error == EINTR) {
+				continue;
+			}
+			return s_would_block(error) ? MEMCACHED_SUCCESS : MEMCACHED_READ_FAILURE;
+		}
+		run->in_len += received;
+
+		while ((eol = memchr(run->in + start, '\n', run->in_len - start)) != NULL) {
+			const char *line = run->in + start;
+			size_t len = eol - line;
+
+			if (len > 0 && line[len - 1] == '\r') {
+				len--;
+			}
+			if (run->replied == run->count || !s_reply(&items[run->order[run->replied]], line, len)) {
+				return MEMCACHED_PROTOCOL_ERROR;
+			}
+			run->replied++;
+			start = (eol - run->in) + 1;
+		}
+
+		if (start) {
+			memmove(run->in, run->in + start, run->in_len - start);
+			run->in_len -= start;
+		}
+		else if (run->in_len == sizeof(run->in)) {
+			/* No reply is this long */
+			return MEMCACHED_PROTOCOL_ERROR;
+		}
+	}
+	return MEMCACHED_SUCCESS;
+}
+
+/*
+ * Fails the commands that may have been sent without a reply, and leaves the ones that
+ * were never sent to libmemcached. The connection cannot be reused after that, and when
+ * the server could not be reached it is left to libmemcached for a while.
+ */
+static
+void s_run_fail(php_memc_pipeline_run_t *run, memcached_st *memc, php_memc_batch_item_t *items, memcached_return status)
+{
+	for (; run->replied < run->queued; run->replied++) {
+		items[run->order[run->replied]].status = status;
+	}
+	for (; run->replied < run->count; run->replied++) {
+		items[run->order[run->replied]].unsent = 1;
+	}
+	run->queued  = run->count;
+	run->payload = NULL;
+	run->out_len = run->out_sent = 0;
+
+	switch (status) {
+		case MEMCACHED_CONNECTION_FAILURE:
+		case MEMCACHED_WRITE_FAILURE:
+		case MEMCACHED_READ_FAILURE:
+		case MEMCACHED_TIMEOUT:
+		case MEMCACHED_ERRNO:
+			s_conn_failed(run->conn, memc);
+		break;
+
+		default:
+			s_conn_close(run->conn);
+		break;
+	}
+}
+
+void php_memc_pipeline_run(php_memc_pipeline_t *pipeline, memcached_st *memc, zend_string *server_key,
+						php_memc_batch_item_t *items, size_t count)
+{
+	memcached_return status;
+	const char *prefix;
+	size_t prefix_len, i, used = 0;
+	uint32_t *routes, *runs_by_conn;
+	size_t *order;
+	php_memc_pipeline_run_t *runs;
+	php_pollfd *pfds;
+	php_memc_pipeline_run_t **polled;
+	int timeout = (int) memcached_behavior_get(memc, MEMCACHED_BEHAVIOR_POLL_TIMEOUT);
+
+	if (!count) {
+		return;
+	}
+
+	prefix = memcached_callback_get(memc, MEMCACHED_CALLBACK_PREFIX_KEY, &status);
+	prefix_len = prefix ? strlen(prefix) : 0;
+
+	/* Find the server of every key, the same way libmemcached does */
+	routes = safe_emalloc(count, sizeof(uint32_t), 0);
+
+	for (i = 0; i < count; i++) {
+		php_memc_batch_item_t *item = &items[i];
+		zend_string *hash_key = server_key ? server_key : item->key;
+		php_memcached_instance_st instance;
+
+		routes[i] = (uint32_t) -1;
+
+		if (!php_memc_batch_item_pending(item)) {
+			continue;
+		}
+		if (!s_key_valid(prefix, prefix_len, item->key)) {
+			item->status = MEMCACHED_BAD_KEY_PROVIDED;
+			continue;
+		}
+
+		instance = memcached_server_by_key(memc, ZSTR_VAL(hash_key), ZSTR_LEN(hash_key), &status);
+		if (!instance) {
+			item->status = status;
+			continue;
+		}
+		routes[i] = s_conn_find(pipeline, memcached_server_name(instance), memcached_server_port(instance));
+
+		if (s_conn_disabled(&pipeline->conns[routes[i]])) {
+			item->unsent = 1;
+			routes[i] = (uint32_t) -1;
+		}
+	}
+
+	/* Group the commands by connection, keeping their order */
+	runs_by_conn = safe_emalloc(pipeline->count, sizeof(uint32_t), 0);
+	memset(runs_by_conn, 0xff, pipeline->count * sizeof(uint32_t));
+
+	runs  = safe_emalloc(pipeline->count, sizeof(php_memc_pipeline_run_t), 0);
+	order = safe_emalloc(count, sizeof(size_t), 0);
+
+	for (i = 0; i < count; i++) {
+		if (routes[i] != (uint32_t) -1 && runs_by_conn[routes[i]] == (uint32_t) -1) {
+			runs_by_conn[routes[i]] = used;
+			memset(&runs[used], 0, XtOffsetOf(php_memc_pipeline_run_t, out));
+			runs[used].conn = &pipeline->conns[routes[i]];
+			used++;
+		}
+		if (routes[i] != (uint32_t) -1) {
+			runs[runs_by_conn[routes[i]]].count++;
+		}
+	}
+
+	{
+		size_t offset = 0, r;
+
+		for (r = 0; r < used; r++) {
+			runs[r].order = order + offset;
+			offset += runs[r].count;
+			runs[r].count = 0;
+		}
+		for (i = 0; i < count; i++) {
+			if (routes[i] != (uint32_t) -1) {
+				php_memc_pipeline_run_t *run = &runs[runs_by_conn[routes[i]]];
+				run->order[run->count++] = i;
+			}
+		}
+		for (r = 0; r < used; r++) {
+			runs[r].connect_deadline = s_time_ms() + memcached_behavior_get(memc, MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT);
+
+			if (!s_conn_open(runs[r].conn, memc)) {
+				s_run_fail(&runs[r], memc, items, MEMCACHED_CONNECTION_FAILURE);
+			}
+		}
+	}
+
+	/* Write and read on all connections at once, the servers stop reading when their replies are not read */
+	pfds   = safe_emalloc(used, sizeof(php_pollfd), 0);
+	polled = safe_emalloc(used, sizeof(php_memc_pipeline_run_t *), 0);
+
+	for (;;) {
+		unsigned int nfds = 0, p;
+		uint64_t now = s_time_ms();
+		int wait = timeout;
+		size_t r;
+		int ready;
+
+		for (r = 0; r < used; r++) {
+			if (runs[r].replied < runs[r].count) {
+				if (runs[r].conn->connecting) {
+					int left = runs[r].connect_deadline > now ? (int) (runs[r].connect_deadline - now) : 0;
+
+					pfds[nfds].events = POLLOUT;
+					wait = (wait < 0 || left < wait) ? left : wait;
+				} else {
+					pfds[nfds].events = POLLIN | (s_run_writing(&runs[r]) ? POLLOUT : 0);
+				}
+				pfds[nfds].fd      = runs[r].conn->fd;
+				pfds[nfds].revents = 0;
+				polled[nfds++]     = &runs[r];
+			}
+		}
+		if (!nfds) {
+			break;
+		}
+
+		ready = php_poll2(pfds, nfds, wait);
+		if (ready < 0 && php_socket_errno() == EINTR) {
+			continue;
+		}
+		if (ready < 0) {
+			for (p = 0; p < nfds; p++) {
+				s_run_fail(polled[p], memc, items, polled[p]->conn->connecting ? MEMCACHED_CONNECTION_FAILURE : MEMCACHED_ERRNO);
+			}
+			break;
+		}
+		if (ready == 0) {
+			/* A connect that ran out of time fails alone, the others time out after a full wait */
+			now = s_time_ms();
+
+			for (p = 0; p < nfds; p++) {
+				if (polled[p]->conn->connecting) {
+					if (now >= polled[p]->connect_deadline) {
+						s_run_fail(polled[p], memc, items, MEMCACHED_CONNECTION_FAILURE);
+					}
+				} else if (wait == timeout) {
+					s_run_fail(polled[p], memc, items, MEMCACHED_TIMEOUT);
+				}
+			}
+			continue;
+		}
+
+		for (p = 0; p < nfds; p++) {
+			php_memc_pipeline_run_t *run = polled[p];
+
+			status = MEMCACHED_SUCCESS;
+
+			if (run->conn->connecting) {
+				if (pfds[p].revents && !s_conn_connected(run->conn)) {
+					s_run_fail(run, memc, items, MEMCACHED_CONNECTION_FAILURE);
+				}
+				continue;
+			}
+
+			if (pfds[p].revents & POLLOUT) {
+				status = s_run_send(run, items, prefix, prefix_len);
+			}
+			if (status == MEMCACHED_SUCCESS && (pfds[p].revents & (POLLIN | POLLERR | POLLHUP))) {
+				status = s_run_receive(run, items);
+			}
+			if (status != MEMCACHED_SUCCESS) {
+				s_run_fail(run, memc, items, status);
+			}
+		}
+	}
+
+	efree(polled);
+	efree(pfds);
+	efree(order);
+	efree(runs);
+	efree(runs_by_conn);
+	efree(routes);
+}
+
+void php_memc_pipeline_close(php_memc_pipeline_t *pipeline)
+{
+	uint32_t i;
+
+	for (i = 0; i < pipeline->count; i++) {
+		s_conn_close(&pipeline->conns[i]);
+		pefree(pipeline->conns[i].host, pipeline->is_persistent);
+	}
+	if (pipeline->conns) {
+		pefree(pipeline->conns, pipeline->is_persistent);
+	}
+	pipeline->conns = NULL;
+	pipeline->count = 0;
+}
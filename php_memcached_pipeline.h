@@ -0,0 +1,100 @@
+/*
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2009-2017 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt.                                 |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+*/
+
+#ifndef PHP_MEMCACHED_PIPELINE_H
+#define PHP_MEMCACHED_PIPELINE_H
+
+typedef enum {
+	MEMC_BATCH_SET,
+	MEMC_BATCH_ADD,
+	MEMC_BATCH_REPLACE,
+	MEMC_BATCH_CAS,
+	MEMC_BATCH_DELETE,
+	MEMC_BATCH_TOUCH,
+	MEMC_BATCH_INCR,
+	MEMC_BATCH_DECR
+} php_memc_batch_cmd;
+
+/* One key of a multi-key write, status and value are filled in from its reply */
+typedef struct {
+	php_memc_batch_cmd cmd;
+	zend_string *key;
+	zend_string *payload;
+	uint32_t flags;
+	uint64_t cas;
+	uint64_t delta;
+	time_t expiration;
+	/* Set by setMulti() for s_compress_batch(), not used here */
+	zend_bool compress;
+
+	memcached_return status;
+	uint64_t value;
+	/* Never sent by the pipeline, libmemcached is to send it */
+	zend_bool unsent;
+} php_memc_batch_item_t;
+
+/* Items are sent while their status is MEMCACHED_SUCCESS, stores only with a payload */
+static inline zend_bool php_memc_batch_item_pending(const php_memc_batch_item_t *item)
+{
+	if (item->status != MEMCACHED_SUCCESS) {
+		return 0;
+	}
+	switch (item->cmd) {
+		case MEMC_BATCH_SET:
+		case MEMC_BATCH_ADD:
+		case MEMC_BATCH_REPLACE:
+		case MEMC_BATCH_CAS:
+			return item->payload != NULL;
+
+		default:
+			return 1;
+	}
+}
+
+typedef struct _php_memc_pipeline_conn_t php_memc_pipeline_conn_t;
+
+/* Connections of one memcached_st, kept from one batch to the next */
+typedef struct {
+	php_memc_pipeline_conn_t *conns;
+	uint32_t count;
+	zend_bool is_persistent;
+} php_memc_pipeline_t;
+
+/*
+ * libmemcached does not hand back the replies of buffered or quiet commands, so
+ * batches go over connections of their own: every command is written without
+ * waiting and its reply is read in order, all servers at once. Only the ASCII
+ * protocol over TCP is spoken, without noreply or buffered writes.
+ *
+ * The servers are still libmemcached's to judge: a server the pipeline cannot
+ * reach is left alone for MEMCACHED_BEHAVIOR_RETRY_TIMEOUT, and its commands go
+ * through libmemcached meanwhile, which counts the failure and marks the server
+ * dead or ejects it as configured.
+ */
+zend_bool php_memc_pipeline_supported(memcached_st *memc);
+
+/*
+ * Sends the command of every pending item and fills in the status from its reply,
+ * and the new value for increments and decrements.
+ * Commands that were sent but not answered, because of a timeout or a broken
+ * connection, get the error and may or may not have been applied. Commands that
+ * were never sent are marked unsent and keep their status, for the caller to
+ * send through libmemcached.
+ */
+void php_memc_pipeline_run(php_memc_pipeline_t *pipeline, memcached_st *memc, zend_string *server_key,
+						php_memc_batch_item_t *items, size_t count);
+
+void php_memc_pipeline_close(php_memc_pipeline_t *pipeline);
+
+#endif /* PHP_MEMCACHED_PIPELINE_H */
@@ -0,0 +1,452 @@
+/*
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2009-2017 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt.                                 |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+*/
+
+#include "php_memcached.h"
+#include "php_memcached_private.h"
+#include "php_memcached_pool.h"
+
+#ifdef HAVE_MEMCACHED_CODEC_POOL
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The workers are shared by the whole process. They are started by the first
+ * batch rather than at module startup, so that a forking SAPI does not start
+ * them in a parent that only forks, and a child notices from the pid that the
+ * threads it inherited the bookkeeping of do not exist and starts its own.
+ *
+ * One batch runs at a time. A thread that finds the pool busy, possible with
+ * ZTS, runs its batch itself.
+ */
+typedef struct {
+	zend_long threads;
+	php_memc_pool_scratch_dtor_fn scratch_dtor;
+
+	pthread_t *workers;
+	zend_long  started;
+	pid_t      pid;
+
+	/* One slot per worker, the last one for the thread running the batch */
+	void **scratch;
+
+	pthread_mutex_t busy;
+
+	/* Guards everything below */
+	pthread_mutex_t lock;
+	pthread_cond_t  work;
+	pthread_cond_t  done;
+	zend_bool       stopping;
+
+	php_memc_pool_task_fn fn;
+	char   *tasks;
+	size_t  task_size;
+	size_t  count;
+	size_t  next;
+	size_t  finished;
+} php_memc_pool_t;
+
+static php_memc_pool_t pool;
+
+/* Runs tasks of the current batch until none are left, called and returning with the lock held */
+static
+void s_pool_work(void **scratch)
+{
+	while (pool.fn && pool.next < pool.count) {
+		php_memc_pool_task_fn fn = pool.fn;
+		char *task = pool.tasks + (pool.next++ * pool.task_size);
+
+		pthread_mutex_unlock(&pool.lock);
+		fn(task, scratch);
+		pthread_mutex_lock(&pool.lock);
+
+		if (++pool.finished == pool.count) {
+			pthread_cond_signal(&pool.done);
+		}
+	}
+}
+
+static
+void *s_pool_worker(void *arg)
+{
+	void **scratch = &pool.scratch[(intptr_t) arg];
+
+	pthread_mutex_lock(&pool.lock);
+	while (!pool.stopping) {
+		s_pool_work(scratch);
+		pthread_cond_wait(&pool.work, &pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+static
+zend_bool s_pool_start(void)
+{
+	pid_t pid = getpid();
+	sigset_t all, previous;
+
+	if (pool.started && pool.pid == pid) {
+		return 1;
+	}
+
+	/* A forked child may have copied the lock held and the conditions with waiters that are not there */
+	if (pool.started) {
+		pthread_mutex_init(&pool.lock, NULL);
+		pthread_cond_init(&pool.work, NULL);
+		pthread_cond_init(&pool.done, NULL);
+	}
+
+	pool.started  = 0;
+	pool.pid      = pid;
+	pool.stopping = 0;
+
+	if (!pool.workers) {
+		pool.workers = calloc(pool.threads, sizeof(pthread_t));
+		pool.scratch = calloc(pool.threads + 1, sizeof(void *));
+
+		if (!pool.workers || !pool.scratch) {
+			free(pool.workers);
+			free(pool.scratch);
+			pool.workers = NULL;
+			pool.scratch = NULL;
+			return 0;
+		}
+	}
+
+	/* Signals are for the PHP thread, the workers start with all of them blocked and keep it that way */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &previous);
+
+	while (pool.started < pool.threads) {
+		if (pthread_create(&pool.workers[pool.started], NULL, s_pool_worker, (void *) (intptr_t) pool.started) != 0) {
+			break;
+		}
+		pool.started++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+	return pool.started > 0;
+}
+
+void php_memc_pool_init(zend_long threads, php_memc_pool_scratch_dtor_fn scratch_dtor)
+{
+	memset(&pool, 0, sizeof(pool));
+
+	if (threads <= 0) {
+		return;
+	}
+
+	pool.threads      = threads;
+	pool.scratch_dtor = scratch_dtor;
+
+	pthread_mutex_init(&pool.busy, NULL);
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.work, NULL);
+	pthread_cond_init(&pool.done, NULL);
+}
+
+void php_memc_pool_shutdown(void)
+{
+	zend_long i;
+
+	if (pool.threads <= 0) {
+		return;
+	}
+
+	if (pool.started && pool.pid == getpid()) {
+		pthread_mutex_lock(&pool.lock);
+		pool.stopping = 1;
+		pthread_cond_broadcast(&pool.work);
+		pthread_mutex_unlock(&pool.lock);
+
+		for (i = 0; i < pool.started; i++) {
+			pthread_join(pool.workers[i], NULL);
+		}
+	}
+
+	if (pool.scratch) {
+		for (i = 0; i <= pool.threads; i++) {
+			if (pool.scratch[i] && pool.scratch_dtor) {
+				pool.scratch_dtor(pool.scratch[i]);
+			}
+		}
+	}
+	free(pool.scratch);
+	free(pool.workers);
+
+	pthread_cond_destroy(&pool.done);
+	pthread_cond_destroy(&pool.work);
+	pthread_mutex_destroy(&pool.lock);
+	pthread_mutex_destroy(&pool.busy);
+
+	memset(&pool, 0, sizeof(pool));
+}
+
+zend_long php_memc_pool_size(void)
+{
+	return pool.threads;
+}
+
+zend_bool php_memc_pool_run(php_memc_pool_task_fn fn, void *tasks, size_t task_size, size_t count)
+{
+	if (pool.threads <= 0 || count == 0) {
+		return 0;
+	}
+
+	if (pthread_mutex_trylock(&pool.busy) != 0) {
+		return 0;
+	}
+
+	if (!s_pool_start()) {
+		pthread_mutex_unlock(&pool.busy);
+		return 0;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+
+	pool.fn        = fn;
+	pool.tasks     = tasks;
+	pool.task_size = task_size;
+	pool.count     = count;
+	pool.next      = 0;
+	pool.finished  = 0;
+
+	pthread_cond_broadcast(&pool.work);
+
+	/* The calling thread would only wait otherwise */
+	s_pool_work(&pool.scratch[pool.threads]);
+
+	while (pool.finished < pool.count) {
+		pthread_cond_wait(&pool.done, &pool.lock);
+	}
+
+	pool.fn    = NULL;
+	pool.tasks = NULL;
+
+	pthread_mutex_unlock(&pool.lock);
+	pthread_mutex_unlock(&pool.busy);
+	return 1;
+}
+
+struct _php_memc_async_t {
+	pthread_t thread;
+	pid_t     pid;
+	zend_bool started;
+
+	/* Guards everything below */
+	pthread_mutex_t lock;
+	pthread_cond_t  wake;
+	pthread_cond_t  done;
+	zend_bool       stopping;
+	zend_bool       cancelled;
+
+	/* Set while a task is handed over or running */
+	php_memc_async_fn fn;
+	void *arg;
+};
+
+static
+void *s_async_worker(void *in_async)
+{
+	php_memc_async_t *async = (php_memc_async_t *) in_async;
+
+	pthread_mutex_lock(&async->lock);
+	while (!async->stopping) {
+		if (async->fn) {
+			php_memc_async_fn fn = async->fn;
+
+			pthread_mutex_unlock(&async->lock);
+			fn(async->arg, async);
+			pthread_mutex_lock(&async->lock);
+
+			async->fn = NULL;
+			pthread_cond_broadcast(&async->done);
+			continue;
+		}
+		pthread_cond_wait(&async->wake, &async->lock);
+	}
+	pthread_mutex_unlock(&async->lock);
+	return NULL;
+}
+
+static
+void s_async_init(php_memc_async_t *async)
+{
+	pthread_mutex_init(&async->lock, NULL);
+	pthread_cond_init(&async->wake, NULL);
+	pthread_cond_init(&async->done, NULL);
+}
+
+php_memc_async_t *php_memc_async_new(void)
+{
+	php_memc_async_t *async = calloc(1, sizeof(php_memc_async_t));
+
+	if (async) {
+		s_async_init(async);
+	}
+	return async;
+}
+
+zend_bool php_memc_async_start(php_memc_async_t *async, php_memc_async_fn fn, void *arg)
+{
+	pid_t pid = getpid();
+
+	if (!async) {
+		return 0;
+	}
+
+	if (!async->started || async->pid != pid) {
+		sigset_t all, previous;
+
+		/* A forked child has the bookkeeping of a thread that is not there */
+		if (async->started) {
+			s_async_init(async);
+		}
+		async->started  = 0;
+		async->stopping = 0;
+		async->fn       = NULL;
+		async->pid      = pid;
+
+		/* Like the pool workers, the thread keeps all signals blocked */
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &previous);
+		async->started = (pthread_create(&async->thread, NULL, s_async_worker, async) == 0);
+		pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+		if (!async->started) {
+			return 0;
+		}
+	}
+
+	pthread_mutex_lock(&async->lock);
+	async->fn        = fn;
+	async->arg       = arg;
+	async->cancelled = 0;
+	pthread_cond_broadcast(&async->wake);
+	pthread_mutex_unlock(&async->lock);
+	return 1;
+}
+
+zend_bool php_memc_async_sleep(php_memc_async_t *async, uint64_t ms)
+{
+	struct timespec deadline;
+	zend_bool awake;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec  += (time_t) (ms / 1000);
+	deadline.tv_nsec += (long) ((ms % 1000) * 1000000);
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&async->lock);
+	while (!async->cancelled && !async->stopping) {
+		if (pthread_cond_timedwait(&async->wake, &async->lock, &deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+	awake = !async->cancelled && !async->stopping;
+	pthread_mutex_unlock(&async->lock);
+
+	return awake;
+}
+
+void php_memc_async_finish(php_memc_async_t *async)
+{
+	if (!async || !async->started || async->pid != getpid()) {
+		return;
+	}
+
+	pthread_mutex_lock(&async->lock);
+	async->cancelled = 1;
+	pthread_cond_broadcast(&async->wake);
+
+	while (async->fn) {
+		pthread_cond_wait(&async->done, &async->lock);
+	}
+	pthread_mutex_unlock(&async->lock);
+}
+
+void php_memc_async_free(php_memc_async_t *async)
+{
+	if (!async) {
+		return;
+	}
+
+	if (async->started && async->pid == getpid()) {
+		pthread_mutex_lock(&async->lock);
+		async->stopping = 1;
+		pthread_cond_broadcast(&async->wake);
+		pthread_mutex_unlock(&async->lock);
+
+		pthread_join(async->thread, NULL);
+	}
+
+	pthread_cond_destroy(&async->done);
+	pthread_cond_destroy(&async->wake);
+	pthread_mutex_destroy(&async->lock);
+	free(async);
+}
+
+#else
+
+/* Without pthreads every batch runs on the calling thread */
+
+void php_memc_pool_init(zend_long threads, php_memc_pool_scratch_dtor_fn scratch_dtor)
+{
+}
+
+void php_memc_pool_shutdown(void)
+{
+}
+
+zend_long php_memc_pool_size(void)
+{
+	return 0;
+}
+
+zend_bool php_memc_pool_run(php_memc_pool_task_fn fn, void *tasks, size_t task_size, size_t count)
+{
+	return 0;
+}
+
+php_memc_async_t *php_memc_async_new(void)
+{
+	return NULL;
+}
+
+zend_bool php_memc_async_start(php_memc_async_t *async, php_memc_async_fn fn, void *arg)
+{
+	return 0;
+}
+
+zend_bool php_memc_async_sleep(php_memc_async_t *async, uint64_t ms)
+{
+	return 0;
+}
+
+void php_memc_async_finish(php_memc_async_t *async)
+{
+}
+
+void php_memc_async_free(php_memc_async_t *async)
+{
+}
+
+#endif /* HAVE_MEMCACHED_CODEC_POOL */
@@ -0,0 +1,65 @@
+/*
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2009-2017 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt.                                 |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+*/
+
+#ifndef PHP_MEMCACHED_POOL_H
+#define PHP_MEMCACHED_POOL_H
+
+/*
+ * Native worker threads for byte-level work on a batch of values, sized by
+ * memcached.codec_threads. Tasks run outside of PHP: they must not allocate
+ * with the Zend allocator, touch zvals or raise errors.
+ *
+ * Every thread, the calling one included, has a scratch pointer of its own
+ * that lives as long as the pool, for codec state reused between tasks.
+ */
+typedef void (*php_memc_pool_task_fn)(void *task, void **scratch);
+typedef void (*php_memc_pool_scratch_dtor_fn)(void *scratch);
+
+void php_memc_pool_init(zend_long threads, php_memc_pool_scratch_dtor_fn scratch_dtor);
+
+void php_memc_pool_shutdown(void);
+
+zend_long php_memc_pool_size(void);
+
+/*
+ * Runs fn on each of the count tasks, task_size bytes apart, and returns once
+ * all of them are done. Returns 0 without running anything when the pool is
+ * disabled, could not be started or is busy with another thread's batch.
+ */
+zend_bool php_memc_pool_run(php_memc_pool_task_fn fn, void *tasks, size_t task_size, size_t count);
+
+/*
+ * A thread of its own that runs one task at a time alongside the calling
+ * thread, such as the replica read of a hedged read while the primary is
+ * awaited. The same rules as for the pool tasks apply. Without pthreads
+ * php_memc_async_new() returns NULL and nothing runs.
+ */
+typedef struct _php_memc_async_t php_memc_async_t;
+
+typedef void (*php_memc_async_fn)(void *arg, php_memc_async_t *async);
+
+php_memc_async_t *php_memc_async_new(void);
+
+/* Hands the task to the thread, which is started on first use and again in a forked child */
+zend_bool php_memc_async_start(php_memc_async_t *async, php_memc_async_fn fn, void *arg);
+
+/* Called by the task, waits the milliseconds out and returns 0 if php_memc_async_finish() came first */
+zend_bool php_memc_async_sleep(php_memc_async_t *async, uint64_t ms);
+
+/* Cuts the sleep of the task short and waits until the task has returned */
+void php_memc_async_finish(php_memc_async_t *async);
+
+void php_memc_async_free(php_memc_async_t *async);
+
+#endif /* PHP_MEMCACHED_POOL_H */
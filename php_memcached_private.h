@@ -41,6 +41,7 @@
 #include <ext/standard/info.h>
 #include <zend_extensions.h>
 #include <zend_exceptions.h>
+#include <zend_interfaces.h>
 #include <ext/standard/php_smart_string.h>
 #include <ext/standard/php_var.h>
 #include <ext/standard/basic_functions.h>
@@ -80,12 +81,15 @@ typedef enum {
 	SERIALIZER_IGBINARY   = 2,
 	SERIALIZER_JSON       = 3,
 	SERIALIZER_JSON_ARRAY = 4,
-	SERIALIZER_MSGPACK    = 5
+	SERIALIZER_MSGPACK    = 5,
+	SERIALIZER_NATIVE     = 6
 } php_memc_serializer_type;
 
 typedef enum {
 	COMPRESSION_TYPE_ZLIB   = 1,
-	COMPRESSION_TYPE_FASTLZ = 2
+	COMPRESSION_TYPE_FASTLZ = 2,
+	COMPRESSION_TYPE_ZSTD   = 3,
+	COMPRESSION_TYPE_LZ4    = 4
 } php_memc_compression_type;
 
 typedef struct {
@@ -171,6 +175,7 @@ ZEND_BEGIN_MODULE_GLOBALS(php_memcached)
 		zend_long compression_threshold;
 		double    compression_factor;
 		zend_long store_retry_count;
+		zend_long codec_threads;
 
 		/* Converted values*/
 		php_memc_serializer_type  serializer_type;
@@ -179,6 +184,9 @@ ZEND_BEGIN_MODULE_GLOBALS(php_memcached)
 		/* Whether we have initialised sasl for this process */
 		zend_bool sasl_initialised;
 
+		/* Instances with queued writes or buffered counters, drained at request shutdown */
+		HashTable *pending;
+
 		struct {
 
 			zend_bool consistent_hash_enabled;
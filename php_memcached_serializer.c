@@ -0,0 +1,510 @@
+/*
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2009-2017 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt.                                 |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+*/
+
+#include "php_memcached.h"
+#include "php_memcached_private.h"
+#include "php_memcached_serializer.h"
+
+/*
+ * Layout: a version byte followed by a single value. Each value starts with
+ * one of the tags below. Counts, lengths and string table indexes are
+ * unsigned LEB128 varints, integers are zigzag encoded varints.
+ *
+ * Short strings are numbered in the order they first appear, and any later
+ * occurrence, as a key or a value, is written as a reference to that number.
+ * The table is never written out, the reader rebuilds it as it goes.
+ */
+#define MEMC_NATIVE_VERSION 1
+
+#define MEMC_NATIVE_MAX_DEPTH 256
+
+/* Strings up to this length go into the string table, longer ones rarely repeat */
+#define MEMC_NATIVE_INTERN_MAX 64
+
+enum {
+	MEMC_NATIVE_NULL       = 0,
+	MEMC_NATIVE_FALSE      = 1,
+	MEMC_NATIVE_TRUE       = 2,
+	MEMC_NATIVE_LONG       = 3, /* zigzag varint */
+	MEMC_NATIVE_DOUBLE     = 4, /* 8 bytes, little-endian IEEE 754 */
+	MEMC_NATIVE_STRING     = 5, /* varint length and bytes */
+	MEMC_NATIVE_STRING_REF = 6, /* varint index into the string table */
+	MEMC_NATIVE_LIST       = 7, /* varint count, values for keys 0 to count - 1 */
+	MEMC_NATIVE_MAP        = 8  /* varint count, key and value pairs, keys are LONG or strings */
+};
+
+typedef struct {
+	smart_str *buf;
+	HashTable  strings;
+	zend_bool  strings_ready;
+} php_memc_native_writer_t;
+
+typedef struct {
+	const unsigned char *p;
+	const unsigned char *end;
+
+	zend_string **strings;
+	uint32_t      count;
+	uint32_t      allocated;
+} php_memc_native_reader_t;
+
+static
+uint64_t s_zigzag(int64_t value)
+{
+	return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+static
+int64_t s_unzigzag(uint64_t value)
+{
+	return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+/****************************************
+  Writing
+****************************************/
+
+static
+void s_write_varint(smart_str *buf, uint64_t value)
+{
+	char bytes[10];
+	size_t len = 0;
+
+	while (value >= 0x80) {
+		bytes[len++] = (char) ((value & 0x7f) | 0x80);
+		value >>= 7;
+	}
+	bytes[len++] = (char) value;
+
+	smart_str_appendl(buf, bytes, len);
+}
+
+static
+void s_write_long(smart_str *buf, int64_t value)
+{
+	smart_str_appendc(buf, MEMC_NATIVE_LONG);
+	s_write_varint(buf, s_zigzag(value));
+}
+
+static
+void s_write_double(smart_str *buf, double value)
+{
+	char bytes[8];
+	uint64_t bits;
+	int i;
+
+	memcpy(&bits, &value, sizeof(bits));
+	for (i = 0; i < 8; i++) {
+		bytes[i] = (char) (bits >> (i * 8));
+	}
+
+	smart_str_appendc(buf, MEMC_NATIVE_DOUBLE);
+	smart_str_appendl(buf, bytes, sizeof(bytes));
+}
+
+static
+void s_write_string(php_memc_native_writer_t *writer, zend_string *str)
+{
+	if (ZSTR_LEN(str) <= MEMC_NATIVE_INTERN_MAX) {
+		zval *index, next;
+
+		if (!writer->strings_ready) {
+			zend_hash_init(&writer->strings, 16, NULL, NULL, 0);
+			writer->strings_ready = 1;
+		}
+
+		if ((index = zend_hash_find(&writer->strings, str)) != NULL) {
+			smart_str_appendc(writer->buf, MEMC_NATIVE_STRING_REF);
+			s_write_varint(writer->buf, (uint64_t) Z_LVAL_P(index));
+			return;
+		}
+
+		ZVAL_LONG(&next, zend_hash_num_elements(&writer->strings));
+		zend_hash_add_new(&writer->strings, str, &next);
+	}
+
+	smart_str_appendc(writer->buf, MEMC_NATIVE_STRING);
+	s_write_varint(writer->buf, ZSTR_LEN(str));
+	smart_str_appendl(writer->buf, ZSTR_VAL(str), ZSTR_LEN(str));
+}
+
+static
+zend_bool s_is_list(HashTable *ht)
+{
+	zend_ulong expected = 0, num_key;
+	zend_string *key;
+
+	ZEND_HASH_FOREACH_KEY(ht, num_key, key) {
+		if (key || num_key != expected++) {
+			return 0;
+		}
+	} ZEND_HASH_FOREACH_END();
+
+	return 1;
+}
+
+static
+zend_bool s_write_value(php_memc_native_writer_t *writer, zval *value, int depth);
+
+static
+zend_bool s_write_array(php_memc_native_writer_t *writer, HashTable *ht, int depth)
+{
+	zend_bool is_list;
+	zend_ulong num_key;
+	zend_string *key;
+	zval *entry;
+
+	if (depth > MEMC_NATIVE_MAX_DEPTH) {
+		return 0;
+	}
+
+	is_list = s_is_list(ht);
+
+	smart_str_appendc(writer->buf, is_list ? MEMC_NATIVE_LIST : MEMC_NATIVE_MAP);
+	s_write_varint(writer->buf, zend_hash_num_elements(ht));
+
+	ZEND_HASH_FOREACH_KEY_VAL_IND(ht, num_key, key, entry) {
+		if (!is_list) {
+			if (key) {
+				s_write_string(writer, key);
+			} else {
+				s_write_long(writer->buf, (int64_t) (zend_long) num_key);
+			}
+		}
+
+		if (!s_write_value(writer, entry, depth)) {
+			return 0;
+		}
+	} ZEND_HASH_FOREACH_END();
+
+	return 1;
+}
+
+static
+zend_bool s_write_value(php_memc_native_writer_t *writer, zval *value, int depth)
+{
+	/* A reference nothing else points to is just a value, as with php serialize */
+	if (Z_ISREF_P(value) && Z_REFCOUNT_P(value) == 1) {
+		value = Z_REFVAL_P(value);
+	}
+
+	switch (Z_TYPE_P(value)) {
+		case IS_NULL:
+			smart_str_appendc(writer->buf, MEMC_NATIVE_NULL);
+			break;
+
+		case IS_FALSE:
+			smart_str_appendc(writer->buf, MEMC_NATIVE_FALSE);
+			break;
+
+		case IS_TRUE:
+			smart_str_appendc(writer->buf, MEMC_NATIVE_TRUE);
+			break;
+
+		case IS_LONG:
+			s_write_long(writer->buf, (int64_t) Z_LVAL_P(value));
+			break;
+
+		case IS_DOUBLE:
+			s_write_double(writer->buf, Z_DVAL_P(value));
+			break;
+
+		case IS_STRING:
+			s_write_string(writer, Z_STR_P(value));
+			break;
+
+		case IS_ARRAY:
+			return s_write_array(writer, Z_ARRVAL_P(value), depth + 1);
+
+		/* Objects, shared references and resources */
+		default:
+			return 0;
+	}
+	return 1;
+}
+
+zend_bool php_memc_native_serialize(smart_str *buf, zval *value)
+{
+	php_memc_native_writer_t writer;
+	zend_bool status;
+
+	writer.buf           = buf;
+	writer.strings_ready = 0;
+
+	smart_str_appendc(buf, MEMC_NATIVE_VERSION);
+	status = s_write_value(&writer, value, 0);
+
+	if (writer.strings_ready) {
+		zend_hash_destroy(&writer.strings);
+	}
+
+	smart_str_0(buf);
+	return status;
+}
+
+/****************************************
+  Reading
+****************************************/
+
+static
+zend_bool s_read_varint(php_memc_native_reader_t *reader, uint64_t *value)
+{
+	int shift;
+
+	*value = 0;
+
+	for (shift = 0; shift < 64 && reader->p < reader->end; shift += 7) {
+		unsigned char byte = *reader->p++;
+
+		*value |= ((uint64_t) (byte & 0x7f)) << shift;
+		if (!(byte & 0x80)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Every element takes at least a byte, which bounds counts taken from corrupt data */
+static
+zend_bool s_read_count(php_memc_native_reader_t *reader, uint64_t *count)
+{
+	return s_read_varint(reader, count) && *count <= (uint64_t) (reader->end - reader->p);
+}
+
+/* Returns a string the caller owns a reference to */
+static
+zend_string *s_read_string(php_memc_native_reader_t *reader, unsigned char tag)
+{
+	zend_string *str;
+	uint64_t value;
+
+	if (!s_read_varint(reader, &value)) {
+		return NULL;
+	}
+
+	if (tag == MEMC_NATIVE_STRING_REF) {
+		return value < reader->count ? zend_string_copy(reader->strings[value]) : NULL;
+	}
+
+	if (value > (uint64_t) (reader->end - reader->p)) {
+		return NULL;
+	}
+
+	str = zend_string_init((const char *) reader->p, (size_t) value, 0);
+	reader->p += value;
+
+	if (value <= MEMC_NATIVE_INTERN_MAX) {
+		if (reader->count == reader->allocated) {
+			reader->allocated = reader->allocated ? reader->allocated * 2 : 16;
+			reader->strings   = erealloc(reader->strings, reader->allocated * sizeof(zend_string *));
+		}
+		reader->strings[reader->count++] = zend_string_copy(str);
+	}
+	return str;
+}
+
+static
+zend_bool s_read_value(php_memc_native_reader_t *reader, zval *return_value, int depth);
+
+static
+zend_bool s_read_array(php_memc_native_reader_t *reader, zval *return_value, zend_bool is_list, int depth)
+{
+	HashTable *ht;
+	uint64_t i, count;
+	zval value;
+
+	if (depth > MEMC_NATIVE_MAX_DEPTH || !s_read_count(reader, &count)) {
+		return 0;
+	}
+
+	array_init_size(return_value, (uint32_t) count);
+	ht = Z_ARRVAL_P(return_value);
+
+	/* Lists are filled in order, straight into a packed table */
+	if (is_list) {
+		zend_hash_real_init(ht, 1);
+
+		for (i = 0; i < count; i++) {
+			if (!s_read_value(reader, &value, depth)) {
+				zval_ptr_dtor(&value);
+				return 0;
+			}
+			zend_hash_next_index_insert_new(ht, &value);
+		}
+		return 1;
+	}
+
+	for (i = 0; i < count; i++) {
+		zend_string *key = NULL;
+		zend_ulong num_key = 0;
+		unsigned char tag;
+
+		if (reader->p >= reader->end) {
+			return 0;
+		}
+
+		tag = *reader->p++;
+
+		if (tag == MEMC_NATIVE_LONG) {
+			uint64_t bits;
+
+			if (!s_read_varint(reader, &bits)) {
+				return 0;
+			}
+			num_key = (zend_ulong) (zend_long) s_unzigzag(bits);
+		}
+		else if (tag == MEMC_NATIVE_STRING || tag == MEMC_NATIVE_STRING_REF) {
+			if ((key = s_read_string(reader, tag)) == NULL) {
+				return 0;
+			}
+		}
+		else {
+			return 0;
+		}
+
+		if (!s_read_value(reader, &value, depth)) {
+			zval_ptr_dtor(&value);
+			if (key) {
+				zend_string_release(key);
+			}
+			return 0;
+		}
+
+		if (key) {
+			zend_symtable_update(ht, key, &value);
+			zend_string_release(key);
+		} else {
+			zend_hash_index_update(ht, num_key, &value);
+		}
+	}
+	return 1;
+}
+
+/* On failure return_value is left as a value that is safe to destroy */
+static
+zend_bool s_read_value(php_memc_native_reader_t *reader, zval *return_value, int depth)
+{
+	unsigned char tag;
+
+	ZVAL_NULL(return_value);
+
+	if (reader->p >= reader->end) {
+		return 0;
+	}
+
+	tag = *reader->p++;
+
+	switch (tag) {
+		case MEMC_NATIVE_NULL:
+			break;
+
+		case MEMC_NATIVE_FALSE:
+			ZVAL_FALSE(return_value);
+			break;
+
+		case MEMC_NATIVE_TRUE:
+			ZVAL_TRUE(return_value);
+			break;
+
+		case MEMC_NATIVE_LONG:
+		{
+			uint64_t bits;
+			int64_t lval;
+
+			if (!s_read_varint(reader, &bits)) {
+				return 0;
+			}
+			lval = s_unzigzag(bits);
+
+			/* Only possible when a 64-bit build wrote the value */
+			if (lval > ZEND_LONG_MAX || lval < ZEND_LONG_MIN) {
+				ZVAL_DOUBLE(return_value, (double) lval);
+			} else {
+				ZVAL_LONG(return_value, (zend_long) lval);
+			}
+		}
+			break;
+
+		case MEMC_NATIVE_DOUBLE:
+		{
+			uint64_t bits = 0;
+			double dval;
+			int i;
+
+			if (reader->end - reader->p < 8) {
+				return 0;
+			}
+			for (i = 0; i < 8; i++) {
+				bits |= ((uint64_t) reader->p[i]) << (i * 8);
+			}
+			reader->p += 8;
+
+			memcpy(&dval, &bits, sizeof(dval));
+			ZVAL_DOUBLE(return_value, dval);
+		}
+			break;
+
+		case MEMC_NATIVE_STRING:
+		case MEMC_NATIVE_STRING_REF:
+		{
+			zend_string *str = s_read_string(reader, tag);
+
+			if (!str) {
+				return 0;
+			}
+			ZVAL_STR(return_value, str);
+		}
+			break;
+
+		case MEMC_NATIVE_LIST:
+		case MEMC_NATIVE_MAP:
+			return s_read_array(reader, return_value, tag == MEMC_NATIVE_LIST, depth + 1);
+
+		default:
+			return 0;
+	}
+	return 1;
+}
+
+zend_bool php_memc_native_unserialize(zval *return_value, const char *payload, size_t payload_len)
+{
+	php_memc_native_reader_t reader;
+	zend_bool status;
+	uint32_t i;
+
+	ZVAL_FALSE(return_value);
+
+	if (payload_len < 1 || payload[0] != MEMC_NATIVE_VERSION) {
+		return 0;
+	}
+
+	memset(&reader, 0, sizeof(reader));
+	reader.p   = (const unsigned char *) payload + 1;
+	reader.end = (const unsigned char *) payload + payload_len;
+
+	status = s_read_value(&reader, return_value, 0) && reader.p == reader.end;
+
+	for (i = 0; i < reader.count; i++) {
+		zend_string_release(reader.strings[i]);
+	}
+	if (reader.strings) {
+		efree(reader.strings);
+	}
+
+	if (!status) {
+		zval_ptr_dtor(return_value);
+		ZVAL_FALSE(return_value);
+	}
+	return status;
+}
@@ -0,0 +1,29 @@
+/*
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2009-2017 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt.                                 |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+*/
+
+#ifndef PHP_MEMCACHED_SERIALIZER_H
+#define PHP_MEMCACHED_SERIALIZER_H
+
+#include "zend_smart_str.h"
+
+/*
+ * SERIALIZER_NATIVE, a compact binary format for arrays of scalars.
+ * Serializing fails, leaving a partial buffer, on values the format cannot
+ * hold: objects, shared references, resources and very deep nesting.
+ */
+zend_bool php_memc_native_serialize(smart_str *buf, zval *value);
+
+zend_bool php_memc_native_unserialize(zval *return_value, const char *payload, size_t payload_len);
+
+#endif /* PHP_MEMCACHED_SERIALIZER_H */
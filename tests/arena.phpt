@@ -0,0 +1,39 @@
+--TEST--
+Memcached key vectors reuse the scratch arena
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance ();
+
+$keys = array();
+for ($i = 0; $i < 1000; $i++) {
+	$keys[] = "arena_key_$i";
+}
+$m->set('arena_key_1', 'value');
+
+// Warm up, the arena grows to fit the largest call
+$m->get('arena_key_1');
+$m->getMulti($keys);
+
+$before = $m->getClientStats()['arena'];
+
+for ($i = 0; $i < 100; $i++) {
+	$m->get('arena_key_1');
+	$m->getMulti($keys);
+}
+
+$after = $m->getClientStats()['arena'];
+
+var_dump($after['allocations'] - $before['allocations']);
+var_dump($after['requests'] > $before['requests']);
+var_dump($after['size'] >= 1000 * 3 * PHP_INT_SIZE);
+
+echo "OK" . PHP_EOL;
+?>
+--EXPECT--
+int(0)
+bool(true)
+bool(true)
+OK
@@ -0,0 +1,45 @@
+--TEST--
+Memcached binary encoding of integers and floats
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance (array (
+	Memcached::OPT_BINARY_NUMBERS => true,
+));
+$text = memc_get_instance ();
+
+var_dump($m->getOption(Memcached::OPT_BINARY_NUMBERS));
+
+$values = array (0, -1, 42, PHP_INT_MAX, PHP_INT_MIN, 0.1 + 0.2, -1.5, 1e300, INF, -INF);
+
+// Binary values read back the same, whether or not the reader writes them too
+$ok = true;
+foreach ($values as $i => $value) {
+	$m->set("binary_numbers_$i", $value);
+	if ($m->get("binary_numbers_$i") !== $value || $text->get("binary_numbers_$i") !== $value) {
+		echo "Mismatch for "; var_dump($value);
+		$ok = false;
+	}
+}
+var_dump($ok);
+
+$m->set('binary_numbers_nan', NAN);
+var_dump(is_nan($text->get('binary_numbers_nan')));
+
+// Text values still decode
+$text->set('binary_numbers_text', 12345);
+var_dump($m->get('binary_numbers_text'));
+
+// Counters have to stay text
+var_dump($m->increment('binary_numbers_text'));
+var_dump($m->increment('binary_numbers_2'));
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+int(12345)
+int(12346)
+bool(false)
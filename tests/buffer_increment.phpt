@@ -0,0 +1,79 @@
+--TEST--
+Memcached::bufferIncrement() coalesces deltas per key
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance (array (
+	Memcached::OPT_COUNTER_BUFFER_SIZE => 2,
+));
+$other = memc_get_instance ();
+
+$m->deleteMulti(array('buffer_increment_1', 'buffer_increment_2', 'buffer_increment_3', 'buffer_increment_4'));
+
+var_dump($m->getOption(Memcached::OPT_COUNTER_BUFFER_SIZE));
+
+for ($i = 0; $i < 100; $i++) {
+	$m->bufferIncrement('buffer_increment_1');
+}
+
+// Nothing has been sent yet
+var_dump($m->get('buffer_increment_1'));
+var_dump($m->getClientStats()['counter_buffer']['pending']);
+
+// The second key reaches the threshold
+var_dump($m->bufferIncrement('buffer_increment_2', 5));
+var_dump($m->get('buffer_increment_1'), $m->get('buffer_increment_2'));
+
+// Deltas that cancel out are not sent, decrements stop at zero
+$m->bufferIncrement('buffer_increment_1', 3);
+$m->bufferIncrement('buffer_increment_1', -3);
+$m->bufferIncrement('buffer_increment_2', -10);
+var_dump($m->get('buffer_increment_1'), $m->get('buffer_increment_2'));
+
+var_dump($m->bufferIncrement(''));
+var_dump($m->getResultCode() == Memcached::RES_BAD_KEY_PROVIDED);
+
+$m->bufferIncrement('buffer_increment_3', 7);
+var_dump($m->flushBuffers());
+var_dump($m->get('buffer_increment_3'));
+
+// Freeing the instance sends what is left
+$m->bufferIncrement('buffer_increment_4', 2);
+$stats = $m->getClientStats()['counter_buffer'];
+unset($m);
+usleep(100000);
+var_dump($other->get('buffer_increment_4'));
+var_dump($stats);
+
+$m = memc_get_instance ();
+var_dump($m->setOption(Memcached::OPT_COUNTER_BUFFER_SIZE, -1));
+?>
+--EXPECTF--
+int(2)
+bool(false)
+int(1)
+bool(true)
+string(3) "100"
+string(1) "5"
+string(3) "100"
+string(1) "0"
+bool(false)
+bool(true)
+bool(true)
+string(1) "7"
+string(1) "2"
+array(4) {
+  ["buffered"]=>
+  int(106)
+  ["flushed"]=>
+  int(4)
+  ["failed"]=>
+  int(0)
+  ["pending"]=>
+  int(1)
+}
+
+Warning: Memcached::setOption(): MEMC_OPT_COUNTER_BUFFER_SIZE must be >= 0 in %s on line %d
+bool(false)
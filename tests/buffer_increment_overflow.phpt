@@ -0,0 +1,33 @@
+--TEST--
+Memcached::bufferIncrement() sends a total before it overflows
+--SKIPIF--
+<?php
+include "skipif.inc";
+if (PHP_INT_SIZE != 8) die("skip 64-bit only");
+?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance (array (
+	Memcached::OPT_COUNTER_BUFFER_SIZE => 10,
+));
+
+$m->delete('buffer_increment_overflow');
+
+$m->bufferIncrement('buffer_increment_overflow', PHP_INT_MAX);
+var_dump($m->get('buffer_increment_overflow'));
+
+// The first total is sent, the second delta waits on its own
+$m->bufferIncrement('buffer_increment_overflow', PHP_INT_MAX);
+var_dump($m->get('buffer_increment_overflow'));
+var_dump($m->getClientStats()['counter_buffer']['pending']);
+
+var_dump($m->flushBuffers());
+var_dump($m->get('buffer_increment_overflow'));
+?>
+--EXPECT--
+bool(false)
+string(19) "9223372036854775807"
+int(1)
+bool(true)
+string(20) "18446744073709551614"
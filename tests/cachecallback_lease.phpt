@@ -0,0 +1,66 @@
+--TEST--
+Memcached::get() cache callback with leases
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance (array (
+	Memcached::OPT_LEASE_TIME      => 5,
+	Memcached::OPT_LEASE_WAIT      => 20,
+	Memcached::OPT_LEASE_STALE_TTL => 60,
+));
+$other = memc_get_instance ();
+
+$key = 'lease_test';
+
+// Lease granted, the callback runs and a stale copy is kept
+var_dump($m->get($key, function ($memc, $key, &$value) {
+	$value = 'fresh';
+	return true;
+}));
+var_dump($other->get('lease.' . $key));
+var_dump($other->get('stale.' . $key));
+
+// Someone else holds the lease, the stale copy is served
+$other->delete($key);
+$other->add('lease.' . $key, '1', 10);
+
+var_dump($m->get($key, function ($memc, $key, &$value) {
+	echo "not called" . PHP_EOL;
+	return false;
+}));
+
+// No stale copy and the holder never delivers, regenerate after waiting
+$other->delete('stale.' . $key);
+
+var_dump($m->get($key, function ($memc, $key, &$value) {
+	$value = 'regenerated';
+	return true;
+}));
+
+var_dump($m->getClientStats()['lease']);
+
+var_dump($m->setOption(Memcached::OPT_LEASE_TIME, -1));
+echo "OK" . PHP_EOL;
+?>
+--EXPECTF--
+string(5) "fresh"
+bool(false)
+string(5) "fresh"
+string(5) "fresh"
+string(11) "regenerated"
+array(4) {
+  ["granted"]=>
+  int(1)
+  ["stale"]=>
+  int(1)
+  ["waited"]=>
+  int(1)
+  ["expired"]=>
+  int(1)
+}
+
+Warning: Memcached::setOption(): lease options must be >= 0 in %s on line %d
+bool(false)
+OK
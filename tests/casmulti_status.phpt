@@ -0,0 +1,79 @@
+--TEST--
+Memcached::casMulti()
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance ();
+$other = memc_get_instance ();
+
+$data = array();
+for ($i = 0; $i < 20; $i++) {
+	$data['casmulti_' . $i] = $i;
+}
+$m->delete('casmulti_missing');
+$m->setMulti($data, 60);
+
+$items = $m->getMulti(array_keys($data), Memcached::GET_EXTENDED);
+foreach ($items as $key => $item) {
+	$items[$key]['value'] = $item['value'] * 10;
+	$items[$key]['expiration'] = 60;
+}
+
+// One conflicting write and one key that no longer exists
+$other->set('casmulti_3', 'changed');
+$other->delete('casmulti_7');
+$items['casmulti_missing'] = array('value' => 1, 'cas' => $items['casmulti_1']['cas']);
+
+$result = $m->casMulti($items);
+var_dump(count($result));
+var_dump($result['casmulti_3'] === Memcached::RES_DATA_EXISTS);
+var_dump($result['casmulti_7'] === Memcached::RES_NOTFOUND);
+var_dump($result['casmulti_missing'] === Memcached::RES_NOTFOUND);
+var_dump(count(array_filter($result, function ($v) { return $v === true; })));
+
+var_dump($m->get('casmulti_0'), $m->get('casmulti_19'), $m->get('casmulti_3'));
+
+// Retrying only the conflicting key with a fresh token
+$retry = $m->getMulti(array('casmulti_3'), Memcached::GET_EXTENDED);
+$retry['casmulti_3']['value'] = 30;
+var_dump($m->casMulti($retry));
+var_dump($m->get('casmulti_3'));
+
+// A value that would be chunked is refused for its key only
+$m->setOption(Memcached::OPT_COMPRESSION, false);
+$m->setOption(Memcached::OPT_CHUNK_SIZE, 1024);
+$retry = $m->getMulti(array('casmulti_0', 'casmulti_1'), Memcached::GET_EXTENDED);
+$retry['casmulti_0']['value'] = str_repeat('a', 2048);
+$retry['casmulti_1']['value'] = 'small';
+$result = $m->casMulti($retry);
+var_dump($result['casmulti_0'] === Memcached::RES_E2BIG, $result['casmulti_1']);
+var_dump($m->get('casmulti_0'), $m->get('casmulti_1'));
+$m->setOption(Memcached::OPT_CHUNK_SIZE, 0);
+
+var_dump($m->casMulti(array('casmulti_0' => 'not an array')));
+?>
+--EXPECTF--
+int(21)
+bool(true)
+bool(true)
+bool(true)
+int(18)
+int(0)
+int(190)
+string(7) "changed"
+array(1) {
+  ["casmulti_3"]=>
+  bool(true)
+}
+int(30)
+
+Warning: Memcached::casMulti(): value of key 'casmulti_0' is longer than OPT_CHUNK_SIZE and cannot be written with a cas token in %s on line %d
+bool(true)
+bool(true)
+int(0)
+string(5) "small"
+
+Warning: Memcached::casMulti(): items must be arrays with 'value' and 'cas' elements in %s on line %d
+bool(false)
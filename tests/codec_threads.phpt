@@ -0,0 +1,70 @@
+--TEST--
+Memcached setMulti() and getMulti() with compression spread over codec threads
+--SKIPIF--
+<?php include "skipif.inc";?>
+--INI--
+memcached.codec_threads=4
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance ();
+$reader = memc_get_instance ();
+
+var_dump(ini_get('memcached.codec_threads'));
+
+$data = file_get_contents(dirname(__FILE__) . '/testdata.res');
+
+// Large enough for the batch to go to the threads
+$values = array();
+for ($i = 0; $i < 64; $i++) {
+	$values["codec_threads_$i"] = ($i % 2) ? "$i " . $data : array($i, $data);
+}
+$values['codec_threads_small'] = 'short';
+$values['codec_threads_random'] = random_bytes(4096);
+
+foreach (array ('fastlz' => Memcached::COMPRESSION_FASTLZ, 'zlib' => Memcached::COMPRESSION_ZLIB) as $name => $type) {
+	$m->setOption(Memcached::OPT_COMPRESSION_TYPE, $type);
+
+	$before = $m->getClientStats()['codec_pool'];
+	var_dump($m->setMulti($values));
+	$after = $m->getClientStats()['codec_pool'];
+	echo "$name setMulti pooled: ";
+	var_dump($after['batches'] > $before['batches'], $after['values'] >= 64);
+
+	// Compressed values are applied after the others
+	$before = $reader->getClientStats()['codec_pool'];
+	$read = $reader->getMulti(array_keys($values));
+	$after = $reader->getClientStats()['codec_pool'];
+	ksort($read);
+	ksort($values);
+	echo "$name getMulti: ";
+	var_dump($read === $values);
+	echo "$name getMulti pooled: ";
+	var_dump($after['batches'] - $before['batches'], $after['values'] - $before['values'] >= 64);
+
+	// Single values take the same codecs on the PHP thread
+	$before = $after;
+	echo "$name get: ";
+	var_dump($reader->get('codec_threads_1') === $values['codec_threads_1']);
+	echo "$name get pooled: ";
+	var_dump($reader->getClientStats()['codec_pool'] === $before);
+}
+?>
+--EXPECT--
+string(1) "4"
+bool(true)
+fastlz setMulti pooled: bool(true)
+bool(true)
+fastlz getMulti: bool(true)
+fastlz getMulti pooled: int(1)
+bool(true)
+fastlz get: bool(true)
+fastlz get pooled: bool(true)
+bool(true)
+zlib setMulti pooled: bool(true)
+bool(true)
+zlib getMulti: bool(true)
+zlib getMulti pooled: int(1)
+bool(true)
+zlib get: bool(true)
+zlib get pooled: bool(true)
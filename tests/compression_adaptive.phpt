@@ -0,0 +1,56 @@
+--TEST--
+Memcached adaptive compression
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance (array (
+	Memcached::OPT_COMPRESSION_TYPE     => Memcached::COMPRESSION_FASTLZ,
+	Memcached::OPT_COMPRESSION_ADAPTIVE => true,
+));
+
+var_dump($m->getOption(Memcached::OPT_COMPRESSION_ADAPTIVE));
+
+$text = str_repeat('compressible ', 500);
+$m->set('adaptive_text', $text);
+
+// Passes the entropy check but fastlz cannot shrink it, about the size of $text
+for ($i = 0; $i < 4; $i++) {
+	$m->set('adaptive_base64', base64_encode(random_bytes(4800)));
+}
+
+// Strings of another size keep their own history
+$long = str_repeat('compressible ', 2000);
+$m->set('adaptive_long', $long);
+
+// Other value types keep their own history
+$m->set('adaptive_array', array_fill(0, 500, 'value'));
+
+// Strings of this size are now only tried every 16th write
+for ($i = 0; $i < 16; $i++) {
+	$m->set('adaptive_text', $text);
+}
+var_dump($m->get('adaptive_text') === $text);
+var_dump($m->get('adaptive_long') === $long);
+
+// Looks random, so it is not even tried, nor counted as a failure
+for ($i = 0; $i < 5; $i++) {
+	$m->set('adaptive_random', random_bytes(6400));
+}
+$m->set('adaptive_text', $text);
+
+var_dump($m->getClientStats()['compression']);
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+array(3) {
+  ["attempted"]=>
+  int(9)
+  ["successful"]=>
+  int(5)
+  ["skipped"]=>
+  int(20)
+}
@@ -0,0 +1,60 @@
+--TEST--
+Memcached zstd compression dictionaries
+--SKIPIF--
+<?php
+include "skipif.inc";
+if (!Memcached::HAVE_ZSTD) die ("skip no zstd support");
+?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$dictionary = dirname (__FILE__) . '/testdata.dict';
+
+$m = memc_get_instance (array (
+	Memcached::OPT_SERIALIZER               => Memcached::SERIALIZER_PHP,
+	Memcached::OPT_COMPRESSION_DICTIONARIES => array ('user:' => $dictionary),
+));
+$other = memc_get_instance (array (
+	Memcached::OPT_SERIALIZER => Memcached::SERIALIZER_PHP,
+));
+
+var_dump($m->getOption(Memcached::OPT_COMPRESSION_DICTIONARIES) === array ('user:' => $dictionary));
+
+// Well below compression_threshold, only keys covered by the dictionary get compressed
+$value = array ('id' => 1, 'name' => 'alice', 'email' => 'alice@example.com', 'status' => 'active');
+$m->set('user:1', $value);
+$m->set('other:1', $value);
+
+var_dump($m->get('user:1') === $value);
+var_dump($other->get('other:1') === $value);
+
+// Readers need the dictionary named in the value
+var_dump($other->get('user:1'));
+
+$other->setOption(Memcached::OPT_COMPRESSION_DICTIONARIES, $dictionary);
+var_dump($other->get('user:1') === $value);
+
+// A failed load keeps the current dictionaries
+var_dump($m->setOption(Memcached::OPT_COMPRESSION_DICTIONARIES, array ('user:' => dirname (__FILE__) . '/testdata.res')));
+var_dump($m->getOption(Memcached::OPT_COMPRESSION_DICTIONARIES) === array ('user:' => $dictionary));
+
+var_dump($m->setOption(Memcached::OPT_COMPRESSION_DICTIONARIES, null));
+var_dump($m->getOption(Memcached::OPT_COMPRESSION_DICTIONARIES));
+echo "OK" . PHP_EOL;
+?>
+--EXPECTF--
+bool(true)
+bool(true)
+bool(true)
+
+Warning: Memcached::get(): could not decompress value: zstd dictionary %d is not loaded in %s on line %d
+bool(false)
+bool(true)
+
+Warning: Memcached::setOption(): %s is not a trained zstd dictionary in %s on line %d
+bool(false)
+bool(true)
+bool(true)
+array(0) {
+}
+OK
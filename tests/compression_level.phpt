@@ -0,0 +1,37 @@
+--TEST--
+Memcached compression levels for fastlz and zlib
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance ();
+$reader = memc_get_instance ();
+
+$data = file_get_contents(dirname(__FILE__) . '/testdata.res');
+$random = random_bytes(4096);
+
+foreach (array ('fastlz' => Memcached::COMPRESSION_FASTLZ, 'zlib' => Memcached::COMPRESSION_ZLIB) as $name => $type) {
+	$m->setOption(Memcached::OPT_COMPRESSION_TYPE, $type);
+
+	foreach (array (0, 1, 2, 9) as $level) {
+		$m->setOption(Memcached::OPT_COMPRESSION_LEVEL, $level);
+
+		// Does not fit in the room given to the codec, so it is stored as is
+		$m->set('compression_level_random', $random);
+		$m->set('compression_level', $data);
+
+		echo "$name $level: ";
+		var_dump($reader->get('compression_level') === $data && $reader->get('compression_level_random') === $random);
+	}
+}
+?>
+--EXPECT--
+fastlz 0: bool(true)
+fastlz 1: bool(true)
+fastlz 2: bool(true)
+fastlz 9: bool(true)
+zlib 0: bool(true)
+zlib 1: bool(true)
+zlib 2: bool(true)
+zlib 9: bool(true)
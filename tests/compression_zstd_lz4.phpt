@@ -0,0 +1,58 @@
+--TEST--
+Memcached zstd and lz4 compression
+--SKIPIF--
+<?php
+include "skipif.inc";
+if (!Memcached::HAVE_ZSTD && !Memcached::HAVE_LZ4) die ("skip no zstd or lz4 support");
+?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance ();
+
+$data = file_get_contents(dirname(__FILE__) . '/testdata.res');
+
+$types = array (Memcached::COMPRESSION_ZLIB, Memcached::COMPRESSION_FASTLZ);
+if (Memcached::HAVE_ZSTD) {
+	$types[] = Memcached::COMPRESSION_ZSTD;
+}
+if (Memcached::HAVE_LZ4) {
+	$types[] = Memcached::COMPRESSION_LZ4;
+}
+
+// Values are readable whatever compression type the reader has set
+$ok = true;
+foreach ($types as $set_type) {
+	foreach ($types as $get_type) {
+		$m->setOption(Memcached::OPT_COMPRESSION_TYPE, $set_type);
+		$m->set('zstd_lz4', $data);
+		$m->setOption(Memcached::OPT_COMPRESSION_TYPE, $get_type);
+		if ($m->get('zstd_lz4') !== $data) {
+			echo "Mismatch set=$set_type get=$get_type" . PHP_EOL;
+			$ok = false;
+		}
+	}
+}
+var_dump($ok);
+
+var_dump($m->getOption(Memcached::OPT_COMPRESSION_LEVEL));
+var_dump($m->setOption(Memcached::OPT_COMPRESSION_LEVEL, 19));
+var_dump($m->getOption(Memcached::OPT_COMPRESSION_LEVEL));
+
+$m->setOption(Memcached::OPT_COMPRESSION_TYPE, end ($types));
+$m->set('zstd_lz4', $data);
+var_dump($m->get('zstd_lz4') === $data);
+
+var_dump($m->setOption(Memcached::OPT_COMPRESSION_LEVEL, 23));
+echo "OK" . PHP_EOL;
+?>
+--EXPECTF--
+bool(true)
+int(0)
+bool(true)
+int(19)
+bool(true)
+
+Warning: Memcached::setOption(): MEMC_OPT_COMPRESSION_LEVEL must be between 0 and 22 in %s on line %d
+bool(false)
+OK
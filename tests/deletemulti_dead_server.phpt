@@ -0,0 +1,62 @@
+--TEST--
+Memcached::deleteMulti() leaves a server that cannot be reached to libmemcached
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance (array (
+	Memcached::OPT_CONNECT_TIMEOUT       => 100,
+	Memcached::OPT_RETRY_TIMEOUT         => 60,
+	Memcached::OPT_SERVER_FAILURE_LIMIT  => 1,
+));
+// Nothing listens there
+$m->addServer('127.0.0.1', 7312);
+
+$live = $dead = array();
+for ($i = 0; $i < 40; $i++) {
+	$key = 'deletemulti_dead_' . $i;
+	$server = $m->getServerByKey($key);
+
+	if ($server['port'] == 7312) {
+		$dead[] = $key;
+	} else {
+		$live[] = $key;
+		$m->set($key, $i);
+	}
+}
+var_dump(count($live) > 0, count($dead) > 0);
+
+function results($result, $keys) {
+	$codes = array();
+	foreach ($keys as $key) {
+		$codes[] = $result[$key] === true ? 'deleted' : ($result[$key] === Memcached::RES_NOTFOUND ? 'missing' : 'failed');
+	}
+	return array_unique($codes);
+}
+
+// The commands of the unreachable server went through libmemcached, which now knows it is down
+$result = $m->deleteMulti(array_merge($live, $dead));
+var_dump(results($result, $live), results($result, $dead));
+
+$result = $m->deleteMulti($dead);
+$disabled = 0;
+foreach ($result as $value) {
+	if ($value === Memcached::RES_SERVER_TEMPORARILY_DISABLED || $value === Memcached::RES_SERVER_MARKED_DEAD) {
+		$disabled++;
+	}
+}
+var_dump($disabled == count($dead));
+?>
+--EXPECT--
+bool(true)
+bool(true)
+array(1) {
+  [0]=>
+  string(7) "deleted"
+}
+array(1) {
+  [0]=>
+  string(6) "failed"
+}
+bool(true)
@@ -0,0 +1,55 @@
+--TEST--
+Memcached::deleteMulti() with a mix of existing and missing keys
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance ();
+
+$keys = array();
+$data = array();
+for ($i = 0; $i < 200; $i++) {
+	$keys[] = 'deletemulti_pipelined_' . $i;
+	if ($i % 2) {
+		$data['deletemulti_pipelined_' . $i] = $i;
+	}
+}
+
+$m->deleteMulti($keys);
+$m->setMulti($data, 60);
+
+$result = $m->deleteMulti($keys);
+var_dump(count($result));
+var_dump(array_keys($result) === $keys);
+
+$deleted = $missing = 0;
+foreach ($result as $key => $value) {
+	if ($value === true && isset($data[$key])) {
+		$deleted++;
+	}
+	if ($value === Memcached::RES_NOTFOUND && !isset($data[$key])) {
+		$missing++;
+	}
+}
+var_dump($deleted, $missing);
+var_dump($m->getMulti($keys));
+
+// The connection is still usable afterwards
+var_dump($m->set('deletemulti_pipelined_after', 'value'));
+var_dump($m->get('deletemulti_pipelined_after'));
+var_dump($m->deleteMulti(array('deletemulti_pipelined_after')));
+?>
+--EXPECT--
+int(200)
+bool(true)
+int(100)
+int(100)
+array(0) {
+}
+bool(true)
+string(5) "value"
+array(1) {
+  ["deletemulti_pipelined_after"]=>
+  bool(true)
+}
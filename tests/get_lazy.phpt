@@ -0,0 +1,89 @@
+--TEST--
+Memcached::getMulti() with GET_LAZY decodes values on first access
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance ();
+
+class LazyFoo {
+	public $name;
+
+	function __construct($name) {
+		$this->name = $name;
+	}
+
+	function __wakeup() {
+		echo "wakeup {$this->name}" . PHP_EOL;
+	}
+}
+
+$m->setMulti(array(
+	'lazy_foo' => new LazyFoo('foo'),
+	'lazy_bar' => new LazyFoo('bar'),
+	'lazy_baz' => str_repeat('baz', 1000),
+));
+
+$values = $m->getMulti(array('lazy_foo', 'lazy_bar', 'lazy_baz', 'lazy_missing'), Memcached::GET_LAZY);
+echo "fetched" . PHP_EOL;
+
+ksort($values);
+var_dump(array_keys($values));
+var_dump($values['lazy_foo'] instanceof MemcachedLazyValue);
+
+// Only the value that is used gets unserialized, and only once
+var_dump($values['lazy_foo']->getValue()->name);
+var_dump($values['lazy_foo']->getValue()->name);
+var_dump(strlen($values['lazy_baz']->getValue()));
+
+$values = $m->getMulti(array('lazy_baz'), Memcached::GET_LAZY | Memcached::GET_EXTENDED);
+var_dump(strlen($values['lazy_baz']['value']->getValue()), is_int($values['lazy_baz']['cas']));
+
+// Values filled in by the cache callback are wrapped as well
+$values = $m->getMulti(array('lazy_missing'), Memcached::GET_LAZY, function ($m, $keys, &$expirations) {
+	return array('lazy_missing' => 'filled');
+});
+var_dump($values['lazy_missing']->getValue());
+$m->delete('lazy_missing');
+
+// Reads made from inside the callback are not lazy unless they ask for it
+$values = $m->getMulti(array('lazy_missing'), Memcached::GET_LAZY, function ($m, $keys, &$expirations) {
+	var_dump($m->get('lazy_baz') === str_repeat('baz', 1000));
+	var_dump(is_string($m->getMulti(array('lazy_baz'))['lazy_baz']));
+	return array('lazy_missing' => 'filled');
+});
+var_dump($values['lazy_missing'] instanceof MemcachedLazyValue);
+$m->delete('lazy_missing');
+
+try {
+	serialize($values['lazy_missing']);
+} catch (Exception $e) {
+	echo $e->getMessage() . PHP_EOL;
+}
+
+echo "OK" . PHP_EOL;
+?>
+--EXPECT--
+fetched
+array(3) {
+  [0]=>
+  string(8) "lazy_bar"
+  [1]=>
+  string(8) "lazy_baz"
+  [2]=>
+  string(8) "lazy_foo"
+}
+bool(true)
+wakeup foo
+string(3) "foo"
+string(3) "foo"
+int(3000)
+int(3000)
+bool(true)
+string(6) "filled"
+bool(true)
+bool(true)
+bool(true)
+Serialization of 'MemcachedLazyValue' is not allowed
+OK
@@ -0,0 +1,63 @@
+--TEST--
+Memcached::getIterator() streams results
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance ();
+
+$data = array(
+	'iter_foo' => 'foo-data',
+	'iter_bar' => 42,
+	'iter_baz' => array('baz'),
+);
+$m->setMulti($data);
+
+$it = $m->getIterator(array('iter_foo', 'iter_bar', 'iter_missing', 'iter_baz'));
+var_dump($it instanceof Traversable);
+
+$results = array();
+foreach ($it as $key => $value) {
+	$results[$key] = $value;
+}
+ksort($results);
+var_dump($results);
+
+// Exhausted iterators stay exhausted
+foreach ($it as $key => $value) {
+	echo "not reached" . PHP_EOL;
+}
+
+foreach ($m->getIterator(array('iter_foo'), Memcached::GET_EXTENDED) as $key => $value) {
+	var_dump($key, $value['value'], is_int($value['cas']), $value['flags']);
+}
+
+foreach ($m->getIterator(array()) as $value) {
+	echo "not reached" . PHP_EOL;
+}
+var_dump($m->getResultCode() == Memcached::RES_NOTFOUND);
+
+echo "OK" . PHP_EOL;
+?>
+--EXPECTF--
+bool(true)
+array(3) {
+  ["iter_bar"]=>
+  int(42)
+  ["iter_baz"]=>
+  array(1) {
+    [0]=>
+    string(3) "baz"
+  }
+  ["iter_foo"]=>
+  string(8) "foo-data"
+}
+
+Warning: MemcachedIterator::rewind(): cannot rewind an iterator that has already advanced in %s on line %d
+string(8) "iter_foo"
+string(8) "foo-data"
+bool(true)
+int(0)
+bool(true)
+OK
@@ -0,0 +1,49 @@
+--TEST--
+Memcached::getIterator() keeps other requests off its results
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance ();
+
+$m->setMulti(array('iter_busy_1' => 1, 'iter_busy_2' => 2, 'iter_busy_3' => 3));
+
+try {
+	unserialize('O:17:"MemcachedIterator":0:{}');
+} catch (Exception $e) {
+	echo $e->getMessage() . PHP_EOL;
+}
+
+$it = $m->getIterator(array('iter_busy_1', 'iter_busy_2', 'iter_busy_3'));
+var_dump($it->valid());
+
+var_dump($m->get('iter_busy_1'));
+var_dump($m->set('iter_busy_4', 4));
+var_dump($m->getResultCode() == Memcached::RES_SUCCESS);
+
+// Dropping the iterator reads what is left and frees the instance
+unset($it);
+var_dump($m->get('iter_busy_2'));
+var_dump($m->set('iter_busy_4', 4));
+
+// So does reading all results
+foreach ($m->getIterator(array('iter_busy_1', 'iter_busy_4')) as $key => $value) {
+}
+var_dump($m->get('iter_busy_4'));
+echo "OK" . PHP_EOL;
+?>
+--EXPECTF--
+Unserialization of 'MemcachedIterator' is not allowed
+bool(true)
+
+Warning: Memcached::get(): cannot send requests while an iterator is reading results in %s on line %d
+NULL
+
+Warning: Memcached::set(): cannot send requests while an iterator is reading results in %s on line %d
+NULL
+bool(true)
+int(2)
+bool(true)
+int(4)
+OK
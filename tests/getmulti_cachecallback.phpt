@@ -0,0 +1,62 @@
+--TEST--
+Memcached::getMulti() with cache callback
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance ();
+
+$m->set('multi_cb_1', 'stored');
+$m->delete('multi_cb_2');
+$m->delete('multi_cb_3');
+
+$calls = 0;
+$result = $m->getMulti(array('multi_cb_1', 'multi_cb_2', 'multi_cb_3'), Memcached::GET_PRESERVE_ORDER,
+	function (Memcached $memc, array $keys, array &$expirations) use (&$calls) {
+		$calls++;
+		var_dump($keys);
+		$expirations['multi_cb_2'] = 100;
+		return array(
+			'multi_cb_2' => 'loaded',
+			'multi_cb_1' => 'ignored',
+			'unrelated'  => 'ignored',
+		);
+	});
+
+var_dump($result);
+var_dump($m->getResultCode() == Memcached::RES_SUCCESS);
+
+// Written back, the callback is not needed again for this key
+var_dump($m->get('multi_cb_2'));
+var_dump($m->get('unrelated'));
+
+$result = $m->getMulti(array('multi_cb_1', 'multi_cb_2'), 0, function () use (&$calls) {
+	$calls++;
+	return array();
+});
+var_dump(count($result), $calls);
+
+echo "OK" . PHP_EOL;
+?>
+--EXPECT--
+array(2) {
+  [0]=>
+  string(10) "multi_cb_2"
+  [1]=>
+  string(10) "multi_cb_3"
+}
+array(3) {
+  ["multi_cb_1"]=>
+  string(6) "stored"
+  ["multi_cb_2"]=>
+  string(6) "loaded"
+  ["multi_cb_3"]=>
+  NULL
+}
+bool(true)
+string(6) "loaded"
+bool(false)
+int(2)
+int(1)
+OK
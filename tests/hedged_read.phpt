@@ -0,0 +1,87 @@
+--TEST--
+Memcached hedged reads go to the replica when the primary stalls
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+
+// Accepts connections but never answers
+$stall = stream_socket_server('tcp://127.0.0.1:0');
+list (, $stall_port) = explode(':', stream_socket_get_name($stall, false));
+
+$m = new Memcached();
+$m->setOptions(array (
+	Memcached::OPT_BINARY_PROTOCOL    => true,
+	Memcached::OPT_NUMBER_OF_REPLICAS => 1,
+	Memcached::OPT_HEDGE_DELAY        => 50,
+	Memcached::OPT_POLL_TIMEOUT       => 500,
+));
+$m->addServer('127.0.0.1', (int) $stall_port);
+$m->addServer(MEMC_SERVER_HOST, MEMC_SERVER_PORT);
+
+var_dump($m->getOption(Memcached::OPT_HEDGE_DELAY));
+
+// A key whose primary is the stalled server, with its replica on the real one
+for ($i = 0; ; $i++) {
+	$key = "hedged_read_{$i}";
+	$server = $m->getServerByKey($key);
+	if ($server['port'] == $stall_port) {
+		break;
+	}
+}
+
+// libmemcached writes the copies, with the real server standing in for the stalled one
+$writer = new Memcached();
+$writer->setOptions(array (
+	Memcached::OPT_BINARY_PROTOCOL    => true,
+	Memcached::OPT_NUMBER_OF_REPLICAS => 1,
+));
+$writer->addServer(MEMC_SERVER_HOST, MEMC_SERVER_PORT);
+$writer->addServer(MEMC_SERVER_HOST, MEMC_SERVER_PORT);
+$writer->flush();
+var_dump($writer->set($key, 'from replica'));
+
+var_dump($m->get($key));
+var_dump($m->getResultCode() == Memcached::RES_SUCCESS);
+var_dump($m->getClientStats()['hedge']);
+
+// A key the real server answers as missing is not asked again
+for ($i = 0; ; $i++) {
+	$missing = "hedged_read_missing_{$i}";
+	$server = $m->getServerByKey($missing);
+	if ($server['port'] != $stall_port) {
+		break;
+	}
+}
+var_dump($m->get($missing));
+var_dump($m->getClientStats()['hedge']['hedged']);
+
+var_dump($m->setOption(Memcached::OPT_HEDGE_DELAY, -1));
+var_dump($m->setOption(Memcached::OPT_HEDGE_PERCENTILE, 101));
+?>
+--EXPECTF--
+int(50)
+bool(true)
+string(12) "from replica"
+bool(true)
+array(5) {
+  ["reads"]=>
+  int(1)
+  ["hedged"]=>
+  int(1)
+  ["wins"]=>
+  int(1)
+  ["keys"]=>
+  int(1)
+  ["delay"]=>
+  int(50)
+}
+bool(false)
+int(1)
+
+Warning: Memcached::setOption(): MEMC_OPT_HEDGE_DELAY must be >= 0 in %s on line %d
+bool(false)
+
+Warning: Memcached::setOption(): MEMC_OPT_HEDGE_PERCENTILE must be between 0 and 100 in %s on line %d
+bool(false)
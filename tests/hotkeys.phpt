@@ -0,0 +1,58 @@
+--TEST--
+Memcached::getHotKeys()
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance (array (
+	Memcached::OPT_HOT_KEYS_SIZE        => 3,
+	Memcached::OPT_HOT_KEYS_SAMPLE_RATE => 1,
+));
+
+var_dump($m->getOption(Memcached::OPT_HOT_KEYS_SIZE));
+var_dump($m->getHotKeys());
+
+$m->set('hot_key', str_repeat('x', 10));
+for ($i = 0; $i < 20; $i++) {
+	$m->get('hot_key');
+}
+for ($i = 0; $i < 5; $i++) {
+	$m->set("cold_key_$i", 'v');
+	$m->get("cold_key_$i");
+}
+
+$hot = $m->getHotKeys(1);
+var_dump(array_keys($hot));
+var_dump($hot['hot_key']['count'], $hot['hot_key']['bytes']);
+var_dump(count($m->getHotKeys(10)));
+
+$m->setOption(Memcached::OPT_HOT_KEYS_SIZE, 0);
+var_dump($m->getHotKeys());
+
+var_dump($m->setOption(Memcached::OPT_HOT_KEYS_SAMPLE_RATE, 0));
+var_dump($m->setOption(Memcached::OPT_HOT_KEYS_SIZE, 65537));
+var_dump($m->getOption(Memcached::OPT_HOT_KEYS_SIZE));
+echo "OK" . PHP_EOL;
+?>
+--EXPECTF--
+int(3)
+array(0) {
+}
+array(1) {
+  [0]=>
+  string(7) "hot_key"
+}
+int(21)
+int(210)
+int(3)
+array(0) {
+}
+
+Warning: Memcached::setOption(): MEMC_OPT_HOT_KEYS_SAMPLE_RATE must be > 0 in %s on line %d
+bool(false)
+
+Warning: Memcached::setOption(): MEMC_OPT_HOT_KEYS_SIZE must be between 0 and 65536 in %s on line %d
+bool(false)
+int(0)
+OK
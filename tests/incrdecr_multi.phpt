@@ -0,0 +1,118 @@
+--TEST--
+Memcached::incrementMulti() Memcached::decrementMulti()
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+
+foreach (array(false, true) as $binary) {
+	$m = memc_get_instance (array (
+								Memcached::OPT_BINARY_PROTOCOL => $binary
+							));
+	echo $binary ? "binary" : "ascii", PHP_EOL;
+
+	$m->deleteMulti(array('incrmulti_a', 'incrmulti_b', 'incrmulti_c', 'incrmulti_missing'));
+	$m->set('incrmulti_a', 10);
+	$m->set('incrmulti_b', 100);
+
+	var_dump($m->incrementMulti(array('incrmulti_a' => 1, 'incrmulti_b' => 5, 'incrmulti_missing' => 1)));
+	var_dump($m->getResultCode() == Memcached::RES_NOTFOUND);
+
+	var_dump($m->decrementMulti(array('incrmulti_a' => 2, 'incrmulti_b' => 95)));
+
+	// Missing counters start at the initial value
+	var_dump($m->incrementMulti(array('incrmulti_a' => 1, 'incrmulti_c' => 1), 40, 60));
+	var_dump($m->incrementMulti(array('incrmulti_c' => 2), 40, 60));
+	var_dump($m->decrementMulti(array('incrmulti_c' => 50), 0, 60));
+
+	// Every key gets the reply of its own increment, a value that is not a number fails alone
+	$m->set('incrmulti_text', 'text');
+	$result = $m->incrementMulti(array('incrmulti_text' => 1, 'incrmulti_a' => 1), 0, 60);
+	var_dump($result['incrmulti_text'], $result['incrmulti_a']);
+	var_dump($m->getResultCode() != Memcached::RES_SUCCESS);
+	var_dump($m->get('incrmulti_text'));
+
+	var_dump($m->incrementMulti(array()));
+	var_dump($m->incrementMulti(array('incrmulti_a' => -1)));
+}
+?>
+--EXPECTF--
+ascii
+array(3) {
+  ["incrmulti_a"]=>
+  int(11)
+  ["incrmulti_b"]=>
+  int(105)
+  ["incrmulti_missing"]=>
+  bool(false)
+}
+bool(true)
+array(2) {
+  ["incrmulti_a"]=>
+  int(9)
+  ["incrmulti_b"]=>
+  int(10)
+}
+array(2) {
+  ["incrmulti_a"]=>
+  int(10)
+  ["incrmulti_c"]=>
+  int(40)
+}
+array(1) {
+  ["incrmulti_c"]=>
+  int(42)
+}
+array(1) {
+  ["incrmulti_c"]=>
+  int(0)
+}
+bool(false)
+int(11)
+bool(true)
+string(4) "text"
+array(0) {
+}
+
+Warning: Memcached::incrementMulti(): offset cannot be a negative value in %s on line %d
+bool(false)
+binary
+array(3) {
+  ["incrmulti_a"]=>
+  int(11)
+  ["incrmulti_b"]=>
+  int(105)
+  ["incrmulti_missing"]=>
+  bool(false)
+}
+bool(true)
+array(2) {
+  ["incrmulti_a"]=>
+  int(9)
+  ["incrmulti_b"]=>
+  int(10)
+}
+array(2) {
+  ["incrmulti_a"]=>
+  int(10)
+  ["incrmulti_c"]=>
+  int(40)
+}
+array(1) {
+  ["incrmulti_c"]=>
+  int(42)
+}
+array(1) {
+  ["incrmulti_c"]=>
+  int(0)
+}
+bool(false)
+int(11)
+bool(true)
+string(4) "text"
+array(0) {
+}
+
+Warning: Memcached::incrementMulti(): offset cannot be a negative value in %s on line %d
+bool(false)
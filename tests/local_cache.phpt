@@ -0,0 +1,68 @@
+--TEST--
+Memcached local read-through cache
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance (array (
+	Memcached::OPT_LOCAL_CACHE_SIZE => 2,
+	Memcached::OPT_LOCAL_CACHE_TTL  => 60000,
+));
+$other = memc_get_instance ();
+
+var_dump($m->getOption(Memcached::OPT_LOCAL_CACHE_SIZE));
+var_dump($m->getOption(Memcached::OPT_LOCAL_CACHE_TTL));
+
+$m->set('local_cache_1', 'first');
+var_dump($m->get('local_cache_1'));
+
+// Changed behind our back, the local copy is still served
+$other->set('local_cache_1', 'changed');
+var_dump($m->get('local_cache_1'));
+
+// Own writes invalidate the local copy
+$m->set('local_cache_1', 'second');
+var_dump($m->get('local_cache_1'));
+
+$other->set('local_cache_2', 'two');
+$other->set('local_cache_3', 'three');
+var_dump($m->getMulti(array('local_cache_1', 'local_cache_2', 'local_cache_3')));
+
+$m->delete('local_cache_1');
+var_dump($m->get('local_cache_1'));
+
+var_dump($m->getClientStats()['local_cache']);
+
+var_dump($m->setOption(Memcached::OPT_LOCAL_CACHE_TTL, 0));
+echo "OK" . PHP_EOL;
+?>
+--EXPECTF--
+int(2)
+int(60000)
+string(5) "first"
+string(5) "first"
+string(6) "second"
+array(3) {
+  ["local_cache_1"]=>
+  string(6) "second"
+  ["local_cache_2"]=>
+  string(3) "two"
+  ["local_cache_3"]=>
+  string(5) "three"
+}
+bool(false)
+array(4) {
+  ["hits"]=>
+  int(2)
+  ["misses"]=>
+  int(5)
+  ["evictions"]=>
+  int(1)
+  ["entries"]=>
+  int(2)
+}
+
+Warning: Memcached::setOption(): MEMC_OPT_LOCAL_CACHE_TTL must be > 0 in %s on line %d
+bool(false)
+OK
@@ -0,0 +1,67 @@
+--TEST--
+Memcached negative result cache
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance (array (
+	Memcached::OPT_NEGATIVE_CACHE_SIZE => 10,
+	Memcached::OPT_NEGATIVE_CACHE_TTL  => 60000,
+));
+$other = memc_get_instance ();
+
+var_dump($m->get('negative_1'));
+var_dump($m->getResultCode() == Memcached::RES_NOTFOUND);
+
+// Created behind our back, still known to be missing
+$other->set('negative_1', 'exists');
+var_dump($m->get('negative_1'));
+
+// Own writes clear the entry
+$m->set('negative_1', 'mine');
+var_dump($m->get('negative_1'));
+
+$m->set('negative_2', 'two');
+var_dump($m->getMulti(array('negative_2', 'negative_3'), Memcached::GET_PRESERVE_ORDER));
+$other->set('negative_3', 'three');
+var_dump($m->getMulti(array('negative_2', 'negative_3'), Memcached::GET_PRESERVE_ORDER));
+
+// Misses are still handed to the cache callback
+var_dump($m->getMulti(array('negative_3'), 0, function ($memc, $keys, &$expirations) {
+	return array('negative_3' => 'loaded');
+}));
+var_dump($m->get('negative_3'));
+
+var_dump($m->getClientStats()['negative_cache']);
+echo "OK" . PHP_EOL;
+?>
+--EXPECT--
+bool(false)
+bool(true)
+bool(false)
+string(4) "mine"
+array(2) {
+  ["negative_2"]=>
+  string(3) "two"
+  ["negative_3"]=>
+  NULL
+}
+array(2) {
+  ["negative_2"]=>
+  string(3) "two"
+  ["negative_3"]=>
+  NULL
+}
+array(1) {
+  ["negative_3"]=>
+  string(6) "loaded"
+}
+string(6) "loaded"
+array(2) {
+  ["hits"]=>
+  int(3)
+  ["entries"]=>
+  int(0)
+}
+OK
@@ -0,0 +1,33 @@
+--TEST--
+Memcached negative result cache skips the keys of failed servers
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance (array (
+	Memcached::OPT_NEGATIVE_CACHE_SIZE => 100,
+	Memcached::OPT_NEGATIVE_CACHE_TTL  => 60000,
+	Memcached::OPT_CONNECT_TIMEOUT     => 100,
+));
+// Nothing listens there
+$m->addServer('127.0.0.1', 7312);
+
+$keys = array();
+for ($i = 0; $i < 20; $i++) {
+	$keys[] = "negative_unconfirmed_$i";
+}
+
+var_dump($m->getMulti($keys));
+var_dump($m->getResultCode() == Memcached::RES_SOME_ERRORS);
+
+// The keys the live server did not find are not remembered either, the result was partial
+var_dump($m->getClientStats()['negative_cache']['entries']);
+echo "OK" . PHP_EOL;
+?>
+--EXPECT--
+array(0) {
+}
+bool(true)
+int(0)
+OK
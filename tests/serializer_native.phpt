@@ -0,0 +1,71 @@
+--TEST--
+Memcached native serializer
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance (array (
+	Memcached::OPT_SERIALIZER => Memcached::SERIALIZER_NATIVE,
+));
+$php = memc_get_instance (array (
+	Memcached::OPT_SERIALIZER => Memcached::SERIALIZER_PHP,
+));
+
+$records = array ();
+for ($i = 0; $i < 100; $i++) {
+	$records[] = array ('id' => $i, 'name' => "user $i", 'status' => $i % 2 ? 'active' : 'inactive', 'score' => $i / 3);
+}
+
+$values = array (
+	'list'     => array (1, -2, PHP_INT_MAX, PHP_INT_MIN, 0.5, 'x', '', null, true, false),
+	'records'  => $records,
+	'holes'    => array (1 => 'a', 2 => 'b', 0 => 'c'),
+	'keys'     => array (-5 => 'negative', '10' => 'numeric string', 'ten' => 10, '' => 'empty key'),
+	'nested'   => array ('a' => array ('b' => array ('c' => array ()))),
+	'long'     => array (str_repeat ('long string ', 100), str_repeat ('long string ', 100)),
+	'repeated' => array ('same', 'same', 'same' => 'same'),
+);
+
+$ok = true;
+foreach ($values as $key => $value) {
+	$m->set("serializer_native_$key", $value);
+
+	// Readers decode native values whatever serializer they write with
+	if ($m->get("serializer_native_$key") !== $value || $php->get("serializer_native_$key") !== $value) {
+		echo "Mismatch for $key" . PHP_EOL;
+		$ok = false;
+	}
+}
+var_dump($ok);
+
+// Objects and shared references are left to php serialize
+$object = new stdClass;
+$object->list = array (1, 2, 3);
+$m->set('serializer_native_object', array ('object' => $object));
+var_dump($m->get('serializer_native_object'));
+
+$shared = 'shared';
+$refs = array (&$shared, &$shared);
+$m->set('serializer_native_refs', $refs);
+$refs = $m->get('serializer_native_refs');
+$refs[0] = 'changed';
+var_dump($refs[1]);
+?>
+--EXPECTF--
+bool(true)
+array(1) {
+  ["object"]=>
+  object(stdClass)#%d (1) {
+    ["list"]=>
+    array(3) {
+      [0]=>
+      int(1)
+      [1]=>
+      int(2)
+      [2]=>
+      int(3)
+    }
+  }
+}
+string(7) "changed"
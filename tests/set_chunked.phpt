@@ -0,0 +1,66 @@
+--TEST--
+Memcached stores values over OPT_CHUNK_SIZE in chunks
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance (array (
+	Memcached::OPT_COMPRESSION => false,
+	Memcached::OPT_CHUNK_SIZE  => 100000,
+));
+$plain = memc_get_instance ();
+
+var_dump($m->getOption(Memcached::OPT_CHUNK_SIZE));
+
+// Larger than the default item size limit of the server
+$key   = 'set_chunked';
+$value = str_repeat("foo bar", 1024 * 1024);
+
+var_dump($m->set($key, $value, 360));
+var_dump($m->get($key) === $value);
+
+// Reading does not depend on the option
+var_dump($plain->get($key) === $value);
+
+$m->set('set_chunked_small', 'small');
+var_dump($m->getMulti(array($key, 'set_chunked_small')) === array($key => $value, 'set_chunked_small' => 'small'));
+
+$value = str_repeat("bar foo", 512 * 1024);
+var_dump($m->replace($key, $value));
+var_dump($m->get($key) === $value);
+
+$m->getDelayed(array($key));
+$all = $m->fetchAll();
+var_dump($all[0]['value'] === $value);
+
+var_dump($m->delete($key));
+var_dump($m->get($key));
+
+// A chunk the server refuses fails the write before the manifest is stored
+var_dump($m->setOption(Memcached::OPT_CHUNK_SIZE, 4 * 1024 * 1024));
+$m->delete('set_chunked_huge');
+var_dump($m->set('set_chunked_huge', random_bytes(5 * 1024 * 1024)));
+var_dump($m->getResultCode() != Memcached::RES_SUCCESS);
+var_dump($plain->get('set_chunked_huge'));
+
+var_dump($m->setOption(Memcached::OPT_CHUNK_SIZE, 10));
+?>
+--EXPECTF--
+int(100000)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(false)
+bool(true)
+bool(false)
+bool(true)
+bool(false)
+
+Warning: Memcached::setOption(): MEMC_OPT_CHUNK_SIZE must be 0 or at least 1024 in %s on line %d
+bool(false)
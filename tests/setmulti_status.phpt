@@ -0,0 +1,64 @@
+--TEST--
+Memcached::setMulti() with per-key status
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance ();
+
+$data = array();
+for ($i = 0; $i < 100; $i++) {
+	$data['setmulti_status_' . $i] = str_repeat('x', $i);
+}
+$data[42] = array('nested' => true);
+
+$m->deleteMulti(array_keys($data));
+
+$status = $m->setMulti($data, 10, Memcached::SET_RETURN_STATUS);
+var_dump(count($status));
+var_dump(count(array_filter($status, function ($v) { return $v === true; })));
+var_dump($status[42]);
+var_dump($m->getResultCode() == Memcached::RES_SUCCESS);
+
+var_dump($m->getMulti(array_keys($data)) === $data);
+
+// Default return value stays a bool
+var_dump($m->setMultiByKey('setmulti_status', array('setmulti_status_by_key' => 'value'), 10));
+var_dump($m->getByKey('setmulti_status', 'setmulti_status_by_key'));
+
+// Failed keys are reported with their result code
+$status = $m->setMulti(array('setmulti_status_ok' => 1, str_repeat('k', 300) => 2), 10, Memcached::SET_RETURN_STATUS);
+var_dump($status['setmulti_status_ok']);
+var_dump(is_int($status[str_repeat('k', 300)]));
+var_dump($m->getResultCode() != Memcached::RES_SUCCESS);
+
+// Every key gets the reply of its own store, a value over the server's item size fails alone
+$m->setOption(Memcached::OPT_COMPRESSION, false);
+$status = $m->setMulti(array('setmulti_status_small' => 'a', 'setmulti_status_huge' => random_bytes(2 * 1024 * 1024)), 10, Memcached::SET_RETURN_STATUS);
+var_dump($status['setmulti_status_small']);
+var_dump($status['setmulti_status_huge'] !== true);
+var_dump($m->get('setmulti_status_small'));
+
+var_dump($m->setMulti(array(), 10, Memcached::SET_RETURN_STATUS));
+?>
+--EXPECTF--
+int(101)
+int(101)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+string(5) "value"
+
+Warning: Memcached::setMulti(): failed to set key %s in %s on line %d
+bool(true)
+bool(true)
+bool(true)
+
+Warning: Memcached::setMulti(): failed to set key setmulti_status_huge in %s on line %d
+bool(true)
+bool(true)
+string(1) "a"
+array(0) {
+}
@@ -0,0 +1,64 @@
+--TEST--
+Memcached::touchMulti() Memcached::getAndTouch() Memcached::getMultiAndTouch()
+--SKIPIF--
+<?php
+$min_version = "1.4.8"; //TOUCH is added since 1.4.8
+include dirname(__FILE__) . "/skipif.inc";
+?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance ();
+
+$m->setMulti(array('touchmulti_a' => 'a', 'touchmulti_b' => 'b'), 2);
+$m->delete('touchmulti_missing');
+
+$result = $m->touchMulti(array('touchmulti_a', 'touchmulti_b', 'touchmulti_missing'), 60);
+var_dump($result['touchmulti_a'], $result['touchmulti_b']);
+var_dump($result['touchmulti_missing'] === Memcached::RES_NOTFOUND);
+
+$m->set('touchmulti_gat', 'value', 2);
+var_dump($m->getAndTouch('touchmulti_gat', 60));
+var_dump($m->getAndTouch('touchmulti_missing', 60));
+var_dump($m->getResultCode() == Memcached::RES_NOTFOUND);
+
+// A stored null is touched like any other value, only the miss is not
+$m->setMulti(array('touchmulti_c' => 'c', 'touchmulti_d' => 'd', 'touchmulti_null' => null), 2);
+var_dump($m->getMultiAndTouch(array('touchmulti_c', 'touchmulti_missing', 'touchmulti_d', 'touchmulti_null'), 60, Memcached::GET_PRESERVE_ORDER));
+
+sleep(3);
+
+// Everything that was touched outlives its original expiration
+var_dump($m->getMulti(array('touchmulti_a', 'touchmulti_b', 'touchmulti_gat', 'touchmulti_c', 'touchmulti_d', 'touchmulti_null')));
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+string(5) "value"
+bool(false)
+bool(true)
+array(4) {
+  ["touchmulti_c"]=>
+  string(1) "c"
+  ["touchmulti_missing"]=>
+  NULL
+  ["touchmulti_d"]=>
+  string(1) "d"
+  ["touchmulti_null"]=>
+  NULL
+}
+array(6) {
+  ["touchmulti_a"]=>
+  string(1) "a"
+  ["touchmulti_b"]=>
+  string(1) "b"
+  ["touchmulti_gat"]=>
+  string(5) "value"
+  ["touchmulti_c"]=>
+  string(1) "c"
+  ["touchmulti_d"]=>
+  string(1) "d"
+  ["touchmulti_null"]=>
+  NULL
+}
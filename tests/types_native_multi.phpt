@@ -0,0 +1,16 @@
+--TEST--
+Memcached multi store & fetch type and value correctness using native serializer
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+include dirname (__FILE__) . '/types.inc';
+
+memc_run_test ('memc_types_test_multi',
+	memc_create_combinations ('native', Memcached::SERIALIZER_NATIVE)
+);
+
+?>
+--EXPECT--
+TEST DONE
@@ -0,0 +1,90 @@
+--TEST--
+Memcached write-behind queue
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance (array (
+	Memcached::OPT_WRITE_BEHIND_SIZE => 4,
+));
+$other = memc_get_instance ();
+
+$other->deleteMulti(array('write_behind_1', 'write_behind_2', 'write_behind_3', 'write_behind_4'));
+$other->set('write_behind_gone', 'value');
+
+var_dump($m->getOption(Memcached::OPT_WRITE_BEHIND_SIZE));
+
+var_dump($m->set('write_behind_1', 'one'));
+var_dump($m->setMulti(array('write_behind_2' => 'two')));
+var_dump($m->delete('write_behind_gone'));
+
+// Nothing has been sent yet
+var_dump($m->get('write_behind_1'), $m->get('write_behind_gone'));
+var_dump($m->getClientStats()['write_behind']['pending']);
+
+// The fourth write reaches the threshold
+var_dump($m->touch('write_behind_1', 60));
+var_dump($m->getMulti(array('write_behind_1', 'write_behind_2', 'write_behind_gone')));
+
+$m->set('write_behind_3', 'three');
+var_dump($m->flushBuffers());
+var_dump($m->get('write_behind_3'));
+
+// Freeing the instance sends what is left
+$m->set('write_behind_4', 'four');
+$stats = $m->getClientStats()['write_behind'];
+unset($m);
+usleep(100000);
+var_dump($other->get('write_behind_4'));
+var_dump($stats);
+
+// Writes that are not queued go after the queued ones
+$m = memc_get_instance (array (
+	Memcached::OPT_WRITE_BEHIND_SIZE => 100,
+));
+$m->set('write_behind_counter', 5);
+$m->delete('write_behind_added');
+var_dump($m->increment('write_behind_counter'));
+var_dump($m->add('write_behind_added', 'value'));
+var_dump($m->getClientStats()['write_behind']['pending']);
+
+$m = memc_get_instance ();
+var_dump($m->setOption(Memcached::OPT_WRITE_BEHIND_SIZE, -1));
+?>
+--EXPECTF--
+int(4)
+bool(true)
+bool(true)
+bool(true)
+bool(false)
+string(5) "value"
+int(3)
+bool(true)
+array(2) {
+  ["write_behind_1"]=>
+  string(3) "one"
+  ["write_behind_2"]=>
+  string(3) "two"
+}
+bool(true)
+string(5) "three"
+string(4) "four"
+array(5) {
+  ["queued"]=>
+  int(6)
+  ["flushed"]=>
+  int(5)
+  ["failed"]=>
+  int(0)
+  ["dropped"]=>
+  int(0)
+  ["pending"]=>
+  int(1)
+}
+int(6)
+bool(true)
+int(0)
+
+Warning: Memcached::setOption(): MEMC_OPT_WRITE_BEHIND_SIZE must be >= 0 in %s on line %d
+bool(false)
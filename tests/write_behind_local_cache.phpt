@@ -0,0 +1,32 @@
+--TEST--
+Memcached write-behind queue drops local cache entries when it is flushed
+--SKIPIF--
+<?php include "skipif.inc";?>
+--FILE--
+<?php
+include dirname (__FILE__) . '/config.inc';
+$m = memc_get_instance (array (
+	Memcached::OPT_WRITE_BEHIND_SIZE => 4,
+	Memcached::OPT_LOCAL_CACHE_SIZE  => 10,
+	Memcached::OPT_LOCAL_CACHE_TTL   => 60000,
+));
+$other = memc_get_instance ();
+
+$other->set('write_behind_local', 'old');
+
+// The queued write has not reached the server, the old value is read and cached
+var_dump($m->set('write_behind_local', 'new'));
+var_dump($m->get('write_behind_local'));
+
+var_dump($m->flushBuffers());
+var_dump($m->get('write_behind_local'));
+var_dump($other->get('write_behind_local'));
+echo "OK" . PHP_EOL;
+?>
+--EXPECT--
+bool(true)
+string(3) "old"
+bool(true)
+string(3) "new"
+string(3) "new"
+OK